@@ -19,8 +19,42 @@ Date: April 9, 2021.
 #include <vector>
 #include <deque>
 #include <set>
+#include <map>
 #include <utility>
 #include <chrono>
+#include <climits>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <fstream>
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <bitset>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#endif
 
 using std::cout;
 using std::string;
@@ -28,6 +62,10 @@ using std::vector;
 using std::deque;
 using std::set;
 using std::pair;
+using std::map;
+using std::bitset;
+using std::unordered_map;
+using std::uint64_t;
 using namespace std::chrono;
 using std::endl;
 
@@ -135,7 +173,7 @@ class CHAR : public Rexp
                 }
             }
             bool equals(Rexp* other){
-                if(name == "CHAR") {
+                if(other->name == "CHAR") {
                     CHAR* rexp = static_cast<CHAR*>(other);
                     return (c == rexp->c);
                 }
@@ -295,6 +333,69 @@ class NTIMES : public Rexp
             }
 };
 
+// Matches one or more repetitions of rs. The bitcode is the one of SEQ(rs, STAR(rs)), but rs is
+// not internalized twice, so nested PLUSes do not blow up the annotated regular expression.
+// star is the STAR(rs) of that SEQ, which the decoders walk after the first repetition.
+class PLUS : public Rexp
+{
+    public: Rexp* rs;
+            STAR* star;
+            PLUS(Rexp* rsIn)
+            : Rexp("PLUS"), rs(rsIn), star(new STAR(rsIn)){
+
+            }
+            bool operator== (Rexp & other){
+                if(other.name == "PLUS") {
+                    PLUS* rexp = static_cast<PLUS*>(&other);
+                    return (*rs == *rexp->rs);
+                }
+                else{
+                    return false;
+                }
+            }
+            bool equals(Rexp* other){
+                if(other->name == "PLUS") {
+                    PLUS* rexp = static_cast<PLUS*>(other);
+                    return (rs->equals(rexp->rs));
+                }
+                else{
+                    return false;
+                }
+            }
+            // Defined after deepCopyRegex, which it uses to copy rs.
+            void operator= (Rexp & other);
+};
+
+// Matches rs or the empty string, with the bitcode of ALT(ONE, rs).
+class OPTIONAL : public Rexp
+{
+    public: Rexp* rs;
+            OPTIONAL(Rexp* rsIn)
+            : Rexp("OPTIONAL"), rs(rsIn){
+
+            }
+            bool operator== (Rexp & other){
+                if(other.name == "OPTIONAL") {
+                    OPTIONAL* rexp = static_cast<OPTIONAL*>(&other);
+                    return (*rs == *rexp->rs);
+                }
+                else{
+                    return false;
+                }
+            }
+            bool equals(Rexp* other){
+                if(other->name == "OPTIONAL") {
+                    OPTIONAL* rexp = static_cast<OPTIONAL*>(other);
+                    return (rs->equals(rexp->rs));
+                }
+                else{
+                    return false;
+                }
+            }
+            // Defined after deepCopyRegex, which it uses to copy rs.
+            void operator= (Rexp & other);
+};
+
 class RECD : public Rexp
 {
     public: string x;
@@ -336,16 +437,98 @@ class RECD : public Rexp
             }
 };
 
+// Matches any single character contained in the set cs. Produced by the spec optimiser
+// when it merges single-character alternatives into one range.
+class CHARSET : public Rexp
+{
+    public: bitset<256> cs;
+            CHARSET(bitset<256> csIn)
+            : Rexp("CHARSET"), cs(csIn){
+
+            }
+            bool operator== (Rexp & other){
+                if(other.name == "CHARSET") {
+                    CHARSET* rexp = static_cast<CHARSET*>(&other);
+                    return (cs == rexp->cs);
+                }
+                else{
+                    return false;
+                }
+            }
+            bool equals(Rexp* other){
+                if(other->name == "CHARSET") {
+                    CHARSET* rexp = static_cast<CHARSET*>(other);
+                    return (cs == rexp->cs);
+                }
+                else{
+                    return false;
+                }
+            }
+            void operator= (Rexp & other){
+                if(other.name == "CHARSET") {
+                    Rexp::operator=(other);
+                    CHARSET* rexp = static_cast<CHARSET*>(&other);
+                    cs = rexp->cs;
+                }
+            }
+};
+
+// Matches the fixed string s. stringToSEQ produces it for keywords and operators, so that their
+// derivatives advance a cursor instead of taking apart a nested SEQ of CHARs.
+class LITERAL : public Rexp
+{
+    public: string s;
+            LITERAL(string sIn)
+            : Rexp("LITERAL"), s(sIn){
+
+            }
+            bool operator== (Rexp & other){
+                if(other.name == "LITERAL") {
+                    LITERAL* rexp = static_cast<LITERAL*>(&other);
+                    return (s == rexp->s);
+                }
+                else{
+                    return false;
+                }
+            }
+            bool equals(Rexp* other){
+                if(other->name == "LITERAL") {
+                    LITERAL* rexp = static_cast<LITERAL*>(other);
+                    return (s == rexp->s);
+                }
+                else{
+                    return false;
+                }
+            }
+            void operator= (Rexp & other){
+                if(other.name == "LITERAL") {
+                    Rexp::operator=(other);
+                    LITERAL* rexp = static_cast<LITERAL*>(&other);
+                    s = rexp->s;
+                }
+            }
+};
+
 // Class declarations for basic regular expressions with annotations included.
 class ARexp {
     public: string name;
             deque<bool> ann;
+            // When set, every annotated regular expression created on this thread is recorded
+            // here, so that short-lived intermediate regular expressions can be deleted together.
+            static thread_local vector<ARexp*>* arena;
             ARexp(string nameIn)
             : name(nameIn), ann(deque<bool>(0)){
-
+                if(arena != nullptr){
+                    arena->push_back(this);
+                }
             }
             ARexp(deque<bool> annIn, string nameIn)
             : name(nameIn), ann(annIn){
+                if(arena != nullptr){
+                    arena->push_back(this);
+                }
+            }
+            virtual ~ARexp(){
 
             }
 
@@ -390,6 +573,7 @@ class ARexp {
             }
                
 };
+thread_local vector<ARexp*>* ARexp::arena = nullptr;
 
 class AZERO : public ARexp {
     public:
@@ -551,7 +735,7 @@ class AALT : public ARexp {
             bool equals(ARexp* other){
                 if(other->name == "AALT") {
                     AALT* rexp = static_cast<AALT*>(other);
-                    deque<ARexp*> rs1 = rexp->rs;
+                    deque<ARexp*> & rs1 = rexp->rs;
                     if(rs1.size() != rs.size()){
                         return false;
                     }
@@ -731,13 +915,198 @@ class ANTIMES : public ARexp
             }
 };
 
+class APLUS : public ARexp
+{
+    public: ARexp* rs;
+            APLUS(ARexp* rsIn)
+            : ARexp("APLUS"), rs(rsIn){
+
+            }
+            APLUS(deque<bool> annIn, ARexp* rsIn)
+            : ARexp(annIn, "APLUS"), rs(rsIn){
+
+            }
+
+            // Methods for checking equality between this regular expression and another.
+            bool operator== (ARexp & other){
+                if(other.name == "APLUS") {
+                    APLUS* rexp = static_cast<APLUS*>(&other);
+                    return (*rs == *rexp->rs);
+                }
+                else{
+                    return false;
+                }
+            }
+            bool equals(ARexp* other){
+                if(other->name == "APLUS") {
+                    APLUS* rexp = static_cast<APLUS*>(other);
+                    return (rs->equals(rexp->rs));
+                }
+                else{
+                    return false;
+                }
+            }
+
+            // Defined after deepCopyRegex, which it uses to copy rs.
+            void operator= (ARexp & other);
+            int annSize(){
+                int size = ARexp::annSize();
+                size += rs->annSize();
+                return size;
+            }
+};
+
+class AOPTIONAL : public ARexp
+{
+    public: ARexp* rs;
+            AOPTIONAL(ARexp* rsIn)
+            : ARexp("AOPTIONAL"), rs(rsIn){
+
+            }
+            AOPTIONAL(deque<bool> annIn, ARexp* rsIn)
+            : ARexp(annIn, "AOPTIONAL"), rs(rsIn){
+
+            }
+
+            // Methods for checking equality between this regular expression and another.
+            bool operator== (ARexp & other){
+                if(other.name == "AOPTIONAL") {
+                    AOPTIONAL* rexp = static_cast<AOPTIONAL*>(&other);
+                    return (*rs == *rexp->rs);
+                }
+                else{
+                    return false;
+                }
+            }
+            bool equals(ARexp* other){
+                if(other->name == "AOPTIONAL") {
+                    AOPTIONAL* rexp = static_cast<AOPTIONAL*>(other);
+                    return (rs->equals(rexp->rs));
+                }
+                else{
+                    return false;
+                }
+            }
+
+            // Defined after deepCopyRegex, which it uses to copy rs.
+            void operator= (ARexp & other);
+            int annSize(){
+                int size = ARexp::annSize();
+                size += rs->annSize();
+                return size;
+            }
+};
+
+class ACHARSET : public ARexp
+{
+    public: bitset<256> cs;
+            ACHARSET(bitset<256> csIn)
+            : ARexp("ACHARSET"), cs(csIn){
+
+            }
+            ACHARSET(deque<bool> annIn, bitset<256> csIn)
+            : ARexp(annIn, "ACHARSET"), cs(csIn){
+
+            }
+
+            // Methods for checking equality between this regular expression and another.
+            bool operator== (ARexp & other){
+                if(other.name == "ACHARSET") {
+                    ACHARSET* arexp = static_cast<ACHARSET*>(&other);
+                    return (cs == arexp->cs);
+                }
+                else{
+                    return false;
+                }
+            }
+            bool equals(ARexp* other){
+                if(other->name == "ACHARSET") {
+                    ACHARSET* rexp = static_cast<ACHARSET*>(other);
+                    return (cs == rexp->cs);
+                }
+                else{
+                    return false;
+                }
+            }
+
+            void operator= (ARexp & other){
+                if(name == "ACHARSET") {
+                    ARexp::operator=(other);
+                    ACHARSET* arexp = static_cast<ACHARSET*>(&other);
+                    cs = arexp->cs;
+                }
+            }
+            int annSize(){
+                int size = ARexp::annSize();
+                return size;
+            }
+};
+
+// The part of a LITERAL from position cursor onwards that is still to be matched. s points at the
+// string of the LITERAL it was internalized from, so derivatives share it instead of copying it.
+// Two ALITERALs are equal when the rest they still have to match is equal.
+class ALITERAL : public ARexp
+{
+    public: const string* s;
+            int cursor;
+            ALITERAL(const string* sIn, int cursorIn)
+            : ARexp("ALITERAL"), s(sIn), cursor(cursorIn){
+
+            }
+            ALITERAL(deque<bool> annIn, const string* sIn, int cursorIn)
+            : ARexp(annIn, "ALITERAL"), s(sIn), cursor(cursorIn){
+
+            }
+            int remaining(){
+                return s->size() - cursor;
+            }
+            const char* rest(){
+                return s->data() + cursor;
+            }
+
+            // Methods for checking equality between this regular expression and another.
+            bool operator== (ARexp & other){
+                return equals(&other);
+            }
+            bool equals(ARexp* other){
+                if(other->name == "ALITERAL") {
+                    ALITERAL* rexp = static_cast<ALITERAL*>(other);
+                    return (remaining() == rexp->remaining()) && (memcmp(rest(), rexp->rest(), remaining()) == 0);
+                }
+                else{
+                    return false;
+                }
+            }
+
+            void operator= (ARexp & other){
+                if(other.name == "ALITERAL") {
+                    ARexp::operator=(other);
+                    ALITERAL* arexp = static_cast<ALITERAL*>(&other);
+                    s = arexp->s;
+                    cursor = arexp->cursor;
+                }
+            }
+            int annSize(){
+                int size = ARexp::annSize();
+                return size;
+            }
+};
+
 // Class declarations for different values.
 // Adapted from lexer.sc coursework file provided in the 6CCS3CFL module except for noMatch value.
 // noMatch value helps test (a*)*b and (a+a+)+b regular expressions.
+// Values are kept small because decode builds one per matched character: each node carries a
+// one-byte tag instead of a name string, Stars and Ntimes keep their iterations in a contiguous
+// vector and Rec points at the name stored in its RECD instead of copying it. Likewise a Lit
+// stands for a whole LITERAL and points at its string.
+enum ValTag : unsigned char {
+    NOMATCH_VAL, EMPTY_VAL, CHR_VAL, LEFT_VAL, RIGHT_VAL, SEQU_VAL, STARS_VAL, NTIMES_VAL, REC_VAL, LIT_VAL
+};
+
 class Val {
-    public: string name;
-            Val(string nameIn)
-            : name(nameIn){
+    public: ValTag tag;
+            Val(ValTag tagIn)
+            : tag(tagIn){
 
             }
             virtual ~Val(){
@@ -748,7 +1117,7 @@ class noMatch : public Val
 {
     public:
             noMatch()
-            : Val("noMatch"){
+            : Val(NOMATCH_VAL){
 
             }
 };
@@ -756,7 +1125,7 @@ class Empty : public Val
 {
     public:
             Empty()
-            : Val("Empty"){
+            : Val(EMPTY_VAL){
 
             }
 };
@@ -765,7 +1134,7 @@ class Chr : public Val
     public:
             char c;
             Chr(char cIn)
-            : Val("Chr"), c(cIn){
+            : Val(CHR_VAL), c(cIn){
 
             }
 };
@@ -774,7 +1143,7 @@ class Left : public Val
     public:
             Val* leftVal;
             Left(Val* leftIn)
-            : Val("Left"), leftVal(leftIn){
+            : Val(LEFT_VAL), leftVal(leftIn){
 
             }
 };
@@ -783,7 +1152,7 @@ class Right : public Val
     public:
             Val* rightVal;
             Right(Val* rightIn)
-            : Val("Right"), rightVal(rightIn){
+            : Val(RIGHT_VAL), rightVal(rightIn){
 
             }
 };
@@ -793,35 +1162,52 @@ class Sequ : public Val
             Val* val1;
             Val* val2;
             Sequ(Val* val1In, Val* val2In)
-            : Val("Sequ"), val1(val1In), val2(val2In){
+            : Val(SEQU_VAL), val1(val1In), val2(val2In){
 
             }
 };
 class Stars : public Val
 {
     public:
-            deque<Val*> vals;
-            Stars(deque<Val*> valsIn)
-            : Val("Stars"), vals(valsIn){
+            vector<Val*> vals;
+            Stars()
+            : Val(STARS_VAL){
+
+            }
+            Stars(vector<Val*> valsIn)
+            : Val(STARS_VAL), vals(valsIn){
 
             }
 };
 class Ntimes : public Val
 {
     public:
-            deque<Val*> vals;
-            Ntimes(deque<Val*> valsIn)
-            : Val("Ntimes"), vals(valsIn){
+            vector<Val*> vals;
+            Ntimes()
+            : Val(NTIMES_VAL){
+
+            }
+            Ntimes(vector<Val*> valsIn)
+            : Val(NTIMES_VAL), vals(valsIn){
 
             }
 };
 class Rec : public Val
 {
     public:
-            string x;
+            const string* x;
             Val* v;
-            Rec(string xIn, Val* valIn)
-            : Val("Rec"), x(xIn), v(valIn){
+            Rec(const string* xIn, Val* valIn)
+            : Val(REC_VAL), x(xIn), v(valIn){
+
+            }
+};
+class Lit : public Val
+{
+    public:
+            const string* s;
+            Lit(const string* sIn)
+            : Val(LIT_VAL), s(sIn){
 
             }
 };
@@ -909,54 +1295,167 @@ Rexp* deannotate(ARexp* ar){
         int n1 = rexp->n;
         return new NTIMES(deannotate(rs1), n1);
     }
+    else if(name == "APLUS"){
+        return new PLUS(deannotate(static_cast<APLUS*>(ar)->rs));
+    }
+    else if(name == "AOPTIONAL"){
+        return new OPTIONAL(deannotate(static_cast<AOPTIONAL*>(ar)->rs));
+    }
+    else if(name == "ACHARSET"){
+        ACHARSET* rexp = static_cast<ACHARSET*>(ar);
+        return new CHARSET(rexp->cs);
+    }
+    else if(name == "ALITERAL"){
+        ALITERAL* rexp = static_cast<ALITERAL*>(ar);
+        return new LITERAL(string(rexp->rest(), rexp->remaining()));
+    }
     else{
         cout << "error in deannotate" << endl;
         return new ZERO();
     }
 }
 
-// Helper function checks whether an element is present in a set.
-bool setContains(set<ARexp*> & rSet, ARexp* r){
-    for(auto elem : rSet){
-        if(elem->equals(r)){
-            return true;
+// Returns a hash of the structure of an annotated regular expression. Annotations are ignored,
+// so two regular expressions that are equal according to equals have the same hash.
+size_t hashBC(ARexp* r){
+    string & name = r->name;
+    size_t h = name.size() * 31 + name[1];
+    if(name == "ACHAR"){
+        ACHAR* rexp = static_cast<ACHAR*>(r);
+        h = h * 1000003 + (unsigned char) rexp->c;
+    }
+    else if(name == "ACHARSET"){
+        ACHARSET* rexp = static_cast<ACHARSET*>(r);
+        h = h * 1000003 + std::hash<bitset<256>>()(rexp->cs);
+    }
+    else if(name == "ALITERAL"){
+        ALITERAL* rexp = static_cast<ALITERAL*>(r);
+        for(int i = 0; i < rexp->remaining(); ++i){
+            h = h * 1000003 + (unsigned char) rexp->rest()[i];
         }
     }
-    return false;
-}
-
-// Auxiliary function filters out duplicates of the same regular expression from a list, keeping 
-// only the first instance.
-deque<ARexp*> distinct(deque<ARexp*> rs){
-    set<ARexp*> rexpSet = set<ARexp*>{};
-    deque<ARexp*> uniqueRs = deque<ARexp*>{};
-    for(int i = 0; i < rs.size(); ++i){
-        ARexp* currRaexp = rs[i];
-        if(!setContains(rexpSet, currRaexp)){
-            uniqueRs.push_back(currRaexp);
-            rexpSet.insert(currRaexp);
+    else if(name == "AALT"){
+        AALT* rexp = static_cast<AALT*>(r);
+        for(size_t i = 0; i < rexp->rs.size(); ++i){
+            h = h * 1000003 + hashBC(rexp->rs[i]);
         }
     }
-    return uniqueRs; 
-}
-
-// Inserts an empty bit sequence to a regular expression, converting it to 
-// an annotated regular expression.
-ARexp* internalize(Rexp* r){
-    string name = r->name;
-    if(name == "ZERO") {
-        return new AZERO();
+    else if(name == "ASEQ"){
+        ASEQ* rexp = static_cast<ASEQ*>(r);
+        h = (h * 1000003 + hashBC(rexp->r1)) * 1000003 + hashBC(rexp->r2);
     }
-    else if(name == "ONE") {
-        return new AONE();
+    else if(name == "ASTAR"){
+        ASTAR* rexp = static_cast<ASTAR*>(r);
+        h = h * 1000003 + hashBC(rexp->rs);
     }
-    else if(name == "CHAR") {
-        CHAR* rexp = static_cast<CHAR*>(r);
-        char c = rexp->c;
-        return new ACHAR(c);
+    else if(name == "ANTIMES"){
+        ANTIMES* rexp = static_cast<ANTIMES*>(r);
+        h = (h * 1000003 + hashBC(rexp->rs)) * 1000003 + rexp->n;
     }
-    else if(name == "ALT") {
-        ALT* rexp = static_cast<ALT*>(r);
+    else if(name == "APLUS"){
+        h = h * 1000003 + hashBC(static_cast<APLUS*>(r)->rs);
+    }
+    else if(name == "AOPTIONAL"){
+        h = h * 1000003 + hashBC(static_cast<AOPTIONAL*>(r)->rs);
+    }
+    return h;
+}
+
+// Open-addressing hash set of the alternatives kept so far by flattenDistinct. It is reused
+// between calls so that simplifying wide alternatives does not allocate a fresh set each time.
+class AltSet {
+    public: vector<int> slots;
+            vector<size_t> hashes;
+            vector<ARexp*> rs;
+            size_t mask;
+
+            // Empties the set and makes room for up to n alternatives.
+            void reset(int n){
+                int size = 16;
+                while(size < 2 * n){
+                    size *= 2;
+                }
+                if(slots.size() < (size_t) size){
+                    slots.resize(size);
+                }
+                std::fill(slots.begin(), slots.begin() + size, -1);
+                hashes.clear();
+                rs.clear();
+                mask = size - 1;
+            }
+
+            // Adds r unless an equal regular expression is already in the set.
+            void insert(ARexp* r){
+                size_t h = hashBC(r);
+                size_t i = h & mask;
+                while(slots[i] != -1){
+                    int j = slots[i];
+                    if(hashes[j] == h && rs[j]->equals(r)){
+                        return;
+                    }
+                    i = (i + 1) & mask;
+                }
+                slots[i] = rs.size();
+                hashes.push_back(h);
+                rs.push_back(r);
+            }
+};
+
+// Flattens a list of alternatives and removes duplicates in a single pass: ZEROs are dropped,
+// the children of nested AALTs are spliced in with the AALT's annotation fused to them, and only
+// the first instance of equal alternatives is kept. The result is left in out.rs.
+void flattenDistinct(ARexp** rs, int n, AltSet & out){
+    int total = 0;
+    for(int i = 0; i < n; ++i){
+        total += (rs[i]->name == "AALT") ? static_cast<AALT*>(rs[i])->rs.size() : 1;
+    }
+    out.reset(total);
+    for(int i = 0; i < n; ++i){
+        ARexp* r = rs[i];
+        if(r->name == "AZERO"){
+            continue;
+        }
+        else if(r->name == "AALT"){
+            AALT* rexp = static_cast<AALT*>(r);
+            deque<ARexp*> & rs1 = rexp->rs;
+            for(size_t j = 0; j < rs1.size(); ++j){
+                out.insert(fuse(rexp->ann, rs1[j]));
+            }
+        }
+        else{
+            out.insert(r);
+        }
+    }
+}
+
+// Auxiliary function filters out duplicates of the same regular expression from a list, keeping 
+// only the first instance.
+deque<ARexp*> distinct(deque<ARexp*> rs){
+    AltSet rexpSet = AltSet();
+    rexpSet.reset(rs.size());
+    for(int i = 0; i < rs.size(); ++i){
+        rexpSet.insert(rs[i]);
+    }
+    return deque<ARexp*>(rexpSet.rs.begin(), rexpSet.rs.end());
+}
+
+// Inserts an empty bit sequence to a regular expression, converting it to 
+// an annotated regular expression.
+ARexp* internalize(Rexp* r){
+    string name = r->name;
+    if(name == "ZERO") {
+        return new AZERO();
+    }
+    else if(name == "ONE") {
+        return new AONE();
+    }
+    else if(name == "CHAR") {
+        CHAR* rexp = static_cast<CHAR*>(r);
+        char c = rexp->c;
+        return new ACHAR(c);
+    }
+    else if(name == "ALT") {
+        ALT* rexp = static_cast<ALT*>(r);
         ARexp* intR1 = fuse(false, internalize(rexp->r1));
         ARexp* intR2 = fuse(true, internalize(rexp->r2));
         //fuse(false, internalize(rexp->r1));
@@ -980,11 +1479,27 @@ ARexp* internalize(Rexp* r){
         int n1 = rexp->n;
         return new ANTIMES(intR, n1);
     }
+    else if(name == "PLUS") {
+        PLUS* rexp = static_cast<PLUS*>(r);
+        return new APLUS(internalize(rexp->rs));
+    }
+    else if(name == "OPTIONAL") {
+        OPTIONAL* rexp = static_cast<OPTIONAL*>(r);
+        return new AOPTIONAL(internalize(rexp->rs));
+    }
     else if(name == "RECD") {
         RECD* rRecd = static_cast<RECD*>(r);
         ARexp* intR = internalize(rRecd->r);
         return intR;
     }
+    else if(name == "CHARSET") {
+        CHARSET* rexp = static_cast<CHARSET*>(r);
+        return new ACHARSET(rexp->cs);
+    }
+    else if(name == "LITERAL") {
+        LITERAL* rexp = static_cast<LITERAL*>(r);
+        return new ALITERAL(&rexp->s, 0);
+    }
     return new AZERO();
 }
 
@@ -1051,6 +1566,14 @@ Rexp* deepCopyRegex(Rexp* reg){
         Rexp* outNTimes = new NTIMES(copyRs, n1);
         return outNTimes;
     }
+    else if(name == "PLUS"){
+        PLUS* rexp = static_cast<PLUS*>(reg);
+        return new PLUS(deepCopyRegex(rexp->rs));
+    }
+    else if(name == "OPTIONAL"){
+        OPTIONAL* rexp = static_cast<OPTIONAL*>(reg);
+        return new OPTIONAL(deepCopyRegex(rexp->rs));
+    }
 
     else if(name == "RECD"){
         RECD* rexp = static_cast<RECD*>(reg);
@@ -1059,6 +1582,14 @@ Rexp* deepCopyRegex(Rexp* reg){
         Rexp* outRecd = new RECD(copyX, copyR);
         return outRecd;
     }
+    else if(name == "CHARSET"){
+        CHARSET* rexp = static_cast<CHARSET*>(reg);
+        return new CHARSET(rexp->cs);
+    }
+    else if(name == "LITERAL"){
+        LITERAL* rexp = static_cast<LITERAL*>(reg);
+        return new LITERAL(rexp->s);
+    }
 
     cout << name << "fault in copy\n";
     return new ZERO();
@@ -1120,6 +1651,26 @@ ARexp* deepCopyRegex(ARexp* areg){
         ARexp* outANTimes = new ANTIMES(annReg, copyRs, n1);
         return outANTimes;
     }
+    else if(name == "APLUS"){
+        deque<bool> annReg = areg->ann;
+        APLUS* rexp = static_cast<APLUS*>(areg);
+        return new APLUS(annReg, deepCopyRegex(rexp->rs));
+    }
+    else if(name == "AOPTIONAL"){
+        deque<bool> annReg = areg->ann;
+        AOPTIONAL* rexp = static_cast<AOPTIONAL*>(areg);
+        return new AOPTIONAL(annReg, deepCopyRegex(rexp->rs));
+    }
+    else if(name == "ACHARSET"){
+        deque<bool> annReg = areg->ann;
+        ACHARSET* rexp = static_cast<ACHARSET*>(areg);
+        return new ACHARSET(annReg, rexp->cs);
+    }
+    else if(name == "ALITERAL"){
+        deque<bool> annReg = areg->ann;
+        ALITERAL* rexp = static_cast<ALITERAL*>(areg);
+        return new ALITERAL(annReg, rexp->s, rexp->cursor);
+    }
 
     cout << name << "fault in copy\n";
     return new AZERO();
@@ -1137,12 +1688,52 @@ deque<ARexp*> deepCopyRegexList(deque<ARexp*> & aregs){
     return outList;
 }
 
+// Assignment operators of the repetition nodes, which take a deep copy of the other node's body so
+// that it cannot be left dangling.
+void PLUS::operator= (Rexp & other){
+    if(other.name == "PLUS") {
+        Rexp::operator=(other);
+        PLUS* rexp = static_cast<PLUS*>(&other);
+        rs = deepCopyRegex(rexp->rs);
+        star = new STAR(rs);
+    }
+}
+
+void OPTIONAL::operator= (Rexp & other){
+    if(other.name == "OPTIONAL") {
+        Rexp::operator=(other);
+        OPTIONAL* rexp = static_cast<OPTIONAL*>(&other);
+        rs = deepCopyRegex(rexp->rs);
+    }
+}
+
+void APLUS::operator= (ARexp & other){
+    if(other.name == "APLUS") {
+        ARexp::operator=(other);
+        APLUS* arexp = static_cast<APLUS*>(&other);
+        rs = deepCopyRegex(arexp->rs);
+    }
+}
+
+void AOPTIONAL::operator= (ARexp & other){
+    if(other.name == "AOPTIONAL") {
+        ARexp::operator=(other);
+        AOPTIONAL* arexp = static_cast<AOPTIONAL*>(&other);
+        rs = deepCopyRegex(arexp->rs);
+    }
+}
+
 // Determines if a regular expression can match the empty string. 
 bool nullableBC(ARexp* r){
     string name = r->name;
     if(name == "AZERO") {return false;}
     else if(name == "AONE") {return true;}
     else if(name == "ACHAR") {return false;}
+    else if(name == "ACHARSET") {return false;}
+    else if(name == "ALITERAL") {
+        ALITERAL* rexp = static_cast<ALITERAL*>(r);
+        return (size_t) rexp->cursor == rexp->s->size();
+    }
     else if(name == "AALT") {
         AALT* rexp = static_cast<AALT*>(r);
         if(rexp->rs.size() == 1){
@@ -1160,6 +1751,10 @@ bool nullableBC(ARexp* r){
         return nullableBC(rexp->r1) && nullableBC(rexp->r2);
         }
     else if(name == "ASTAR") {return true;}
+    else if(name == "AOPTIONAL") {return true;}
+    else if(name == "APLUS") {
+        return nullableBC(static_cast<APLUS*>(r)->rs);
+    }
     else if(name == "ANTIMES") {
         ANTIMES* rexp = static_cast<ANTIMES*>(r);
             if(rexp->n == 0){
@@ -1174,48 +1769,56 @@ bool nullableBC(ARexp* r){
 
 // Removes ZERO regular expressions from alternative regular expressions.
 deque<ARexp*> flatten(deque<ARexp*> & rs){
-    if(rs.size() == 0){
-        return deque<ARexp*>{};
-    }
-    else if(rs.front()->name == "AZERO"){
-        rs.pop_front();
-        return flatten(rs);
-    }
-    else if(rs.front()->name == "AALT"){
-        AALT* rexp = static_cast<AALT*>(rs.front());
-        deque<ARexp*> rs1 = rexp->rs;
-        deque<bool> ann = rexp->ann;
-        for(int i = 0; i < rs1.size(); i++){
-            ARexp* rexp1 = rs1[i];
-
-            rs1[i] = fuse(ann, rexp1);
+    deque<ARexp*> out = deque<ARexp*>{};
+    for(size_t i = 0; i < rs.size(); ++i){
+        ARexp* r = rs[i];
+        if(r->name == "AZERO"){
+            continue;
         }
-        rs.pop_front();
-        auto rs2 = flatten(rs);
-        for(int j = 0; j < rs2.size(); j++){
-            rs1.push_back(rs2[j]);
+        else if(r->name == "AALT"){
+            AALT* rexp = static_cast<AALT*>(r);
+            deque<ARexp*> & rs1 = rexp->rs;
+            for(size_t j = 0; j < rs1.size(); ++j){
+                out.push_back(fuse(rexp->ann, rs1[j]));
+            }
+        }
+        else{
+            out.push_back(r);
         }
-        return rs1;
-    }
-    else{
-        ARexp* r1 = rs.front();
-        rs.pop_front();
-        auto rsFlat = flatten(rs);
-        rsFlat.push_front(r1);
-        return rsFlat;
     }
+    rs.clear();
+    return out;
+}
 
+// Returns SEQ(r, STAR(r)) for an APLUS and ALT(ONE, r) for an AOPTIONAL, annotated as internalize
+// annotates them.
+ARexp* expandBC(ARexp* r){
+    if(r->name == "APLUS"){
+        APLUS* rexp = static_cast<APLUS*>(r);
+        return new ASEQ(r->ann, deepCopyRegex(rexp->rs), new ASTAR(deepCopyRegex(rexp->rs)));
+    }
+    AOPTIONAL* rexp = static_cast<AOPTIONAL*>(r);
+    return new AALT(r->ann, deque<ARexp*>{new AONE(deque<bool>{false}), fuse(true, deepCopyRegex(rexp->rs))});
+}
 
+// True if simpBC returns r unchanged and r does not take part in the ASEQ or AALT rules. An APLUS
+// with such a body simplifies exactly as its expansion would, so it can stay unexpanded.
+bool simpStableBC(ARexp* r){
+    string name = r->name;
+    if(name == "APLUS"){return simpStableBC(static_cast<APLUS*>(r)->rs);}
+    return name == "ACHAR" || name == "ACHARSET" || name == "ALITERAL" || name == "ASTAR" || name == "ANTIMES";
 }
 
 // Simplifies regular expressions in the intermediate steps of the Brzozowski matching algorithm.
-// Adapted from simplification rules provided in Chengsong Tan's paper.
-ARexp* simpBC(ARexp* r){
+// Adapted from simplification rules provided in Chengsong Tan's paper. Spreading an ASEQ over the
+// alternatives of its first part changes which value is preferred; without it, as with distribute
+// set to false, the derivatives keep the POSIX value of the unsimplified ones.
+ARexp* simpBC(ARexp* r, bool distribute = true){
     string name = r->name;
     if(name == "ASEQ") {
         ASEQ* rexp = static_cast<ASEQ*>(r);
-        ARexp* simpR1 = simpBC(rexp->r1);
-        ARexp* simpR2 = simpBC(rexp->r2);
+        ARexp* simpR1 = simpBC(rexp->r1, distribute);
+        ARexp* simpR2 = simpBC(rexp->r2, distribute);
         if(simpR1->name == "AZERO"){return simpR1;}
         else if(simpR2->name == "AZERO"){return simpR2;}
         else if(simpR1->name == "AONE"){
@@ -1225,7 +1828,7 @@ ARexp* simpBC(ARexp* r){
             ARexp* simpR2Copy = deepCopyRegex(simpR2);
             fuse(ann1, simpR2Copy);
             return simpR2Copy;}
-        else if(simpR1->name == "AALT"){
+        else if(distribute && simpR1->name == "AALT"){
             AALT* sr1 = static_cast<AALT*>(simpR1);
             deque<ARexp*> & rs1 = sr1->rs;
             for(int i = 0; i < rs1.size(); ++i){
@@ -1245,15 +1848,21 @@ ARexp* simpBC(ARexp* r){
             }
     }
     else if(name == "AALT"){
+        // The simplified children are kept on a stack shared by all calls; nested calls pop
+        // what they pushed before returning, so this call's children stay at [base, base + size).
+        static thread_local vector<ARexp*> simpStack;
+        static thread_local AltSet altSet;
         AALT* rexp = static_cast<AALT*>(r);
-        deque<ARexp*> rs1 = rexp->rs;
+        deque<ARexp*> & rs1 = rexp->rs;
         int size = rs1.size();
-        
+        int base = simpStack.size();
         for(int i = 0; i < size; i++){
-            ARexp* currRexp = rs1[i];
-            rs1[i] = simpBC(currRexp);
+            ARexp* simpRexp = simpBC(rs1[i], distribute);
+            simpStack.push_back(simpRexp);
         }
-        deque<ARexp*> flatRs = distinct(flatten(rs1));
+        flattenDistinct(simpStack.data() + base, size, altSet);
+        simpStack.resize(base);
+        vector<ARexp*> & flatRs = altSet.rs;
         if(flatRs.size() == 0){
             return new AZERO();
         }
@@ -1263,12 +1872,22 @@ ARexp* simpBC(ARexp* r){
             return fuse(ann1, flatRsCopy);
         }
         else{
-            deque<ARexp*> flatRsCopy = deepCopyRegexList(flatRs);
+            deque<ARexp*> flatRsCopy = deque<ARexp*>{};
+            for(size_t i = 0; i < flatRs.size(); ++i){
+                flatRsCopy.push_back(deepCopyRegex(flatRs[i]));
+            }
             deque<bool> ann1 = rexp->ann;
             ARexp* outRexp = new AALT(ann1, flatRsCopy);
             return outRexp;
         }
     }
+    else if(name == "APLUS" || name == "AOPTIONAL"){
+        // The rules above decide which alternative is preferred, so these must simplify as their
+        // expansions do. An OPTIONAL is always flattened and spread like the ALT it stands for;
+        // a PLUS is only kept when simplifying would not change its body.
+        if(name == "APLUS" && simpStableBC(static_cast<APLUS*>(r)->rs)){return r;}
+        return simpBC(expandBC(r), distribute);
+    }
     else{
         return r;
     }
@@ -1277,24 +1896,21 @@ ARexp* simpBC(ARexp* r){
 // Returns a bit sequence of how the given regular expression matches the empty string.
 deque<bool> mkepsBC(ARexp* r){
     string name = r->name;
-    if(name == "AONE") {return r->ann;}
+    if(name == "AONE" || name == "ALITERAL") {return r->ann;}
     else if(name == "AALT") {
+        // The first nullable alternative is chosen. The alternatives are not removed from r,
+        // so r can still be used after mkepsBC, e.g. while looking for a longer match.
         AALT* rexp = static_cast<AALT*>(r);
         deque<ARexp*> & rs = rexp->rs;
-        ARexp* r1 = rs.front();
-        rs.pop_front();
         deque<bool> rAnn = r->ann;
-        if(nullableBC(r1)){
-            deque<bool> mkepsR1 = mkepsBC(r1);
-            push_Back(rAnn, mkepsR1);
-            deque<bool> outAnn = rAnn;
-            return outAnn;
-        }
-        else{
-            ARexp* remainRexp = new AALT(rAnn, rs);
-            deque<bool> mkepsRexp = mkepsBC(remainRexp);
-            return mkepsRexp;
+        for(size_t i = 0; i < rs.size(); ++i){
+            if(nullableBC(rs[i])){
+                deque<bool> mkepsR1 = mkepsBC(rs[i]);
+                push_Back(rAnn, mkepsR1);
+                break;
+            }
         }
+        return rAnn;
     }
     else if(name == "ASEQ") {
         ASEQ* rexp = static_cast<ASEQ*>(r);
@@ -1323,11 +1939,44 @@ deque<bool> mkepsBC(ARexp* r){
         }
         return outAnn;
     }
+    else if(name == "APLUS"){
+        // As for SEQ(r, STAR(r)): one repetition of r, then the end of the STAR.
+        deque<bool> outAnn = r->ann;
+        push_Back(outAnn, mkepsBC(static_cast<APLUS*>(r)->rs));
+        outAnn.push_back(true);
+        return outAnn;
+    }
+    else if(name == "AOPTIONAL"){
+        // As for ALT(ONE, r), whose ONE is always nullable and comes first.
+        deque<bool> outAnn = r->ann;
+        outAnn.push_back(false);
+        return outAnn;
+    }
     else{
         return deque<bool>{};
     }
 }
 
+// Appends the 8 bits of character c (most significant bit first) to the bit-sequence bs.
+// A CHARSET cannot tell which of its characters was matched from its position alone, so
+// its derivative records the character itself in the bitcode.
+void charToBits(char c, deque<bool> & bs){
+    unsigned char uc = (unsigned char) c;
+    for(int i = 7; i >= 0; --i){
+        bs.push_back((uc >> i) & 1);
+    }
+}
+
+// Removes the first 8 bits from the bit-sequence bs and returns the character they encode.
+char bitsToChar(deque<bool> & bs){
+    unsigned char uc = 0;
+    for(int i = 0; i < 8; ++i){
+        uc = (uc << 1) | (bs.front() ? 1 : 0);
+        bs.pop_front();
+    }
+    return (char) uc;
+}
+
 // Returns the derivative of the input annotated regular expression with respect to the input character.
 ARexp* derBC(char c, ARexp* r){
     string name = r->name;
@@ -1395,6 +2044,35 @@ ARexp* derBC(char c, ARexp* r){
         ASEQ* outASEQ = new ASEQ(ann1, derBC(c, rs), new ANTIMES(rs, n1-1));
         return outASEQ;
     }
+    else if(name == "APLUS" || name == "AOPTIONAL"){
+        // Only the derivative unfolds these, so the regular expression itself keeps a single
+        // copy of their body.
+        return derBC(c, expandBC(r));
+    }
+    else if(name == "ACHARSET"){
+        ACHARSET* rexp = static_cast<ACHARSET*>(r);
+        if(rexp->cs.test((unsigned char) c)){
+            deque<bool> ann1 = rexp->ann;
+            charToBits(c, ann1);
+            return new AONE(ann1);
+        }
+        else{
+            return new AZERO();
+        }
+    }
+    else if(name == "ALITERAL"){
+        // Like the last CHAR of a nested SEQ, the last character of a literal leaves an AONE,
+        // which simpBC can fuse into what follows.
+        ALITERAL* rexp = static_cast<ALITERAL*>(r);
+        if(rexp->remaining() == 0 || c != rexp->rest()[0]){
+            return new AZERO();
+        }
+        deque<bool> ann1 = rexp->ann;
+        if(rexp->remaining() == 1){
+            return new AONE(ann1);
+        }
+        return new ALITERAL(ann1, rexp->s, rexp->cursor + 1);
+    }
     else{
         return new AZERO();
     }
@@ -1441,6 +2119,18 @@ int regexSize(Rexp* r){
         Rexp* rs = rexp->rs;
         return 1 + regexSize(rs);
     }
+    else if(name == "PLUS") { 
+        return 1 + regexSize(static_cast<PLUS*>(r)->rs);
+    }
+    else if(name == "OPTIONAL") { 
+        return 1 + regexSize(static_cast<OPTIONAL*>(r)->rs);
+    }
+    else if(name == "RECD") { 
+        RECD* rexp = static_cast<RECD*>(r);
+        return 1 + regexSize(rexp->r);
+    }
+    else if(name == "CHARSET") { return 1;}
+    else if(name == "LITERAL") { return 1;}
     else{
         cout << "error in determining regular expression size." << endl;
         return 0;
@@ -1479,6 +2169,14 @@ int regexSizeBC(ARexp* r){
         ARexp* rs = rexp->rs;
         return 1 + regexSizeBC(rs);
     }
+    else if(name == "APLUS") { 
+        return 1 + regexSizeBC(static_cast<APLUS*>(r)->rs);
+    }
+    else if(name == "AOPTIONAL") { 
+        return 1 + regexSizeBC(static_cast<AOPTIONAL*>(r)->rs);
+    }
+    else if(name == "ACHARSET") { return 1;}
+    else if(name == "ALITERAL") { return 1;}
     else{
         cout << "error in determining regular expression size." << endl;
         return 0;
@@ -1545,6 +2243,19 @@ deque<string> sdecode_aux(deque<Rexp*> rs, deque<bool> bs, deque<string> acc){
         head += c;
         return sdecode_aux(rs, bs, acc);
     }
+    else if(name == "CHARSET"){
+        if(bs.size() < 8){
+            return acc;
+        }
+        string & head = acc.front();
+        head += bitsToChar(bs);
+        return sdecode_aux(rs, bs, acc);
+    }
+    else if(name == "LITERAL"){
+        string & head = acc.front();
+        head += static_cast<LITERAL*>(rf)->s;
+        return sdecode_aux(rs, bs, acc);
+    }
     else if(name == "ALT"){
         if(bs.size() == 0){
             return acc;
@@ -1589,6 +2300,30 @@ deque<string> sdecode_aux(deque<Rexp*> rs, deque<bool> bs, deque<string> acc){
         }
         
     }
+    else if(name == "NTIMES"){
+        NTIMES* rNtimes = static_cast<NTIMES*>(rf);
+        for(int i = 0; i < rNtimes->n; ++i){
+            rs.push_front(rNtimes->rs);
+        }
+        return sdecode_aux(rs, bs, acc);
+    }
+    else if(name == "PLUS"){
+        PLUS* rPlus = static_cast<PLUS*>(rf);
+        rs.push_front(rPlus->star);
+        rs.push_front(rPlus->rs);
+        return sdecode_aux(rs, bs, acc);
+    }
+    else if(name == "OPTIONAL"){
+        if(bs.size() == 0){
+            return acc;
+        }
+        bool front = bs.front();
+        bs.pop_front();
+        if(front == true){
+            rs.push_front(static_cast<OPTIONAL*>(rf)->rs);
+        }
+        return sdecode_aux(rs, bs, acc);
+    }
     else if(name == "RECD"){
         RECD* rRecd = static_cast<RECD*>(rf);
         Rexp* r1 = rRecd->r;
@@ -1610,296 +2345,976 @@ deque<string> sdecode(Rexp* r, deque<bool> bs){
     return tokList;
 }
 
-// Converts input bit-sequences and input regular expression to values.
-pair<Val*, deque<bool>> decode(Rexp* r, deque<bool> bs){
+// Walks a bit-sequence over a regular expression in the order of sdecode, but reads the bits in
+// place and keeps its own stack, and reports what it decodes to a visitor. The visitor has the
+// methods character(char), literal(const string &), open(RECD*) and close(), which is called
+// when the RECD opened last has been decoded. When the bits run out the walk stops, keeping its
+// stack, and a later walk carries on with more bits.
+class BitWalker {
+    public: vector<Rexp*> stack;
+            BitWalker()
+            : stack(vector<Rexp*>{}){
+
+            }
+
+            BitWalker(Rexp* r)
+            : stack(vector<Rexp*>{r}){
+
+            }
+
+            // Forgets the current walk and starts one over r.
+            void start(Rexp* r){
+                stack.clear();
+                stack.push_back(r);
+            }
+
+            // Walks bs from bit, which is moved past the bits that were used. Returns true once
+            // the whole expression has been decoded, and false if the bits ran out first.
+            template <typename Visitor>
+            bool walk(const deque<bool> & bs, size_t & bit, Visitor & visitor){
+                size_t bitsSize = bs.size();
+                while(stack.size() > 0){
+                    Rexp* rf = stack.back();
+                    // A null entry closes the innermost RECD.
+                    if(rf == nullptr){
+                        stack.pop_back();
+                        visitor.close();
+                        continue;
+                    }
+                    const string & name = rf->name;
+                    if(name == "CHARSET"){
+                        if(bitsSize - bit < 8){
+                            return false;
+                        }
+                    }
+                    else if(name == "ALT" || name == "STAR" || name == "OPTIONAL"){
+                        if(bit == bitsSize){
+                            return false;
+                        }
+                    }
+                    stack.pop_back();
+                    if(name == "CHAR"){
+                        visitor.character(static_cast<CHAR*>(rf)->c);
+                    }
+                    else if(name == "CHARSET"){
+                        unsigned char uc = 0;
+                        for(int i = 0; i < 8; ++i){
+                            uc = (uc << 1) | (bs[bit++] ? 1 : 0);
+                        }
+                        visitor.character((char) uc);
+                    }
+                    else if(name == "LITERAL"){
+                        visitor.literal(static_cast<LITERAL*>(rf)->s);
+                    }
+                    else if(name == "ALT"){
+                        ALT* rAlt = static_cast<ALT*>(rf);
+                        stack.push_back(bs[bit++] ? rAlt->r2 : rAlt->r1);
+                    }
+                    else if(name == "SEQ"){
+                        SEQ* rSeq = static_cast<SEQ*>(rf);
+                        stack.push_back(rSeq->r2);
+                        stack.push_back(rSeq->r1);
+                    }
+                    else if(name == "STAR"){
+                        if(!bs[bit++]){
+                            STAR* rStar = static_cast<STAR*>(rf);
+                            stack.push_back(rStar);
+                            stack.push_back(rStar->rs);
+                        }
+                    }
+                    else if(name == "NTIMES"){
+                        NTIMES* rNtimes = static_cast<NTIMES*>(rf);
+                        for(int i = 0; i < rNtimes->n; ++i){
+                            stack.push_back(rNtimes->rs);
+                        }
+                    }
+                    else if(name == "PLUS"){
+                        PLUS* rPlus = static_cast<PLUS*>(rf);
+                        stack.push_back(rPlus->star);
+                        stack.push_back(rPlus->rs);
+                    }
+                    else if(name == "OPTIONAL"){
+                        if(bs[bit++]){
+                            stack.push_back(static_cast<OPTIONAL*>(rf)->rs);
+                        }
+                    }
+                    else if(name == "RECD"){
+                        RECD* rRecd = static_cast<RECD*>(rf);
+                        visitor.open(rRecd);
+                        stack.push_back(nullptr);
+                        stack.push_back(rRecd->r);
+                    }
+                }
+                return true;
+            }
+};
+
+// Converts the bit-sequence bs, starting at bit pos, and the input regular expression to a value.
+// pos is advanced past the bits that were used, so the bit-sequence itself is never copied.
+// Star and NTIMES iterations are appended to their vector in order.
+Val* decode_aux(Rexp* r, deque<bool> & bs, size_t & pos){
     string name = r->name;
     if(name == "ONE"){
-        return pair<Val*, deque<bool>>(new Empty(), bs);
+        return new Empty();
     }
     else if(name == "CHAR"){
         CHAR* rexp = static_cast<CHAR*>(r);
-        char c1 = rexp->c;
-        return pair<Val*, deque<bool>>(new Chr(c1), bs);
+        return new Chr(rexp->c);
+    }
+    else if(name == "CHARSET"){
+        unsigned char uc = 0;
+        for(int i = 0; i < 8; ++i){
+            uc = (uc << 1) | (bs[pos++] ? 1 : 0);
+        }
+        return new Chr((char) uc);
+    }
+    else if(name == "LITERAL"){
+        LITERAL* rexp = static_cast<LITERAL*>(r);
+        return new Lit(&rexp->s);
     }
     else if(name == "ALT"){
         ALT* rexp = static_cast<ALT*>(r);
-        bool frontBit = bs.front();
-        bs.pop_front();
+        bool frontBit = bs[pos++];
         if(frontBit == false){
-            Rexp* rexp1 = deepCopyRegex(rexp->r1);
-            pair<Val*, deque<bool>> p1 = decode(rexp1, bs);
-            return pair<Val*, deque<bool>>(new Left(p1.first), p1.second);
+            return new Left(decode_aux(rexp->r1, bs, pos));
         }
         else{
-            Rexp* rexp2 = deepCopyRegex(rexp->r2);
-            pair<Val*, deque<bool>> p2 = decode(rexp2, bs);
-            return pair<Val*, deque<bool>>(new Right(p2.first), p2.second);
+            return new Right(decode_aux(rexp->r2, bs, pos));
         }
     }
     else if(name == "SEQ"){
         SEQ* rexp = static_cast<SEQ*>(r);
-        Rexp* rexp1 = deepCopyRegex(rexp->r1);
-        Rexp* rexp2 = deepCopyRegex(rexp->r2);
-        pair<Val*, deque<bool>> p1 = decode(rexp1, bs);
-        pair<Val*, deque<bool>> p2 = decode(rexp2, p1.second);
-        return pair<Val*, deque<bool>>(new Sequ(p1.first, p2.first), p2.second);
+        Val* v1 = decode_aux(rexp->r1, bs, pos);
+        Val* v2 = decode_aux(rexp->r2, bs, pos);
+        return new Sequ(v1, v2);
     }
     else if(name == "STAR"){
         STAR* rexp = static_cast<STAR*>(r);
-        if(bs.size() == 0){
-            return pair<Val*, deque<bool>>(new Stars(deque<Val*>{}), bs);
+        Stars* out = new Stars();
+        while(pos < bs.size() && bs[pos] == false){
+            pos++;
+            out->vals.push_back(decode_aux(rexp->rs, bs, pos));
         }
-        bool frontBit = bs.front();
-        bs.pop_front();
-        if(frontBit == false){
-            Rexp* rexps = deepCopyRegex(rexp->rs);
-            pair<Val*, deque<bool>> p1 = decode(rexps, bs);
-            pair<Val*, deque<bool>> p2 = decode(rexp, p1.second);
-            Val* vs = p2.first;
-            Stars* val1 = static_cast<Stars*>(vs);
-            deque<Val*> s = val1->vals;
-            s.push_front(p1.first);
-            return pair<Val*, deque<bool>>(new Stars(s), p2.second);
-        }
-        else{
-            return pair<Val*, deque<bool>>(new Stars(deque<Val*>{}), bs);
+        if(pos < bs.size()){
+            pos++;
         }
+        return out;
     }
     else if(name == "NTIMES"){
         NTIMES* rexp = static_cast<NTIMES*>(r);
-        int n1 = rexp->n;
-        if(n1 == 0){
-            return pair<Val*, deque<bool>>(new Ntimes(deque<Val*>{}), bs);
+        Ntimes* out = new Ntimes();
+        out->vals.reserve(rexp->n);
+        for(int i = 0; i < rexp->n; ++i){
+            out->vals.push_back(decode_aux(rexp->rs, bs, pos));
         }
-        
-        Rexp* rexps1 = deepCopyRegex(rexp->rs);
-        Rexp* rexps2 = deepCopyRegex(rexp->rs);
-        
-        pair<Val*, deque<bool>> p1 = decode(rexp->rs, bs);
-        
-        pair<Val*, deque<bool>> p2 = decode(new NTIMES(rexps2, n1 - 1), p1.second);
-        Val* vs = p2.first;
-        Ntimes* val1 = static_cast<Ntimes*>(vs);
-        deque<Val*> s = val1->vals;
-        s.push_front(p1.first);
-        
-        return pair<Val*, deque<bool>>(new Ntimes(s), p2.second);
+        return out;
+    }
+    else if(name == "PLUS"){
+        // Every repetition, the first one included, goes into one Stars.
+        PLUS* rexp = static_cast<PLUS*>(r);
+        Val* first = decode_aux(rexp->rs, bs, pos);
+        Stars* out = static_cast<Stars*>(decode_aux(rexp->star, bs, pos));
+        out->vals.insert(out->vals.begin(), first);
+        return out;
+    }
+    else if(name == "OPTIONAL"){
+        // The value of r if it was matched, Empty otherwise.
+        OPTIONAL* rexp = static_cast<OPTIONAL*>(r);
+        if(bs[pos++]){
+            return decode_aux(rexp->rs, bs, pos);
+        }
+        return new Empty();
     }
     else if(name == "RECD"){
         RECD* rexp = static_cast<RECD*>(r);
-        Rexp* rs = rexp->r;
-        pair<Val*, deque<bool>> p = decode(rs, bs);
-        return pair<Val*, deque<bool>>(new Rec(rexp->x, p.first), p.second);
+        return new Rec(&rexp->x, decode_aux(rexp->r, bs, pos));
     }
     else{
-        return pair<Val*, deque<bool>>(new Empty(), deque<bool>{});
+        pos = bs.size();
+        return new Empty();
     }
 }
 
-// Returns the underlying matched string under the given value.
-// Adapted from my submission for coursework 2 in the 6CCS3CFL module.
-string flattenVal(Val* v) {
-    string name = v->name;
-    if(name == "Empty"){
-        return "";
-    }
-    else if(name == "Chr"){
-        Chr* v1 = static_cast<Chr*>(v);
-        string c = string(1, v1->c);
-        return c;
-    }
-    else if(name == "Left"){
-        Left* v1 = static_cast<Left*>(v);
-        Val* vs = v1->leftVal;
-        return flattenVal(vs);
-    }
-    else if(name == "Right"){
-        Right* v1 = static_cast<Right*>(v);
-        Val* vs = v1->rightVal;
-        return flattenVal(vs);
-    }
-    else if(name == "Sequ"){
-        Sequ* v1 = static_cast<Sequ*>(v);
-        Val* vs1 = v1->val1;
-        Val* vs2 = v1->val2;
-        string fl1 = flattenVal(vs1);
-        string fl2 = flattenVal(vs2);
-        return fl1 + fl2;
-    }
-    else if(name == "Stars"){
-        Stars* v1 = static_cast<Stars*>(v);
-        deque<Val*> vs = v1->vals;
-        string fl = "";
-        int size = vs.size();
-        for(int i = 0; i < size; ++i){
-            fl += flattenVal(vs[i]);
-        }
-        return fl;
-    }
-    else if(name == "Ntimes"){
-        Ntimes* v1 = static_cast<Ntimes*>(v);
-        deque<Val*> vs = v1->vals;
-        string fl = "";
-        int size = vs.size();
-        for(int i = 0; i < size; ++i){
-            fl += flattenVal(vs[i]);
-        }
-        return fl;
-    }
-    else if(name == "Rec"){
-        Rec* v1 = static_cast<Rec*>(v);
-        Val* vs1 = v1->v;
-        return flattenVal(vs1);
-    }
-    else{
-        cout << "error in flattenVal function" << endl;
-        return "";
-    }
+// Converts input bit-sequences and input regular expression to values.
+// Returns the value together with the bits that were not needed to build it.
+pair<Val*, deque<bool>> decode(Rexp* r, deque<bool> bs){
+    size_t pos = 0;
+    Val* v = decode_aux(r, bs, pos);
+    bs.erase(bs.begin(), bs.begin() + pos);
+    return pair<Val*, deque<bool>>(v, bs);
 }
 
-// Returns a list of tokens extracted from RECD regular expressions.
-// Adapted from my submission for coursework 2 in the 6CCS3CFL module.
-deque<pair<string, string>> env(Val* v){
-    string name = v->name;
-    if(name == "Empty"){
-        return deque<pair<string, string>>{};
-    }
-    else if(name == "Chr"){
-        return deque<pair<string, string>>{};
-    }
-    else if(name == "Left"){
-        Left* v1 = static_cast<Left*>(v);
-        Val* vs = v1->leftVal;
-        return env(vs);
-    }
-    else if(name == "Right"){
-        Right* v1 = static_cast<Right*>(v);
-        Val* vs = v1->rightVal;
-        return env(vs);
-    }
-    else if(name == "Sequ"){
-        Sequ* v1 = static_cast<Sequ*>(v);
-        Val* vs1 = v1->val1;
-        Val* vs2 = v1->val2;
-        return push_Back(env(vs1), env(vs2));
-    }
-    else if(name == "Stars"){
-        Stars* v1 = static_cast<Stars*>(v);
-        deque<Val*> vs = v1->vals;
-        auto tmp = deque<deque<pair<string, string>>>{};
-        auto out = deque<pair<string, string>>{};
-        int size = vs.size();
-        for(int i = 0; i < size; ++i){
-            Val* curr = vs[i];
-            tmp.push_back(env(curr));
-        }
-        for(int i = 0; i < tmp.size(); ++i){
-            deque<pair<string, string>> & curr = tmp[i];
-            for(int j = 0; j < curr.size(); ++j){
-                out.push_back(curr[j]);
+// Appends the underlying matched string under the given value to out.
+void flattenVal(Val* v, string & out){
+    switch(v->tag){
+        case EMPTY_VAL:
+            break;
+        case CHR_VAL:
+            out += static_cast<Chr*>(v)->c;
+            break;
+        case LEFT_VAL:
+            flattenVal(static_cast<Left*>(v)->leftVal, out);
+            break;
+        case RIGHT_VAL:
+            flattenVal(static_cast<Right*>(v)->rightVal, out);
+            break;
+        case SEQU_VAL:
+            flattenVal(static_cast<Sequ*>(v)->val1, out);
+            flattenVal(static_cast<Sequ*>(v)->val2, out);
+            break;
+        case STARS_VAL: {
+            vector<Val*> & vs = static_cast<Stars*>(v)->vals;
+            for(size_t i = 0; i < vs.size(); ++i){
+                flattenVal(vs[i], out);
             }
+            break;
         }
-        return out;
-    }
-    else if(name == "Ntimes"){
-        Ntimes* v1 = static_cast<Ntimes*>(v);
-        deque<Val*> vs = v1->vals;
-        auto tmp = deque<deque<pair<string, string>>>{};
-        auto out = deque<pair<string, string>>{};
-        int size = vs.size();
-        for(int i = 0; i < size; ++i){
-            Val* curr = vs[i];
-            tmp.push_back(env(curr));
-        }
-        for(int i = 0; i < tmp.size(); ++i){
-            deque<pair<string, string>> & curr = tmp[i];
-            for(int j = 0; j < curr.size(); ++j){
-                out.push_back(curr[j]);
+        case NTIMES_VAL: {
+            vector<Val*> & vs = static_cast<Ntimes*>(v)->vals;
+            for(size_t i = 0; i < vs.size(); ++i){
+                flattenVal(vs[i], out);
             }
+            break;
         }
-        return out;
-    }
-    else if(name == "Rec"){
-        Rec* v1 = static_cast<Rec*>(v);
-        string x1 = v1->x;
-        Val* vs1 = v1->v;
-        deque<pair<string, string>> out = env(vs1);
-        out.push_front(pair<string, string>(x1, flattenVal(vs1)));
-        return out;
-    }
-    else{
-        cout << "error in env function" << endl;
-        return deque<pair<string, string>>{pair<string, string>("", "")};
+        case REC_VAL:
+            flattenVal(static_cast<Rec*>(v)->v, out);
+            break;
+        case LIT_VAL:
+            out += *static_cast<Lit*>(v)->s;
+            break;
+        default:
+            cout << "error in flattenVal function" << endl;
     }
 }
 
-// Helper function to return value names as a string from values.
-string valToString(Val* v){
-    string name = v->name;
-    if(name == "Empty"){
-        return "Empty";
-    }
-    else if(name == "Chr"){
-        Chr* v1 = static_cast<Chr*>(v);
-        string c = string(1, v1->c);
-        return "Chr(\'" + c + "\')";
-    }
-    else if(name == "Left"){
-        Left* v1 = static_cast<Left*>(v);
-        Val* vs = v1->leftVal;
-        return "Left(" + valToString(vs) + ")";
-    }
-    else if(name == "Right"){
-        Right* v1 = static_cast<Right*>(v);
-        Val* vs = v1->rightVal;
-        return "Right(" + valToString(vs) + ")";
-    }
-    else if(name == "Sequ"){
-        Sequ* v1 = static_cast<Sequ*>(v);
-        Val* vs1 = v1->val1;
-        Val* vs2 = v1->val2;
-        return "Sequ(" + valToString(vs1) + ", " + valToString(vs2) + ")";
-    }
-    else if(name == "Stars"){
-        Stars* v1 = static_cast<Stars*>(v);
-        deque<Val*> vs = v1->vals;
-        string out = "Stars(";
-        int size = vs.size();
-        for(int i = 0; i < size; ++i){
-            if(i == size-1){
-                out += valToString(vs[i]);
-            }
-            else{
-                out += valToString(vs[i]) + ", ";
+// Returns the underlying matched string under the given value.
+// Adapted from my submission for coursework 2 in the 6CCS3CFL module.
+string flattenVal(Val* v) {
+    string out = "";
+    flattenVal(v, out);
+    return out;
+}
+
+// Appends the tokens extracted from RECD regular expressions to out.
+void env(Val* v, deque<pair<string, string>> & out){
+    switch(v->tag){
+        case EMPTY_VAL:
+        case CHR_VAL:
+        case LIT_VAL:
+            break;
+        case LEFT_VAL:
+            env(static_cast<Left*>(v)->leftVal, out);
+            break;
+        case RIGHT_VAL:
+            env(static_cast<Right*>(v)->rightVal, out);
+            break;
+        case SEQU_VAL:
+            env(static_cast<Sequ*>(v)->val1, out);
+            env(static_cast<Sequ*>(v)->val2, out);
+            break;
+        case STARS_VAL: {
+            vector<Val*> & vs = static_cast<Stars*>(v)->vals;
+            for(size_t i = 0; i < vs.size(); ++i){
+                env(vs[i], out);
             }
+            break;
         }
-        out += ")";
-        return out;
-    }
-    else if(name == "Ntimes"){
-        Ntimes* v1 = static_cast<Ntimes*>(v);
-        deque<Val*> vs = v1->vals;
-        string out = "Ntimes(";
-        int size = vs.size();
-        for(int i = 0; i < size; ++i){
-            if(i == size-1){
-                out += valToString(vs[i]);
-            }
-            else{
-                out += valToString(vs[i]) + ", ";
+        case NTIMES_VAL: {
+            vector<Val*> & vs = static_cast<Ntimes*>(v)->vals;
+            for(size_t i = 0; i < vs.size(); ++i){
+                env(vs[i], out);
             }
+            break;
         }
-        out += ")";
-        return out;
-    }
-    else{
-        return "error in valToString";
+        case REC_VAL: {
+            Rec* v1 = static_cast<Rec*>(v);
+            out.push_back(pair<string, string>(*v1->x, flattenVal(v1->v)));
+            env(v1->v, out);
+            break;
+        }
+        default:
+            cout << "error in env function" << endl;
+            out.push_back(pair<string, string>("", ""));
     }
+}
 
+// Returns a list of tokens extracted from RECD regular expressions.
+// Adapted from my submission for coursework 2 in the 6CCS3CFL module.
+deque<pair<string, string>> env(Val* v){
+    deque<pair<string, string>> out = deque<pair<string, string>>{};
+    env(v, out);
+    return out;
 }
 
-// Recursively applies the derivative to a regular expression with respect to a given string
-// and simplifies intermediate regular expressions.
+// Helper function to return the values in a list as a comma separated string.
+string valsToString(vector<Val*> & vs);
+
+// Helper function to return value names as a string from values.
+string valToString(Val* v){
+    switch(v->tag){
+        case EMPTY_VAL:
+            return "Empty";
+        case CHR_VAL:
+            return "Chr(\'" + string(1, static_cast<Chr*>(v)->c) + "\')";
+        case LEFT_VAL:
+            return "Left(" + valToString(static_cast<Left*>(v)->leftVal) + ")";
+        case RIGHT_VAL:
+            return "Right(" + valToString(static_cast<Right*>(v)->rightVal) + ")";
+        case SEQU_VAL:
+            return "Sequ(" + valToString(static_cast<Sequ*>(v)->val1) + ", " + valToString(static_cast<Sequ*>(v)->val2) + ")";
+        case STARS_VAL:
+            return "Stars(" + valsToString(static_cast<Stars*>(v)->vals) + ")";
+        case NTIMES_VAL:
+            return "Ntimes(" + valsToString(static_cast<Ntimes*>(v)->vals) + ")";
+        case LIT_VAL:
+            return "Lit(\"" + *static_cast<Lit*>(v)->s + "\")";
+        default:
+            return "error in valToString";
+    }
+}
+
+string valsToString(vector<Val*> & vs){
+    string out = "";
+    int size = vs.size();
+    for(int i = 0; i < size; ++i){
+        if(i == size-1){
+            out += valToString(vs[i]);
+        }
+        else{
+            out += valToString(vs[i]) + ", ";
+        }
+    }
+    return out;
+}
+
+// *** SPEC REWRITING ***
+// The rewriter normalises pathological nesting in a specification before it is internalized:
+// (r*)* and (r+)* become r*, alternatives that can only match the empty string are dropped from
+// the bodies of STARs, unreachable (ZERO) and repeated alternatives are dropped and alternatives
+// starting with the same CHAR are factored. Each rewritten node records how its bitcode maps back
+// to the node it replaced, so a bitcode of the rewritten specification can be translated into the
+// one blexer2_simp would give for the specification as it was written.
+
+// Returns true if the regular expression r matches the empty string, like nullableBC without
+// internalizing r first.
+bool nullable(Rexp* r){
+    string & name = r->name;
+    if(name == "ONE" || name == "STAR" || name == "OPTIONAL"){
+        return true;
+    }
+    else if(name == "LITERAL"){
+        return static_cast<LITERAL*>(r)->s.size() == 0;
+    }
+    else if(name == "ALT"){
+        ALT* rexp = static_cast<ALT*>(r);
+        return nullable(rexp->r1) || nullable(rexp->r2);
+    }
+    else if(name == "SEQ"){
+        SEQ* rexp = static_cast<SEQ*>(r);
+        return nullable(rexp->r1) && nullable(rexp->r2);
+    }
+    else if(name == "NTIMES"){
+        NTIMES* rexp = static_cast<NTIMES*>(r);
+        return rexp->n == 0 || nullable(rexp->rs);
+    }
+    else if(name == "PLUS"){
+        return nullable(static_cast<PLUS*>(r)->rs);
+    }
+    else if(name == "RECD"){
+        return nullable(static_cast<RECD*>(r)->r);
+    }
+    return false;
+}
+
+// Returns true if r matches no string other than the empty one.
+bool onlyEmpty(Rexp* r){
+    string & name = r->name;
+    if(name == "ZERO" || name == "ONE"){
+        return true;
+    }
+    else if(name == "LITERAL"){
+        return static_cast<LITERAL*>(r)->s.size() == 0;
+    }
+    else if(name == "ALT"){
+        ALT* rexp = static_cast<ALT*>(r);
+        return onlyEmpty(rexp->r1) && onlyEmpty(rexp->r2);
+    }
+    else if(name == "SEQ"){
+        SEQ* rexp = static_cast<SEQ*>(r);
+        return (onlyEmpty(rexp->r1) && onlyEmpty(rexp->r2)) || rexp->r1->name == "ZERO" || rexp->r2->name == "ZERO";
+    }
+    else if(name == "STAR" || name == "PLUS" || name == "OPTIONAL"){
+        Rexp* rs = (name == "STAR") ? static_cast<STAR*>(r)->rs : (name == "PLUS") ? static_cast<PLUS*>(r)->rs : static_cast<OPTIONAL*>(r)->rs;
+        return onlyEmpty(rs);
+    }
+    else if(name == "NTIMES"){
+        NTIMES* rexp = static_cast<NTIMES*>(r);
+        return rexp->n == 0 || onlyEmpty(rexp->rs);
+    }
+    else if(name == "RECD"){
+        return onlyEmpty(static_cast<RECD*>(r)->r);
+    }
+    return false;
+}
+
+// One repetition that was removed from a chain such as (r*)*: whether it was a PLUS, and the bits
+// that came before it in the original specification.
+class RemovedRepetition {
+    public: bool plus;
+            deque<bool> prefix;
+            RemovedRepetition(bool plusIn, deque<bool> prefixIn)
+            : plus(plusIn), prefix(prefixIn){
+
+            }
+};
+
+// How a node of the rewritten specification maps back. prefix is emitted before the bits of the
+// node; it holds the choices of the alternatives that collapsed into it. A chain of alternatives
+// keeps the original bits selecting each of its alternatives in paths. A STAR keeps the
+// repetitions removed from its body, outermost first.
+class RewriteStep {
+    public: deque<bool> prefix;
+            vector<Rexp*> alts;
+            vector<deque<bool>> paths;
+            vector<RemovedRepetition> removed;
+};
+
+class SpecRewriter {
+    public: Rexp* original;
+            Rexp* spec;
+            unordered_map<Rexp*, RewriteStep> steps;
+            SpecRewriter(Rexp* r)
+            : original(r){
+                spec = rewrite(r);
+            }
+
+            // Translates a bitcode of spec into the bitcode of the original specification.
+            deque<bool> translate(deque<bool> & bs){
+                deque<bool> out = deque<bool>{};
+                size_t pos = 0;
+                translate(spec, bs, pos, out);
+                return out;
+            }
+
+    private:
+            Rexp* rewrite(Rexp* r){
+                string name = r->name;
+                if(name == "ALT"){
+                    vector<pair<Rexp*, deque<bool>>> alts = vector<pair<Rexp*, deque<bool>>>{};
+                    collectPaths(r, deque<bool>{}, false, alts);
+                    return buildAlts(alts);
+                }
+                else if(name == "SEQ"){
+                    SEQ* rexp = static_cast<SEQ*>(r);
+                    Rexp* r1 = rewrite(rexp->r1);
+                    Rexp* r2 = rewrite(rexp->r2);
+                    if(r1->name == "ZERO" || r2->name == "ZERO"){
+                        return new ZERO();
+                    }
+                    return new SEQ(r1, r2);
+                }
+                else if(name == "STAR"){
+                    return rewriteStar(static_cast<STAR*>(r));
+                }
+                else if(name == "NTIMES"){
+                    NTIMES* rexp = static_cast<NTIMES*>(r);
+                    return new NTIMES(rewrite(rexp->rs), rexp->n);
+                }
+                else if(name == "PLUS"){
+                    Rexp* rs = rewrite(static_cast<PLUS*>(r)->rs);
+                    return (rs->name == "ZERO") ? rs : new PLUS(rs);
+                }
+                else if(name == "OPTIONAL"){
+                    return new OPTIONAL(rewrite(static_cast<OPTIONAL*>(r)->rs));
+                }
+                else if(name == "RECD"){
+                    RECD* rexp = static_cast<RECD*>(r);
+                    Rexp* rs = rewrite(rexp->r);
+                    return (rs->name == "ZERO") ? rs : new RECD(rexp->x, rs);
+                }
+                else{
+                    return deepCopyRegex(r);
+                }
+            }
+
+            // Every iteration of a STAR matches at least one character, so alternatives of its body
+            // that only match the empty string are never taken, and the iterations of a STAR or of
+            // a PLUS directly under it all go into its first iteration.
+            Rexp* rewriteStar(STAR* r){
+                Rexp* body = nullptr;
+                if(r->rs->name == "ALT" || r->rs->name == "OPTIONAL"){
+                    vector<pair<Rexp*, deque<bool>>> alts = vector<pair<Rexp*, deque<bool>>>{};
+                    collectPaths(r->rs, deque<bool>{}, true, alts);
+                    body = buildAlts(alts);
+                }
+                else{
+                    body = rewrite(r->rs);
+                }
+                vector<RemovedRepetition> removed = vector<RemovedRepetition>{};
+                while(body->name == "STAR" || (body->name == "PLUS" && !nullable(static_cast<PLUS*>(body)->rs))){
+                    RewriteStep & inner = steps[body];
+                    removed.push_back(RemovedRepetition(body->name == "PLUS", inner.prefix));
+                    removed.insert(removed.end(), inner.removed.begin(), inner.removed.end());
+                    body = (body->name == "STAR") ? static_cast<STAR*>(body)->rs : static_cast<PLUS*>(body)->rs;
+                }
+                Rexp* out = new STAR(body);
+                if(removed.size() > 0){
+                    steps[out].removed = removed;
+                }
+                return out;
+            }
+
+            // Appends the alternatives of r, rewritten, with the bits selecting them in r. In the
+            // body of a STAR the alternatives that only match the empty string are left out, and
+            // an OPTIONAL counts as ALT(ONE, r), so its ONE is left out too.
+            void collectPaths(Rexp* r, deque<bool> path, bool inStar, vector<pair<Rexp*, deque<bool>>> & alts){
+                if(r->name == "ALT" || (inStar && r->name == "OPTIONAL")){
+                    Rexp* r1 = (r->name == "ALT") ? static_cast<ALT*>(r)->r1 : new ONE();
+                    Rexp* r2 = (r->name == "ALT") ? static_cast<ALT*>(r)->r2 : static_cast<OPTIONAL*>(r)->rs;
+                    path.push_back(false);
+                    collectPaths(r1, path, inStar, alts);
+                    path.back() = true;
+                    collectPaths(r2, path, inStar, alts);
+                }
+                else{
+                    Rexp* alt = rewrite(r);
+                    if(!(inStar && onlyEmpty(alt))){
+                        alts.push_back(pair<Rexp*, deque<bool>>(alt, path));
+                    }
+                }
+            }
+
+            // Builds the chain of the given alternatives without the ZERO ones and the ones equal to
+            // an earlier alternative, which blexer2_simp never chooses either. Neighbours starting
+            // with the same CHAR share it.
+            Rexp* buildAlts(vector<pair<Rexp*, deque<bool>>> & alts){
+                vector<pair<Rexp*, deque<bool>>> kept = vector<pair<Rexp*, deque<bool>>>{};
+                for(size_t i = 0; i < alts.size(); ++i){
+                    bool repeated = alts[i].first->name == "ZERO";
+                    for(size_t j = 0; j < kept.size() && !repeated; ++j){
+                        repeated = kept[j].first->equals(alts[i].first);
+                    }
+                    if(!repeated){
+                        kept.push_back(alts[i]);
+                    }
+                }
+                vector<pair<Rexp*, deque<bool>>> factored = vector<pair<Rexp*, deque<bool>>>{};
+                for(size_t i = 0; i < kept.size();){
+                    size_t j = i + 1;
+                    while(j < kept.size() && startsWithChar(kept[j].first) && startsWithChar(kept[i].first)
+                          && static_cast<SEQ*>(kept[j].first)->r1->equals(static_cast<SEQ*>(kept[i].first)->r1)){
+                        ++j;
+                    }
+                    if(j - i == 1){
+                        factored.push_back(kept[i]);
+                    }
+                    else{
+                        vector<pair<Rexp*, deque<bool>>> rests = vector<pair<Rexp*, deque<bool>>>{};
+                        for(size_t k = i; k < j; ++k){
+                            rests.push_back(pair<Rexp*, deque<bool>>(static_cast<SEQ*>(kept[k].first)->r2, kept[k].second));
+                        }
+                        Rexp* c = static_cast<SEQ*>(kept[i].first)->r1;
+                        factored.push_back(pair<Rexp*, deque<bool>>(new SEQ(c, buildAlts(rests)), deque<bool>{}));
+                    }
+                    i = j;
+                }
+                if(factored.size() == 0){
+                    return new ZERO();
+                }
+                else if(factored.size() == 1){
+                    deque<bool> & prefix = steps[factored[0].first].prefix;
+                    prefix.insert(prefix.begin(), factored[0].second.begin(), factored[0].second.end());
+                    return factored[0].first;
+                }
+                deque<Rexp*> list = deque<Rexp*>{};
+                RewriteStep step = RewriteStep();
+                for(size_t i = 0; i < factored.size(); ++i){
+                    list.push_back(factored[i].first);
+                    step.alts.push_back(factored[i].first);
+                    step.paths.push_back(factored[i].second);
+                }
+                Rexp* out = listAlt(list);
+                steps[out] = step;
+                return out;
+            }
+
+            bool startsWithChar(Rexp* r){
+                return r->name == "SEQ" && static_cast<SEQ*>(r)->r1->name == "CHAR";
+            }
+
+            // Appends to out the original bits of r, read from bs at pos.
+            void translate(Rexp* r, deque<bool> & bs, size_t & pos, deque<bool> & out){
+                unordered_map<Rexp*, RewriteStep>::iterator it = steps.find(r);
+                RewriteStep* step = (it == steps.end()) ? nullptr : &it->second;
+                if(step != nullptr){
+                    out.insert(out.end(), step->prefix.begin(), step->prefix.end());
+                    if(step->alts.size() > 0){
+                        size_t k = 0;
+                        while(k < step->alts.size() - 1 && bs[pos++]){
+                            ++k;
+                        }
+                        out.insert(out.end(), step->paths[k].begin(), step->paths[k].end());
+                        translate(step->alts[k], bs, pos, out);
+                        return;
+                    }
+                }
+                string name = r->name;
+                if(name == "CHARSET"){
+                    out.insert(out.end(), bs.begin() + pos, bs.begin() + pos + 8);
+                    pos += 8;
+                }
+                else if(name == "ALT"){
+                    ALT* rexp = static_cast<ALT*>(r);
+                    bool bit = bs[pos++];
+                    out.push_back(bit);
+                    translate(bit ? rexp->r2 : rexp->r1, bs, pos, out);
+                }
+                else if(name == "SEQ"){
+                    SEQ* rexp = static_cast<SEQ*>(r);
+                    translate(rexp->r1, bs, pos, out);
+                    translate(rexp->r2, bs, pos, out);
+                }
+                else if(name == "STAR"){
+                    STAR* rexp = static_cast<STAR*>(r);
+                    vector<deque<bool>> iterations = vector<deque<bool>>{};
+                    while(!bs[pos++]){
+                        iterations.push_back(deque<bool>{});
+                        translate(rexp->rs, bs, pos, iterations.back());
+                    }
+                    if(step == nullptr || step->removed.size() == 0){
+                        emitStar(iterations, out);
+                    }
+                    else if(iterations.size() == 0){
+                        out.push_back(true);
+                    }
+                    else{
+                        out.push_back(false);
+                        emitRemoved(step->removed, 0, iterations, out);
+                        out.push_back(true);
+                    }
+                }
+                else if(name == "NTIMES"){
+                    NTIMES* rexp = static_cast<NTIMES*>(r);
+                    for(int i = 0; i < rexp->n; ++i){
+                        translate(rexp->rs, bs, pos, out);
+                    }
+                }
+                else if(name == "PLUS"){
+                    PLUS* rexp = static_cast<PLUS*>(r);
+                    translate(rexp->rs, bs, pos, out);
+                    translate(rexp->star, bs, pos, out);
+                }
+                else if(name == "OPTIONAL"){
+                    bool bit = bs[pos++];
+                    out.push_back(bit);
+                    if(bit){
+                        translate(static_cast<OPTIONAL*>(r)->rs, bs, pos, out);
+                    }
+                }
+                else if(name == "RECD"){
+                    translate(static_cast<RECD*>(r)->r, bs, pos, out);
+                }
+            }
+
+            void emitStar(vector<deque<bool>> & iterations, deque<bool> & out){
+                for(size_t i = 0; i < iterations.size(); ++i){
+                    out.push_back(false);
+                    out.insert(out.end(), iterations[i].begin(), iterations[i].end());
+                }
+                out.push_back(true);
+            }
+
+            // Emits the bits of removed[k] matching all the (non-empty) iterations in its first one.
+            void emitRemoved(vector<RemovedRepetition> & removed, size_t k, vector<deque<bool>> & iterations, deque<bool> & out){
+                out.insert(out.end(), removed[k].prefix.begin(), removed[k].prefix.end());
+                if(k == removed.size() - 1){
+                    if(removed[k].plus){
+                        out.insert(out.end(), iterations[0].begin(), iterations[0].end());
+                        vector<deque<bool>> rest = vector<deque<bool>>(iterations.begin() + 1, iterations.end());
+                        emitStar(rest, out);
+                    }
+                    else{
+                        emitStar(iterations, out);
+                    }
+                }
+                else{
+                    if(!removed[k].plus){
+                        out.push_back(false);
+                    }
+                    emitRemoved(removed, k + 1, iterations, out);
+                    out.push_back(true);
+                }
+            }
+};
+
+// *** SPEC-LEVEL OPTIMISATION ***
+// The optimiser rewrites a specification before it is internalized. It never moves code across
+// a RECD, so sdecode produces the same tokens from the optimised specification, but derivatives
+// of the optimised specification are much narrower: keywords sharing a prefix are differentiated
+// once per prefix and ranges such as SYM become a single CHARSET node.
+
+// Collects the alternatives of a nested ALT regular expression from left to right.
+// Nested ALTs are flattened by simpBC anyway, so the order of the alternatives is all that matters.
+void collectAlts(Rexp* r, deque<Rexp*> & rs){
+    if(r->name == "ALT"){
+        ALT* rexp = static_cast<ALT*>(r);
+        collectAlts(rexp->r1, rs);
+        collectAlts(rexp->r2, rs);
+    }
+    else{
+        rs.push_back(r);
+    }
+}
+
+// Returns true if r only matches a single fixed string, which is appended to word.
+bool literalWord(Rexp* r, string & word){
+    string name = r->name;
+    if(name == "ONE"){
+        return true;
+    }
+    else if(name == "CHAR"){
+        CHAR* rexp = static_cast<CHAR*>(r);
+        word += rexp->c;
+        return true;
+    }
+    else if(name == "LITERAL"){
+        word += static_cast<LITERAL*>(r)->s;
+        return true;
+    }
+    else if(name == "SEQ"){
+        SEQ* rexp = static_cast<SEQ*>(r);
+        return literalWord(rexp->r1, word) && literalWord(rexp->r2, word);
+    }
+    else{
+        return false;
+    }
+}
+
+// Node of the trie built from the literal alternatives of an ALT. endIdx is the position of the
+// alternative ending at this node (or -1) and minIdx/maxIdx bound the positions of all
+// alternatives ending at or passing through it.
+class SpecTrie {
+    public: int endIdx;
+            int minIdx;
+            int maxIdx;
+            deque<pair<char, SpecTrie*>> children;
+            SpecTrie()
+            : endIdx(-1), minIdx(INT_MAX), maxIdx(-1){
+
+            }
+            ~SpecTrie(){
+                for(size_t i = 0; i < children.size(); ++i){
+                    delete children[i].second;
+                }
+            }
+};
+
+// Adds the word found at position idx of an ALT to the trie.
+void trieInsert(SpecTrie* t, string word, int idx){
+    t->minIdx = std::min(t->minIdx, idx);
+    t->maxIdx = std::max(t->maxIdx, idx);
+    for(size_t i = 0; i < word.size(); ++i){
+        SpecTrie* next = nullptr;
+        for(size_t j = 0; j < t->children.size(); ++j){
+            if(t->children[j].first == word[i]){
+                next = t->children[j].second;
+            }
+        }
+        if(next == nullptr){
+            next = new SpecTrie();
+            t->children.push_back(pair<char, SpecTrie*>(word[i], next));
+        }
+        t = next;
+        t->minIdx = std::min(t->minIdx, idx);
+        t->maxIdx = std::max(t->maxIdx, idx);
+    }
+    if(t->endIdx == -1){
+        t->endIdx = idx;
+    }
+}
+
+// Returns CHAR c followed by r. The result is a single LITERAL when r only matches a fixed string,
+// so the branches of a trie that no other word shares stay literals.
+Rexp* prependChar(char c, Rexp* r){
+    if(r->name == "CHAR"){
+        return new LITERAL(string(1, c) + static_cast<CHAR*>(r)->c);
+    }
+    else if(r->name == "LITERAL"){
+        return new LITERAL(string(1, c) + static_cast<LITERAL*>(r)->s);
+    }
+    else{
+        return new SEQ(new CHAR(c), r);
+    }
+}
+
+// Converts a trie back into a regular expression. Alternatives are disjoint unless one word is a
+// prefix of another, so the only order that has to be kept is between the word ending at a node
+// and the words continuing below it. ok is set to false if no trie shape can keep that order.
+Rexp* trieToRexp(SpecTrie* t, bool & ok){
+    deque<pair<int, Rexp*>> entries = deque<pair<int, Rexp*>>{};
+    if(t->endIdx >= 0){
+        entries.push_back(pair<int, Rexp*>(t->endIdx, new ONE()));
+    }
+    bitset<256> leaves;
+    int leafMin = INT_MAX;
+    int leafMax = -1;
+    for(size_t i = 0; i < t->children.size(); ++i){
+        char c = t->children[i].first;
+        SpecTrie* sub = t->children[i].second;
+        if(t->endIdx >= 0 && sub->minIdx < t->endIdx && t->endIdx < sub->maxIdx){
+            ok = false;
+        }
+        if(sub->children.size() == 0){
+            leaves.set((unsigned char) c);
+            leafMin = std::min(leafMin, sub->endIdx);
+            leafMax = std::max(leafMax, sub->endIdx);
+        }
+        else{
+            entries.push_back(pair<int, Rexp*>(sub->minIdx, prependChar(c, trieToRexp(sub, ok))));
+        }
+    }
+    // Single-character words are merged into one range unless the word ending at this
+    // node has to be tried between two of them.
+    bool splitLeaves = t->endIdx >= 0 && leafMin < t->endIdx && t->endIdx < leafMax;
+    if(leaves.count() == 1 || (splitLeaves && leaves.count() > 0)){
+        for(size_t i = 0; i < t->children.size(); ++i){
+            SpecTrie* sub = t->children[i].second;
+            if(sub->children.size() == 0){
+                entries.push_back(pair<int, Rexp*>(sub->endIdx, new CHAR(t->children[i].first)));
+            }
+        }
+    }
+    else if(leaves.count() > 1){
+        entries.push_back(pair<int, Rexp*>(leafMin, new CHARSET(leaves)));
+    }
+    std::stable_sort(entries.begin(), entries.end(),
+        [](const pair<int, Rexp*> & a, const pair<int, Rexp*> & b){ return a.first < b.first; });
+    deque<Rexp*> alts = deque<Rexp*>{};
+    for(size_t i = 0; i < entries.size(); ++i){
+        alts.push_back(entries[i].second);
+    }
+    return listAlt(alts);
+}
+
+// Replaces a run of consecutive literal alternatives by a single trie-shaped regular expression
+// and appends the result to out.
+void flushLiteralRun(deque<Rexp*> & run, deque<Rexp*> & out){
+    if(run.size() == 1){
+        out.push_back(run[0]);
+    }
+    else if(run.size() > 1){
+        SpecTrie* root = new SpecTrie();
+        for(size_t i = 0; i < run.size(); ++i){
+            if(run[i]->name == "CHARSET"){
+                CHARSET* rexp = static_cast<CHARSET*>(run[i]);
+                for(int c = 0; c < 256; ++c){
+                    if(rexp->cs.test(c)){
+                        trieInsert(root, string(1, (char) c), i);
+                    }
+                }
+            }
+            else{
+                string word = "";
+                literalWord(run[i], word);
+                trieInsert(root, word, i);
+            }
+        }
+        bool ok = true;
+        Rexp* trie = trieToRexp(root, ok);
+        delete root;
+        if(ok){
+            out.push_back(trie);
+        }
+        else{
+            for(size_t i = 0; i < run.size(); ++i){
+                out.push_back(run[i]);
+            }
+        }
+    }
+    run.clear();
+}
+
+// Returns an optimised copy of the regular expression r. Literal alternatives (keywords, operators
+// and single characters) are factored into a trie with single-character leaves merged into
+// CHARSET ranges. The rest of the specification, including every RECD, keeps its shape.
+Rexp* optimiseRexp(Rexp* r){
+    string name = r->name;
+    if(name == "ALT"){
+        deque<Rexp*> alts = deque<Rexp*>{};
+        collectAlts(r, alts);
+        deque<Rexp*> out = deque<Rexp*>{};
+        deque<Rexp*> run = deque<Rexp*>{};
+        for(size_t i = 0; i < alts.size(); ++i){
+            Rexp* alt = optimiseRexp(alts[i]);
+            string word = "";
+            if(alt->name == "CHARSET" || literalWord(alt, word)){
+                run.push_back(alt);
+            }
+            else{
+                flushLiteralRun(run, out);
+                out.push_back(alt);
+            }
+        }
+        flushLiteralRun(run, out);
+        return listAlt(out);
+    }
+    else if(name == "SEQ"){
+        SEQ* rexp = static_cast<SEQ*>(r);
+        return new SEQ(optimiseRexp(rexp->r1), optimiseRexp(rexp->r2));
+    }
+    else if(name == "STAR"){
+        STAR* rexp = static_cast<STAR*>(r);
+        return new STAR(optimiseRexp(rexp->rs));
+    }
+    else if(name == "NTIMES"){
+        NTIMES* rexp = static_cast<NTIMES*>(r);
+        return new NTIMES(optimiseRexp(rexp->rs), rexp->n);
+    }
+    else if(name == "PLUS"){
+        return new PLUS(optimiseRexp(static_cast<PLUS*>(r)->rs));
+    }
+    else if(name == "OPTIONAL"){
+        return new OPTIONAL(optimiseRexp(static_cast<OPTIONAL*>(r)->rs));
+    }
+    else if(name == "RECD"){
+        RECD* rexp = static_cast<RECD*>(r);
+        return new RECD(rexp->x, optimiseRexp(rexp->r));
+    }
+    else{
+        return r;
+    }
+}
+
+// The most specifications whose optimised copies optimiseSpec keeps; once there are more, it
+// starts over.
+const size_t OPTIMISED_SPECS = 256;
+
+// Returns an optimised copy of the specification r: its pathological nesting is rewritten by
+// SpecRewriter and its literal alternatives are then factored by optimiseRexp. Every lexer
+// optimises its specification on every call, so the copies of the last specifications are kept
+// by address. No Rexp is ever freed, so an address always stands for the same specification.
+// Lookups share the lock, and only a new specification takes it alone.
+Rexp* optimiseSpec(Rexp* r){
+    static unordered_map<Rexp*, Rexp*> optimised;
+    static std::shared_mutex lock;
+    {
+        std::shared_lock<std::shared_mutex> reader(lock);
+        auto found = optimised.find(r);
+        if(found != optimised.end()){
+            return found->second;
+        }
+    }
+    Rexp* spec = optimiseRexp(SpecRewriter(r).spec);
+    std::unique_lock<std::shared_mutex> writer(lock);
+    if(optimised.size() >= OPTIMISED_SPECS){
+        optimised.clear();
+    }
+    // Another thread may have optimised r in the meantime; its copy is kept.
+    return optimised.insert({r, spec}).first->second;
+}
+
+// Recursively applies the derivative to a regular expression with respect to a given string
+// and simplifies intermediate regular expressions.
 ARexp* simpDersBC(deque<char> s, ARexp* r){
     if(s.size() == 0){
         return r;
@@ -1911,193 +3326,7205 @@ ARexp* simpDersBC(deque<char> s, ARexp* r){
     }
 }
 
-// Helper function to convert a string to a list of characters.
-deque<char> stringToList(string s){
-    deque<char> charList = deque<char>(0);
-    int sLen = s.length();
-    for(int i = 0; i < sLen; i++){
-        char currChar = s[i];
-        charList.push_back(currChar);
-    }
-    return charList;
+// Helper function to convert a string to a list of characters.
+deque<char> stringToList(string s){
+    deque<char> charList = deque<char>(0);
+    int sLen = s.length();
+    for(int i = 0; i < sLen; i++){
+        char currChar = s[i];
+        charList.push_back(currChar);
+    }
+    return charList;
+}
+
+// Returns a value associated with matching the input string s with respect 
+// to the input regular expression r. It needs further processing for tokenisation.
+// The derivatives are taken of the rewritten specification, whose bitcode is translated back
+// so that the value is one of r as it was written.
+Val* blexer_simp(Rexp* r, deque<char> s){
+    SpecRewriter rewriter = SpecRewriter(r);
+    ARexp* a = simpDersBC(s, internalize(rewriter.spec));
+    //Used to measure the size of the final regular expression.
+    //cout << "Size: " << regexSize(deannotate(a)) << endl;
+    if(nullableBC(a)){
+        deque<bool> bs = mkepsBC(a);
+        return decode(r, rewriter.translate(bs)).first;
+    }
+    else{
+        cout << "lexing error...\n";
+        return new noMatch();
+    }
+}
+
+// Tokenises the input string with respect to the input regular expression
+// using the tail-recursive decode function, sdecode. The specification is optimised
+// first; the bitcode is decoded against the optimised specification, which has the same RECDs.
+deque<string> blexer2_simp(Rexp* r, string s){
+    Rexp* spec = optimiseSpec(r);
+    ARexp* a = simpDersBC(stringToList(s), internalize(spec));
+    //Used to measure the size of the final regular expression.
+    //cout << "Size: " << regexSize(deannotate(a)) << endl;
+    if(nullableBC(a)){
+        return sdecode(spec, mkepsBC(a));
+    }
+    else{
+        cout << "No match found.\n";
+        return deque<string>{};
+    }
+}
+
+// Helper function to convert a string into a regular expression matching exactly that string:
+// a CHAR for a single character and a LITERAL for a longer one.
+Rexp* stringToSEQ(string s){
+    if(s.length() == 1){
+        return new CHAR(s[0]);
+    }
+    else{
+        return new LITERAL(s);
+    }
+}
+
+// Returns r with every LITERAL replaced by the nested SEQ of its CHARs, which matches the same
+// strings with the same bitcode.
+Rexp* expandLiterals(Rexp* r){
+    string name = r->name;
+    if(name == "LITERAL"){
+        string & s = static_cast<LITERAL*>(r)->s;
+        if(s.empty()){
+            return new ONE();
+        }
+        Rexp* out = new CHAR(s.back());
+        for(int i = (int) s.size() - 2; i >= 0; --i){
+            out = new SEQ(new CHAR(s[i]), out);
+        }
+        return out;
+    }
+    else if(name == "ALT"){
+        ALT* rexp = static_cast<ALT*>(r);
+        return new ALT(expandLiterals(rexp->r1), expandLiterals(rexp->r2));
+    }
+    else if(name == "SEQ"){
+        SEQ* rexp = static_cast<SEQ*>(r);
+        return new SEQ(expandLiterals(rexp->r1), expandLiterals(rexp->r2));
+    }
+    else if(name == "STAR"){
+        return new STAR(expandLiterals(static_cast<STAR*>(r)->rs));
+    }
+    else if(name == "NTIMES"){
+        NTIMES* rexp = static_cast<NTIMES*>(r);
+        return new NTIMES(expandLiterals(rexp->rs), rexp->n);
+    }
+    else if(name == "PLUS"){
+        return new PLUS(expandLiterals(static_cast<PLUS*>(r)->rs));
+    }
+    else if(name == "OPTIONAL"){
+        return new OPTIONAL(expandLiterals(static_cast<OPTIONAL*>(r)->rs));
+    }
+    else if(name == "RECD"){
+        RECD* rexp = static_cast<RECD*>(r);
+        return new RECD(rexp->x, expandLiterals(rexp->r));
+    }
+    else{
+        return r;
+    }
+}
+
+// Returns r with every PLUS replaced by SEQ(r, STAR(r)) and every OPTIONAL by ALT(ONE, r), which
+// match the same strings with the same bitcode. The body of a PLUS is expanded twice.
+Rexp* expandRepetitions(Rexp* r){
+    string name = r->name;
+    if(name == "PLUS"){
+        Rexp* rs = static_cast<PLUS*>(r)->rs;
+        return new SEQ(expandRepetitions(rs), new STAR(expandRepetitions(rs)));
+    }
+    else if(name == "OPTIONAL"){
+        return new ALT(new ONE(), expandRepetitions(static_cast<OPTIONAL*>(r)->rs));
+    }
+    else if(name == "ALT"){
+        ALT* rexp = static_cast<ALT*>(r);
+        return new ALT(expandRepetitions(rexp->r1), expandRepetitions(rexp->r2));
+    }
+    else if(name == "SEQ"){
+        SEQ* rexp = static_cast<SEQ*>(r);
+        return new SEQ(expandRepetitions(rexp->r1), expandRepetitions(rexp->r2));
+    }
+    else if(name == "STAR"){
+        return new STAR(expandRepetitions(static_cast<STAR*>(r)->rs));
+    }
+    else if(name == "NTIMES"){
+        NTIMES* rexp = static_cast<NTIMES*>(r);
+        return new NTIMES(expandRepetitions(rexp->rs), rexp->n);
+    }
+    else if(name == "RECD"){
+        RECD* rexp = static_cast<RECD*>(r);
+        return new RECD(rexp->x, expandRepetitions(rexp->r));
+    }
+    else{
+        return r;
+    }
+}
+
+// Helper function to convert a string into a nested ALT regular expression
+// representing the RANGE regular expression.
+Rexp* RANGE(string s){
+    if(s.length() == 1){
+        return new CHAR(s[0]);
+    }
+    else{
+        return new ALT(new CHAR(s[0]), RANGE(s.substr(1, s.size()-1)));
+    }
+}
+
+// Helper function to return the tail elements of a deque.
+deque<Rexp*> listTail(deque<Rexp*> ls){
+    deque<Rexp*> outList = deque<Rexp*>{};
+    for(int i = 1; i < ls.size(); ++i){
+        outList.push_back(ls[i]);
+    }
+    return outList;
+}
+
+// Helper function to convert a deque of regular expressions into a 
+// nested ALT regular expression.
+Rexp* listToALT(deque<Rexp*> ls){
+    if(ls.size() == 1){
+        return ls[0];
+    }
+    else{
+        return new ALT(ls[0], listToALT(listTail(ls)));
+    }
+}
+
+
+// *** BIT-PARALLEL GLUSHKOV MATCHER ***
+// An alternative backend for callers that only need to know whether (and how far) a string
+// matches. The regular expression is compiled to its Glushkov position automaton: every CHAR
+// or CHARSET occurrence is a position and position 0 is the initial state. A set of active
+// positions is a bit-vector of 64-bit words, so patterns with more than 64 positions use
+// several words. One step over character c computes follow(D) & B[c], where follow(D) is looked
+// up eight positions at a time in precomputed tables.
+
+// Nullability, first and last positions of a subexpression while it is being linearised.
+class GlushkovInfo {
+    public: bool nullable;
+            vector<uint64_t> first;
+            vector<uint64_t> last;
+            GlushkovInfo(int words)
+            : nullable(false), first(vector<uint64_t>(words, 0)), last(vector<uint64_t>(words, 0)){
+
+            }
+};
+
+class GlushkovMatcher {
+    public: int positions;
+            int words;
+            vector<uint64_t> charMasks;
+            vector<uint64_t> lastMask;
+            vector<vector<uint64_t>> follow;
+            vector<uint64_t> followTable;
+
+            GlushkovMatcher(Rexp* r)
+            : positions(countPositions(r) + 1), words((positions + 63) / 64){
+                charMasks = vector<uint64_t>(256 * words, 0);
+                follow = vector<vector<uint64_t>>(positions, vector<uint64_t>(words, 0));
+                int next = 1;
+                GlushkovInfo info = build(r, next);
+                follow[0] = info.first;
+                lastMask = info.last;
+                if(info.nullable){
+                    lastMask[0] |= 1;
+                }
+                buildFollowTable();
+            }
+
+            // Returns the number of positions in r. NTIMES repeats the positions of its body.
+            static int countPositions(Rexp* r){
+                string name = r->name;
+                if(name == "CHAR" || name == "CHARSET"){
+                    return 1;
+                }
+                else if(name == "LITERAL"){
+                    return static_cast<LITERAL*>(r)->s.size();
+                }
+                else if(name == "ALT"){
+                    ALT* rexp = static_cast<ALT*>(r);
+                    return countPositions(rexp->r1) + countPositions(rexp->r2);
+                }
+                else if(name == "SEQ"){
+                    SEQ* rexp = static_cast<SEQ*>(r);
+                    return countPositions(rexp->r1) + countPositions(rexp->r2);
+                }
+                else if(name == "STAR"){
+                    STAR* rexp = static_cast<STAR*>(r);
+                    return countPositions(rexp->rs);
+                }
+                else if(name == "NTIMES"){
+                    NTIMES* rexp = static_cast<NTIMES*>(r);
+                    return rexp->n * countPositions(rexp->rs);
+                }
+                else if(name == "PLUS"){
+                    return countPositions(static_cast<PLUS*>(r)->rs);
+                }
+                else if(name == "OPTIONAL"){
+                    return countPositions(static_cast<OPTIONAL*>(r)->rs);
+                }
+                else if(name == "RECD"){
+                    RECD* rexp = static_cast<RECD*>(r);
+                    return countPositions(rexp->r);
+                }
+                else{
+                    return 0;
+                }
+            }
+
+            // Adds every position in from to the follow set of every position in to.
+            void addFollow(vector<uint64_t> & from, vector<uint64_t> & to){
+                for(int p = 0; p < positions; ++p){
+                    if((from[p / 64] >> (p % 64)) & 1){
+                        for(int w = 0; w < words; ++w){
+                            follow[p][w] |= to[w];
+                        }
+                    }
+                }
+            }
+
+            // Linearises r, numbering its positions from next onwards.
+            GlushkovInfo build(Rexp* r, int & next){
+                string name = r->name;
+                GlushkovInfo info = GlushkovInfo(words);
+                if(name == "ONE"){
+                    info.nullable = true;
+                }
+                else if(name == "CHAR" || name == "CHARSET"){
+                    int p = next++;
+                    uint64_t bit = (uint64_t) 1 << (p % 64);
+                    info.first[p / 64] |= bit;
+                    info.last[p / 64] |= bit;
+                    for(int c = 0; c < 256; ++c){
+                        bool member = (name == "CHAR") ? ((unsigned char) static_cast<CHAR*>(r)->c == c)
+                                                       : static_cast<CHARSET*>(r)->cs.test(c);
+                        if(member){
+                            charMasks[c * words + p / 64] |= bit;
+                        }
+                    }
+                }
+                else if(name == "LITERAL"){
+                    // Every character is a position that is followed by the next one.
+                    string & s = static_cast<LITERAL*>(r)->s;
+                    info.nullable = s.empty();
+                    for(size_t i = 0; i < s.size(); ++i){
+                        int p = next++;
+                        uint64_t bit = (uint64_t) 1 << (p % 64);
+                        if(i == 0){
+                            info.first[p / 64] |= bit;
+                        }
+                        else{
+                            follow[p - 1][p / 64] |= bit;
+                        }
+                        if(i == s.size() - 1){
+                            info.last[p / 64] |= bit;
+                        }
+                        charMasks[(unsigned char) s[i] * words + p / 64] |= bit;
+                    }
+                }
+                else if(name == "ALT"){
+                    ALT* rexp = static_cast<ALT*>(r);
+                    GlushkovInfo i1 = build(rexp->r1, next);
+                    GlushkovInfo i2 = build(rexp->r2, next);
+                    info.nullable = i1.nullable || i2.nullable;
+                    for(int w = 0; w < words; ++w){
+                        info.first[w] = i1.first[w] | i2.first[w];
+                        info.last[w] = i1.last[w] | i2.last[w];
+                    }
+                }
+                else if(name == "SEQ"){
+                    SEQ* rexp = static_cast<SEQ*>(r);
+                    GlushkovInfo i1 = build(rexp->r1, next);
+                    GlushkovInfo i2 = build(rexp->r2, next);
+                    info = seq(i1, i2);
+                }
+                else if(name == "STAR"){
+                    STAR* rexp = static_cast<STAR*>(r);
+                    info = build(rexp->rs, next);
+                    addFollow(info.last, info.first);
+                    info.nullable = true;
+                }
+                else if(name == "NTIMES"){
+                    NTIMES* rexp = static_cast<NTIMES*>(r);
+                    info.nullable = true;
+                    for(int i = 0; i < rexp->n; ++i){
+                        GlushkovInfo copy = build(rexp->rs, next);
+                        info = seq(info, copy);
+                    }
+                }
+                else if(name == "PLUS"){
+                    // Like STAR, but only as nullable as the body.
+                    info = build(static_cast<PLUS*>(r)->rs, next);
+                    addFollow(info.last, info.first);
+                }
+                else if(name == "OPTIONAL"){
+                    info = build(static_cast<OPTIONAL*>(r)->rs, next);
+                    info.nullable = true;
+                }
+                else if(name == "RECD"){
+                    RECD* rexp = static_cast<RECD*>(r);
+                    info = build(rexp->r, next);
+                }
+                return info;
+            }
+
+            // Combines the information of two consecutive subexpressions.
+            GlushkovInfo seq(GlushkovInfo & i1, GlushkovInfo & i2){
+                GlushkovInfo info = GlushkovInfo(words);
+                addFollow(i1.last, i2.first);
+                info.nullable = i1.nullable && i2.nullable;
+                for(int w = 0; w < words; ++w){
+                    info.first[w] = i1.first[w] | (i1.nullable ? i2.first[w] : 0);
+                    info.last[w] = i2.last[w] | (i2.nullable ? i1.last[w] : 0);
+                }
+                return info;
+            }
+
+            // followTable[(k * 256 + b) * words + w] holds the union of the follow sets of the
+            // positions 8k + i for every bit i set in the byte b.
+            void buildFollowTable(){
+                int chunks = (positions + 7) / 8;
+                followTable = vector<uint64_t>(chunks * 256 * words, 0);
+                for(int k = 0; k < chunks; ++k){
+                    for(int b = 1; b < 256; ++b){
+                        int low = b & (b - 1);
+                        int i = __builtin_ctz(b);
+                        uint64_t* out = &followTable[(k * 256 + b) * words];
+                        uint64_t* prev = &followTable[(k * 256 + low) * words];
+                        for(int w = 0; w < words; ++w){
+                            uint64_t f = (8 * k + i < positions) ? follow[8 * k + i][w] : 0;
+                            out[w] = prev[w] | f;
+                        }
+                    }
+                }
+            }
+
+            // Replaces the active positions d by the positions reached after reading c.
+            // Returns false once no position is active any more.
+            bool step(vector<uint64_t> & d, vector<uint64_t> & next, unsigned char c){
+                std::fill(next.begin(), next.end(), 0);
+                for(int w = 0; w < words; ++w){
+                    uint64_t bits = d[w];
+                    for(int j = 0; bits != 0; ++j, bits >>= 8){
+                        int b = bits & 0xFF;
+                        if(b != 0){
+                            uint64_t* row = &followTable[((w * 8 + j) * 256 + b) * words];
+                            for(int v = 0; v < words; ++v){
+                                next[v] |= row[v];
+                            }
+                        }
+                    }
+                }
+                uint64_t any = 0;
+                uint64_t* mask = &charMasks[c * words];
+                for(int w = 0; w < words; ++w){
+                    next[w] &= mask[w];
+                    any |= next[w];
+                }
+                d.swap(next);
+                return any != 0;
+            }
+
+            bool accepting(vector<uint64_t> & d){
+                for(int w = 0; w < words; ++w){
+                    if(d[w] & lastMask[w]){
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // Returns true if the whole string s matches.
+            bool matches(const string & s){
+                vector<uint64_t> d = vector<uint64_t>(words, 0);
+                vector<uint64_t> next = vector<uint64_t>(words, 0);
+                d[0] = 1;
+                for(size_t i = 0; i < s.size(); ++i){
+                    if(!step(d, next, (unsigned char) s[i])){
+                        return false;
+                    }
+                }
+                return accepting(d);
+            }
+
+            // Returns the length of the longest prefix of s that matches, or -1 if none does.
+            int longestMatch(const string & s){
+                vector<uint64_t> d = vector<uint64_t>(words, 0);
+                vector<uint64_t> next = vector<uint64_t>(words, 0);
+                d[0] = 1;
+                int longest = accepting(d) ? 0 : -1;
+                for(size_t i = 0; i < s.size(); ++i){
+                    if(!step(d, next, (unsigned char) s[i])){
+                        break;
+                    }
+                    if(accepting(d)){
+                        longest = i + 1;
+                    }
+                }
+                return longest;
+            }
+};
+
+// Returns true if the string s matches the regular expression r.
+bool matches(Rexp* r, string s){
+    GlushkovMatcher m = GlushkovMatcher(r);
+    return m.matches(s);
+}
+
+// Returns the end offset of the longest prefix of s matching r, or -1 if there is none.
+int longest_match(Rexp* r, string s){
+    GlushkovMatcher m = GlushkovMatcher(r);
+    return m.longestMatch(s);
+}
+
+
+// *** MEMORY-MAPPED INPUT FILES ***
+// Lexing a file through blexer2_simp holds it twice, once as a string and once as the deque
+// built by stringToList. The functions below map the file read-only instead and take derivatives
+// directly over the mapping; the tokens they return point into the mapping rather than owning
+// a copy of their lexeme.
+
+// Read-only mapping of a whole file. Tokens lexed from the file point into the mapping,
+// so it has to outlive them.
+class MappedFile {
+    public: string path;
+            const char* data;
+            size_t size;
+            bool mapped;
+            MappedFile(string pathIn)
+            : path(pathIn), data(nullptr), size(0), mapped(false){
+                int fd = open(path.c_str(), O_RDONLY);
+                if(fd < 0){
+                    cout << "could not open " << path << endl;
+                    return;
+                }
+                struct stat st;
+                if(fstat(fd, &st) == 0){
+                    size = st.st_size;
+                    if(size == 0){
+                        mapped = true;
+                    }
+                    else{
+                        void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                        if(addr != MAP_FAILED){
+                            madvise(addr, size, MADV_SEQUENTIAL);
+                            data = static_cast<const char*>(addr);
+                            mapped = true;
+                        }
+                    }
+                }
+                close(fd);
+                if(!mapped){
+                    cout << "could not map " << path << endl;
+                    size = 0;
+                }
+            }
+            ~MappedFile(){
+                if(data != nullptr){
+                    munmap(const_cast<char*>(data), size);
+                }
+            }
+            MappedFile(const MappedFile & other) = delete;
+            MappedFile & operator= (const MappedFile & other) = delete;
+};
+
+// A token found by the lexer. The lexeme is not copied: it points into the lexed input.
+class Token {
+    public: string name;
+            const char* lexeme;
+            size_t length;
+            Token(string nameIn, const char* lexemeIn, size_t lengthIn)
+            : name(nameIn), lexeme(lexemeIn), length(lengthIn){
+
+            }
+};
+
+// Returns a token in the "name:lexeme" form produced by sdecode.
+string tokenToString(Token & t){
+    return t.name + ":" + string(t.lexeme, t.length);
+}
+
+// Applies simplified derivatives for every character from begin up to end.
+ARexp* simpDersBC(const char* begin, const char* end, ARexp* r){
+    for(const char* p = begin; p != end; ++p){
+        r = simpBC(derBC(*p, r));
+    }
+    return r;
+}
+
+// Builds the tokens of a BitWalker walk. Instead of collecting the characters of each lexeme it
+// counts them, so every token can point into the input at its start position.
+class TokenVisitor {
+    public: deque<Token> & tokens;
+            // The tokens whose RECD is still being decoded. A token's length is its whole span,
+            // including the tokens nested inside it.
+            vector<size_t> pending;
+            const char* pos;
+            TokenVisitor(deque<Token> & tokensIn, const char* input)
+            : tokens(tokensIn), pending(vector<size_t>{}), pos(input){
+
+            }
+
+            void character(char){
+                pos++;
+            }
+
+            void literal(const string & s){
+                pos += s.size();
+            }
+
+            void open(RECD* r){
+                pending.push_back(tokens.size());
+                tokens.push_back(Token(r->x, pos, 0));
+            }
+
+            void close(){
+                tokens[pending.back()].length = pos - tokens[pending.back()].lexeme;
+                pending.pop_back();
+            }
+};
+
+// Decodes the bit-sequence bs into tokens, like sdecode, but the tokens point into the input.
+// A RECD nested in another gives a token after the outer one, whose lexeme spans them both.
+deque<Token> tdecode(Rexp* r, deque<bool> & bs, const char* input){
+    deque<Token> tokens = deque<Token>{};
+    TokenVisitor visitor = TokenVisitor(tokens, input);
+    BitWalker walker = BitWalker(r);
+    size_t bit = 0;
+    walker.walk(bs, bit, visitor);
+    // Tokens left open by a truncated bit-sequence end where decoding stopped.
+    while(visitor.pending.size() > 0){
+        visitor.close();
+    }
+    return tokens;
+}
+
+// Tokenises a mapped file with respect to the input regular expression. The returned tokens
+// point into file, which must stay mapped while they are in use.
+deque<Token> blexer_mapped(Rexp* r, MappedFile & file){
+    if(!file.mapped){
+        return deque<Token>{};
+    }
+    Rexp* spec = optimiseSpec(r);
+    ARexp* a = simpDersBC(file.data, file.data + file.size, internalize(spec));
+    if(nullableBC(a)){
+        deque<bool> bs = mkepsBC(a);
+        return tdecode(spec, bs, file.data);
+    }
+    else{
+        cout << "No match found.\n";
+        return deque<Token>{};
+    }
+}
+
+// The span of the input matched by one RECD, including RECDs nested inside tokens. depth is 0
+// for a token and one more than its enclosing RECD otherwise.
+class Capture {
+    public: const string* name;
+            size_t start;
+            size_t end;
+            int depth;
+            Capture(const string* nameIn, size_t startIn, int depthIn)
+            : name(nameIn), start(startIn), end(startIn), depth(depthIn){
+
+            }
+};
+
+// Appends the span of every RECD of a BitWalker walk to captures, in the order the RECDs start.
+class CaptureVisitor {
+    public: vector<Capture> & captures;
+            vector<size_t> & pending;
+            size_t pos;
+            CaptureVisitor(vector<Capture> & capturesIn, vector<size_t> & pendingIn)
+            : captures(capturesIn), pending(pendingIn), pos(0){
+
+            }
+
+            void character(char){
+                pos++;
+            }
+
+            void literal(const string & s){
+                pos += s.size();
+            }
+
+            void open(RECD* r){
+                pending.push_back(captures.size());
+                captures.push_back(Capture(&r->x, pos, pending.size() - 1));
+            }
+
+            void close(){
+                captures[pending.back()].end = pos;
+                pending.pop_back();
+            }
+};
+
+// Walks the bit-sequence bs once, like tdecode, and appends the span of every RECD to captures.
+// Only a position counter is kept: no Val is built, and the stacks are reused between calls, so
+// the walk does not allocate per node.
+void captureBC(Rexp* r, deque<bool> & bs, vector<Capture> & captures){
+    static thread_local BitWalker walker;
+    static thread_local vector<size_t> pending;
+    walker.start(r);
+    pending.clear();
+    CaptureVisitor visitor = CaptureVisitor(captures, pending);
+    size_t bit = 0;
+    walker.walk(bs, bit, visitor);
+    // Captures left open by a truncated bit-sequence end where the walk stopped.
+    while(pending.size() > 0){
+        visitor.close();
+    }
+}
+
+// Lexes the input string with respect to r and returns the spans of all RECDs, nested ones
+// included. The names point into r, which must outlive the captures.
+vector<Capture> blexer_captures(Rexp* r, string s){
+    vector<Capture> captures = vector<Capture>{};
+    ARexp* a = simpDersBC(s.data(), s.data() + s.size(), internalize(r));
+    if(nullableBC(a)){
+        deque<bool> bs = mkepsBC(a);
+        captureBC(r, bs, captures);
+    }
+    else{
+        cout << "No match found.\n";
+    }
+    return captures;
+}
+
+
+// *** LINE AND COLUMN POSITIONS ***
+// Tokens point into the input, so their offsets are known without extra work. Line and column
+// numbers are not tracked while lexing: the offsets of the newlines are collected once per
+// input, sixteen bytes at a time where SSE2 is available, and an offset is turned into a line
+// and a column by binary search over them, only when it is asked for.
+
+// A line and a column, both counted from 1. The column counts bytes.
+class LineColumn {
+    public: size_t line;
+            size_t column;
+            LineColumn(size_t lineIn, size_t columnIn)
+            : line(lineIn), column(columnIn){
+
+            }
+};
+
+class NewlineIndex {
+    public: const char* input;
+            vector<size_t> newlines;
+            NewlineIndex(const char* inputIn, size_t size)
+            : input(inputIn){
+                size_t i = 0;
+#ifdef __SSE2__
+                // Each 64-byte block gives one mask with a bit set for every newline in it.
+                const __m128i newline = _mm_set1_epi8('\n');
+                for(; i + 64 <= size; i += 64){
+                    uint64_t mask = 0;
+                    for(int j = 0; j < 4; ++j){
+                        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i + 16 * j));
+                        mask |= (uint64_t) (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)) << (16 * j);
+                    }
+                    while(mask != 0){
+                        newlines.push_back(i + __builtin_ctzll(mask));
+                        mask &= mask - 1;
+                    }
+                }
+#endif
+                for(; i < size; ++i){
+                    if(input[i] == '\n'){
+                        newlines.push_back(i);
+                    }
+                }
+            }
+
+            // Returns the line and column of the byte at offset.
+            LineColumn position(size_t offset){
+                size_t before = std::lower_bound(newlines.begin(), newlines.end(), offset) - newlines.begin();
+                size_t lineStart = (before == 0) ? 0 : newlines[before - 1] + 1;
+                return LineColumn(before + 1, offset - lineStart + 1);
+            }
+
+            // Returns the line and column at which a token lexed from the indexed input starts.
+            LineColumn position(Token & t){
+                return position(t.lexeme - input);
+            }
+};
+
+// Appends a line "line:column name:lexeme" to out for every token lexed from the indexed input.
+void positionedTokens(deque<Token> & tokens, NewlineIndex & index, string & out){
+    for(size_t i = 0; i < tokens.size(); ++i){
+        LineColumn lc = index.position(tokens[i]);
+        out += std::to_string(lc.line);
+        out += ':';
+        out += std::to_string(lc.column);
+        out += ' ';
+        out += tokens[i].name;
+        out += ':';
+        out.append(tokens[i].lexeme, tokens[i].length);
+        out += '\n';
+    }
+}
+
+
+// *** BINARY TOKEN STREAMS ***
+// Tokens for a downstream parser, written in a binary format so it does not have to re-parse the
+// "name:lexeme" strings. A stream is a sequence of self-contained blocks, so a file can be
+// appended to by one process while another reads the blocks written so far. A block is:
+//   "BTOK", byte count of the rest of the block, offset of the end of the previous block's
+//   tokens, kind count, kind names (length and bytes), token count, byte count of the tokens,
+//   byte count of the lexemes, then every token as (kind, gap since the previous token, length),
+//   then the lexemes if they were written.
+// Every number is an unsigned LEB128 varint.
+
+// Appends n to out as a varint.
+void writeVarint(string & out, uint64_t n){
+    while(n >= 0x80){
+        out += (char) ((n & 0x7f) | 0x80);
+        n >>= 7;
+    }
+    out += (char) n;
+}
+
+// Reads a varint at p and moves p past it. Returns false if the varint runs past end.
+bool readVarint(const char* & p, const char* end, uint64_t & n){
+    n = 0;
+    for(int shift = 0; p < end && shift < 64; shift += 7){
+        unsigned char byte = *p++;
+        n |= (uint64_t) (byte & 0x7f) << shift;
+        if(byte < 0x80){
+            return true;
+        }
+    }
+    return false;
+}
+
+// Collects tokens as the lexer produces them and encodes them as blocks.
+class TokenWriter {
+    public: vector<string> kinds;
+            map<string, int> ids;
+            bool withLexemes;
+            size_t base;
+            size_t lastEnd;
+            int count;
+            string tokens;
+            string lexemes;
+            TokenWriter(bool withLexemesIn)
+            : withLexemes(withLexemesIn), base(0), lastEnd(0), count(0), tokens(""), lexemes(""){
+
+            }
+
+            // Adds the token of the given kind starting at offset start of the lexed stream.
+            // input points at offset 0 and is only read if lexemes are written.
+            void add(const string & kind, size_t start, size_t length, const char* input){
+                auto found = ids.find(kind);
+                if(found == ids.end()){
+                    found = ids.insert(pair<string, int>(kind, kinds.size())).first;
+                    kinds.push_back(kind);
+                }
+                writeVarint(tokens, found->second);
+                writeVarint(tokens, start - lastEnd);
+                writeVarint(tokens, length);
+                if(withLexemes){
+                    lexemes.append(input + start, length);
+                }
+                lastEnd = start + length;
+                count++;
+            }
+
+            // Returns the tokens added since the last block as a block and starts a new one.
+            string block(){
+                string body = "";
+                writeVarint(body, base);
+                writeVarint(body, kinds.size());
+                for(size_t i = 0; i < kinds.size(); ++i){
+                    writeVarint(body, kinds[i].size());
+                    body += kinds[i];
+                }
+                writeVarint(body, count);
+                writeVarint(body, tokens.size());
+                writeVarint(body, lexemes.size());
+                body += tokens;
+                body += lexemes;
+                string out = "BTOK";
+                writeVarint(out, body.size());
+                out += body;
+                kinds.clear();
+                ids.clear();
+                tokens.clear();
+                lexemes.clear();
+                count = 0;
+                base = lastEnd;
+                return out;
+            }
+
+            // Appends the current block to the file at path, creating it if needed.
+            bool appendTo(string path){
+                std::ofstream out(path, std::ios::binary | std::ios::app);
+                if(!out){
+                    cout << "could not write " << path << endl;
+                    return false;
+                }
+                string b = block();
+                out.write(b.data(), b.size());
+                return true;
+            }
+};
+
+// A token read from a binary stream. The kind name and the lexeme point into the stream; the
+// lexeme is null if the block was written without lexemes.
+class BinaryToken {
+    public: const char* kind;
+            size_t kindLength;
+            size_t start;
+            size_t length;
+            const char* lexeme;
+            BinaryToken()
+            : kind(nullptr), kindLength(0), start(0), length(0), lexeme(nullptr){
+
+            }
+};
+
+// Reads the tokens of a binary stream in place, for example from a MappedFile.
+class TokenReader {
+    public: const char* data;
+            const char* end;
+            const char* pos;
+            bool corrupt;
+            TokenReader(const char* dataIn, size_t sizeIn)
+            : data(dataIn), end(dataIn + sizeIn), pos(dataIn), corrupt(false),
+              blockEnd(dataIn), tokensLeft(0), lastEnd(0), lexeme(nullptr){
+
+            }
+
+            // Reads the next token into out. Returns false at the end of the stream, or if the
+            // stream is corrupt, in which case corrupt is set.
+            bool next(BinaryToken & out){
+                while(tokensLeft == 0){
+                    pos = blockEnd;
+                    if(pos == end){
+                        return false;
+                    }
+                    if(!readHeader()){
+                        cout << "corrupt token stream" << endl;
+                        corrupt = true;
+                        return false;
+                    }
+                }
+                uint64_t kind, gap, length;
+                // A lexeme must lie within the lexemes of its block, which end with the block.
+                if(!readVarint(pos, tokensEnd, kind) || !readVarint(pos, tokensEnd, gap) || !readVarint(pos, tokensEnd, length) || kind >= kinds.size()
+                   || (lexeme != nullptr && length > (uint64_t) (blockEnd - lexeme))){
+                    cout << "corrupt token stream" << endl;
+                    corrupt = true;
+                    tokensLeft = 0;
+                    blockEnd = end;
+                    return false;
+                }
+                out.kind = kinds[kind].first;
+                out.kindLength = kinds[kind].second;
+                out.start = lastEnd + gap;
+                out.length = length;
+                out.lexeme = nullptr;
+                if(lexeme != nullptr){
+                    out.lexeme = lexeme;
+                    lexeme += length;
+                }
+                lastEnd = out.start + length;
+                tokensLeft--;
+                return true;
+            }
+
+    private: const char* blockEnd;
+            const char* tokensEnd;
+            uint64_t tokensLeft;
+            uint64_t lastEnd;
+            const char* lexeme;
+            vector<pair<const char*, size_t>> kinds;
+
+            bool readHeader(){
+                if(end - pos < 4 || memcmp(pos, "BTOK", 4) != 0){
+                    return false;
+                }
+                pos += 4;
+                uint64_t n, kindCount, tokenCount, tokenBytes, lexemeBytes;
+                if(!readVarint(pos, end, n) || n > (uint64_t) (end - pos)){
+                    return false;
+                }
+                blockEnd = pos + n;
+                if(!readVarint(pos, blockEnd, lastEnd) || !readVarint(pos, blockEnd, kindCount)){
+                    return false;
+                }
+                kinds.clear();
+                for(uint64_t i = 0; i < kindCount; ++i){
+                    if(!readVarint(pos, blockEnd, n) || n > (uint64_t) (blockEnd - pos)){
+                        return false;
+                    }
+                    kinds.push_back(pair<const char*, size_t>(pos, n));
+                    pos += n;
+                }
+                if(!readVarint(pos, blockEnd, tokenCount) || !readVarint(pos, blockEnd, tokenBytes) || !readVarint(pos, blockEnd, lexemeBytes)
+                   || tokenBytes > (uint64_t) (blockEnd - pos) || lexemeBytes != (uint64_t) (blockEnd - pos) - tokenBytes){
+                    return false;
+                }
+                tokensEnd = pos + tokenBytes;
+                lexeme = (lexemeBytes > 0) ? tokensEnd : nullptr;
+                tokensLeft = tokenCount;
+                return true;
+            }
+};
+
+// Returns the kind of a token read from a binary stream.
+string binaryTokenKind(BinaryToken & t){
+    return string(t.kind, t.kindLength);
+}
+
+// Lexes the input between begin and end and adds its tokens to out. offset is the position of
+// begin in the stream, so successive pieces of one stream can be written to the same writer.
+bool blexer_binary(Rexp* r, const char* begin, const char* end, size_t offset, TokenWriter & out){
+    Rexp* spec = optimiseSpec(r);
+    ARexp* a = simpDersBC(begin, end, internalize(spec));
+    if(!nullableBC(a)){
+        cout << "No match found.\n";
+        return false;
+    }
+    deque<bool> bs = mkepsBC(a);
+    vector<Capture> captures = vector<Capture>{};
+    captureBC(spec, bs, captures);
+    for(size_t i = 0; i < captures.size(); ++i){
+        if(captures[i].depth == 0){
+            out.add(*captures[i].name, offset + captures[i].start, captures[i].end - captures[i].start, begin - offset);
+        }
+    }
+    return true;
+}
+
+
+// *** DERIVATIVE AUTOMATON ***
+// The structure of simpBC(derBC(c, r)) only depends on the structure of r, never on its
+// annotations: every annotation of the result is a concatenation of annotations of r and
+// constant bits. A derivative state is therefore identified by a canonical key of its structure
+// with the annotations left out, and the annotations become registers: each transition records,
+// for every node of the target state, which registers of the source state and which constant
+// bits its annotation is made of. With these transition outputs the states visited by
+// simpDersBC repeat, so transitions can be cached and the number of states can be counted.
+// Alternatives are not sorted in the canonical key because their order decides which
+// alternative mkepsBC prefers.
+
+// Appends the canonical key of the structure of r to out. Every node is written in prefix form
+// so that keys can be parsed back by parseCanonicalBC.
+void canonicalBC(ARexp* r, string & out){
+    static const char* hex = "0123456789abcdef";
+    string & name = r->name;
+    if(name == "AZERO"){
+        out += '0';
+    }
+    else if(name == "AONE"){
+        out += '1';
+    }
+    else if(name == "ACHAR"){
+        unsigned char c = static_cast<ACHAR*>(r)->c;
+        out += 'c';
+        out += hex[c >> 4];
+        out += hex[c & 15];
+    }
+    else if(name == "ACHARSET"){
+        bitset<256> & cs = static_cast<ACHARSET*>(r)->cs;
+        out += 'r';
+        for(int i = 0; i < 256; i += 4){
+            out += hex[cs[i] | (cs[i + 1] << 1) | (cs[i + 2] << 2) | (cs[i + 3] << 3)];
+        }
+    }
+    else if(name == "ALITERAL"){
+        ALITERAL* rexp = static_cast<ALITERAL*>(r);
+        out += 'l' + std::to_string(rexp->remaining()) + ':';
+        for(int i = 0; i < rexp->remaining(); ++i){
+            unsigned char c = rexp->rest()[i];
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+    }
+    else if(name == "AALT"){
+        deque<ARexp*> & rs = static_cast<AALT*>(r)->rs;
+        out += 'a' + std::to_string(rs.size()) + ':';
+        for(size_t i = 0; i < rs.size(); ++i){
+            canonicalBC(rs[i], out);
+        }
+    }
+    else if(name == "ASEQ"){
+        ASEQ* rexp = static_cast<ASEQ*>(r);
+        out += 's';
+        canonicalBC(rexp->r1, out);
+        canonicalBC(rexp->r2, out);
+    }
+    else if(name == "ASTAR"){
+        out += '*';
+        canonicalBC(static_cast<ASTAR*>(r)->rs, out);
+    }
+    else if(name == "ANTIMES"){
+        ANTIMES* rexp = static_cast<ANTIMES*>(r);
+        out += 'n' + std::to_string(rexp->n) + ':';
+        canonicalBC(rexp->rs, out);
+    }
+    else if(name == "APLUS"){
+        out += '+';
+        canonicalBC(static_cast<APLUS*>(r)->rs, out);
+    }
+    else if(name == "AOPTIONAL"){
+        out += '?';
+        canonicalBC(static_cast<AOPTIONAL*>(r)->rs, out);
+    }
+}
+
+// Returns the canonical key of the structure of r.
+string canonicalBC(ARexp* r){
+    string out = "";
+    canonicalBC(r, out);
+    return out;
+}
+
+// Helper function to read the decimal number in a canonical key that ends with ':'.
+int parseCount(const string & key, int & pos){
+    int n = 0;
+    while(key[pos] != ':'){
+        n = n * 10 + (key[pos++] - '0');
+    }
+    pos++;
+    return n;
+}
+
+// Helper function to read one hexadecimal digit of a canonical key.
+int parseHex(char h){
+    return (h <= '9') ? (h - '0') : (h - 'a' + 10);
+}
+
+// Returns a copy of s that is never freed, for ALITERALs rebuilt from canonical keys. Equal
+// strings share one copy, so the number of copies is bounded by the literals of the states.
+const string* internLiteral(const string & s){
+    static set<string> literals;
+    static std::mutex lock;
+    std::lock_guard<std::mutex> guard(lock);
+    return &*literals.insert(s).first;
+}
+
+// Rebuilds the annotated regular expression whose canonical key starts at pos. All the
+// annotations of the result are empty.
+ARexp* parseCanonicalBC(const string & key, int & pos){
+    char tag = key[pos++];
+    if(tag == '1'){
+        return new AONE();
+    }
+    else if(tag == 'c'){
+        int c = parseHex(key[pos]) * 16 + parseHex(key[pos + 1]);
+        pos += 2;
+        return new ACHAR((char) c);
+    }
+    else if(tag == 'r'){
+        bitset<256> cs;
+        for(int i = 0; i < 256; i += 4){
+            int h = parseHex(key[pos++]);
+            for(int j = 0; j < 4; ++j){
+                cs[i + j] = (h >> j) & 1;
+            }
+        }
+        return new ACHARSET(cs);
+    }
+    else if(tag == 'l'){
+        int n = parseCount(key, pos);
+        string s = string(n, ' ');
+        for(int i = 0; i < n; ++i){
+            s[i] = (char) (parseHex(key[pos]) * 16 + parseHex(key[pos + 1]));
+            pos += 2;
+        }
+        return new ALITERAL(internLiteral(s), 0);
+    }
+    else if(tag == 'a'){
+        int n = parseCount(key, pos);
+        deque<ARexp*> rs = deque<ARexp*>{};
+        for(int i = 0; i < n; ++i){
+            rs.push_back(parseCanonicalBC(key, pos));
+        }
+        return new AALT(rs);
+    }
+    else if(tag == 's'){
+        ARexp* r1 = parseCanonicalBC(key, pos);
+        ARexp* r2 = parseCanonicalBC(key, pos);
+        return new ASEQ(r1, r2);
+    }
+    else if(tag == '*'){
+        return new ASTAR(parseCanonicalBC(key, pos));
+    }
+    else if(tag == 'n'){
+        int n = parseCount(key, pos);
+        return new ANTIMES(parseCanonicalBC(key, pos), n);
+    }
+    else if(tag == '+'){
+        return new APLUS(parseCanonicalBC(key, pos));
+    }
+    else if(tag == '?'){
+        return new AOPTIONAL(parseCanonicalBC(key, pos));
+    }
+    else{
+        return new AZERO();
+    }
+}
+
+ARexp* parseCanonicalBC(const string & key){
+    int pos = 0;
+    return parseCanonicalBC(key, pos);
+}
+
+// Collects the annotations of r in preorder. These are the registers of r's state: register i
+// is the annotation of the i-th node of the canonical key.
+void collectAnns(ARexp* r, vector<deque<bool>*> & anns){
+    anns.push_back(&r->ann);
+    string & name = r->name;
+    if(name == "AALT"){
+        deque<ARexp*> & rs = static_cast<AALT*>(r)->rs;
+        for(size_t i = 0; i < rs.size(); ++i){
+            collectAnns(rs[i], anns);
+        }
+    }
+    else if(name == "ASEQ"){
+        collectAnns(static_cast<ASEQ*>(r)->r1, anns);
+        collectAnns(static_cast<ASEQ*>(r)->r2, anns);
+    }
+    else if(name == "ASTAR"){
+        collectAnns(static_cast<ASTAR*>(r)->rs, anns);
+    }
+    else if(name == "ANTIMES"){
+        collectAnns(static_cast<ANTIMES*>(r)->rs, anns);
+    }
+    else if(name == "APLUS"){
+        collectAnns(static_cast<APLUS*>(r)->rs, anns);
+    }
+    else if(name == "AOPTIONAL"){
+        collectAnns(static_cast<AOPTIONAL*>(r)->rs, anns);
+    }
+}
+
+// One piece of a register program: the contents of register reg of the source state, or the
+// constant bits if reg is -1. A program is the list of pieces an annotation is made of.
+class AnnPiece {
+    public: int reg;
+            vector<bool> bits;
+            AnnPiece(int regIn)
+            : reg(regIn){
+
+            }
+};
+
+// A cached transition: the target state and, for every register of the target, its program.
+class DerTransition {
+    public: int target;
+            vector<vector<AnnPiece>> programs;
+};
+
+// Register programs are found by running derBC and simpBC twice on a state. The first run
+// leaves every annotation empty and yields the constant bits. In the second run register i is
+// replaced by a marker 0 1^L 0 followed by i in 20 bits, where L is longer than any run of ones
+// in the constant bits, so markers can be told apart from constant bits and from each other.
+class ProbeMarkers {
+    public: int runLength;
+            ProbeMarkers(vector<deque<bool>*> & constants){
+                int longest = 0;
+                for(size_t i = 0; i < constants.size(); ++i){
+                    int run = 0;
+                    deque<bool> & bs = *constants[i];
+                    for(size_t j = 0; j < bs.size(); ++j){
+                        run = bs[j] ? run + 1 : 0;
+                        longest = std::max(longest, run);
+                    }
+                }
+                runLength = longest + 24;
+            }
+
+            deque<bool> marker(int reg){
+                deque<bool> bs = deque<bool>{false};
+                for(int i = 0; i < runLength; ++i){
+                    bs.push_back(true);
+                }
+                bs.push_back(false);
+                for(int i = 19; i >= 0; --i){
+                    bs.push_back((reg >> i) & 1);
+                }
+                return bs;
+            }
+
+            // Splits an annotation produced by the marked run into a register program.
+            vector<AnnPiece> program(deque<bool> & bs){
+                vector<AnnPiece> pieces = vector<AnnPiece>{};
+                int size = bs.size();
+                int pos = 0;
+                while(pos < size){
+                    if(isMarker(bs, pos)){
+                        int reg = 0;
+                        for(int i = 0; i < 20; ++i){
+                            reg = (reg << 1) | bs[pos + runLength + 2 + i];
+                        }
+                        pieces.push_back(AnnPiece(reg));
+                        pos += runLength + 22;
+                    }
+                    else{
+                        if(pieces.size() == 0 || pieces.back().reg != -1){
+                            pieces.push_back(AnnPiece(-1));
+                        }
+                        pieces.back().bits.push_back(bs[pos]);
+                        pos++;
+                    }
+                }
+                return pieces;
+            }
+
+    private: bool isMarker(deque<bool> & bs, int pos){
+                if(pos + runLength + 22 > (int) bs.size() || bs[pos] || bs[pos + runLength + 1]){
+                    return false;
+                }
+                for(int i = 1; i <= runLength; ++i){
+                    if(!bs[pos + i]){
+                        return false;
+                    }
+                }
+                return true;
+            }
+};
+
+// Bit-sequences built by register programs. Concatenation only creates a node, so registers
+// can be copied and extended in constant time; the final bitcode is flattened once at the end.
+// Nodes live in a pool that is freed all at once.
+class BitRopes {
+    public: vector<int> lefts;
+            vector<int> rights;
+            vector<const vector<bool>*> leaves;
+            // A leaf holds the bits [start, start + length) of its vector.
+            vector<uint32_t> starts;
+            vector<uint32_t> lengths;
+
+            // Returns a rope for constant bits, or -1 (the empty rope) if there are none.
+            int leaf(const vector<bool>* bits){
+                return leaf(bits, 0, bits->size());
+            }
+
+            // Returns a rope for the length bits of bits from start, which may be a shared pool.
+            int leaf(const vector<bool>* bits, uint32_t start, uint32_t length){
+                if(length == 0){
+                    return -1;
+                }
+                lefts.push_back(-1);
+                rights.push_back(-1);
+                leaves.push_back(bits);
+                starts.push_back(start);
+                lengths.push_back(length);
+                return lefts.size() - 1;
+            }
+
+            int concat(int a, int b){
+                if(a == -1){
+                    return b;
+                }
+                if(b == -1){
+                    return a;
+                }
+                lefts.push_back(a);
+                rights.push_back(b);
+                leaves.push_back(nullptr);
+                starts.push_back(0);
+                lengths.push_back(0);
+                return lefts.size() - 1;
+            }
+
+            // Evaluates a register program over the registers regs.
+            int run(vector<AnnPiece> & program, vector<int> & regs){
+                int out = -1;
+                for(size_t i = 0; i < program.size(); ++i){
+                    AnnPiece & piece = program[i];
+                    out = concat(out, (piece.reg == -1) ? leaf(&piece.bits) : regs[piece.reg]);
+                }
+                return out;
+            }
+
+            // Appends the bits of rope to out, without recursion since ropes can be very deep.
+            void flatten(int rope, deque<bool> & out){
+                vector<int> stack = vector<int>{};
+                if(rope != -1){
+                    stack.push_back(rope);
+                }
+                while(stack.size() > 0){
+                    int node = stack.back();
+                    stack.pop_back();
+                    if(leaves[node] != nullptr){
+                        auto first = leaves[node]->begin() + starts[node];
+                        out.insert(out.end(), first, first + lengths[node]);
+                    }
+                    else{
+                        stack.push_back(rights[node]);
+                        stack.push_back(lefts[node]);
+                    }
+                }
+            }
+};
+
+// The automaton of simplified derivative states of a specification, built lazily: a transition
+// is computed the first time it is taken and cached from then on.
+class DerivativeAutomaton {
+    public: Rexp* spec;
+            vector<string> keys;
+            unordered_map<string, int> ids;
+            vector<int> registers;
+            vector<bool> nullable;
+            // dead[s] is true if s is the ZERO state, from which nothing can be matched.
+            vector<bool> dead;
+            vector<int> sizes;
+            // finals[s] computes mkepsBC of a nullable state s from its registers.
+            vector<vector<AnnPiece>> finals;
+            vector<vector<DerTransition*>> transitions;
+            vector<vector<bool>> initialAnns;
+
+            DerivativeAutomaton(Rexp* r)
+            : spec(optimiseSpec(r)){
+                vector<ARexp*> nodes = vector<ARexp*>{};
+                ARexp::arena = &nodes;
+                ARexp* start = internalize(spec);
+                vector<deque<bool>*> anns = vector<deque<bool>*>{};
+                collectAnns(start, anns);
+                for(size_t i = 0; i < anns.size(); ++i){
+                    initialAnns.push_back(vector<bool>(anns[i]->begin(), anns[i]->end()));
+                }
+                string key = canonicalBC(start);
+                freeArena(nodes);
+                addState(key);
+            }
+
+            ~DerivativeAutomaton(){
+                for(size_t s = 0; s < transitions.size(); ++s){
+                    for(int c = 0; c < 256; ++c){
+                        delete transitions[s][c];
+                    }
+                }
+            }
+
+            DerivativeAutomaton(const DerivativeAutomaton & other) = delete;
+            DerivativeAutomaton & operator= (const DerivativeAutomaton & other) = delete;
+
+            // Returns the identifier of the state with the given key, adding it if it is new.
+            int addState(const string & key){
+                auto found = ids.find(key);
+                if(found != ids.end()){
+                    return found->second;
+                }
+                int id = keys.size();
+                keys.push_back(key);
+                ids[key] = id;
+                vector<ARexp*> nodes = vector<ARexp*>{};
+                ARexp::arena = &nodes;
+                ARexp* plain = parseCanonicalBC(key);
+                vector<deque<bool>*> anns = vector<deque<bool>*>{};
+                collectAnns(plain, anns);
+                registers.push_back(anns.size());
+                dead.push_back(key == "0");
+                sizes.push_back(regexSizeBC(plain));
+                nullable.push_back(nullableBC(plain));
+                vector<AnnPiece> finalProgram = vector<AnnPiece>{};
+                if(nullable.back()){
+                    deque<bool> constant = mkepsBC(plain);
+                    vector<deque<bool>*> constants = vector<deque<bool>*>{&constant};
+                    ProbeMarkers markers = ProbeMarkers(constants);
+                    ARexp* probe = markState(key, markers);
+                    deque<bool> marked = mkepsBC(probe);
+                    finalProgram = markers.program(marked);
+                }
+                finals.push_back(finalProgram);
+                transitions.push_back(vector<DerTransition*>(256, nullptr));
+                freeArena(nodes);
+                return id;
+            }
+
+            // Returns the transition of state s for character c, computing it on first use.
+            DerTransition* transition(int s, char c){
+                DerTransition* & t = transitions[s][(unsigned char) c];
+                if(t == nullptr){
+                    string key = keys[s];
+                    vector<ARexp*> nodes = vector<ARexp*>{};
+                    ARexp::arena = &nodes;
+                    ARexp* plain = simpBC(derBC(c, parseCanonicalBC(key)));
+                    vector<deque<bool>*> constants = vector<deque<bool>*>{};
+                    collectAnns(plain, constants);
+                    ProbeMarkers markers = ProbeMarkers(constants);
+                    ARexp* probed = simpBC(derBC(c, markState(key, markers)));
+                    vector<deque<bool>*> anns = vector<deque<bool>*>{};
+                    collectAnns(probed, anns);
+                    DerTransition* out = new DerTransition();
+                    for(size_t i = 0; i < anns.size(); ++i){
+                        out->programs.push_back(markers.program(*anns[i]));
+                    }
+                    string target = canonicalBC(plain);
+                    freeArena(nodes);
+                    out->target = addState(target);
+                    // addState may have grown transitions, so look the slot up again.
+                    transitions[s][(unsigned char) c] = out;
+                    return out;
+                }
+                return t;
+            }
+
+            // Explores every state reachable from the initial state over the characters used by
+            // the specification and one character it does not use. Stops as soon as more than
+            // bound states have been found. Returns the number of states found.
+            int explore(int bound){
+                vector<char> alphabet = specAlphabet(spec);
+                for(size_t s = 0; s < keys.size() && keys.size() <= (size_t) bound; ++s){
+                    for(size_t i = 0; i < alphabet.size() && keys.size() <= (size_t) bound; ++i){
+                        transition(s, alphabet[i]);
+                    }
+                }
+                return keys.size();
+            }
+
+            // Returns the characters used by the specification followed by one character it
+            // does not use, which stands for all the others.
+            static vector<char> specAlphabet(Rexp* r){
+                bitset<256> used;
+                markAlphabet(r, used);
+                vector<char> alphabet = vector<char>{};
+                int unused = -1;
+                for(int c = 0; c < 256; ++c){
+                    if(used.test(c)){
+                        alphabet.push_back((char) c);
+                    }
+                    else if(unused == -1){
+                        unused = c;
+                    }
+                }
+                if(unused != -1){
+                    alphabet.push_back((char) unused);
+                }
+                return alphabet;
+            }
+
+            // Deletes every annotated regular expression recorded while computing a state or a
+            // transition; only keys and register programs are kept.
+            static void freeArena(vector<ARexp*> & nodes){
+                ARexp::arena = nullptr;
+                for(size_t i = 0; i < nodes.size(); ++i){
+                    delete nodes[i];
+                }
+                nodes.clear();
+            }
+
+    private: static void markAlphabet(Rexp* r, bitset<256> & used){
+                string & name = r->name;
+                if(name == "CHAR"){
+                    used.set((unsigned char) static_cast<CHAR*>(r)->c);
+                }
+                else if(name == "CHARSET"){
+                    used |= static_cast<CHARSET*>(r)->cs;
+                }
+                else if(name == "LITERAL"){
+                    string & s = static_cast<LITERAL*>(r)->s;
+                    for(size_t i = 0; i < s.size(); ++i){
+                        used.set((unsigned char) s[i]);
+                    }
+                }
+                else if(name == "ALT"){
+                    markAlphabet(static_cast<ALT*>(r)->r1, used);
+                    markAlphabet(static_cast<ALT*>(r)->r2, used);
+                }
+                else if(name == "SEQ"){
+                    markAlphabet(static_cast<SEQ*>(r)->r1, used);
+                    markAlphabet(static_cast<SEQ*>(r)->r2, used);
+                }
+                else if(name == "STAR"){
+                    markAlphabet(static_cast<STAR*>(r)->rs, used);
+                }
+                else if(name == "NTIMES"){
+                    markAlphabet(static_cast<NTIMES*>(r)->rs, used);
+                }
+                else if(name == "PLUS"){
+                    markAlphabet(static_cast<PLUS*>(r)->rs, used);
+                }
+                else if(name == "OPTIONAL"){
+                    markAlphabet(static_cast<OPTIONAL*>(r)->rs, used);
+                }
+                else if(name == "RECD"){
+                    markAlphabet(static_cast<RECD*>(r)->r, used);
+                }
+            }
+
+            // Rebuilds the state with the given key with register i holding marker i.
+            ARexp* markState(const string & key, ProbeMarkers & markers){
+                ARexp* probe = parseCanonicalBC(key);
+                vector<deque<bool>*> anns = vector<deque<bool>*>{};
+                collectAnns(probe, anns);
+                for(size_t i = 0; i < anns.size(); ++i){
+                    *anns[i] = markers.marker(i);
+                }
+                return probe;
+            }
+
+};
+
+// Returns the registers of the initial state of the automaton.
+vector<int> initialRegisters(DerivativeAutomaton & da, BitRopes & ropes){
+    vector<int> regs = vector<int>{};
+    for(size_t i = 0; i < da.initialAnns.size(); ++i){
+        regs.push_back(ropes.leaf(&da.initialAnns[i]));
+    }
+    return regs;
+}
+
+// Runs the register programs of t, replacing regs with the registers of t's target. next is
+// scratch space that is reused between transitions.
+void takeTransition(DerTransition* t, BitRopes & ropes, vector<int> & regs, vector<int> & next){
+    next.resize(t->programs.size());
+    for(size_t j = 0; j < t->programs.size(); ++j){
+        next[j] = ropes.run(t->programs[j], regs);
+    }
+    regs.swap(next);
+}
+
+// Decodes the tokens from the registers of the state reached at the end of the input.
+deque<string> automatonTokens(DerivativeAutomaton & da, BitRopes & ropes, vector<int> & regs, int state){
+    deque<string> tokens = deque<string>{};
+    if(da.nullable[state]){
+        deque<bool> bs = deque<bool>{};
+        ropes.flatten(ropes.run(da.finals[state], regs), bs);
+        tokens = sdecode(da.spec, bs);
+    }
+    else{
+        cout << "No match found.\n";
+    }
+    return tokens;
+}
+
+// Tokenises the input string like blexer2_simp, but follows the cached transitions of the
+// automaton instead of computing derivatives, which only happens for transitions not seen before.
+deque<string> blexer_automaton(DerivativeAutomaton & da, string s){
+    BitRopes ropes = BitRopes();
+    vector<int> regs = initialRegisters(da, ropes);
+    vector<int> next = vector<int>{};
+    int state = 0;
+    for(size_t i = 0; i < s.size(); ++i){
+        DerTransition* t = da.transition(state, s[i]);
+        takeTransition(t, ropes, regs, next);
+        state = t->target;
+    }
+    return automatonTokens(da, ropes, regs, state);
+}
+
+// Counts the derivative states of the specification r (after optimiseSpec) and prints a report.
+// Fails loudly if there are more than bound states, so pathological specifications can be
+// caught before they are deployed.
+bool checkDerivativeStates(Rexp* r, int bound){
+    DerivativeAutomaton da = DerivativeAutomaton(r);
+    int states = da.explore(bound);
+    int largest = 0;
+    for(size_t i = 0; i < da.sizes.size(); ++i){
+        largest = std::max(largest, da.sizes[i]);
+    }
+    if(states > bound){
+        cout << "error: more than " << bound << " derivative states (largest state has " << largest << " nodes)" << endl;
+        return false;
+    }
+    cout << states << " derivative states (bound " << bound << "), largest state has " << largest << " nodes" << endl;
+    return true;
+}
+
+
+// *** MINIMISED TRANSDUCER ***
+// Once every state of the derivative automaton has been explored, the automaton is a complete
+// transducer whose outputs are register programs, and many of its states behave the same: their
+// keys differ, but for every input they emit the same bits. Two passes find them.
+// - Liveness: a register is live in a state if its contents can reach the bitcode, through the
+//   final program or through the program of a live register of a successor. The programs of dead
+//   registers are emptied, since what they hold is never emitted. This plays the part of the
+//   output delays of a sequential transducer: bits that are not emitted yet are not compared.
+// - Hopcroft's partition refinement. States start in one block per register count, final
+//   program and list of transition outputs; a block is split until, for every character, all of
+//   its states go to one block. States in one block then emit the same bits for any registers.
+// The result keeps one row of targets and output indices per block, over the characters the
+// specification uses and one column for all the others.
+
+// Appends a key of a register program to out; equal programs have equal keys.
+void programKey(vector<AnnPiece> & program, string & out){
+    for(size_t i = 0; i < program.size(); ++i){
+        if(program[i].reg == -1){
+            out += 'b';
+            for(size_t j = 0; j < program[i].bits.size(); ++j){
+                out += program[i].bits[j] ? '1' : '0';
+            }
+        }
+        else{
+            out += 'r' + std::to_string(program[i].reg);
+        }
+        out += ';';
+    }
+    out += '|';
+}
+
+// Returns the bytes taken by a register program: its pieces and the words of their bits.
+size_t programBytes(const vector<AnnPiece> & program){
+    size_t bytes = program.capacity() * sizeof(AnnPiece);
+    for(size_t i = 0; i < program.size(); ++i){
+        bytes += (program[i].bits.capacity() + 63) / 64 * 8;
+    }
+    return bytes;
+}
+
+// Returns the bytes taken by a list of register programs.
+size_t programsBytes(const vector<vector<AnnPiece>> & programs){
+    size_t bytes = programs.capacity() * sizeof(vector<AnnPiece>);
+    for(size_t i = 0; i < programs.size(); ++i){
+        bytes += programBytes(programs[i]);
+    }
+    return bytes;
+}
+
+// Returns the bytes taken by a list of annotations.
+size_t annsBytes(const vector<vector<bool>> & anns){
+    size_t bytes = anns.capacity() * sizeof(vector<bool>);
+    for(size_t i = 0; i < anns.size(); ++i){
+        bytes += (anns[i].capacity() + 63) / 64 * 8;
+    }
+    return bytes;
+}
+
+// Returns the bytes taken by the transitions of the automaton and their register programs,
+// together with the final programs and the initial annotations.
+size_t automatonBytes(DerivativeAutomaton & da){
+    size_t bytes = da.transitions.capacity() * sizeof(vector<DerTransition*>) + programsBytes(da.finals) + annsBytes(da.initialAnns);
+    for(size_t s = 0; s < da.transitions.size(); ++s){
+        bytes += da.transitions[s].capacity() * sizeof(DerTransition*);
+        for(size_t c = 0; c < da.transitions[s].size(); ++c){
+            if(da.transitions[s][c] != nullptr){
+                bytes += sizeof(DerTransition) + programsBytes(da.transitions[s][c]->programs);
+            }
+        }
+    }
+    return bytes;
+}
+
+// A piece of a pooled register program: the register reg, or, if reg is -1, the constant bits
+// [start, start + length) of the bit pool.
+class PoolPiece {
+    public: int reg;
+            uint32_t start;
+            uint32_t length;
+            PoolPiece(int regIn, uint32_t startIn, uint32_t lengthIn)
+            : reg(regIn), start(startIn), length(lengthIn){
+
+            }
+};
+
+class MinimalTransducer {
+    public: Rexp* spec;
+            // The states before minimisation, and after.
+            int explored;
+            int states;
+            // The column of every character; the last column stands for the characters the
+            // specification does not use.
+            int column[256];
+            int columns;
+            // next[s * columns + c] is the target of state s on column c, and out[s * columns + c]
+            // its output. State 0 is the initial state.
+            vector<int> next;
+            vector<int> out;
+            // The programs are stored once each, in contiguous pools: output o is the list of
+            // programs outputPrograms[outputStarts[o] .. outputStarts[o + 1]), program p is
+            // pieces[programStarts[p] .. programStarts[p + 1]), and the constant bits of every
+            // piece lie in the one bit pool bits.
+            vector<uint32_t> outputStarts;
+            vector<uint32_t> outputPrograms;
+            vector<uint32_t> programStarts;
+            vector<PoolPiece> pieces;
+            vector<bool> bits;
+            vector<bool> nullable;
+            // finals[s] is the program of state s.
+            vector<uint32_t> finals;
+            vector<vector<bool>> initialAnns;
+            bool complete;
+
+            // Explores the automaton of r and minimises it. complete is false, and nothing is
+            // built, if r has more than bound derivative states.
+            MinimalTransducer(Rexp* r, int bound)
+            : explored(0), states(0), columns(0), outputStarts(1, 0), programStarts(1, 0), complete(false){
+                DerivativeAutomaton da = DerivativeAutomaton(r);
+                spec = da.spec;
+                explored = da.explore(bound);
+                if(explored > bound){
+                    return;
+                }
+                vector<char> alphabet = DerivativeAutomaton::specAlphabet(da.spec);
+                columns = alphabet.size();
+                for(int c = 0; c < 256; ++c){
+                    column[c] = columns - 1;
+                }
+                for(int i = 0; i < columns; ++i){
+                    column[(unsigned char) alphabet[i]] = i;
+                }
+                // Only the live registers of a state are kept, numbered in order.
+                vector<vector<bool>> live = liveRegisters(da, alphabet);
+                vector<vector<int>> renumber = vector<vector<int>>(explored);
+                for(int s = 0; s < explored; ++s){
+                    int kept = 0;
+                    for(size_t i = 0; i < live[s].size(); ++i){
+                        renumber[s].push_back(live[s][i] ? kept++ : -1);
+                    }
+                }
+                for(size_t i = 0; i < da.initialAnns.size(); ++i){
+                    if(live[0][i]){
+                        initialAnns.push_back(da.initialAnns[i]);
+                    }
+                }
+                vector<vector<AnnPiece>> compactFinals = vector<vector<AnnPiece>>{};
+                for(int s = 0; s < explored; ++s){
+                    compactFinals.push_back(renamed(da.finals[s], renumber[s]));
+                }
+                vector<int> outIds = vector<int>(explored * columns);
+                unordered_map<string, int> outputIds = unordered_map<string, int>{};
+                unordered_map<string, uint32_t> programIds = unordered_map<string, uint32_t>{};
+                unordered_map<string, uint32_t> bitStarts = unordered_map<string, uint32_t>{};
+                for(int s = 0; s < explored; ++s){
+                    for(int c = 0; c < columns; ++c){
+                        DerTransition* t = da.transitions[s][(unsigned char) alphabet[c]];
+                        vector<vector<AnnPiece>> programs = vector<vector<AnnPiece>>{};
+                        string key = "";
+                        for(size_t j = 0; j < t->programs.size(); ++j){
+                            if(live[t->target][j]){
+                                programs.push_back(renamed(t->programs[j], renumber[s]));
+                                programKey(programs.back(), key);
+                            }
+                        }
+                        auto found = outputIds.find(key);
+                        if(found == outputIds.end()){
+                            found = outputIds.insert({key, (int) outputStarts.size() - 1}).first;
+                            for(size_t j = 0; j < programs.size(); ++j){
+                                outputPrograms.push_back(pool(programs[j], programIds, bitStarts));
+                            }
+                            outputStarts.push_back(outputPrograms.size());
+                        }
+                        outIds[s * columns + c] = found->second;
+                    }
+                }
+                vector<int> blockOf = refine(da, alphabet, outIds, compactFinals);
+                // Renumber the blocks in the order their first states appear, so that the block
+                // of the initial state is 0.
+                vector<int> number = vector<int>(explored, -1);
+                vector<int> first = vector<int>{};
+                for(int s = 0; s < explored; ++s){
+                    if(number[blockOf[s]] == -1){
+                        number[blockOf[s]] = first.size();
+                        first.push_back(s);
+                    }
+                }
+                states = first.size();
+                next.resize(states * columns);
+                out.resize(states * columns);
+                for(int b = 0; b < states; ++b){
+                    int s = first[b];
+                    nullable.push_back(da.nullable[s]);
+                    finals.push_back(pool(compactFinals[s], programIds, bitStarts));
+                    for(int c = 0; c < columns; ++c){
+                        next[b * columns + c] = number[blockOf[da.transitions[s][(unsigned char) alphabet[c]]->target]];
+                        out[b * columns + c] = outIds[s * columns + c];
+                    }
+                }
+                // The pools are not grown again.
+                outputPrograms.shrink_to_fit();
+                pieces.shrink_to_fit();
+                bits.shrink_to_fit();
+                complete = true;
+            }
+
+            // Evaluates the pooled program p over the registers regs.
+            int run(BitRopes & ropes, uint32_t p, vector<int> & regs){
+                int rope = -1;
+                for(uint32_t i = programStarts[p]; i < programStarts[p + 1]; ++i){
+                    PoolPiece & piece = pieces[i];
+                    rope = ropes.concat(rope, (piece.reg == -1) ? ropes.leaf(&bits, piece.start, piece.length) : regs[piece.reg]);
+                }
+                return rope;
+            }
+
+            // Bytes taken by the transition table, the character columns, the pools of the
+            // register programs and the initial annotations.
+            size_t tableBytes(){
+                size_t bytes = sizeof(column) + (next.capacity() + out.capacity()) * sizeof(int) + (nullable.capacity() + 63) / 64 * 8;
+                bytes += (outputStarts.capacity() + outputPrograms.capacity() + programStarts.capacity() + finals.capacity()) * sizeof(uint32_t);
+                bytes += pieces.capacity() * sizeof(PoolPiece) + (bits.capacity() + 63) / 64 * 8 + annsBytes(initialAnns);
+                return bytes;
+            }
+
+    private: // Adds program to the pools, unless an equal program is already there, and returns its
+            // number. Equal constant bits are stored once too.
+            uint32_t pool(vector<AnnPiece> & program, unordered_map<string, uint32_t> & programIds, unordered_map<string, uint32_t> & bitStarts){
+                string key = "";
+                programKey(program, key);
+                auto found = programIds.find(key);
+                if(found != programIds.end()){
+                    return found->second;
+                }
+                for(size_t i = 0; i < program.size(); ++i){
+                    if(program[i].reg != -1){
+                        pieces.push_back(PoolPiece(program[i].reg, 0, 0));
+                        continue;
+                    }
+                    string bitKey = string(program[i].bits.begin(), program[i].bits.end());
+                    auto start = bitStarts.find(bitKey);
+                    if(start == bitStarts.end()){
+                        start = bitStarts.insert({bitKey, (uint32_t) bits.size()}).first;
+                        bits.insert(bits.end(), program[i].bits.begin(), program[i].bits.end());
+                    }
+                    pieces.push_back(PoolPiece(-1, start->second, program[i].bits.size()));
+                }
+                programStarts.push_back(pieces.size());
+                return programIds.insert({key, (uint32_t) programStarts.size() - 2}).first->second;
+            }
+
+            // Returns program with every register renumbered.
+            static vector<AnnPiece> renamed(vector<AnnPiece> & program, vector<int> & renumber){
+                vector<AnnPiece> out = program;
+                for(size_t i = 0; i < out.size(); ++i){
+                    if(out[i].reg != -1){
+                        out[i].reg = renumber[out[i].reg];
+                    }
+                }
+                return out;
+            }
+
+            static vector<bool> programRegisters(vector<AnnPiece> & program, int registers){
+                vector<bool> used = vector<bool>(registers, false);
+                for(size_t i = 0; i < program.size(); ++i){
+                    if(program[i].reg != -1){
+                        used[program[i].reg] = true;
+                    }
+                }
+                return used;
+            }
+
+            // Computes the live registers of every state by propagating liveness backwards over
+            // the transitions until nothing changes.
+            static vector<vector<bool>> liveRegisters(DerivativeAutomaton & da, vector<char> & alphabet){
+                int n = da.keys.size();
+                vector<vector<bool>> live = vector<vector<bool>>{};
+                for(int s = 0; s < n; ++s){
+                    live.push_back(programRegisters(da.finals[s], da.registers[s]));
+                }
+                bool changed = true;
+                while(changed){
+                    changed = false;
+                    for(int s = 0; s < n; ++s){
+                        for(size_t c = 0; c < alphabet.size(); ++c){
+                            DerTransition* t = da.transitions[s][(unsigned char) alphabet[c]];
+                            for(size_t j = 0; j < t->programs.size(); ++j){
+                                if(!live[t->target][j]){
+                                    continue;
+                                }
+                                vector<AnnPiece> & program = t->programs[j];
+                                for(size_t i = 0; i < program.size(); ++i){
+                                    if(program[i].reg != -1 && !live[s][program[i].reg]){
+                                        live[s][program[i].reg] = true;
+                                        changed = true;
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+                return live;
+            }
+
+            // Hopcroft's algorithm. Returns the block of every state.
+            vector<int> refine(DerivativeAutomaton & da, vector<char> & alphabet, vector<int> & outIds, vector<vector<AnnPiece>> & compactFinals){
+                int n = explored;
+                vector<vector<vector<int>>> preds = vector<vector<vector<int>>>(columns, vector<vector<int>>(n));
+                for(int s = 0; s < n; ++s){
+                    for(int c = 0; c < columns; ++c){
+                        preds[c][da.transitions[s][(unsigned char) alphabet[c]]->target].push_back(s);
+                    }
+                }
+                // The initial partition: states with the same outputs and the same final program,
+                // which also fixes the number of live registers.
+                vector<int> blockOf = vector<int>(n);
+                vector<vector<int>> blocks = vector<vector<int>>{};
+                map<string, int> initial = map<string, int>{};
+                for(int s = 0; s < n; ++s){
+                    string key = da.nullable[s] ? "n:" : ":";
+                    programKey(compactFinals[s], key);
+                    for(int c = 0; c < columns; ++c){
+                        key += std::to_string(outIds[s * columns + c]) + ',';
+                    }
+                    auto found = initial.find(key);
+                    if(found == initial.end()){
+                        found = initial.insert({key, (int) blocks.size()}).first;
+                        blocks.push_back(vector<int>{});
+                    }
+                    blockOf[s] = found->second;
+                    blocks[found->second].push_back(s);
+                }
+                vector<pair<int, int>> work = vector<pair<int, int>>{};
+                vector<vector<bool>> waiting = vector<vector<bool>>{};
+                for(size_t b = 0; b < blocks.size(); ++b){
+                    waiting.push_back(vector<bool>(columns, true));
+                    for(int c = 0; c < columns; ++c){
+                        work.push_back({b, c});
+                    }
+                }
+                vector<bool> marked = vector<bool>(n, false);
+                vector<int> markedCount = vector<int>{};
+                while(work.size() > 0){
+                    int splitter = work.back().first;
+                    int c = work.back().second;
+                    work.pop_back();
+                    waiting[splitter][c] = false;
+                    // Mark the states that go into the splitter on c.
+                    vector<int> touched = vector<int>{};
+                    vector<int> sources = vector<int>{};
+                    markedCount.resize(blocks.size(), 0);
+                    for(size_t i = 0; i < blocks[splitter].size(); ++i){
+                        vector<int> & ps = preds[c][blocks[splitter][i]];
+                        for(size_t j = 0; j < ps.size(); ++j){
+                            int s = ps[j];
+                            if(!marked[s]){
+                                marked[s] = true;
+                                sources.push_back(s);
+                                if(markedCount[blockOf[s]]++ == 0){
+                                    touched.push_back(blockOf[s]);
+                                }
+                            }
+                        }
+                    }
+                    // Split every block that is only partly marked.
+                    for(size_t i = 0; i < touched.size(); ++i){
+                        int y = touched[i];
+                        if((size_t) markedCount[y] < blocks[y].size()){
+                            int z = blocks.size();
+                            vector<int> in = vector<int>{};
+                            vector<int> rest = vector<int>{};
+                            for(size_t j = 0; j < blocks[y].size(); ++j){
+                                (marked[blocks[y][j]] ? in : rest).push_back(blocks[y][j]);
+                            }
+                            blocks[y] = rest;
+                            blocks.push_back(in);
+                            for(size_t j = 0; j < in.size(); ++j){
+                                blockOf[in[j]] = z;
+                            }
+                            waiting.push_back(vector<bool>(columns, false));
+                            for(int d = 0; d < columns; ++d){
+                                int add = (waiting[y][d] || in.size() <= rest.size()) ? z : y;
+                                if(!waiting[add][d]){
+                                    waiting[add][d] = true;
+                                    work.push_back({add, d});
+                                }
+                            }
+                        }
+                        markedCount[y] = 0;
+                    }
+                    for(size_t i = 0; i < sources.size(); ++i){
+                        marked[sources[i]] = false;
+                    }
+                }
+                return blockOf;
+            }
+};
+
+// Runs the minimised transducer on s and sets bs to the bitcode of blexer_automaton. Returns false
+// if s does not match.
+bool minimalBits(MinimalTransducer & m, const string & s, deque<bool> & bs){
+    BitRopes ropes = BitRopes();
+    vector<int> regs = vector<int>{};
+    for(size_t i = 0; i < m.initialAnns.size(); ++i){
+        regs.push_back(ropes.leaf(&m.initialAnns[i]));
+    }
+    vector<int> next = vector<int>{};
+    int state = 0;
+    for(size_t i = 0; i < s.size(); ++i){
+        int cell = state * m.columns + m.column[(unsigned char) s[i]];
+        uint32_t first = m.outputStarts[m.out[cell]];
+        uint32_t last = m.outputStarts[m.out[cell] + 1];
+        next.resize(last - first);
+        for(uint32_t j = first; j < last; ++j){
+            next[j - first] = m.run(ropes, m.outputPrograms[j], regs);
+        }
+        regs.swap(next);
+        state = m.next[cell];
+    }
+    if(!m.nullable[state]){
+        return false;
+    }
+    ropes.flatten(m.run(ropes, m.finals[state], regs), bs);
+    return true;
+}
+
+// Tokenises the input string like blexer_automaton, with the minimised transducer.
+deque<string> blexer_minimal(MinimalTransducer & m, string s){
+    deque<bool> bs = deque<bool>{};
+    if(!minimalBits(m, s, bs)){
+        cout << "No match found.\n";
+        return deque<string>{};
+    }
+    return sdecode(m.spec, bs);
+}
+
+
+// *** MULTI-PATTERN SEARCH ***
+// Finds every non-overlapping occurrence of the named rules of a specification in a text, like
+// grep -o, instead of requiring the whole text to be one sequence of tokens. Matches are
+// leftmost-longest: the earliest start wins, then the longest match from there, then the rule
+// that comes first in the specification. Empty matches are not reported.
+// Every rule has a derivative automaton whose transitions are cached. The text is read once, as
+// with an implicit .* prefix: a thread of each rule starts at every position the prefilter cannot
+// rule out, and threads of a rule that reach the same state are merged into the one that started
+// first, since they match the same suffixes and the earlier start wins. A rule therefore has at
+// most one thread per state of its automaton. The best match seen is reported once no live thread
+// started at or before it. Merged threads no longer know the later starts, so reading then goes
+// back to the end of the match. A search is linear in the text unless matches are often followed
+// by a longer attempt that fails, as for the rules a and a*b over a run of a's. It is then
+// quadratic, like starting a scan at every position.
+
+// A rule's run of its automaton from offset start of the text, now in state.
+class SearchThread {
+    public: int state;
+            size_t start;
+};
+
+// One occurrence of a rule: the rule name and the offsets of its first and one past its last
+// character.
+class SearchMatch {
+    public: string rule;
+            size_t start;
+            size_t end;
+            SearchMatch()
+            : rule(""), start(0), end(0){
+
+            }
+};
+
+class RuleSearcher {
+    public: vector<string> names;
+            vector<DerivativeAutomaton*> automata;
+            // Bytes that can start a non-empty match of some rule.
+            bitset<256> firstBytes;
+            // The only byte that can start a match, or -1 if there is more than one, in which
+            // case the prefilter cannot use memchr.
+            int onlyByte;
+            // The number of transitions taken since the searcher was made.
+            unsigned long steps;
+
+            // The rules are the alternatives of r, which may be wrapped in a STAR like a lexing
+            // specification. Alternatives that are not named by RECD are reported with no name.
+            RuleSearcher(Rexp* r)
+            : onlyByte(-1), steps(0), text(nullptr), resumePos(0), scanned(0), live(0), bestRule(-1), bestStart(0), bestEnd(0), generation(0){
+                if(r->name == "STAR"){
+                    r = static_cast<STAR*>(r)->rs;
+                }
+                deque<Rexp*> rules = deque<Rexp*>{};
+                collectAlts(r, rules);
+                for(size_t i = 0; i < rules.size(); ++i){
+                    if(rules[i]->name == "RECD"){
+                        RECD* rule = static_cast<RECD*>(rules[i]);
+                        names.push_back(rule->x);
+                        automata.push_back(new DerivativeAutomaton(rule->r));
+                    }
+                    else{
+                        names.push_back("");
+                        automata.push_back(new DerivativeAutomaton(rules[i]));
+                    }
+                    addFirstBytes(*automata.back());
+                }
+                threads = vector<vector<SearchThread>>(automata.size());
+                stamps = vector<vector<unsigned long>>(automata.size());
+                slots = vector<vector<int>>(automata.size());
+                if(firstBytes.count() == 1){
+                    for(int c = 0; c < 256; ++c){
+                        if(firstBytes.test(c)){
+                            onlyByte = c;
+                        }
+                    }
+                }
+            }
+
+            ~RuleSearcher(){
+                for(size_t i = 0; i < automata.size(); ++i){
+                    delete automata[i];
+                }
+            }
+
+            RuleSearcher(const RuleSearcher & other) = delete;
+            RuleSearcher & operator= (const RuleSearcher & other) = delete;
+
+            // Finds the next match starting at or after pos and moves pos past it. Returns false
+            // if there are no more matches. A call that goes on from the pos the last one returned
+            // in the same text goes on from where that one stopped reading.
+            bool nextMatch(const char* begin, const char* end, size_t & pos, SearchMatch & out){
+                if(begin != text || pos != resumePos){
+                    restart(begin, pos);
+                }
+                size_t size = end - begin;
+                while(true){
+                    if(bestRule != -1 && (scanned == size || !liveAtOrBefore(bestStart))){
+                        out.rule = names[bestRule];
+                        out.start = bestStart;
+                        out.end = bestEnd;
+                        restart(begin, bestEnd);
+                        pos = out.end;
+                        resumePos = pos;
+                        return true;
+                    }
+                    if(scanned == size){
+                        break;
+                    }
+                    if(bestRule == -1 && live == 0){
+                        scanned = skip(begin + scanned, end) - begin;
+                        if(scanned == size){
+                            break;
+                        }
+                    }
+                    unsigned char c = begin[scanned];
+                    bool starts = firstBytes.test(c);
+                    for(size_t i = 0; i < automata.size(); ++i){
+                        if(starts){
+                            threads[i].push_back(SearchThread{0, scanned});
+                            live++;
+                        }
+                        if(threads[i].size() > 0){
+                            step(i, c);
+                        }
+                    }
+                    scanned++;
+                }
+                pos = size;
+                resumePos = pos;
+                return false;
+            }
+
+    private: void addFirstBytes(DerivativeAutomaton & da){
+                vector<char> alphabet = DerivativeAutomaton::specAlphabet(da.spec);
+                bitset<256> used;
+                for(size_t i = 0; i < alphabet.size(); ++i){
+                    used.set((unsigned char) alphabet[i]);
+                }
+                for(size_t i = 0; i < alphabet.size(); ++i){
+                    unsigned char c = alphabet[i];
+                    if(da.dead[da.transition(0, c)->target]){
+                        continue;
+                    }
+                    // The last character of the alphabet stands for every character the
+                    // specification does not use, unless the specification uses all of them.
+                    if(i == alphabet.size() - 1 && used.count() < 256){
+                        for(int d = 0; d < 256; ++d){
+                            if(!used.test(d) || d == c){
+                                firstBytes.set(d);
+                            }
+                        }
+                    }
+                    else{
+                        firstBytes.set(c);
+                    }
+                }
+            }
+
+            // Returns the first position from p that can start a match.
+            const char* skip(const char* p, const char* end){
+                if(onlyByte != -1){
+                    const void* found = memchr(p, onlyByte, end - p);
+                    return (found == nullptr) ? end : static_cast<const char*>(found);
+                }
+                while(p < end && !firstBytes.test((unsigned char) *p)){
+                    p++;
+                }
+                return p;
+            }
+
+            // Forgets the threads and starts reading the text at begin from pos.
+            void restart(const char* begin, size_t pos){
+                text = begin;
+                scanned = pos;
+                bestRule = -1;
+                live = 0;
+                for(size_t i = 0; i < threads.size(); ++i){
+                    threads[i].clear();
+                }
+            }
+
+            // Moves the threads of rule i over c, merges those that reach the same state and
+            // records the matches that end after c.
+            void step(size_t i, unsigned char c){
+                DerivativeAutomaton & da = *automata[i];
+                vector<SearchThread> & current = threads[i];
+                if(current.size() == 1){
+                    // Nothing to merge: the common case, away from long attempts.
+                    int target = da.transition(current[0].state, c)->target;
+                    steps++;
+                    if(da.dead[target]){
+                        current.clear();
+                        live--;
+                    }
+                    else{
+                        current[0].state = target;
+                        if(da.nullable[target]){
+                            offer((int) i, current[0].start, scanned + 1);
+                        }
+                    }
+                    return;
+                }
+                vector<unsigned long> & stamp = stamps[i];
+                vector<int> & slot = slots[i];
+                ++generation;
+                next.clear();
+                for(size_t j = 0; j < current.size(); ++j){
+                    int target = da.transition(current[j].state, c)->target;
+                    steps++;
+                    if(da.dead[target]){
+                        continue;
+                    }
+                    if(stamp.size() <= (size_t) target){
+                        stamp.resize(da.keys.size(), 0);
+                        slot.resize(da.keys.size(), -1);
+                    }
+                    if(stamp[target] == generation){
+                        SearchThread & merged = next[slot[target]];
+                        merged.start = std::min(merged.start, current[j].start);
+                    }
+                    else{
+                        stamp[target] = generation;
+                        slot[target] = next.size();
+                        next.push_back(SearchThread{target, current[j].start});
+                    }
+                }
+                for(size_t j = 0; j < next.size(); ++j){
+                    if(da.nullable[next[j].state]){
+                        offer((int) i, next[j].start, scanned + 1);
+                    }
+                }
+                live += next.size();
+                live -= current.size();
+                current.swap(next);
+            }
+
+            // Keeps the match of rule from start to end if it beats the best one so far.
+            void offer(int rule, size_t start, size_t end){
+                if(bestRule == -1 || start < bestStart
+                   || (start == bestStart && (end > bestEnd || (end == bestEnd && rule < bestRule)))){
+                    bestRule = rule;
+                    bestStart = start;
+                    bestEnd = end;
+                }
+            }
+
+            // True if a live thread started at or before start, so that it may still give a
+            // match that beats the best one.
+            bool liveAtOrBefore(size_t start){
+                for(size_t i = 0; i < threads.size(); ++i){
+                    for(size_t j = 0; j < threads[i].size(); ++j){
+                        if(threads[i][j].start <= start){
+                            return true;
+                        }
+                    }
+                }
+                return false;
+            }
+
+            const char* text;
+            size_t resumePos;
+            // The offset of the next character to read, and the number of live threads.
+            size_t scanned;
+            size_t live;
+            int bestRule;
+            size_t bestStart;
+            size_t bestEnd;
+            vector<vector<SearchThread>> threads;
+            vector<SearchThread> next;
+            // For each rule and state, the step that last reached it and the thread it reached.
+            vector<vector<unsigned long>> stamps;
+            vector<vector<int>> slots;
+            unsigned long generation;
+};
+
+// Returns every match of the named rules of r in the text between begin and end.
+deque<SearchMatch> search(Rexp* r, const char* begin, const char* end){
+    RuleSearcher searcher = RuleSearcher(r);
+    deque<SearchMatch> matches = deque<SearchMatch>{};
+    size_t pos = 0;
+    SearchMatch match = SearchMatch();
+    while(searcher.nextMatch(begin, end, pos, match)){
+        matches.push_back(match);
+    }
+    return matches;
+}
+
+
+// *** HOT-STATE CODE GENERATION ***
+// For a fixed specification most of the input is handled by a few derivative states. The
+// transitions taken while lexing a representative corpus are counted, and the most frequent ones
+// are written out as a C++ switch with their register programs inlined. Every other transition
+// falls back to the derivative automaton, which computes it with derBC and simpBC. The generated
+// file defines blexer_hot and is compiled into this file with -DHOT_LEXER='"path"'.
+
+// Counts how often every transition of the automaton is taken while lexing the corpus.
+// counts[s][c] is the count for state s and character c.
+vector<vector<unsigned long>> profileTransitions(DerivativeAutomaton & da, const string & corpus){
+    vector<vector<unsigned long>> counts = vector<vector<unsigned long>>{};
+    int state = 0;
+    for(size_t i = 0; i < corpus.size(); ++i){
+        if((size_t) state >= counts.size()){
+            counts.resize(state + 1, vector<unsigned long>(256, 0));
+        }
+        counts[state][(unsigned char) corpus[i]]++;
+        state = da.transition(state, corpus[i])->target;
+    }
+    return counts;
+}
+
+// Returns a register program as a C++ expression over regs, ropes and the constant table bits.
+// Constant bits are added to bits and constants, which maps them to their index in bits.
+string programToCpp(vector<AnnPiece> & program, vector<vector<bool>> & bits, map<vector<bool>, int> & constants){
+    string expr = "-1";
+    for(size_t i = 0; i < program.size(); ++i){
+        string term = "";
+        if(program[i].reg == -1){
+            auto found = constants.find(program[i].bits);
+            if(found == constants.end()){
+                found = constants.insert(pair<vector<bool>, int>(program[i].bits, bits.size())).first;
+                bits.push_back(program[i].bits);
+            }
+            term = "ropes.leaf(&bits[" + std::to_string(found->second) + "])";
+        }
+        else{
+            term = "regs[" + std::to_string(program[i].reg) + "]";
+        }
+        expr = (i == 0) ? term : "ropes.concat(" + expr + ", " + term + ")";
+    }
+    return expr;
+}
+
+// Writes a lexer specialised to the hottest transitions in counts to path. Transitions are taken
+// from the most to the least frequent until they cover the given fraction of the profiled
+// characters. Returns false if the file cannot be written.
+bool emitHotLexer(DerivativeAutomaton & da, vector<vector<unsigned long>> & counts, double coverage, string path){
+    vector<pair<unsigned long, pair<int, int>>> ranked = vector<pair<unsigned long, pair<int, int>>>{};
+    unsigned long total = 0;
+    for(size_t s = 0; s < counts.size(); ++s){
+        for(int c = 0; c < 256; ++c){
+            if(counts[s][c] > 0){
+                ranked.push_back(pair<unsigned long, pair<int, int>>(counts[s][c], pair<int, int>(s, c)));
+                total += counts[s][c];
+            }
+        }
+    }
+    // Sorting the reversed range puts the most frequent transitions first.
+    std::sort(ranked.rbegin(), ranked.rend());
+    // Hot states get the first keys, in the order their transitions were chosen, followed by the
+    // targets that are not hot themselves.
+    vector<int> keys = vector<int>{};
+    map<int, int> keyOf = map<int, int>{};
+    vector<vector<pair<int, int>>> hot = vector<vector<pair<int, int>>>{};
+    unsigned long covered = 0;
+    int hotTransitions = 0;
+    for(size_t i = 0; i < ranked.size() && covered < coverage * total; ++i){
+        int s = ranked[i].second.first;
+        if(keyOf.find(s) == keyOf.end()){
+            keyOf[s] = keys.size();
+            keys.push_back(s);
+            hot.push_back(vector<pair<int, int>>{});
+        }
+        hot[keyOf[s]].push_back(pair<int, int>(ranked[i].second.second, 0));
+        covered += ranked[i].first;
+        hotTransitions++;
+    }
+    int hotStates = keys.size();
+    for(int h = 0; h < hotStates; ++h){
+        for(size_t i = 0; i < hot[h].size(); ++i){
+            int target = da.transition(keys[h], (char) hot[h][i].first)->target;
+            if(keyOf.find(target) == keyOf.end()){
+                keyOf[target] = keys.size();
+                keys.push_back(target);
+            }
+            hot[h][i].second = keyOf[target];
+        }
+    }
+    vector<vector<bool>> bits = vector<vector<bool>>{};
+    map<vector<bool>, int> constants = map<vector<bool>, int>{};
+    string cases = "";
+    for(int h = 0; h < hotStates; ++h){
+        cases += "            case " + std::to_string(h) + ":\n";
+        cases += "                switch((unsigned char) s[i]){\n";
+        for(size_t i = 0; i < hot[h].size(); ++i){
+            vector<vector<AnnPiece>> & programs = da.transition(keys[h], (char) hot[h][i].first)->programs;
+            cases += "                    case " + std::to_string(hot[h][i].first) + ":\n";
+            cases += "                        next.resize(" + std::to_string(programs.size()) + ");\n";
+            for(size_t j = 0; j < programs.size(); ++j){
+                cases += "                        next[" + std::to_string(j) + "] = " + programToCpp(programs[j], bits, constants) + ";\n";
+            }
+            cases += "                        regs.swap(next);\n";
+            cases += "                        state = ids[" + std::to_string(hot[h][i].second) + "];\n";
+            cases += "                        continue;\n";
+        }
+        cases += "                }\n";
+        cases += "                break;\n";
+    }
+    std::ofstream out(path);
+    if(!out){
+        cout << "could not write " << path << endl;
+        return false;
+    }
+    out << "// Generated by emitHotLexer: " << hotStates << " hot states and " << hotTransitions << " hot transitions cover "
+        << covered << " of " << total << " profiled characters. Do not edit.\n";
+    out << "// Compile bitcode_lexer.cpp with -DHOT_LEXER='\"" << path << "\"' to include it.\n\n";
+    out << "// Tokenises the input string like blexer_automaton, with the hot transitions inlined.\n";
+    out << "deque<string> blexer_hot(DerivativeAutomaton & da, string s){\n";
+    out << "    static const char* keys[] = {\n";
+    for(size_t k = 0; k < keys.size(); ++k){
+        out << "        \"" << da.keys[keys[k]] << "\",\n";
+    }
+    out << "    };\n";
+    out << "    static const vector<bool> bits[] = {\n";
+    for(size_t b = 0; b < bits.size(); ++b){
+        out << "        {";
+        for(size_t i = 0; i < bits[b].size(); ++i){
+            out << (i == 0 ? "" : ", ") << bits[b][i];
+        }
+        out << "},\n";
+    }
+    // An empty entry keeps the table valid when there are no constant bits.
+    out << "        {},\n";
+    out << "    };\n";
+    out << "    vector<int> ids = vector<int>{};\n";
+    out << "    for(int k = 0; k < " << keys.size() << "; ++k){\n";
+    out << "        ids.push_back(da.addState(keys[k]));\n";
+    out << "    }\n";
+    out << "    vector<int> hot = vector<int>(da.keys.size(), -1);\n";
+    out << "    for(int h = 0; h < " << hotStates << "; ++h){\n";
+    out << "        hot[ids[h]] = h;\n";
+    out << "    }\n";
+    out << "    BitRopes ropes = BitRopes();\n";
+    out << "    vector<int> regs = initialRegisters(da, ropes);\n";
+    out << "    vector<int> next = vector<int>{};\n";
+    out << "    int state = 0;\n";
+    out << "    for(size_t i = 0; i < s.size(); ++i){\n";
+    out << "        switch(((size_t) state < hot.size()) ? hot[state] : -1){\n";
+    out << cases;
+    out << "        }\n";
+    out << "        DerTransition* t = da.transition(state, s[i]);\n";
+    out << "        takeTransition(t, ropes, regs, next);\n";
+    out << "        state = t->target;\n";
+    out << "    }\n";
+    out << "    return automatonTokens(da, ropes, regs, state);\n";
+    out << "}\n";
+    out.close();
+    cout << hotStates << " hot states and " << hotTransitions << " hot transitions cover " << covered << " of " << total << " characters" << endl;
+    return true;
+}
+
+#ifdef HOT_LEXER
+#include HOT_LEXER
+#endif
+
+
+// *** PIPELINED LEXING ***
+// blexer2_simp only starts decoding once the derivatives of the whole input are computed. But
+// every bitcode mkepsBC can produce starts with the annotation of the root of the derivative,
+// and every later derivative keeps that annotation as a prefix. So the bits at the root are
+// settled as soon as they appear, typically once a token can no longer be extended. A producer
+// thread moves them out of the derivative and hands them to a consumer thread, which decodes
+// them while the derivatives of the rest of the input are computed. The threads are connected by
+// a ring buffer of (bitcode, span) records. The tokens are the same as blexer2_simp's.
+
+// Settled bits of the bitcode and the span of the input that was read to settle them.
+class LexRecord {
+    public: deque<bool> bits;
+            size_t start;
+            size_t end;
+            LexRecord()
+            : start(0), end(0){
+
+            }
+};
+
+// A bounded ring buffer with one producer and one consumer. The producer only writes tail and
+// the consumer only writes head, so no locks are needed. The producer waits while the ring is
+// full, which bounds the memory used when the consumer falls behind.
+class RecordRing {
+    public: vector<LexRecord> slots;
+            size_t mask;
+            std::atomic<size_t> head;
+            std::atomic<size_t> tail;
+            std::atomic<bool> closed;
+            // Number of times the producer found the ring full.
+            unsigned long stalls;
+            // capacity must be a power of two.
+            RecordRing(size_t capacity)
+            : slots(capacity), mask(capacity - 1), head(0), tail(0), closed(false), stalls(0){
+
+            }
+
+            void push(LexRecord & record){
+                size_t t = tail.load(std::memory_order_relaxed);
+                for(int spins = 0; t - head.load(std::memory_order_acquire) == slots.size(); ++spins){
+                    stalls++;
+                    wait(spins);
+                }
+                slots[t & mask] = std::move(record);
+                tail.store(t + 1, std::memory_order_release);
+            }
+
+            // Takes the oldest record, waiting for one if the ring is empty. Returns false once
+            // the ring is empty and closed.
+            bool pop(LexRecord & record){
+                size_t h = head.load(std::memory_order_relaxed);
+                for(int spins = 0; h == tail.load(std::memory_order_acquire); ++spins){
+                    if(closed.load(std::memory_order_acquire) && h == tail.load(std::memory_order_acquire)){
+                        return false;
+                    }
+                    wait(spins);
+                }
+                record = std::move(slots[h & mask]);
+                head.store(h + 1, std::memory_order_release);
+                return true;
+            }
+
+            // Called by the producer after its last push.
+            void close(){
+                closed.store(true, std::memory_order_release);
+            }
+
+    private: // Spins briefly, then sleeps, so a waiting thread does not take the CPU from the
+             // other one when they share a core.
+             void wait(int spins){
+                if(spins < 64){
+                    std::this_thread::yield();
+                }
+                else{
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+            }
+};
+
+// Decodes a bitcode that arrives in pieces into tokens in the form produced by sdecode. When the
+// bits run out it stops, keeping its stack, and carries on when more bits are fed.
+class StreamDecoder {
+    public: BitWalker walker;
+            deque<bool> bits;
+            deque<string> tokens;
+            StreamDecoder(Rexp* r)
+            : walker(BitWalker(r)), tokens(deque<string>{""}){
+
+            }
+
+            void feed(deque<bool> & more){
+                bits.insert(bits.end(), more.begin(), more.end());
+                size_t bit = 0;
+                walker.walk(bits, bit, *this);
+                bits.erase(bits.begin(), bits.begin() + bit);
+            }
+
+            void character(char c){
+                tokens.back() += c;
+            }
+
+            void literal(const string & s){
+                tokens.back() += s;
+            }
+
+            void open(RECD* r){
+                tokens.push_back(r->x + ":");
+            }
+
+            // Tokens are complete once the next one starts.
+            void close(){
+
+            }
+};
+
+// Timings of one run of blexer_pipelined, in nanoseconds from its start.
+class PipelineStats {
+    public: unsigned long firstToken;
+            unsigned long total;
+            unsigned long stalls;
+            int records;
+            PipelineStats()
+            : firstToken(0), total(0), stalls(0), records(0){
+
+            }
+};
+
+// Computes the derivatives of a for every character of s and pushes the bits that settle at the
+// root as they appear, followed by the rest of the bitcode at the end of the input. Sets failed
+// instead if s does not match.
+void produceBits(ARexp* a, const string & s, RecordRing & ring, std::atomic<bool> & failed){
+    size_t start = 0;
+    for(size_t i = 0; i < s.size(); ++i){
+        a = simpBC(derBC(s[i], a));
+        if(a->name == "AZERO"){
+            break;
+        }
+        if(a->ann.size() > 0){
+            LexRecord record = LexRecord();
+            record.bits.swap(a->ann);
+            record.start = start;
+            record.end = i + 1;
+            start = i + 1;
+            ring.push(record);
+        }
+    }
+    if(nullableBC(a)){
+        LexRecord record = LexRecord();
+        record.bits = mkepsBC(a);
+        record.start = start;
+        record.end = s.size();
+        ring.push(record);
+    }
+    else{
+        failed.store(true);
+    }
+    ring.close();
+}
+
+// Decodes the records in the ring as they arrive. Records the time of the first complete token
+// in stats.
+void consumeBits(RecordRing & ring, StreamDecoder & decoder, PipelineStats & stats, high_resolution_clock::time_point startTime){
+    LexRecord record = LexRecord();
+    while(ring.pop(record)){
+        decoder.feed(record.bits);
+        stats.records++;
+        // A token is complete once the one after it has started.
+        if(stats.firstToken == 0 && decoder.tokens.size() > 2){
+            stats.firstToken = duration_cast<std::chrono::nanoseconds>(high_resolution_clock::now() - startTime).count();
+        }
+    }
+}
+
+// Tokenises the input string like blexer2_simp, with the decoding on a second thread. The
+// derivatives stay on the calling thread, where they allocate faster than on a new thread.
+deque<string> blexer_pipelined(Rexp* r, string s, PipelineStats & stats){
+    auto startTime = high_resolution_clock::now();
+    Rexp* spec = optimiseSpec(r);
+    RecordRing ring = RecordRing(1024);
+    std::atomic<bool> failed(false);
+    StreamDecoder decoder = StreamDecoder(spec);
+    std::thread consumer(consumeBits, std::ref(ring), std::ref(decoder), std::ref(stats), startTime);
+    produceBits(internalize(spec), s, ring, failed);
+    consumer.join();
+    stats.stalls = ring.stalls;
+    stats.total = duration_cast<std::chrono::nanoseconds>(high_resolution_clock::now() - startTime).count();
+    if(failed.load()){
+        cout << "No match found.\n";
+        return deque<string>{};
+    }
+    return decoder.tokens;
+}
+
+deque<string> blexer_pipelined(Rexp* r, string s){
+    PipelineStats stats = PipelineStats();
+    return blexer_pipelined(r, s, stats);
+}
+
+// *** ANNOTATION-FREE FAST PATH ***
+// Lexing in two phases. The first phase only follows the cached transitions of the derivative
+// automaton, whose states are derivatives without annotations, and records the states it visits.
+// No annotation is built or copied. Once the whole input has been accepted, the second phase goes
+// backwards over the recorded states, like the injection phase of Sulzmann and Lu's lexer. It
+// starts from the register program of mkepsBC in the final state and replaces every register it
+// needs by the program that produced it one step earlier. At the initial state the remaining
+// registers are the annotations of the internalised specification. Only the registers that end
+// up in the bitcode are ever visited.
+
+// An item of the bitcode being rebuilt: constant bits, a register of the current state that has
+// not been expanded yet (reg >= 0), a register that has been expanded into count items starting
+// at first, or an alias of another item with the same bits.
+class BackItem {
+    public: const vector<bool>* bits;
+            int reg;
+            int first;
+            int count;
+            int alias;
+            // Where the bits of an expanded item were written to, once they have been.
+            long start;
+            long end;
+            BackItem(const vector<bool>* bitsIn, int regIn)
+            : bits(bitsIn), reg(regIn), first(-1), count(0), alias(-1), start(-1), end(-1){
+
+            }
+};
+
+// Follows the aliases from item i and returns the item they end at. Every item on the way is
+// made to point straight at it, so that long chains of aliases are only followed once.
+int resolveAlias(vector<BackItem> & items, int i){
+    int root = i;
+    while(items[root].alias != -1){
+        root = items[root].alias;
+    }
+    while(items[i].alias != -1){
+        int next = items[i].alias;
+        items[i].alias = root;
+        i = next;
+    }
+    return root;
+}
+
+// Replaces the item at index i, which must be an unexpanded register, by the items of program,
+// and adds the registers it refers to to holes. A program that only copies a register leaves the
+// item unexpanded, so long chains of copies do not create items.
+void expandItem(vector<BackItem> & items, int i, vector<AnnPiece> & program, vector<int> & holes){
+    if(program.size() == 1 && program[0].reg != -1){
+        items[i].reg = program[0].reg;
+        holes.push_back(i);
+        return;
+    }
+    int first = items.size();
+    for(size_t j = 0; j < program.size(); ++j){
+        if(program[j].reg == -1){
+            items.push_back(BackItem(&program[j].bits, -1));
+        }
+        else{
+            holes.push_back(items.size());
+            items.push_back(BackItem(nullptr, program[j].reg));
+        }
+    }
+    items[i].reg = -1;
+    items[i].first = first;
+    items[i].count = program.size();
+}
+
+// Rebuilds the bitcode of the input whose characters s took the automaton through states.
+deque<bool> backwardBits(DerivativeAutomaton & da, const string & s, vector<int> & states){
+    vector<BackItem> items = vector<BackItem>{BackItem(nullptr, 0)};
+    vector<int> holes = vector<int>{};
+    vector<int> next = vector<int>{};
+    expandItem(items, 0, da.finals[states.back()], holes);
+    // Holes for the same register of the same state have the same bits, so only the first one
+    // is expanded and the others become aliases of it. seenAt and seenItem record, for every
+    // register, the last step it was expanded at and the item that was expanded.
+    vector<int> seenAt = vector<int>{};
+    vector<int> seenItem = vector<int>{};
+    for(int i = s.size() - 1; i >= 0; --i){
+        DerTransition* t = da.transition(states[i], s[i]);
+        next.clear();
+        for(size_t j = 0; j < holes.size(); ++j){
+            int reg = items[holes[j]].reg;
+            if((size_t) reg >= seenAt.size()){
+                seenAt.resize(reg + 1, -1);
+                seenItem.resize(reg + 1, -1);
+            }
+            if(seenAt[reg] == i){
+                items[holes[j]].reg = -1;
+                items[holes[j]].alias = seenItem[reg];
+            }
+            else{
+                seenAt[reg] = i;
+                seenItem[reg] = holes[j];
+                expandItem(items, holes[j], t->programs[reg], next);
+            }
+        }
+        holes.swap(next);
+    }
+    for(size_t j = 0; j < holes.size(); ++j){
+        items[holes[j]].bits = &da.initialAnns[items[holes[j]].reg];
+        items[holes[j]].reg = -1;
+    }
+    // Items can be shared, so the range of bits an expanded item produced is recorded and copied
+    // when it is reached again. A negative entry -(i + 1) on the stack marks the end of item i,
+    // with the number of bits there were at its start pushed below it.
+    deque<bool> bs = deque<bool>{};
+    vector<long> stack = vector<long>{0};
+    while(stack.size() > 0){
+        long top = stack.back();
+        stack.pop_back();
+        if(top < 0){
+            items[-top - 1].start = stack.back();
+            items[-top - 1].end = bs.size();
+            stack.pop_back();
+            continue;
+        }
+        top = resolveAlias(items, top);
+        BackItem & item = items[top];
+        if(item.first == -1){
+            bs.insert(bs.end(), item.bits->begin(), item.bits->end());
+        }
+        else if(item.start != -1){
+            for(long j = item.start; j < item.end; ++j){
+                bs.push_back(bs[j]);
+            }
+        }
+        else{
+            stack.push_back(bs.size());
+            stack.push_back(-top - 1);
+            for(int j = item.count - 1; j >= 0; --j){
+                stack.push_back(item.first + j);
+            }
+        }
+    }
+    return bs;
+}
+
+// Tokenises the input string like blexer2_simp: forwards through the automaton without
+// annotations, then backwards to rebuild the bitcode, which is decoded by a StreamDecoder.
+deque<string> blexer_backward(DerivativeAutomaton & da, string s){
+    vector<int> states = vector<int>{0};
+    states.reserve(s.size() + 1);
+    for(size_t i = 0; i < s.size(); ++i){
+        int state = da.transition(states.back(), s[i])->target;
+        if(da.dead[state]){
+            break;
+        }
+        states.push_back(state);
+    }
+    if(states.size() != s.size() + 1 || !da.nullable[states.back()]){
+        cout << "No match found.\n";
+        return deque<string>{};
+    }
+    deque<bool> bs = backwardBits(da, s, states);
+    StreamDecoder decoder = StreamDecoder(da.spec);
+    decoder.feed(bs);
+    return decoder.tokens;
+}
+
+
+// *** FLAT DERIVATIVES ***
+// Every ARexp is a separate heap object with a name string, a deque of bits, a vtable and child
+// pointers, so derBC, simpBC and nullableBC chase pointers all over the heap. FlatRexp keeps a
+// whole derivative in a few contiguous arrays instead: node i has a kind byte, a payload (the
+// character, the NTIMES count, the number of a CHARSET or the cursor of a LITERAL), two 32-bit
+// child indices and a slice
+// of a shared pool of bits for its annotation; the children of an ALT are a slice of a shared
+// list of indices. Nodes are never changed once added: fusing bits adds a new node, and a
+// derivative shares the nodes it does not change with its argument. After every step the nodes
+// reachable from the new root are copied to a second buffer, which keeps them contiguous and
+// drops the others, and the two buffers swap roles.
+
+enum FlatKind : unsigned char {
+    FLAT_ZERO, FLAT_ONE, FLAT_CHAR, FLAT_CHARSET, FLAT_ALT, FLAT_SEQ, FLAT_STAR, FLAT_NTIMES, FLAT_LITERAL
+};
+
+class FlatRexp {
+    public: vector<unsigned char> kinds;
+            vector<int> payloads;
+            // SEQ: r1 and r2. STAR and NTIMES: the body in lefts. ALT: the position of the first
+            // child in lists in lefts and the number of children in rights. LITERAL: the number
+            // of its string in lefts.
+            vector<uint32_t> lefts;
+            vector<uint32_t> rights;
+            vector<uint32_t> annStarts;
+            vector<uint32_t> annLengths;
+            // Hash of the structure of each node, annotations ignored, as in hashBC.
+            vector<size_t> hashes;
+            vector<uint32_t> lists;
+            vector<unsigned char> bits;
+            vector<bitset<256>> charsets;
+            vector<string> literals;
+
+            // Empties the buffer but keeps its memory, its CHARSETs and its literals.
+            void clear(){
+                kinds.clear();
+                payloads.clear();
+                lefts.clear();
+                rights.clear();
+                annStarts.clear();
+                annLengths.clear();
+                hashes.clear();
+                lists.clear();
+                bits.clear();
+            }
+
+            // Adds the nodes of r, like internalize, and returns the root.
+            uint32_t internalize(Rexp* r){
+                string & name = r->name;
+                if(name == "ONE"){
+                    return add(FLAT_ONE, 0, 0, 0, bits.size(), 0);
+                }
+                else if(name == "CHAR"){
+                    return add(FLAT_CHAR, (unsigned char) static_cast<CHAR*>(r)->c, 0, 0, bits.size(), 0);
+                }
+                else if(name == "CHARSET"){
+                    bitset<256> & cs = static_cast<CHARSET*>(r)->cs;
+                    size_t i = std::find(charsets.begin(), charsets.end(), cs) - charsets.begin();
+                    if(i == charsets.size()){
+                        charsets.push_back(cs);
+                    }
+                    return add(FLAT_CHARSET, i, 0, 0, bits.size(), 0);
+                }
+                else if(name == "LITERAL"){
+                    string & s = static_cast<LITERAL*>(r)->s;
+                    size_t i = std::find(literals.begin(), literals.end(), s) - literals.begin();
+                    if(i == literals.size()){
+                        literals.push_back(s);
+                    }
+                    return add(FLAT_LITERAL, 0, i, 0, bits.size(), 0);
+                }
+                else if(name == "ALT"){
+                    ALT* rexp = static_cast<ALT*>(r);
+                    uint32_t r1 = fuse(0, internalize(rexp->r1));
+                    uint32_t r2 = fuse(1, internalize(rexp->r2));
+                    uint32_t first = lists.size();
+                    lists.push_back(r1);
+                    lists.push_back(r2);
+                    return add(FLAT_ALT, 0, first, 2, bits.size(), 0);
+                }
+                else if(name == "SEQ"){
+                    SEQ* rexp = static_cast<SEQ*>(r);
+                    uint32_t r1 = internalize(rexp->r1);
+                    uint32_t r2 = internalize(rexp->r2);
+                    return add(FLAT_SEQ, 0, r1, r2, bits.size(), 0);
+                }
+                else if(name == "STAR"){
+                    return add(FLAT_STAR, 0, internalize(static_cast<STAR*>(r)->rs), 0, bits.size(), 0);
+                }
+                else if(name == "NTIMES"){
+                    NTIMES* rexp = static_cast<NTIMES*>(r);
+                    return add(FLAT_NTIMES, rexp->n, internalize(rexp->rs), 0, bits.size(), 0);
+                }
+                else if(name == "PLUS"){
+                    // Nodes are never changed, so SEQ(r, STAR(r)) can share a single copy of r.
+                    uint32_t body = internalize(static_cast<PLUS*>(r)->rs);
+                    uint32_t star = add(FLAT_STAR, 0, body, 0, bits.size(), 0);
+                    return add(FLAT_SEQ, 0, body, star, bits.size(), 0);
+                }
+                else if(name == "OPTIONAL"){
+                    uint32_t r1 = fuse(0, add(FLAT_ONE, 0, 0, 0, bits.size(), 0));
+                    uint32_t r2 = fuse(1, internalize(static_cast<OPTIONAL*>(r)->rs));
+                    uint32_t first = lists.size();
+                    lists.push_back(r1);
+                    lists.push_back(r2);
+                    return add(FLAT_ALT, 0, first, 2, bits.size(), 0);
+                }
+                else if(name == "RECD"){
+                    return internalize(static_cast<RECD*>(r)->r);
+                }
+                return add(FLAT_ZERO, 0, 0, 0, bits.size(), 0);
+            }
+
+            bool nullable(uint32_t r){
+                switch(kinds[r]){
+                    case FLAT_ONE:
+                    case FLAT_STAR:
+                        return true;
+                    case FLAT_ALT:
+                        for(uint32_t i = 0; i < rights[r]; ++i){
+                            if(nullable(lists[lefts[r] + i])){
+                                return true;
+                            }
+                        }
+                        return false;
+                    case FLAT_SEQ:
+                        return nullable(lefts[r]) && nullable(rights[r]);
+                    case FLAT_NTIMES:
+                        return payloads[r] == 0 || nullable(lefts[r]);
+                    case FLAT_LITERAL:
+                        return (size_t) payloads[r] == literals[lefts[r]].size();
+                    default:
+                        return false;
+                }
+            }
+
+            // Appends the bits of how r matches the empty string to bs, like mkepsBC.
+            void mkeps(uint32_t r, deque<bool> & bs){
+                bs.insert(bs.end(), bits.begin() + annStarts[r], bits.begin() + annStarts[r] + annLengths[r]);
+                switch(kinds[r]){
+                    case FLAT_ALT:
+                        for(uint32_t i = 0; i < rights[r]; ++i){
+                            if(nullable(lists[lefts[r] + i])){
+                                mkeps(lists[lefts[r] + i], bs);
+                                break;
+                            }
+                        }
+                        break;
+                    case FLAT_SEQ:
+                        mkeps(lefts[r], bs);
+                        mkeps(rights[r], bs);
+                        break;
+                    case FLAT_STAR:
+                        bs.push_back(true);
+                        break;
+                    case FLAT_NTIMES:
+                        for(int i = 0; i < payloads[r]; ++i){
+                            mkeps(lefts[r], bs);
+                        }
+                        break;
+                    default:
+                        break;
+                }
+            }
+
+            // Returns the derivative of r with respect to c, like derBC.
+            uint32_t der(char c, uint32_t r){
+                switch(kinds[r]){
+                    case FLAT_ZERO:
+                        return r;
+                    case FLAT_CHAR:
+                        if(payloads[r] == (unsigned char) c){
+                            return add(FLAT_ONE, 0, 0, 0, annStarts[r], annLengths[r]);
+                        }
+                        return zero();
+                    case FLAT_CHARSET:
+                        if(charsets[payloads[r]].test((unsigned char) c)){
+                            uint32_t start = copyAnn(r);
+                            for(int i = 7; i >= 0; --i){
+                                bits.push_back(((unsigned char) c >> i) & 1);
+                            }
+                            return add(FLAT_ONE, 0, 0, 0, start, annLengths[r] + 8);
+                        }
+                        return zero();
+                    case FLAT_LITERAL: {
+                        string & s = literals[lefts[r]];
+                        size_t cursor = payloads[r];
+                        if(cursor == s.size() || s[cursor] != c){
+                            return zero();
+                        }
+                        if(cursor + 1 == s.size()){
+                            return add(FLAT_ONE, 0, 0, 0, annStarts[r], annLengths[r]);
+                        }
+                        return add(FLAT_LITERAL, cursor + 1, lefts[r], 0, annStarts[r], annLengths[r]);
+                    }
+                    case FLAT_ALT: {
+                        int base = stack.size();
+                        for(uint32_t i = 0; i < rights[r]; ++i){
+                            uint32_t d = der(c, lists[lefts[r] + i]);
+                            stack.push_back(d);
+                        }
+                        return addAlt(base, annStarts[r], annLengths[r]);
+                    }
+                    case FLAT_SEQ: {
+                        uint32_t r1 = lefts[r];
+                        uint32_t r2 = rights[r];
+                        if(nullable(r1)){
+                            deque<bool> mk = deque<bool>{};
+                            mkeps(r1, mk);
+                            uint32_t left = der(c, r1);
+                            left = add(FLAT_SEQ, 0, left, r2, bits.size(), 0);
+                            uint32_t right = der(c, r2);
+                            right = fuse(mk, right);
+                            int base = stack.size();
+                            stack.push_back(left);
+                            stack.push_back(right);
+                            return addAlt(base, annStarts[r], annLengths[r]);
+                        }
+                        uint32_t left = der(c, r1);
+                        return add(FLAT_SEQ, 0, left, r2, annStarts[r], annLengths[r]);
+                    }
+                    case FLAT_STAR: {
+                        uint32_t body = lefts[r];
+                        uint32_t left = fuse(0, der(c, body));
+                        uint32_t star = add(FLAT_STAR, 0, body, 0, bits.size(), 0);
+                        return add(FLAT_SEQ, 0, left, star, annStarts[r], annLengths[r]);
+                    }
+                    case FLAT_NTIMES: {
+                        if(payloads[r] == 0){
+                            return zero();
+                        }
+                        uint32_t body = lefts[r];
+                        uint32_t left = der(c, body);
+                        uint32_t rest = add(FLAT_NTIMES, payloads[r] - 1, body, 0, bits.size(), 0);
+                        return add(FLAT_SEQ, 0, left, rest, annStarts[r], annLengths[r]);
+                    }
+                    default:
+                        return zero();
+                }
+            }
+
+            // Simplifies r like simpBC.
+            uint32_t simp(uint32_t r){
+                if(kinds[r] == FLAT_SEQ){
+                    uint32_t s1 = simp(lefts[r]);
+                    uint32_t s2 = simp(rights[r]);
+                    if(kinds[s1] == FLAT_ZERO){
+                        return s1;
+                    }
+                    else if(kinds[s2] == FLAT_ZERO){
+                        return s2;
+                    }
+                    else if(kinds[s1] == FLAT_ONE){
+                        uint32_t start = copyAnn(r);
+                        appendAnn(s1);
+                        appendAnn(s2);
+                        return add(kinds[s2], payloads[s2], lefts[s2], rights[s2], start, bits.size() - start);
+                    }
+                    else if(kinds[s1] == FLAT_ALT){
+                        int base = stack.size();
+                        for(uint32_t i = 0; i < rights[s1]; ++i){
+                            uint32_t seq = add(FLAT_SEQ, 0, lists[lefts[s1] + i], s2, bits.size(), 0);
+                            stack.push_back(seq);
+                        }
+                        uint32_t start = copyAnn(r);
+                        appendAnn(s1);
+                        return addAlt(base, start, bits.size() - start);
+                    }
+                    return add(FLAT_SEQ, 0, s1, s2, annStarts[r], annLengths[r]);
+                }
+                else if(kinds[r] == FLAT_ALT){
+                    // The simplified children are flattened and deduplicated on the stack, above
+                    // the children of the calls that are still running.
+                    int base = stack.size();
+                    for(uint32_t i = 0; i < rights[r]; ++i){
+                        uint32_t s = simp(lists[lefts[r] + i]);
+                        if(kinds[s] == FLAT_ALT){
+                            for(uint32_t j = 0; j < rights[s]; ++j){
+                                uint32_t f = lists[lefts[s] + j];
+                                if(!contains(base, f)){
+                                    stack.push_back(fuse(annStarts[s], annLengths[s], f));
+                                }
+                            }
+                        }
+                        else if(kinds[s] != FLAT_ZERO && !contains(base, s)){
+                            stack.push_back(s);
+                        }
+                    }
+                    int size = stack.size() - base;
+                    if(size == 0){
+                        return zero();
+                    }
+                    else if(size == 1){
+                        uint32_t only = stack.back();
+                        stack.pop_back();
+                        return fuse(annStarts[r], annLengths[r], only);
+                    }
+                    return addAlt(base, annStarts[r], annLengths[r]);
+                }
+                return r;
+            }
+
+            // Copies the nodes reachable from root to out, which is emptied first, and returns
+            // the root there.
+            uint32_t compact(uint32_t root, FlatRexp & out){
+                out.clear();
+                out.charsets = charsets;
+                // Literals are only added by internalize, so equal counts mean equal tables.
+                if(out.literals.size() != literals.size()){
+                    out.literals = literals;
+                }
+                remap.assign(kinds.size(), UINT32_MAX);
+                return copyTo(root, out);
+            }
+
+    private: vector<uint32_t> stack;
+            vector<uint32_t> remap;
+
+            uint32_t add(unsigned char kind, int payload, uint32_t left, uint32_t right, uint32_t annStart, uint32_t annLength){
+                size_t h = kind * 1000003 + payload;
+                if(kind == FLAT_SEQ){
+                    h = (h * 1000003 + hashes[left]) * 1000003 + hashes[right];
+                }
+                else if(kind == FLAT_STAR || kind == FLAT_NTIMES){
+                    h = h * 1000003 + hashes[left];
+                }
+                else if(kind == FLAT_LITERAL){
+                    // Hash only the rest still to be matched, which is what equal compares.
+                    string & literal = literals[left];
+                    h = kind * 1000003;
+                    for(size_t i = payload; i < literal.size(); ++i){
+                        h = h * 1000003 + (unsigned char) literal[i];
+                    }
+                }
+                else if(kind == FLAT_ALT){
+                    for(uint32_t i = 0; i < right; ++i){
+                        h = h * 1000003 + hashes[lists[left + i]];
+                    }
+                }
+                kinds.push_back(kind);
+                payloads.push_back(payload);
+                lefts.push_back(left);
+                rights.push_back(right);
+                annStarts.push_back(annStart);
+                annLengths.push_back(annLength);
+                hashes.push_back(h);
+                return kinds.size() - 1;
+            }
+
+            uint32_t zero(){
+                return add(FLAT_ZERO, 0, 0, 0, bits.size(), 0);
+            }
+
+            // Adds an ALT whose children are the entries of the stack from base, which are
+            // popped.
+            uint32_t addAlt(int base, uint32_t annStart, uint32_t annLength){
+                uint32_t first = lists.size();
+                lists.insert(lists.end(), stack.begin() + base, stack.end());
+                uint32_t count = stack.size() - base;
+                stack.resize(base);
+                return add(FLAT_ALT, 0, first, count, annStart, annLength);
+            }
+
+            // Appends the annotation of r to the pool and returns where the copy starts.
+            uint32_t copyAnn(uint32_t r){
+                uint32_t start = bits.size();
+                appendAnn(r);
+                return start;
+            }
+
+            void appendAnn(uint32_t r){
+                for(uint32_t i = 0; i < annLengths[r]; ++i){
+                    bits.push_back(bits[annStarts[r] + i]);
+                }
+            }
+
+            // Returns r with the bits of the slice [start, start + length) of the pool in front of
+            // its annotation, like fuse.
+            uint32_t fuse(uint32_t start, uint32_t length, uint32_t r){
+                if(kinds[r] == FLAT_ZERO || length == 0){
+                    return r;
+                }
+                uint32_t out = bits.size();
+                for(uint32_t i = 0; i < length; ++i){
+                    bits.push_back(bits[start + i]);
+                }
+                appendAnn(r);
+                return add(kinds[r], payloads[r], lefts[r], rights[r], out, bits.size() - out);
+            }
+
+            uint32_t fuse(bool b, uint32_t r){
+                if(kinds[r] == FLAT_ZERO){
+                    return r;
+                }
+                uint32_t out = bits.size();
+                bits.push_back(b);
+                appendAnn(r);
+                return add(kinds[r], payloads[r], lefts[r], rights[r], out, bits.size() - out);
+            }
+
+            uint32_t fuse(deque<bool> & bs, uint32_t r){
+                if(kinds[r] == FLAT_ZERO || bs.size() == 0){
+                    return r;
+                }
+                uint32_t out = bits.size();
+                bits.insert(bits.end(), bs.begin(), bs.end());
+                appendAnn(r);
+                return add(kinds[r], payloads[r], lefts[r], rights[r], out, bits.size() - out);
+            }
+
+            // Returns true if an entry of the stack from base has the same structure as r.
+            bool contains(int base, uint32_t r){
+                for(size_t i = base; i < stack.size(); ++i){
+                    if(equal(stack[i], r)){
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // Compares the structure of a and b, annotations ignored, like equals. Two LITERALs
+            // are equal when the rest they still have to match is equal, like two ALITERALs,
+            // whatever their strings and cursors.
+            bool equal(uint32_t a, uint32_t b){
+                if(a == b){
+                    return true;
+                }
+                if(hashes[a] != hashes[b] || kinds[a] != kinds[b]){
+                    return false;
+                }
+                if(kinds[a] == FLAT_LITERAL){
+                    string & sa = literals[lefts[a]];
+                    string & sb = literals[lefts[b]];
+                    size_t remaining = sa.size() - payloads[a];
+                    return remaining == sb.size() - payloads[b] && memcmp(sa.data() + payloads[a], sb.data() + payloads[b], remaining) == 0;
+                }
+                if(payloads[a] != payloads[b]){
+                    return false;
+                }
+                switch(kinds[a]){
+                    case FLAT_SEQ:
+                        return equal(lefts[a], lefts[b]) && equal(rights[a], rights[b]);
+                    case FLAT_STAR:
+                    case FLAT_NTIMES:
+                        return equal(lefts[a], lefts[b]);
+                    case FLAT_ALT:
+                        if(rights[a] != rights[b]){
+                            return false;
+                        }
+                        for(uint32_t i = 0; i < rights[a]; ++i){
+                            if(!equal(lists[lefts[a] + i], lists[lefts[b] + i])){
+                                return false;
+                            }
+                        }
+                        return true;
+                    default:
+                        return true;
+                }
+            }
+
+            uint32_t copyTo(uint32_t r, FlatRexp & out){
+                if(remap[r] != UINT32_MAX){
+                    return remap[r];
+                }
+                uint32_t left = lefts[r];
+                uint32_t right = rights[r];
+                switch(kinds[r]){
+                    case FLAT_SEQ:
+                        left = copyTo(lefts[r], out);
+                        right = copyTo(rights[r], out);
+                        break;
+                    case FLAT_STAR:
+                    case FLAT_NTIMES:
+                        left = copyTo(lefts[r], out);
+                        break;
+                    case FLAT_ALT: {
+                        int base = out.stack.size();
+                        for(uint32_t i = 0; i < rights[r]; ++i){
+                            uint32_t child = copyTo(lists[lefts[r] + i], out);
+                            out.stack.push_back(child);
+                        }
+                        left = out.lists.size();
+                        out.lists.insert(out.lists.end(), out.stack.begin() + base, out.stack.end());
+                        out.stack.resize(base);
+                        break;
+                    }
+                    default:
+                        break;
+                }
+                uint32_t start = out.bits.size();
+                out.bits.insert(out.bits.end(), bits.begin() + annStarts[r], bits.begin() + annStarts[r] + annLengths[r]);
+                uint32_t copy = out.kinds.size();
+                out.kinds.push_back(kinds[r]);
+                out.payloads.push_back(payloads[r]);
+                out.lefts.push_back(left);
+                out.rights.push_back(right);
+                out.annStarts.push_back(start);
+                out.annLengths.push_back(annLengths[r]);
+                out.hashes.push_back(hashes[r]);
+                remap[r] = copy;
+                return copy;
+            }
+};
+
+// Computes the bitcode of s with respect to the optimised specification spec like blexer2_simp,
+// but on flat derivatives. Returns false if s does not match. The annotation of the root is
+// always the start of the final bitcode, so it is moved to bs after every step rather than
+// copied from buffer to buffer.
+bool flatBits(Rexp* spec, const string & s, deque<bool> & bs){
+    FlatRexp a = FlatRexp();
+    FlatRexp b = FlatRexp();
+    uint32_t root = a.internalize(spec);
+    for(size_t i = 0; i < s.size(); ++i){
+        root = a.simp(a.der(s[i], root));
+        if(a.kinds[root] == FLAT_ZERO){
+            return false;
+        }
+        bs.insert(bs.end(), a.bits.begin() + a.annStarts[root], a.bits.begin() + a.annStarts[root] + a.annLengths[root]);
+        a.annLengths[root] = 0;
+        root = a.compact(root, b);
+        std::swap(a, b);
+    }
+    if(!a.nullable(root)){
+        return false;
+    }
+    a.mkeps(root, bs);
+    return true;
+}
+
+// Tokenises the input string like blexer2_simp, on flat derivatives. The bitcode is decoded by
+// a StreamDecoder, which unlike sdecode does not copy the rest of the bitcode at every bit.
+deque<string> blexer_flat(Rexp* r, string s){
+    Rexp* spec = optimiseSpec(r);
+    deque<bool> bs = deque<bool>{};
+    if(!flatBits(spec, s, bs)){
+        cout << "No match found.\n";
+        return deque<string>{};
+    }
+    StreamDecoder decoder = StreamDecoder(spec);
+    decoder.feed(bs);
+    return decoder.tokens;
+}
+
+
+// *** PIKE VM ***
+// Matches in time linear in the input for a given specification: the specification is compiled
+// to a Thompson-style program, and a Pike VM runs it with at most one thread per instruction that
+// consumes a character. The cost of a character still grows with the program. With m instructions,
+// each of up to m live threads follows the instructions it reaches, and the precedence matrices of
+// the threads have up to m * m entries, so a string of n characters takes O(n * m * m) steps. On
+// top of that, a guard and the comparison of two paths that forked in the same step walk back
+// along the paths, which can be as long as the program. NTIMES is unrolled, so m grows with the
+// counts, and a program over PIKE_MAX_INSTRUCTIONS (65536) instructions or PIKE_MAX_BITS bits is
+// rejected: blexer_pike returns PIKE_TOO_LARGE for it. Each subexpression is enclosed in an opening and a closing parenthesis
+// marked with its height, its depth in the specification. When two threads reach the same
+// instruction, the one with the POSIX value survives, as decided by Okui and Suzuki: the
+// parenthesis of least height passed since the threads forked marks the outermost subexpression
+// one of them has left, so the thread that kept the higher minimum matched it further. On a tie,
+// the threads keep their order from before, or take the first branch where they forked. The
+// bitcode is that of derivatives without the ASEQ distribution of simpBC, i.e. the POSIX value.
+
+enum PikeOp {PIKE_CONSUME, PIKE_EPSILON, PIKE_SPLIT, PIKE_MATCH, PIKE_FAIL};
+
+// An instruction of the program. A PIKE_EPSILON may emit bits, be a parenthesis of the given
+// height, mark the start of an iteration or be guarded by one: a guarded instruction cannot be
+// reached from its marker without consuming a character, as an iteration of a STAR or NTIMES
+// must not be empty.
+class PikeInst {
+    public: PikeOp op;
+            bitset<256> cs;
+            bool charBits;
+            int out1;
+            int out2;
+            int bitsStart;
+            int bitsLength;
+            int height;
+            int marker;
+            int guard;
+            PikeInst(PikeOp opIn)
+            : op(opIn), charBits(false), out1(-1), out2(-1), bitsStart(0), bitsLength(0), height(INT_MAX), marker(-1), guard(-1){
+
+            }
+};
+
+// A step on the path a thread takes between two characters.
+class PikeNode {
+    public: int pc;
+            int prev;
+            int parent;
+            int depth;
+            int minHeight;
+};
+
+// The bits a thread emitted in one step, after those of the entry prev.
+class PikeLog {
+    public: int prev;
+            int start;
+            int length;
+};
+
+// The most instructions and bits a program may hold.
+const size_t PIKE_MAX_INSTRUCTIONS = 1 << 16;
+const size_t PIKE_MAX_BITS = 1 << 22;
+
+// The number of log entries at which the entries of dead threads are first dropped; after that
+// they are dropped whenever the number of entries has doubled.
+const size_t PIKE_COMPACT_ENTRIES = 1024;
+
+class PikeVM {
+    public: vector<PikeInst> prog;
+            int start;
+            // Set if the specification needs more than PIKE_MAX_INSTRUCTIONS instructions or
+            // PIKE_MAX_BITS bits; such a program does not run.
+            bool tooLarge;
+            // The most log entries held after a step of the last run.
+            size_t maxLogEntries;
+            PikeVM(Rexp* spec)
+            : tooLarge(false), maxLogEntries(0), markers(0), compactAt(PIKE_COMPACT_ENTRIES){
+                vector<ARexp*> nodes = vector<ARexp*>{};
+                vector<ARexp*>* saved = ARexp::arena;
+                ARexp::arena = &nodes;
+                PikeInst match = PikeInst(PIKE_MATCH);
+                prog.push_back(match);
+                start = compile(spec, 0, 0);
+                tooLarge = tooLarge || prog.size() > PIKE_MAX_INSTRUCTIONS || bitPool.size() > PIKE_MAX_BITS;
+                ARexp::arena = saved;
+                DerivativeAutomaton::freeArena(nodes);
+                // Only instructions that consume a character or match can hold a thread between
+                // steps. The precedence matrices are indexed by the positions of the live threads
+                // and grow with their number.
+                slotOf = vector<int>(prog.size(), -1);
+                for(size_t pc = 0; pc < prog.size(); ++pc){
+                    if(prog[pc].op == PIKE_CONSUME || prog[pc].op == PIKE_MATCH){
+                        slotOf[pc] = slotPc.size();
+                        slotPc.push_back(pc);
+                    }
+                }
+                bestNode = vector<int>(prog.size(), -1);
+            }
+
+            // Appends to bs the bitcode of the POSIX value of s. Returns false if s does not match
+            // or the program is too large.
+            bool run(const string & s, deque<bool> & bs){
+                if(tooLarge){
+                    return false;
+                }
+                log.clear();
+                logNodes.clear();
+                maxLogEntries = 0;
+                compactAt = PIKE_COMPACT_ENTRIES;
+                threads.clear();
+                beginFrame();
+                follow(-1, start, -1);
+                endFrame(-1);
+                for(size_t i = 0; i < s.size() && threads.size() > 0; ++i){
+                    unsigned char c = s[i];
+                    beginFrame();
+                    for(size_t j = 0; j < threads.size(); ++j){
+                        PikeInst & inst = prog[slotPc[threads[j]]];
+                        if(inst.op == PIKE_CONSUME && inst.cs.test(c)){
+                            follow(j, inst.out1, -1);
+                        }
+                    }
+                    endFrame(c);
+                }
+                int matchSlot = slotOf[0];
+                for(size_t j = 0; j < threads.size(); ++j){
+                    if(threads[j] == matchSlot){
+                        vector<int> chain = vector<int>{};
+                        for(int n = history[j]; n != -1; n = logNodes[n].prev){
+                            chain.push_back(n);
+                        }
+                        for(int k = (int) chain.size() - 1; k >= 0; --k){
+                            PikeLog & entry = logNodes[chain[k]];
+                            bs.insert(bs.end(), log.begin() + entry.start, log.begin() + entry.start + entry.length);
+                        }
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+    private:
+            int markers;
+            vector<bool> bitPool;
+            vector<int> slotOf;
+            vector<int> slotPc;
+            // The slots of the live threads, and for each of them its bits in log, the height and
+            // the precedence with respect to every other live thread, by position.
+            vector<int> threads;
+            vector<int> nextThreads;
+            vector<int> history;
+            vector<int> nextHistory;
+            vector<int> heights;
+            vector<int> nextHeights;
+            vector<char> prec;
+            vector<char> nextPrec;
+            // The paths of the current step and the best one to reach each instruction.
+            vector<PikeNode> nodes;
+            vector<int> bestNode;
+            vector<int> touched;
+            // The bits of all threads, in entries of logNodes, which are compacted once there
+            // are compactAt of them.
+            vector<bool> log;
+            vector<PikeLog> logNodes;
+            size_t compactAt;
+            // The instructions still to follow in this step and the paths that reached them.
+            vector<std::pair<int, int>> pending;
+
+            int add(PikeInst inst){
+                prog.push_back(inst);
+                return prog.size() - 1;
+            }
+
+            int epsilon(int out, int height){
+                PikeInst inst = PikeInst(PIKE_EPSILON);
+                inst.out1 = out;
+                inst.height = height;
+                return add(inst);
+            }
+
+            int emit(int out, deque<bool> bits){
+                PikeInst inst = PikeInst(PIKE_EPSILON);
+                inst.out1 = out;
+                inst.bitsStart = bitPool.size();
+                inst.bitsLength = bits.size();
+                bitPool.insert(bitPool.end(), bits.begin(), bits.end());
+                return add(inst);
+            }
+
+            int split(int out1, int out2){
+                PikeInst inst = PikeInst(PIKE_SPLIT);
+                inst.out1 = out1;
+                inst.out2 = out2;
+                return add(inst);
+            }
+
+            int consume(int out, bitset<256> cs, bool charBits){
+                PikeInst inst = PikeInst(PIKE_CONSUME);
+                inst.out1 = out;
+                inst.cs = cs;
+                inst.charBits = charBits;
+                return add(inst);
+            }
+
+            // Compiles r, at the given height, to instructions that continue with next and
+            // returns the first one. Each iteration of a STAR, PLUS or NTIMES gets a marker.
+            int compile(Rexp* r, int height, int next){
+                string name = r->name;
+                if(name == "RECD"){
+                    // A RECD has no bits of its own, and its subexpression has the same extent.
+                    return compile(static_cast<RECD*>(r)->r, height, next);
+                }
+                int close = epsilon(next, height);
+                int body = close;
+                if(name == "ZERO"){
+                    body = add(PikeInst(PIKE_FAIL));
+                }
+                else if(name == "CHAR"){
+                    bitset<256> cs = bitset<256>{};
+                    cs.set((unsigned char) static_cast<CHAR*>(r)->c);
+                    body = consume(close, cs, false);
+                }
+                else if(name == "CHARSET"){
+                    body = consume(close, static_cast<CHARSET*>(r)->cs, true);
+                }
+                else if(name == "LITERAL"){
+                    string & s = static_cast<LITERAL*>(r)->s;
+                    for(int i = (int) s.size() - 1; i >= 0; --i){
+                        bitset<256> cs = bitset<256>{};
+                        cs.set((unsigned char) s[i]);
+                        body = consume(body, cs, false);
+                    }
+                }
+                else if(name == "ALT"){
+                    ALT* rexp = static_cast<ALT*>(r);
+                    int left = emit(compile(rexp->r1, height + 1, close), deque<bool>{false});
+                    int right = emit(compile(rexp->r2, height + 1, close), deque<bool>{true});
+                    body = split(left, right);
+                }
+                else if(name == "OPTIONAL"){
+                    // As ALT(ONE, rs).
+                    int none = emit(epsilon(epsilon(close, height + 1), height + 1), deque<bool>{false});
+                    int some = emit(compile(static_cast<OPTIONAL*>(r)->rs, height + 1, close), deque<bool>{true});
+                    body = split(none, some);
+                }
+                else if(name == "SEQ"){
+                    SEQ* rexp = static_cast<SEQ*>(r);
+                    body = compile(rexp->r1, height + 1, compile(rexp->r2, height + 1, close));
+                }
+                else if(name == "STAR"){
+                    body = compileStar(static_cast<STAR*>(r)->rs, height, close);
+                }
+                else if(name == "PLUS"){
+                    // As SEQ(rs, STAR(rs)), whose first part may be empty.
+                    Rexp* rs = static_cast<PLUS*>(r)->rs;
+                    int star = epsilon(compileStar(rs, height + 1, epsilon(close, height + 1)), height + 1);
+                    body = compile(rs, height + 1, star);
+                }
+                else if(name == "NTIMES"){
+                    // As in derBC, once an iteration is empty the ones after it are too, so the
+                    // way out skips the remaining iterations with their mkeps bits.
+                    NTIMES* rexp = static_cast<NTIMES*>(r);
+                    ARexp* rs = internalize(rexp->rs);
+                    deque<bool> empty = nullableBC(rs) ? mkepsBC(rs) : deque<bool>{};
+                    deque<bool> rest = deque<bool>{};
+                    for(int i = rexp->n - 1; i >= 0; --i){
+                        if(prog.size() > PIKE_MAX_INSTRUCTIONS || bitPool.size() > PIKE_MAX_BITS){
+                            tooLarge = true;
+                            break;
+                        }
+                        push_Back(rest, empty);
+                        int marker = markers++;
+                        int guarded = epsilon(body, INT_MAX);
+                        prog[guarded].guard = marker;
+                        int iteration = epsilon(compile(rexp->rs, height + 1, guarded), INT_MAX);
+                        prog[iteration].marker = marker;
+                        int skip = nullableBC(rs) ? emit(close, rest) : add(PikeInst(PIKE_FAIL));
+                        body = split(iteration, skip);
+                    }
+                }
+                return epsilon(body, height);
+            }
+
+            int compileStar(Rexp* rs, int height, int close){
+                int marker = markers++;
+                int loop = split(-1, emit(close, deque<bool>{true}));
+                int guarded = epsilon(loop, INT_MAX);
+                prog[guarded].guard = marker;
+                int iteration = emit(compile(rs, height + 1, guarded), deque<bool>{false});
+                prog[iteration].marker = marker;
+                prog[loop].out1 = iteration;
+                return loop;
+            }
+
+            void beginFrame(){
+                nodes.clear();
+                for(size_t i = 0; i < touched.size(); ++i){
+                    bestNode[touched[i]] = -1;
+                }
+                touched.clear();
+                nextThreads.clear();
+            }
+
+            // Follows the paths of the live thread at position parent from pc, which it has reached
+            // after prev. The paths are followed depth first, out1 before out2, on an explicit
+            // stack, as a large program can have very long chains of epsilon instructions.
+            void follow(int parent, int pc, int prev){
+                pending.clear();
+                pending.push_back(std::make_pair(pc, prev));
+                while(!pending.empty()){
+                    pc = pending.back().first;
+                    prev = pending.back().second;
+                    pending.pop_back();
+                    PikeInst & inst = prog[pc];
+                    PikeNode node = PikeNode();
+                    node.pc = pc;
+                    node.prev = prev;
+                    node.parent = parent;
+                    node.depth = (prev == -1) ? 0 : nodes[prev].depth + 1;
+                    node.minHeight = std::min((prev == -1) ? INT_MAX : nodes[prev].minHeight, inst.height);
+                    if(inst.guard != -1 && reachedMarker(prev, inst.guard)){
+                        continue;
+                    }
+                    nodes.push_back(node);
+                    int id = nodes.size() - 1;
+                    if(bestNode[pc] == -1){
+                        touched.push_back(pc);
+                        if(slotOf[pc] != -1){
+                            nextThreads.push_back(slotOf[pc]);
+                        }
+                    }
+                    else if(!better(id, bestNode[pc])){
+                        continue;
+                    }
+                    bestNode[pc] = id;
+                    if(inst.op == PIKE_EPSILON){
+                        pending.push_back(std::make_pair(inst.out1, id));
+                    }
+                    else if(inst.op == PIKE_SPLIT){
+                        pending.push_back(std::make_pair(inst.out2, id));
+                        pending.push_back(std::make_pair(inst.out1, id));
+                    }
+                }
+            }
+
+            // True if the path ending in node n has passed the given iteration marker.
+            bool reachedMarker(int n, int marker){
+                for(; n != -1; n = nodes[n].prev){
+                    if(prog[nodes[n].pc].marker == marker){
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // Drops the log entries that no live thread reaches and moves the others to the front,
+            // keeping their order, so that an entry still comes after the one before it.
+            void compactLog(){
+                vector<int> moved = vector<int>(logNodes.size(), -1);
+                for(size_t j = 0; j < history.size(); ++j){
+                    for(int n = history[j]; n != -1 && moved[n] == -1; n = logNodes[n].prev){
+                        moved[n] = -2;
+                    }
+                }
+                vector<bool> keptLog = vector<bool>{};
+                vector<PikeLog> keptNodes = vector<PikeLog>{};
+                for(size_t n = 0; n < logNodes.size(); ++n){
+                    if(moved[n] == -1){
+                        continue;
+                    }
+                    PikeLog entry = logNodes[n];
+                    entry.prev = (entry.prev == -1) ? -1 : moved[entry.prev];
+                    int start = entry.start;
+                    entry.start = keptLog.size();
+                    keptLog.insert(keptLog.end(), log.begin() + start, log.begin() + start + entry.length);
+                    moved[n] = keptNodes.size();
+                    keptNodes.push_back(entry);
+                }
+                for(size_t j = 0; j < history.size(); ++j){
+                    history[j] = moved[history[j]];
+                }
+                std::swap(log, keptLog);
+                std::swap(logNodes, keptNodes);
+            }
+
+            // Compares the paths ending in nodes a and b: ha and hb are the least heights each has
+            // passed since they forked and aFirst is true if a comes first when those are equal.
+            void rank(int a, int b, int & ha, int & hb, bool & aFirst){
+                PikeNode & x = nodes[a];
+                PikeNode & y = nodes[b];
+                int live = threads.size();
+                if(x.parent != y.parent){
+                    ha = std::min(heights[x.parent * live + y.parent], x.minHeight);
+                    hb = std::min(heights[y.parent * live + x.parent], y.minHeight);
+                    aFirst = prec[x.parent * live + y.parent];
+                    return;
+                }
+                ha = INT_MAX;
+                hb = INT_MAX;
+                int lastA = -1;
+                int lastB = -1;
+                while(a != b){
+                    if(nodes[a].depth >= nodes[b].depth){
+                        ha = std::min(ha, prog[nodes[a].pc].height);
+                        lastA = a;
+                        a = nodes[a].prev;
+                    }
+                    else{
+                        hb = std::min(hb, prog[nodes[b].pc].height);
+                        lastB = b;
+                        b = nodes[b].prev;
+                    }
+                }
+                // A path that leads through the other one, as round a loop, comes second.
+                aFirst = (lastA == -1) || (lastB != -1 && nodes[lastA].pc == prog[nodes[a].pc].out1);
+            }
+
+            bool better(int a, int b){
+                int ha, hb;
+                bool aFirst;
+                rank(a, b, ha, hb, aFirst);
+                return (ha != hb) ? ha > hb : aFirst;
+            }
+
+            // Makes the threads that reached an instruction in this step the live ones, after c
+            // was consumed, or none if c is -1.
+            void endFrame(int c){
+                int live = nextThreads.size();
+                nextHistory.resize(live);
+                nextHeights.resize(live * live);
+                nextPrec.resize(live * live);
+                for(int i = 0; i < live; ++i){
+                    int a = bestNode[slotPc[nextThreads[i]]];
+                    for(int j = 0; j < live; ++j){
+                        if(i != j){
+                            int ha, hb;
+                            bool aFirst;
+                            rank(a, bestNode[slotPc[nextThreads[j]]], ha, hb, aFirst);
+                            nextHeights[i * live + j] = ha;
+                            nextPrec[i * live + j] = (ha != hb) ? ha > hb : aFirst;
+                        }
+                    }
+                    // The bits of the new thread: those of its parent, the character it consumed
+                    // and what its path emitted.
+                    int parent = nodes[a].parent;
+                    PikeLog entry = PikeLog();
+                    entry.prev = (parent == -1) ? -1 : history[parent];
+                    entry.start = log.size();
+                    if(parent != -1 && prog[slotPc[threads[parent]]].charBits){
+                        for(int k = 7; k >= 0; --k){
+                            log.push_back((c >> k) & 1);
+                        }
+                    }
+                    int mark = log.size();
+                    for(int n = a; n != -1; n = nodes[n].prev){
+                        PikeInst & inst = prog[nodes[n].pc];
+                        for(int k = inst.bitsLength - 1; k >= 0; --k){
+                            log.push_back(bitPool[inst.bitsStart + k]);
+                        }
+                    }
+                    std::reverse(log.begin() + mark, log.end());
+                    entry.length = log.size() - entry.start;
+                    logNodes.push_back(entry);
+                    nextHistory[i] = logNodes.size() - 1;
+                }
+                std::swap(threads, nextThreads);
+                std::swap(history, nextHistory);
+                std::swap(heights, nextHeights);
+                std::swap(prec, nextPrec);
+                if(logNodes.size() >= compactAt){
+                    compactLog();
+                    compactAt = std::max(PIKE_COMPACT_ENTRIES, 2 * logNodes.size());
+                }
+                maxLogEntries = std::max(maxLogEntries, logNodes.size());
+            }
+};
+
+// Computes the POSIX bitcode of s with respect to the specification spec on the Pike VM. Returns
+// false if s does not match.
+bool pikeBits(Rexp* spec, const string & s, deque<bool> & bs){
+    PikeVM vm = PikeVM(spec);
+    return vm.run(s, bs);
+}
+
+enum PikeStatus {PIKE_OK, PIKE_NO_MATCH, PIKE_TOO_LARGE};
+
+// Tokenises the input string on the Pike VM, which takes the POSIX value where blexer2_simp
+// may not. status tells a string that does not match from a specification whose program is
+// too large; there are no tokens in either case.
+deque<string> blexer_pike(Rexp* r, string s, PikeStatus & status){
+    PikeVM vm = PikeVM(r);
+    if(vm.tooLarge){
+        status = PIKE_TOO_LARGE;
+        return deque<string>{};
+    }
+    deque<bool> bs = deque<bool>{};
+    if(!vm.run(s, bs)){
+        status = PIKE_NO_MATCH;
+        return deque<string>{};
+    }
+    status = PIKE_OK;
+    StreamDecoder decoder = StreamDecoder(r);
+    decoder.feed(bs);
+    return decoder.tokens;
+}
+
+
+// *** BUDGETED LEXING ***
+// Lexes like blexer2_simp under a budget, so that a hostile input cannot hold a core or the heap
+// for as long as it likes. Between two derivative steps the lexer checks the number of steps,
+// the number of live nodes, the number of bits held in annotations, the CPU time of the thread
+// and a cancellation token. The bitcode is then decoded in chunks, with the CPU time and the
+// token checked between two chunks. When one of them is exceeded, the call stops with a status
+// and the progress it had made.
+
+enum LexStatus {LEX_OK, LEX_NO_MATCH, LEX_STEPS, LEX_LIVE_NODES, LEX_BITS, LEX_CPU_TIME, LEX_CANCELLED};
+
+string lexStatusName(LexStatus status){
+    static const char* names[] = {"ok", "no match", "step limit", "live node limit", "bit limit", "CPU time limit", "cancelled"};
+    return names[status];
+}
+
+// Set from another thread to stop the lexing calls that were given this token.
+class CancelToken {
+    public: CancelToken()
+            : flag(false){
+
+            }
+
+            void cancel(){
+                flag.store(true, std::memory_order_relaxed);
+            }
+            bool cancelled() const {
+                return flag.load(std::memory_order_relaxed);
+            }
+
+    private: std::atomic<bool> flag;
+};
+
+// Limits of a single lexing call; every limit is unlimited by default. A step derives by one
+// character. maxLiveNodes bounds the nodes reachable from the derivative and maxBits the bits in
+// their annotations and, at the end, in the bitcode; both are checked before every step, each
+// on its own. The arena is also swept whenever it has doubled, so the dead derivatives are freed
+// under any budget.
+class LexBudget {
+    public: unsigned long maxSteps;
+            size_t maxLiveNodes;
+            size_t maxBits;
+            long maxCpuNanoseconds;
+            CancelToken* cancel;
+            LexBudget()
+            : maxSteps(ULONG_MAX), maxLiveNodes(SIZE_MAX), maxBits(SIZE_MAX), maxCpuNanoseconds(LONG_MAX), cancel(nullptr){
+
+            }
+};
+
+// How a budgeted call ended. position is the number of characters that had been read, liveNodes
+// the most nodes held between two steps and bits the most bits seen.
+class LexOutcome {
+    public: LexStatus status;
+            size_t position;
+            size_t liveNodes;
+            size_t bits;
+            long cpuNanoseconds;
+            LexOutcome()
+            : status(LEX_OK), position(0), liveNodes(0), bits(0), cpuNanoseconds(0){
+
+            }
+};
+
+long threadCpuNanoseconds(){
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+// Deletes the nodes in the arena that cannot be reached from roots, which simpBC may share
+// between several parents. Returns the number of nodes left and sets bits to the number of
+// bits in their annotations.
+size_t sweepArena(const vector<ARexp*> & roots, vector<ARexp*> & nodes, size_t & bits){
+    std::unordered_set<ARexp*> live = std::unordered_set<ARexp*>{};
+    vector<ARexp*> stack = roots;
+    bits = 0;
+    while(!stack.empty()){
+        ARexp* r = stack.back();
+        stack.pop_back();
+        if(!live.insert(r).second){
+            continue;
+        }
+        bits += r->ann.size();
+        string & name = r->name;
+        if(name == "AALT"){
+            deque<ARexp*> & rs = static_cast<AALT*>(r)->rs;
+            stack.insert(stack.end(), rs.begin(), rs.end());
+        }
+        else if(name == "ASEQ"){
+            stack.push_back(static_cast<ASEQ*>(r)->r1);
+            stack.push_back(static_cast<ASEQ*>(r)->r2);
+        }
+        else if(name == "ASTAR"){
+            stack.push_back(static_cast<ASTAR*>(r)->rs);
+        }
+        else if(name == "ANTIMES"){
+            stack.push_back(static_cast<ANTIMES*>(r)->rs);
+        }
+        else if(name == "APLUS"){
+            stack.push_back(static_cast<APLUS*>(r)->rs);
+        }
+        else if(name == "AOPTIONAL"){
+            stack.push_back(static_cast<AOPTIONAL*>(r)->rs);
+        }
+    }
+    size_t kept = 0;
+    for(size_t i = 0; i < nodes.size(); ++i){
+        if(live.count(nodes[i]) != 0){
+            nodes[kept++] = nodes[i];
+        }
+        else{
+            delete nodes[i];
+        }
+    }
+    nodes.resize(kept);
+    return kept;
+}
+
+// Checks the cancellation token and the CPU time of the thread since startCpu.
+LexStatus checkLimits(LexBudget & budget, long startCpu, LexOutcome & outcome){
+    if(budget.cancel != nullptr && budget.cancel->cancelled()){
+        return LEX_CANCELLED;
+    }
+    if(budget.maxCpuNanoseconds != LONG_MAX){
+        outcome.cpuNanoseconds = threadCpuNanoseconds() - startCpu;
+        if(outcome.cpuNanoseconds > budget.maxCpuNanoseconds){
+            return LEX_CPU_TIME;
+        }
+    }
+    return LEX_OK;
+}
+
+// The fewest nodes the arena of a budgeted call holds before it is swept.
+const size_t SWEEP_NODES = 4096;
+
+// What a budgeted call knows of its arena between two steps: the nodes and bits that were live
+// at the last sweep, and the bits of the nodes made since then, which are nodes[counted] on.
+class ArenaGauge {
+    public: size_t liveNodes;
+            size_t liveBits;
+            size_t newBits;
+            size_t counted;
+            ArenaGauge()
+            : liveNodes(0), liveBits(0), newBits(0), counted(0){
+
+            }
+};
+
+// Checks the budget before the next step. The bits of the nodes made since the last sweep are
+// added up, and the arena is swept when it holds more nodes than maxLiveNodes, when its bits could
+// be more than maxBits or when it has doubled since the last sweep. The CPU clock is only read
+// every 64 steps.
+LexStatus checkBudget(LexBudget & budget, ARexp* a, vector<ARexp*> & nodes, ArenaGauge & gauge, size_t steps, long startCpu, LexOutcome & outcome){
+    if(budget.cancel != nullptr && budget.cancel->cancelled()){
+        return LEX_CANCELLED;
+    }
+    outcome.bits = std::max(outcome.bits, a->ann.size());
+    if(a->ann.size() > budget.maxBits){
+        return LEX_BITS;
+    }
+    for(; gauge.counted < nodes.size(); ++gauge.counted){
+        gauge.newBits += nodes[gauge.counted]->ann.size();
+    }
+    if(nodes.size() > budget.maxLiveNodes || gauge.liveBits + gauge.newBits > budget.maxBits || nodes.size() > std::max(SWEEP_NODES, 2 * gauge.liveNodes)){
+        gauge.liveNodes = sweepArena(vector<ARexp*>{a}, nodes, gauge.liveBits);
+        gauge.newBits = 0;
+        gauge.counted = nodes.size();
+        outcome.liveNodes = std::max(outcome.liveNodes, gauge.liveNodes);
+        outcome.bits = std::max(outcome.bits, gauge.liveBits);
+        if(gauge.liveNodes > budget.maxLiveNodes){
+            return LEX_LIVE_NODES;
+        }
+        if(gauge.liveBits > budget.maxBits){
+            return LEX_BITS;
+        }
+    }
+    outcome.liveNodes = std::max(outcome.liveNodes, nodes.size());
+    if(budget.maxCpuNanoseconds != LONG_MAX && (steps & 63) == 0){
+        outcome.cpuNanoseconds = threadCpuNanoseconds() - startCpu;
+        if(outcome.cpuNanoseconds > budget.maxCpuNanoseconds){
+            return LEX_CPU_TIME;
+        }
+    }
+    return LEX_OK;
+}
+
+// The number of bits decoded between two checks of the budget.
+const size_t DECODE_CHUNK_BITS = 4096;
+
+// Derives a, the derivative of the characters of s before start, by the rest of s within the
+// budget, with its nodes in the arena nodes, and sets bs to its bitcode if s matches. outcome
+// says how the call ended and how far it got.
+void budgetedBits(ARexp* a, const string & s, size_t start, vector<ARexp*> & nodes, LexBudget & budget, long startCpu, LexOutcome & outcome, deque<bool> & bs){
+    ArenaGauge gauge = ArenaGauge();
+    size_t i = start;
+    for(; i < s.size() && a->name != "AZERO"; ++i){
+        outcome.status = (i >= budget.maxSteps) ? LEX_STEPS : checkBudget(budget, a, nodes, gauge, i, startCpu, outcome);
+        if(outcome.status != LEX_OK){
+            break;
+        }
+        a = simpBC(derBC(s[i], a));
+    }
+    outcome.position = i;
+    if(outcome.status == LEX_OK){
+        outcome.status = checkBudget(budget, a, nodes, gauge, 0, startCpu, outcome);
+    }
+    if(outcome.status == LEX_OK){
+        if(a->name == "AZERO" || !nullableBC(a)){
+            outcome.status = LEX_NO_MATCH;
+        }
+        else{
+            bs = mkepsBC(a);
+            outcome.bits = std::max(outcome.bits, bs.size());
+            if(bs.size() > budget.maxBits){
+                outcome.status = LEX_BITS;
+            }
+        }
+    }
+}
+
+// Decodes the bitcode bs of spec into tokens in chunks of DECODE_CHUNK_BITS, checking the CPU
+// time and the cancellation token between two chunks.
+void budgetedDecode(Rexp* spec, deque<bool> & bs, LexBudget & budget, long startCpu, LexOutcome & outcome, deque<string> & tokens){
+    StreamDecoder decoder = StreamDecoder(spec);
+    size_t fed = 0;
+    do{
+        outcome.status = checkLimits(budget, startCpu, outcome);
+        if(outcome.status != LEX_OK){
+            return;
+        }
+        size_t n = std::min(bs.size() - fed, DECODE_CHUNK_BITS);
+        deque<bool> chunk = deque<bool>(bs.begin() + fed, bs.begin() + fed + n);
+        decoder.feed(chunk);
+        fed += n;
+    } while(fed < bs.size());
+    tokens = decoder.tokens;
+}
+
+// Tokenises s like blexer2_simp within the budget. Returns true and sets tokens if s matches;
+// otherwise outcome says why the call stopped and how far it got. The arena of the caller, if
+// any, is in use again when the call returns.
+bool blexer_budgeted(Rexp* r, const string & s, LexBudget & budget, deque<string> & tokens, LexOutcome & outcome){
+    long startCpu = threadCpuNanoseconds();
+    outcome = LexOutcome();
+    Rexp* spec = optimiseSpec(r);
+    vector<ARexp*> nodes = vector<ARexp*>{};
+    vector<ARexp*>* saved = ARexp::arena;
+    ARexp::arena = &nodes;
+    deque<bool> bs = deque<bool>{};
+    budgetedBits(internalize(spec), s, 0, nodes, budget, startCpu, outcome, bs);
+    DerivativeAutomaton::freeArena(nodes);
+    ARexp::arena = saved;
+    if(outcome.status == LEX_OK){
+        budgetedDecode(spec, bs, budget, startCpu, outcome, tokens);
+    }
+    outcome.cpuNanoseconds = threadCpuNanoseconds() - startCpu;
+    return outcome.status == LEX_OK;
+}
+
+
+// *** ADAPTIVE ENGINE SELECTION ***
+// Lexes with derivatives like blexer2_simp, but under a watchdog: when a derivative step allocates
+// more nodes than allowed, the call goes on from the same position on the cached derivative
+// automaton, whose state is the canonical key of the derivative and whose registers are its
+// annotations. When that meets a state that is too large or has too many states, the derivative
+// is rebuilt from the state and its registers and the call goes on with budgeted derivatives,
+// which stop with an error once they hold more live nodes or take more CPU time than their
+// budget allows. No engine reads a character twice, and every engine gives the tokens of
+// blexer2_simp, so the limits decide the cost of a call and whether it fails, but never which
+// tokens it returns.
+
+enum AdaptiveEngine {ADAPTIVE_DERIVATIVES, ADAPTIVE_AUTOMATON, ADAPTIVE_BUDGETED};
+
+string adaptiveEngineName(AdaptiveEngine engine){
+    if(engine == ADAPTIVE_DERIVATIVES){
+        return "derivatives";
+    }
+    else if(engine == ADAPTIVE_AUTOMATON){
+        return "automaton";
+    }
+    return "budgeted";
+}
+
+// The number of calls each engine finished and of times a call moved to the next engine.
+class AdaptiveStats {
+    public: unsigned long served[3];
+            unsigned long switches;
+            AdaptiveStats()
+            : served{0, 0, 0}, switches(0){
+
+            }
+};
+
+class AdaptiveLexer {
+    public: Rexp* r;
+            DerivativeAutomaton da;
+            int stepNodes;
+            int stateSize;
+            int maxStates;
+            // The limits of the budgeted derivatives. By default they may hold 64 times as many
+            // live nodes as a derivative step may allocate, and no other limit is set.
+            LexBudget budget;
+            AdaptiveStats stats;
+            // A derivative step may allocate at most stepNodes nodes, and the automaton may have
+            // at most maxStates states of at most stateSize nodes each.
+            AdaptiveLexer(Rexp* rIn, int stepNodesIn, int stateSizeIn, int maxStatesIn)
+            : r(rIn), da(rIn), stepNodes(stepNodesIn), stateSize(stateSizeIn), maxStates(maxStatesIn),
+              budget(), automatonFull(false), matched(false){
+                budget.maxLiveNodes = 64 * (size_t) stepNodes;
+            }
+
+            // Tokenises s and sets engine to the engine that finished. Returns false if s does not
+            // match or the budgeted derivatives run out of their budget, and outcome says which.
+            // The arena of the caller, if any, is in use again when the call returns.
+            bool lex(const string & s, AdaptiveEngine & engine, deque<string> & tokens, LexOutcome & outcome){
+                long startCpu = threadCpuNanoseconds();
+                outcome = LexOutcome();
+                vector<ARexp*> nodes = vector<ARexp*>{};
+                vector<ARexp*>* saved = ARexp::arena;
+                ARexp::arena = &nodes;
+                ARexp* a = internalize(da.spec);
+                size_t i = 0;
+                deque<bool> bs = deque<bool>{};
+                engine = ADAPTIVE_DERIVATIVES;
+                if(!derivatives(s, a, i, bs)){
+                    ++stats.switches;
+                    engine = ADAPTIVE_AUTOMATON;
+                    if(!automaton(s, a, i, bs)){
+                        ++stats.switches;
+                        engine = ADAPTIVE_BUDGETED;
+                        budgetedBits(a, s, i, nodes, budget, startCpu, outcome, bs);
+                    }
+                }
+                DerivativeAutomaton::freeArena(nodes);
+                ARexp::arena = saved;
+                if(engine != ADAPTIVE_BUDGETED){
+                    outcome.position = i;
+                    outcome.status = matched ? LEX_OK : LEX_NO_MATCH;
+                }
+                if(outcome.status == LEX_OK){
+                    budgetedDecode(da.spec, bs, budget, startCpu, outcome, tokens);
+                }
+                outcome.cpuNanoseconds = threadCpuNanoseconds() - startCpu;
+                ++stats.served[engine];
+                return outcome.status == LEX_OK;
+            }
+
+            // Tokenises s like blexer2_simp, sets engine to the engine that finished and prints
+            // why if it fails.
+            deque<string> lex(const string & s, AdaptiveEngine & engine){
+                deque<string> tokens = deque<string>{};
+                LexOutcome outcome = LexOutcome();
+                if(!lex(s, engine, tokens, outcome)){
+                    if(outcome.status == LEX_NO_MATCH){
+                        cout << "No match found.\n";
+                    }
+                    else{
+                        cout << "adaptive lexer: " << lexStatusName(outcome.status) << " at " << outcome.position << endl;
+                    }
+                }
+                return tokens;
+            }
+
+    private:
+            // Set once the automaton has grown past maxStates; it is not tried again.
+            bool automatonFull;
+            // Whether the last engine to finish matched; its bitcode may be empty.
+            bool matched;
+
+            // Derives a by the characters of s from position i on and sets bs to its bitcode.
+            // Returns false, with a and i at the derivative and the position reached, as soon as a
+            // derivative step allocates more than stepNodes nodes.
+            bool derivatives(const string & s, ARexp* & a, size_t & i, deque<bool> & bs){
+                vector<ARexp*> & nodes = *ARexp::arena;
+                while(i < s.size() && a->name != "AZERO"){
+                    size_t before = nodes.size();
+                    a = simpBC(derBC(s[i++], a));
+                    if(nodes.size() - before > (size_t) stepNodes){
+                        return false;
+                    }
+                }
+                matched = nullableBC(a);
+                if(matched){
+                    bs = mkepsBC(a);
+                }
+                return true;
+            }
+
+            // Follows the automaton from the state of a by the characters of s from position i on
+            // and sets bs to the bitcode. Returns false, with a and i at the derivative and the
+            // position reached, as soon as it meets a state larger than stateSize or grows past
+            // maxStates states.
+            bool automaton(const string & s, ARexp* & a, size_t & i, deque<bool> & bs){
+                if(automatonFull || regexSizeBC(a) > stateSize){
+                    return false;
+                }
+                vector<ARexp*>* arena = ARexp::arena;
+                int state = da.addState(canonicalBC(a));
+                ARexp::arena = arena;
+                BitRopes ropes = BitRopes();
+                vector<deque<bool>*> anns = vector<deque<bool>*>{};
+                collectAnns(a, anns);
+                deque<vector<bool>> held = deque<vector<bool>>{};
+                vector<int> regs = vector<int>{};
+                for(size_t j = 0; j < anns.size(); ++j){
+                    held.push_back(vector<bool>(anns[j]->begin(), anns[j]->end()));
+                    regs.push_back(ropes.leaf(&held.back()));
+                }
+                vector<int> next = vector<int>{};
+                for(; i < s.size() && !da.dead[state]; ++i){
+                    DerTransition* t = da.transition(state, s[i]);
+                    ARexp::arena = arena;
+                    if(da.sizes[t->target] > stateSize || da.keys.size() > (size_t) maxStates){
+                        automatonFull = (da.keys.size() > (size_t) maxStates);
+                        a = registersToState(state, ropes, regs);
+                        return false;
+                    }
+                    takeTransition(t, ropes, regs, next);
+                    state = t->target;
+                }
+                matched = da.nullable[state];
+                if(matched){
+                    ropes.flatten(ropes.run(da.finals[state], regs), bs);
+                }
+                return true;
+            }
+
+            // Rebuilds the derivative of the given state in the current arena, with the contents
+            // of its registers as annotations.
+            ARexp* registersToState(int state, BitRopes & ropes, vector<int> & regs){
+                ARexp* a = parseCanonicalBC(da.keys[state]);
+                vector<deque<bool>*> anns = vector<deque<bool>*>{};
+                collectAnns(a, anns);
+                for(size_t j = 0; j < anns.size(); ++j){
+                    ropes.flatten(regs[j], *anns[j]);
+                }
+                return a;
+            }
+};
+
+// Tokenises the input string like blexer2_simp, with an AdaptiveLexer. A derivative step of the
+// WHILE specification allocates up to about 1500 nodes, and one of (1+a){n}a{n} about 10 more
+// for every character read so far.
+deque<string> blexer_adaptive(Rexp* r, string s){
+    AdaptiveLexer lexer = AdaptiveLexer(r, 4000, 1000, 10000);
+    AdaptiveEngine engine;
+    return lexer.lex(s, engine);
+}
+
+
+// *** HARDWARE PERFORMANCE COUNTERS ***
+// Wall-clock totals do not say why derBC, simpBC or decoding are slow. The lexer below runs the
+// phases of blexer2_simp one after the other and reads the cycle, instruction, branch miss, L1
+// data cache miss and last-level cache miss counters of the thread around each of them, through
+// perf_event_open. Only user-space events are counted, so the reads themselves are left out.
+// Counters that cannot be opened, as in most containers, are reported as null; the phase times
+// are always reported.
+
+enum LexPhase {PHASE_INTERNALIZE, PHASE_DERIVATIVE, PHASE_SIMPLIFY, PHASE_MKEPS, PHASE_DECODE};
+const int PHASE_COUNT = 5;
+const char* PHASE_NAMES[PHASE_COUNT] = {"internalize", "derivative", "simplify", "mkeps", "decode"};
+
+const int COUNTER_COUNT = 5;
+const char* COUNTER_NAMES[COUNTER_COUNT] = {"cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses"};
+
+// The counters of the calling thread, opened as one group so that they are read together. A
+// counter the kernel refuses is left out of the group.
+class PerfCounters {
+    public: bool available[COUNTER_COUNT];
+            PerfCounters()
+            : leader(-1){
+                for(int i = 0; i < COUNTER_COUNT; ++i){
+                    available[i] = false;
+                    fds[i] = -1;
+                }
+#ifdef __linux__
+                const uint32_t types[COUNTER_COUNT] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+                const uint64_t configs[COUNTER_COUNT] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+                                                         PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                                                         PERF_COUNT_HW_CACHE_MISSES};
+                for(int i = 0; i < COUNTER_COUNT; ++i){
+                    perf_event_attr attr = perf_event_attr();
+                    attr.size = sizeof(attr);
+                    attr.type = types[i];
+                    attr.config = configs[i];
+                    attr.disabled = (leader == -1);
+                    attr.exclude_kernel = 1;
+                    attr.exclude_hv = 1;
+                    attr.read_format = PERF_FORMAT_GROUP;
+                    fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+                    if(fds[i] != -1){
+                        available[i] = true;
+                        order.push_back(i);
+                        if(leader == -1){
+                            leader = fds[i];
+                        }
+                    }
+                }
+                if(leader != -1){
+                    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+                    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+                }
+#endif
+            }
+
+            ~PerfCounters(){
+                for(int i = 0; i < COUNTER_COUNT; ++i){
+                    if(fds[i] != -1){
+                        close(fds[i]);
+                    }
+                }
+            }
+
+            PerfCounters(const PerfCounters & other) = delete;
+            PerfCounters & operator= (const PerfCounters & other) = delete;
+
+            bool any(){
+                return leader != -1;
+            }
+
+            // Sets values to the current counts; unavailable counters read as 0.
+            void read(uint64_t values[COUNTER_COUNT]){
+                for(int i = 0; i < COUNTER_COUNT; ++i){
+                    values[i] = 0;
+                }
+                uint64_t buffer[1 + COUNTER_COUNT];
+                if(leader == -1 || ::read(leader, buffer, sizeof(buffer)) < (ssize_t) ((1 + order.size()) * sizeof(uint64_t))){
+                    return;
+                }
+                for(size_t i = 0; i < order.size(); ++i){
+                    values[order[i]] = buffer[1 + i];
+                }
+            }
+
+    private: int fds[COUNTER_COUNT];
+            int leader;
+            // The counters in the order the group returns them.
+            vector<int> order;
+};
+
+// Counts and wall-clock time accumulated in each phase.
+class PhaseProfile {
+    public: uint64_t counts[PHASE_COUNT][COUNTER_COUNT];
+            long nanoseconds[PHASE_COUNT];
+            size_t bytes;
+            PhaseProfile()
+            : counts{}, nanoseconds{}, bytes(0){
+
+            }
+};
+
+// Times a phase from its construction to its destruction and adds it to the profile.
+class PhaseTimer {
+    public: PhaseTimer(PerfCounters & countersIn, PhaseProfile & profileIn, LexPhase phaseIn)
+            : counters(countersIn), profile(profileIn), phase(phaseIn){
+                counters.read(start);
+                startTime = high_resolution_clock::now();
+            }
+            ~PhaseTimer(){
+                auto endTime = high_resolution_clock::now();
+                uint64_t end[COUNTER_COUNT];
+                counters.read(end);
+                for(int i = 0; i < COUNTER_COUNT; ++i){
+                    profile.counts[phase][i] += end[i] - start[i];
+                }
+                profile.nanoseconds[phase] += duration_cast<std::chrono::nanoseconds>(endTime - startTime).count();
+            }
+
+    private: PerfCounters & counters;
+            PhaseProfile & profile;
+            LexPhase phase;
+            uint64_t start[COUNTER_COUNT];
+            high_resolution_clock::time_point startTime;
+};
+
+// Tokenises s like blexer2_simp and adds the counts of each phase to profile.
+deque<string> blexer_profiled(Rexp* r, string s, PerfCounters & counters, PhaseProfile & profile){
+    Rexp* spec = optimiseSpec(r);
+    profile.bytes += s.size();
+    ARexp* a;
+    {
+        PhaseTimer timer = PhaseTimer(counters, profile, PHASE_INTERNALIZE);
+        a = internalize(spec);
+    }
+    for(size_t i = 0; i < s.size(); ++i){
+        {
+            PhaseTimer timer = PhaseTimer(counters, profile, PHASE_DERIVATIVE);
+            a = derBC(s[i], a);
+        }
+        PhaseTimer timer = PhaseTimer(counters, profile, PHASE_SIMPLIFY);
+        a = simpBC(a);
+    }
+    if(!nullableBC(a)){
+        cout << "No match found.\n";
+        return deque<string>{};
+    }
+    deque<bool> bs;
+    {
+        PhaseTimer timer = PhaseTimer(counters, profile, PHASE_MKEPS);
+        bs = mkepsBC(a);
+    }
+    PhaseTimer timer = PhaseTimer(counters, profile, PHASE_DECODE);
+    return sdecode(spec, bs);
+}
+
+// Returns the profile as a JSON object with the time, every available counter and both per
+// input byte for each phase. Unavailable counters are null.
+string profileToJson(PerfCounters & counters, PhaseProfile & profile){
+    double bytes = std::max(profile.bytes, (size_t) 1);
+    string out = "{\"bytes\": " + std::to_string(profile.bytes) + ", \"counters\": " + (counters.any() ? "true" : "false") + ", \"phases\": {";
+    for(int p = 0; p < PHASE_COUNT; ++p){
+        out += (p == 0) ? "" : ", ";
+        out += string("\"") + PHASE_NAMES[p] + "\": {\"nanoseconds\": " + std::to_string(profile.nanoseconds[p])
+               + ", \"nanoseconds_per_byte\": " + std::to_string(profile.nanoseconds[p] / bytes);
+        for(int c = 0; c < COUNTER_COUNT; ++c){
+            string name = COUNTER_NAMES[c];
+            if(counters.available[c]){
+                out += ", \"" + name + "\": " + std::to_string(profile.counts[p][c])
+                       + ", \"" + name + "_per_byte\": " + std::to_string(profile.counts[p][c] / bytes);
+            }
+            else{
+                out += ", \"" + name + "\": null, \"" + name + "_per_byte\": null";
+            }
+        }
+        out += "}";
+    }
+    return out + "}}";
+}
+
+
+// *** DIFFERENTIAL FUZZING ***
+// Every fast path has to produce exactly the tokens of blexer2_simp. The fuzzer generates random
+// specifications and strings, runs each engine on them and compares its bitcode with the
+// reference bitcode (or its tokens, spans, matches or match result where that is all the engine
+// gives).
+// A mismatch is shrunk to a small specification and string before it is reported.
+
+// xorshift64* generator, so that a fuzzing run can be repeated from its seed.
+class FuzzRandom {
+    public: uint64_t state;
+            FuzzRandom(uint64_t seed)
+            : state(seed ^ 0x9E3779B97F4A7C15ULL){
+                if(state == 0){
+                    state = 1;
+                }
+            }
+
+            uint64_t next(){
+                state ^= state >> 12;
+                state ^= state << 25;
+                state ^= state >> 27;
+                return state * 2685821657736338717ULL;
+            }
+
+            // Returns a number between 0 and n - 1.
+            int below(int n){
+                return next() % n;
+            }
+};
+
+// Random specifications and strings only use a few characters, so that most strings match.
+const string FUZZ_ALPHABET = "abc";
+
+// Returns a random regular expression of at most the given depth over FUZZ_ALPHABET.
+Rexp* randomRexp(FuzzRandom & rng, int depth){
+    int choice = rng.below(depth <= 0 ? 5 : 15);
+    if(choice == 0){
+        return new ONE();
+    }
+    else if(choice <= 2){
+        return new CHAR(FUZZ_ALPHABET[rng.below(FUZZ_ALPHABET.size())]);
+    }
+    else if(choice == 3){
+        bitset<256> cs;
+        for(size_t i = 0; i < FUZZ_ALPHABET.size(); ++i){
+            if(rng.below(2) == 0){
+                cs.set((unsigned char) FUZZ_ALPHABET[i]);
+            }
+        }
+        cs.set((unsigned char) FUZZ_ALPHABET[rng.below(FUZZ_ALPHABET.size())]);
+        return new CHARSET(cs);
+    }
+    else if(choice == 4){
+        string word = "";
+        for(int length = 2 + rng.below(2); word.size() < (size_t) length; ){
+            word += FUZZ_ALPHABET[rng.below(FUZZ_ALPHABET.size())];
+        }
+        return new LITERAL(word);
+    }
+    else if(choice == 5){
+        return new ZERO();
+    }
+    else if(choice <= 7){
+        return new ALT(randomRexp(rng, depth - 1), randomRexp(rng, depth - 1));
+    }
+    else if(choice <= 9){
+        return new SEQ(randomRexp(rng, depth - 1), randomRexp(rng, depth - 1));
+    }
+    else if(choice == 10){
+        return new STAR(randomRexp(rng, depth - 1));
+    }
+    else if(choice == 11){
+        return new NTIMES(randomRexp(rng, depth - 1), rng.below(4));
+    }
+    else if(choice == 12){
+        return new PLUS(randomRexp(rng, depth - 1));
+    }
+    else if(choice == 13){
+        return new OPTIONAL(randomRexp(rng, depth - 1));
+    }
+    else{
+        return new RECD("x" + std::to_string(rng.below(3)), randomRexp(rng, depth - 1));
+    }
+}
+
+// Returns a random specification: either a single RECD, or a lexer made of a star over a few
+// named rules like WHILE_REGS.
+Rexp* randomSpec(FuzzRandom & rng){
+    if(rng.below(3) == 0){
+        return new RECD("t", randomRexp(rng, 5));
+    }
+    deque<Rexp*> rules = deque<Rexp*>{};
+    int count = 1 + rng.below(3);
+    for(int i = 0; i < count; ++i){
+        rules.push_back(new RECD(string(1, 'p' + i), randomRexp(rng, 4)));
+    }
+    return new STAR(listToALT(rules));
+}
+
+// Returns a random string of at most maxLength characters, mostly from FUZZ_ALPHABET.
+string randomString(FuzzRandom & rng, int maxLength){
+    int length = rng.below(maxLength + 1);
+    string s = "";
+    for(int i = 0; i < length; ++i){
+        s += (rng.below(20) == 0) ? 'z' : FUZZ_ALPHABET[rng.below(FUZZ_ALPHABET.size())];
+    }
+    return s;
+}
+
+// Returns the regular expression r in the usual notation, with RECDs written as (?<x>r).
+string rexpToString(Rexp* r){
+    string name = r->name;
+    if(name == "ZERO"){
+        return "0";
+    }
+    else if(name == "ONE"){
+        return "1";
+    }
+    else if(name == "CHAR"){
+        return string(1, static_cast<CHAR*>(r)->c);
+    }
+    else if(name == "CHARSET"){
+        string out = "[";
+        for(int c = 0; c < 256; ++c){
+            if(static_cast<CHARSET*>(r)->cs.test(c)){
+                out += (char) c;
+            }
+        }
+        return out + "]";
+    }
+    else if(name == "LITERAL"){
+        return "\"" + static_cast<LITERAL*>(r)->s + "\"";
+    }
+    else if(name == "ALT"){
+        ALT* rexp = static_cast<ALT*>(r);
+        return "(" + rexpToString(rexp->r1) + "|" + rexpToString(rexp->r2) + ")";
+    }
+    else if(name == "SEQ"){
+        SEQ* rexp = static_cast<SEQ*>(r);
+        return "(" + rexpToString(rexp->r1) + rexpToString(rexp->r2) + ")";
+    }
+    else if(name == "STAR"){
+        return rexpToString(static_cast<STAR*>(r)->rs) + "*";
+    }
+    else if(name == "NTIMES"){
+        NTIMES* rexp = static_cast<NTIMES*>(r);
+        return rexpToString(rexp->rs) + "{" + std::to_string(rexp->n) + "}";
+    }
+    else if(name == "PLUS"){
+        return rexpToString(static_cast<PLUS*>(r)->rs) + "+";
+    }
+    else if(name == "OPTIONAL"){
+        return rexpToString(static_cast<OPTIONAL*>(r)->rs) + "?";
+    }
+    else if(name == "RECD"){
+        RECD* rexp = static_cast<RECD*>(r);
+        return "(?<" + rexp->x + ">" + rexpToString(rexp->r) + ")";
+    }
+    return "?";
+}
+
+// Deletes a value built by decode.
+void deleteVal(Val* v){
+    switch(v->tag){
+        case LEFT_VAL:
+            deleteVal(static_cast<Left*>(v)->leftVal);
+            break;
+        case RIGHT_VAL:
+            deleteVal(static_cast<Right*>(v)->rightVal);
+            break;
+        case SEQU_VAL:
+            deleteVal(static_cast<Sequ*>(v)->val1);
+            deleteVal(static_cast<Sequ*>(v)->val2);
+            break;
+        case STARS_VAL:
+            for(size_t i = 0; i < static_cast<Stars*>(v)->vals.size(); ++i){
+                deleteVal(static_cast<Stars*>(v)->vals[i]);
+            }
+            break;
+        case NTIMES_VAL:
+            for(size_t i = 0; i < static_cast<Ntimes*>(v)->vals.size(); ++i){
+                deleteVal(static_cast<Ntimes*>(v)->vals[i]);
+            }
+            break;
+        case REC_VAL:
+            deleteVal(static_cast<Rec*>(v)->v);
+            break;
+        default:
+            break;
+    }
+    delete v;
+}
+
+// Returns the tokens of the value v as they are printed by the fuzzer.
+string envToString(Val* v){
+    deque<pair<string, string>> tokens = env(v);
+    string out = "";
+    for(size_t i = 0; i < tokens.size(); ++i){
+        out += tokens[i].first + ":" + tokens[i].second + " ";
+    }
+    return out;
+}
+
+// Returns the length of the longest prefix of s that r matches, or -1 if none does, from the
+// derivatives of r.
+int longestByDerivatives(Rexp* r, const string & s){
+    vector<ARexp*> nodes = vector<ARexp*>{};
+    vector<ARexp*>* saved = ARexp::arena;
+    ARexp::arena = &nodes;
+    ARexp* a = internalize(r);
+    int longest = nullableBC(a) ? 0 : -1;
+    for(size_t i = 0; i < s.size() && a->name != "AZERO"; ++i){
+        a = simpBC(derBC(s[i], a));
+        if(nullableBC(a)){
+            longest = i + 1;
+        }
+    }
+    DerivativeAutomaton::freeArena(nodes);
+    ARexp::arena = saved;
+    return longest;
+}
+
+// Returns the matches search finds for the rules of r in s, from the derivatives of every rule
+// at every position: the earliest start wins, then the longest match, then the first rule.
+deque<SearchMatch> searchByDerivatives(Rexp* r, const string & s){
+    if(r->name == "STAR"){
+        r = static_cast<STAR*>(r)->rs;
+    }
+    deque<Rexp*> rules = deque<Rexp*>{};
+    collectAlts(r, rules);
+    vector<ARexp*> nodes = vector<ARexp*>{};
+    vector<ARexp*>* saved = ARexp::arena;
+    ARexp::arena = &nodes;
+    deque<SearchMatch> matches = deque<SearchMatch>{};
+    size_t pos = 0;
+    bool found = true;
+    while(found){
+        found = false;
+        SearchMatch best = SearchMatch();
+        for(size_t start = pos; start < s.size() && !found; ++start){
+            for(size_t k = 0; k < rules.size(); ++k){
+                bool named = (rules[k]->name == "RECD");
+                ARexp* a = internalize(named ? static_cast<RECD*>(rules[k])->r : rules[k]);
+                for(size_t i = start; i < s.size() && a->name != "AZERO"; ++i){
+                    a = simpBC(derBC(s[i], a));
+                    if(nullableBC(a) && (!found || i + 1 > best.end)){
+                        best.rule = named ? static_cast<RECD*>(rules[k])->x : "";
+                        best.start = start;
+                        best.end = i + 1;
+                        found = true;
+                    }
+                }
+            }
+        }
+        if(found){
+            matches.push_back(best);
+            pos = best.end;
+        }
+    }
+    DerivativeAutomaton::freeArena(nodes);
+    ARexp::arena = saved;
+    return matches;
+}
+
+// Returns the matches of a search as they are printed by the fuzzer.
+string matchesToString(const deque<SearchMatch> & matches){
+    string out = "";
+    for(size_t i = 0; i < matches.size(); ++i){
+        out += matches[i].rule + "[" + std::to_string(matches[i].start) + "," + std::to_string(matches[i].end) + ") ";
+    }
+    return out;
+}
+
+// Returns the spans of captureBC as they are printed by the fuzzer, like envToString.
+string capturesToString(const vector<Capture> & captures, const string & s){
+    string out = "";
+    for(size_t i = 0; i < captures.size(); ++i){
+        out += *captures[i].name + ":" + s.substr(captures[i].start, captures[i].end - captures[i].start) + " ";
+    }
+    return out;
+}
+
+// Appends the tokens of the outermost RECDs of the value v to out, in the form produced by
+// sdecode. These are the tokens of a binary token stream.
+void outerTokens(Val* v, deque<string> & out){
+    switch(v->tag){
+        case LEFT_VAL:
+            outerTokens(static_cast<Left*>(v)->leftVal, out);
+            break;
+        case RIGHT_VAL:
+            outerTokens(static_cast<Right*>(v)->rightVal, out);
+            break;
+        case SEQU_VAL:
+            outerTokens(static_cast<Sequ*>(v)->val1, out);
+            outerTokens(static_cast<Sequ*>(v)->val2, out);
+            break;
+        case STARS_VAL:
+            for(size_t i = 0; i < static_cast<Stars*>(v)->vals.size(); ++i){
+                outerTokens(static_cast<Stars*>(v)->vals[i], out);
+            }
+            break;
+        case NTIMES_VAL:
+            for(size_t i = 0; i < static_cast<Ntimes*>(v)->vals.size(); ++i){
+                outerTokens(static_cast<Ntimes*>(v)->vals[i], out);
+            }
+            break;
+        case REC_VAL:
+            out.push_back(*static_cast<Rec*>(v)->x + ":" + flattenVal(static_cast<Rec*>(v)->v));
+            break;
+        default:
+            break;
+    }
+}
+
+// Reads a block of binary tokens written with lexemes into the form produced by sdecode.
+deque<string> binaryTokens(const string & block){
+    TokenReader reader = TokenReader(block.data(), block.size());
+    deque<string> tokens = deque<string>{""};
+    BinaryToken t = BinaryToken();
+    while(reader.next(t)){
+        // A block whose lexemes are all empty has no lexemes.
+        tokens.push_back(binaryTokenKind(t) + ":" + ((t.lexeme != nullptr) ? string(t.lexeme, t.length) : ""));
+    }
+    return tokens;
+}
+
+// Lexes s with a new SharedAutomaton of r and sets tokens to the binary tokens it writes, in the
+// form produced by sdecode. Returns false if s does not match. Defined with the lexer service.
+bool sharedTokens(Rexp* r, const string & s, deque<string> & tokens);
+
+// Every engine, set up once for a specification so that it can be run on many strings.
+// The pipelined engine starts a thread per string and is only run when threaded is set.
+class FuzzEngines {
+    public: Rexp* r;
+            DerivativeAutomaton da;
+            GlushkovMatcher glushkov;
+            SpecRewriter rewriter;
+            PikeVM pike;
+            // Only checked when the specification has at most 64 derivative states.
+            MinimalTransducer minimal;
+            RuleSearcher searcher;
+            // Small enough limits that it switches engines, with an unlimited budget, so that it
+            // always finishes.
+            AdaptiveLexer adaptive;
+            bool threaded;
+            FuzzEngines(Rexp* rIn, bool threadedIn)
+            : r(rIn), da(rIn), glushkov(rIn), rewriter(rIn), pike(rIn), minimal(rIn, 64), searcher(rIn), adaptive(rIn, 8, 8, 16), threaded(threadedIn){
+                adaptive.budget = LexBudget();
+
+            }
+
+            // Runs every engine on s and returns how the first one to disagree with blexer2_simp
+            // differs from it, or an empty string if they all agree.
+            string difference(const string & s){
+                vector<ARexp*> nodes = vector<ARexp*>{};
+                ARexp::arena = &nodes;
+                ARexp* a = simpDersBC(stringToList(s), internalize(da.spec));
+                ARexp* plain = simpDersBC(stringToList(s), internalize(r));
+                ARexp* rewritten = simpDersBC(stringToList(s), internalize(rewriter.spec));
+                ARexp* posix = internalize(r);
+                for(size_t i = 0; i < s.size(); ++i){
+                    posix = simpBC(derBC(s[i], posix), false);
+                }
+                string out = compare(s, a, plain, rewritten, posix);
+                DerivativeAutomaton::freeArena(nodes);
+                return out;
+            }
+
+            // Runs every engine on each prefix of s in turn and returns the first difference,
+            // setting failing to the prefix it was found on. The reference derivatives are taken
+            // one character at a time rather than from scratch for every prefix.
+            string prefixDifference(const string & s, string & failing){
+                vector<ARexp*> nodes = vector<ARexp*>{};
+                ARexp::arena = &nodes;
+                ARexp* a = internalize(da.spec);
+                ARexp* plain = internalize(r);
+                ARexp* rewritten = internalize(rewriter.spec);
+                ARexp* posix = internalize(r);
+                string out = "";
+                for(size_t i = 0; i <= s.size() && out == ""; ++i){
+                    if(i > 0){
+                        // The engines run by compare may have used the arena in the meantime.
+                        ARexp::arena = &nodes;
+                        a = simpBC(derBC(s[i - 1], a));
+                        plain = simpBC(derBC(s[i - 1], plain));
+                        rewritten = simpBC(derBC(s[i - 1], rewritten));
+                        posix = simpBC(derBC(s[i - 1], posix), false);
+                    }
+                    failing = s.substr(0, i);
+                    out = compare(failing, a, plain, rewritten, posix);
+                }
+                DerivativeAutomaton::freeArena(nodes);
+                return out;
+            }
+
+            // Compares every engine on s with the derivatives a of the optimised specification,
+            // which give the reference bitcode as in blexer2_simp, plain of the specification
+            // as it was written, rewritten of the specification rewritten by SpecRewriter and
+            // posix of the specification without the ASEQ distribution, which give the POSIX value.
+            string compare(const string & s, ARexp* a, ARexp* plain, ARexp* rewritten, ARexp* posix){
+                ARexp::arena = nullptr;
+                bool matched = nullableBC(a);
+                deque<bool> bits = matched ? mkepsBC(a) : deque<bool>{};
+                bool plainMatched = nullableBC(plain);
+                deque<bool> plainBits = plainMatched ? mkepsBC(plain) : deque<bool>{};
+                if(plainMatched != matched){
+                    return "optimiseSpec: match " + std::to_string(matched) + ", unoptimised match " + std::to_string(plainMatched);
+                }
+                if(nullableBC(rewritten) != plainMatched){
+                    return "rewriter: match " + std::to_string(!plainMatched) + ", expected " + std::to_string(plainMatched);
+                }
+                if(plainMatched){
+                    deque<bool> rewrittenBits = mkepsBC(rewritten);
+                    deque<bool> translated = rewriter.translate(rewrittenBits);
+                    if(translated != plainBits){
+                        return "rewriter: bits " + listToString(translated) + ", expected " + listToString(plainBits);
+                    }
+                }
+                if(nullableBC(posix) != matched){
+                    return "posix derivatives: match " + std::to_string(!matched) + ", expected " + std::to_string(matched);
+                }
+                deque<bool> pikeBits = deque<bool>{};
+                if(pike.run(s, pikeBits) != matched){
+                    return "pike: match " + std::to_string(!matched) + ", expected " + std::to_string(matched);
+                }
+                if(matched && pikeBits != mkepsBC(posix)){
+                    return "pike: bits " + listToString(pikeBits) + ", expected " + listToString(mkepsBC(posix));
+                }
+                if(glushkov.matches(s) != matched){
+                    return "glushkov: match " + std::to_string(!matched) + ", expected " + std::to_string(matched);
+                }
+                int longest = longestByDerivatives(da.spec, s);
+                if(glushkov.longestMatch(s) != longest){
+                    return "glushkov: longest match " + std::to_string(glushkov.longestMatch(s)) + ", expected " + std::to_string(longest);
+                }
+                deque<SearchMatch> found = deque<SearchMatch>{};
+                SearchMatch match = SearchMatch();
+                size_t pos = 0;
+                while(searcher.nextMatch(s.data(), s.data() + s.size(), pos, match)){
+                    found.push_back(match);
+                }
+                string searched = matchesToString(found);
+                string expectedMatches = matchesToString(searchByDerivatives(r, s));
+                if(searched != expectedMatches){
+                    return "search: matches " + searched + ", expected " + expectedMatches;
+                }
+                deque<string> shared = deque<string>{};
+                if(sharedTokens(r, s, shared) != matched){
+                    return "shared automaton: match " + std::to_string(!matched) + ", expected " + std::to_string(matched);
+                }
+                LexBudget budget = LexBudget();
+                LexOutcome outcome = LexOutcome();
+                deque<string> budgeted = deque<string>{};
+                if(blexer_budgeted(r, s, budget, budgeted, outcome) != matched){
+                    return "budgeted: match " + std::to_string(!matched) + ", expected " + std::to_string(matched) + " (" + lexStatusName(outcome.status) + ")";
+                }
+                AdaptiveEngine engine;
+                deque<string> adapted = deque<string>{};
+                if(adaptive.lex(s, engine, adapted, outcome) != matched){
+                    return "adaptive: match " + std::to_string(!matched) + ", expected " + std::to_string(matched) + " (" + adaptiveEngineName(engine) + ", " + lexStatusName(outcome.status) + ")";
+                }
+
+                BitRopes ropes = BitRopes();
+                vector<int> regs = initialRegisters(da, ropes);
+                vector<int> next = vector<int>{};
+                vector<int> states = vector<int>{0};
+                for(size_t i = 0; i < s.size(); ++i){
+                    DerTransition* t = da.transition(states.back(), s[i]);
+                    takeTransition(t, ropes, regs, next);
+                    states.push_back(t->target);
+                }
+                if(da.nullable[states.back()] != matched){
+                    return "automaton: match " + std::to_string(!matched) + ", expected " + std::to_string(matched);
+                }
+                deque<bool> minimised = deque<bool>{};
+                if(minimal.complete && minimalBits(minimal, s, minimised) != matched){
+                    return "minimal: match " + std::to_string(!matched) + ", expected " + std::to_string(matched);
+                }
+                deque<bool> flat = deque<bool>{};
+                if(flatBits(da.spec, s, flat) != matched){
+                    return "flat: match " + std::to_string(!matched) + ", expected " + std::to_string(matched);
+                }
+                if(!matched){
+                    return "";
+                }
+                deque<bool> automatonBits = deque<bool>{};
+                ropes.flatten(ropes.run(da.finals[states.back()], regs), automatonBits);
+                if(automatonBits != bits){
+                    return "automaton: bits " + listToString(automatonBits) + ", expected " + listToString(bits);
+                }
+                deque<bool> backBits = backwardBits(da, s, states);
+                if(backBits != bits){
+                    return "backward: bits " + listToString(backBits) + ", expected " + listToString(bits);
+                }
+                if(flat != bits){
+                    return "flat: bits " + listToString(flat) + ", expected " + listToString(bits);
+                }
+                if(minimal.complete && minimised != bits){
+                    return "minimal: bits " + listToString(minimised) + ", expected " + listToString(bits);
+                }
+
+                deque<string> tokens = sdecode(da.spec, bits);
+                StreamDecoder decoder = StreamDecoder(da.spec);
+                decoder.feed(bits);
+                if(decoder.tokens != tokens){
+                    return "stream decoder: tokens " + listToString(decoder.tokens) + ", expected " + listToString(tokens);
+                }
+                if(budgeted != tokens){
+                    return "budgeted: tokens " + listToString(budgeted) + ", expected " + listToString(tokens);
+                }
+                if(adapted != tokens){
+                    return "adaptive: tokens " + listToString(adapted) + ", expected " + listToString(tokens) + " (" + adaptiveEngineName(engine) + ")";
+                }
+                Val* v = decode(da.spec, bits).first;
+                Val* plainV = decode(r, plainBits).first;
+                string value = envToString(v);
+                string plainValue = envToString(plainV);
+                deque<string> outer = deque<string>{""};
+                outerTokens(v, outer);
+                deleteVal(v);
+                deleteVal(plainV);
+                if(plainValue != value){
+                    return "optimiseSpec: value " + value + ", unoptimised value " + plainValue;
+                }
+                vector<Capture> captures = vector<Capture>{};
+                captureBC(da.spec, bits, captures);
+                if(capturesToString(captures, s) != value){
+                    return "captures: spans " + capturesToString(captures, s) + ", expected " + value;
+                }
+                TokenWriter writer = TokenWriter(true);
+                blexer_binary(r, s.data(), s.data() + s.size(), 0, writer);
+                deque<string> binary = binaryTokens(writer.block());
+                if(binary != outer){
+                    return "binary tokens: tokens " + listToString(binary) + ", expected " + listToString(outer);
+                }
+                if(shared != outer){
+                    return "shared automaton: tokens " + listToString(shared) + ", expected " + listToString(outer);
+                }
+                if(threaded){
+                    vector<ARexp*> nodes = vector<ARexp*>{};
+                    ARexp::arena = &nodes;
+                    deque<string> pipelined = blexer_pipelined(r, s);
+                    DerivativeAutomaton::freeArena(nodes);
+                    if(pipelined != tokens){
+                        return "pipelined: tokens " + listToString(pipelined) + ", expected " + listToString(tokens);
+                    }
+                }
+                return "";
+            }
+};
+
+// Appends to out the regular expressions obtained from r by replacing one compound
+// subexpression with something smaller: ONE, or one of its own subexpressions.
+void shrinkRexp(Rexp* r, vector<Rexp*> & out){
+    string name = r->name;
+    if(name != "ONE" && name != "ZERO" && name != "CHAR" && name != "CHARSET"){
+        out.push_back(new ONE());
+    }
+    vector<Rexp*> smaller = vector<Rexp*>{};
+    if(name == "LITERAL"){
+        string & word = static_cast<LITERAL*>(r)->s;
+        out.push_back(stringToSEQ(word.substr(0, word.size() - 1)));
+    }
+    else if(name == "ALT" || name == "SEQ"){
+        Rexp* r1 = (name == "ALT") ? static_cast<ALT*>(r)->r1 : static_cast<SEQ*>(r)->r1;
+        Rexp* r2 = (name == "ALT") ? static_cast<ALT*>(r)->r2 : static_cast<SEQ*>(r)->r2;
+        out.push_back(r1);
+        out.push_back(r2);
+        shrinkRexp(r1, smaller);
+        for(size_t i = 0; i < smaller.size(); ++i){
+            out.push_back((name == "ALT") ? (Rexp*) new ALT(smaller[i], r2) : (Rexp*) new SEQ(smaller[i], r2));
+        }
+        smaller.clear();
+        shrinkRexp(r2, smaller);
+        for(size_t i = 0; i < smaller.size(); ++i){
+            out.push_back((name == "ALT") ? (Rexp*) new ALT(r1, smaller[i]) : (Rexp*) new SEQ(r1, smaller[i]));
+        }
+    }
+    else if(name == "STAR"){
+        STAR* rexp = static_cast<STAR*>(r);
+        out.push_back(rexp->rs);
+        shrinkRexp(rexp->rs, smaller);
+        for(size_t i = 0; i < smaller.size(); ++i){
+            out.push_back(new STAR(smaller[i]));
+        }
+    }
+    else if(name == "NTIMES"){
+        NTIMES* rexp = static_cast<NTIMES*>(r);
+        out.push_back(rexp->rs);
+        if(rexp->n > 0){
+            out.push_back(new NTIMES(rexp->rs, rexp->n - 1));
+        }
+        shrinkRexp(rexp->rs, smaller);
+        for(size_t i = 0; i < smaller.size(); ++i){
+            out.push_back(new NTIMES(smaller[i], rexp->n));
+        }
+    }
+    else if(name == "PLUS"){
+        PLUS* rexp = static_cast<PLUS*>(r);
+        out.push_back(rexp->rs);
+        shrinkRexp(rexp->rs, smaller);
+        for(size_t i = 0; i < smaller.size(); ++i){
+            out.push_back(new PLUS(smaller[i]));
+        }
+    }
+    else if(name == "OPTIONAL"){
+        OPTIONAL* rexp = static_cast<OPTIONAL*>(r);
+        out.push_back(rexp->rs);
+        shrinkRexp(rexp->rs, smaller);
+        for(size_t i = 0; i < smaller.size(); ++i){
+            out.push_back(new OPTIONAL(smaller[i]));
+        }
+    }
+    else if(name == "RECD"){
+        RECD* rexp = static_cast<RECD*>(r);
+        out.push_back(rexp->r);
+        shrinkRexp(rexp->r, smaller);
+        for(size_t i = 0; i < smaller.size(); ++i){
+            out.push_back(new RECD(rexp->x, smaller[i]));
+        }
+    }
+}
+
+// Size of a specification for shrinking: its nodes, with an NTIMES counting its repetitions and
+// a LITERAL its characters. Every candidate of shrinkRexp is smaller, so shrinking terminates.
+int fuzzSize(Rexp* r){
+    string name = r->name;
+    if(name == "LITERAL"){
+        return static_cast<LITERAL*>(r)->s.size();
+    }
+    else if(name == "ALT"){
+        return 1 + fuzzSize(static_cast<ALT*>(r)->r1) + fuzzSize(static_cast<ALT*>(r)->r2);
+    }
+    else if(name == "SEQ"){
+        return 1 + fuzzSize(static_cast<SEQ*>(r)->r1) + fuzzSize(static_cast<SEQ*>(r)->r2);
+    }
+    else if(name == "STAR"){
+        return 1 + fuzzSize(static_cast<STAR*>(r)->rs);
+    }
+    else if(name == "PLUS"){
+        return 1 + fuzzSize(static_cast<PLUS*>(r)->rs);
+    }
+    else if(name == "OPTIONAL"){
+        return 1 + fuzzSize(static_cast<OPTIONAL*>(r)->rs);
+    }
+    else if(name == "NTIMES"){
+        return 1 + static_cast<NTIMES*>(r)->n + fuzzSize(static_cast<NTIMES*>(r)->rs);
+    }
+    else if(name == "RECD"){
+        return 1 + fuzzSize(static_cast<RECD*>(r)->r);
+    }
+    return 1;
+}
+
+// Shrinks the specification r and the string s for as long as some engine still disagrees with
+// the reference on them, then prints them together with the difference.
+void reportMismatch(Rexp* r, string s){
+    bool smaller = true;
+    while(smaller){
+        smaller = false;
+        vector<Rexp*> candidates = vector<Rexp*>{};
+        shrinkRexp(r, candidates);
+        for(size_t i = 0; i < candidates.size() && !smaller; ++i){
+            FuzzEngines engines = FuzzEngines(candidates[i], true);
+            if(engines.difference(s) != ""){
+                r = candidates[i];
+                smaller = true;
+            }
+        }
+        FuzzEngines engines = FuzzEngines(r, true);
+        for(size_t i = 0; i < s.size() && !smaller; ++i){
+            string shorter = s.substr(0, i) + s.substr(i + 1);
+            if(engines.difference(shorter) != ""){
+                s = shorter;
+                smaller = true;
+            }
+        }
+    }
+    FuzzEngines engines = FuzzEngines(r, true);
+    cout << "specification: " << rexpToString(r) << endl;
+    cout << "string: \"" << s << "\"" << endl;
+    cout << engines.difference(s) << endl;
+}
+
+// What one fuzzing worker did, and the first mismatch it found.
+class FuzzResult {
+    public: unsigned long cases;
+            unsigned long specs;
+            Rexp* r;
+            string s;
+            string difference;
+            FuzzResult()
+            : cases(0), specs(0), r(nullptr), s(""), difference(""){
+
+            }
+};
+
+// Fuzzes every engine with random specifications from seed, casesPerSpec strings each, until
+// specs specifications have been tried or seconds have passed (whichever limit is not 0), or
+// until stop is set. Every prefix of a string is a case. Sets stop on a mismatch.
+void fuzzWorker(uint64_t seed, unsigned long specs, double seconds, int casesPerSpec, bool threaded, FuzzResult & result, std::atomic<bool> & stop){
+    FuzzRandom rng = FuzzRandom(seed);
+    auto startTime = high_resolution_clock::now();
+    double elapsed = 0;
+    while((specs == 0 || result.specs < specs) && (seconds == 0 || elapsed < seconds) && !stop.load()){
+        Rexp* r = randomSpec(rng);
+        FuzzEngines engines = FuzzEngines(r, threaded);
+        for(int i = 0; i < casesPerSpec && (seconds == 0 || elapsed < seconds); ++i){
+            string s = randomString(rng, 12);
+            string failing = "";
+            string difference = engines.prefixDifference(s, failing);
+            if(difference != ""){
+                result.cases += failing.size() + 1;
+                result.r = r;
+                result.s = failing;
+                result.difference = difference;
+                stop.store(true);
+                return;
+            }
+            result.cases += s.size() + 1;
+            elapsed = duration_cast<std::chrono::nanoseconds>(high_resolution_clock::now() - startTime).count() / 1e9;
+        }
+        result.specs++;
+    }
+}
+
+// Runs workers fuzzing threads, worker i starting from seed + i, with the limits of fuzzWorker
+// applying to each. Prints the throughput and returns false, after reporting the first mismatch
+// shrunk, if any engine disagreed with the reference.
+bool fuzzEngines(uint64_t seed, unsigned long specs, double seconds, int casesPerSpec, bool threaded, int workers){
+    auto startTime = high_resolution_clock::now();
+    vector<FuzzResult> results = vector<FuzzResult>(workers);
+    std::atomic<bool> stop(false);
+    vector<std::thread> threads = vector<std::thread>{};
+    for(int i = 1; i < workers; ++i){
+        threads.push_back(std::thread(fuzzWorker, seed + i, specs, seconds, casesPerSpec, threaded, std::ref(results[i]), std::ref(stop)));
+    }
+    fuzzWorker(seed, specs, seconds, casesPerSpec, threaded, results[0], stop);
+    for(size_t i = 0; i < threads.size(); ++i){
+        threads[i].join();
+    }
+    double elapsed = duration_cast<std::chrono::nanoseconds>(high_resolution_clock::now() - startTime).count() / 1e9;
+    unsigned long cases = 0;
+    unsigned long specsTried = 0;
+    for(int i = 0; i < workers; ++i){
+        cases += results[i].cases;
+        specsTried += results[i].specs;
+    }
+    cout << cases << " cases (" << specsTried << " specifications, " << workers << " workers) in " << elapsed << " seconds, "
+         << (unsigned long) (cases / elapsed * 60) << " cases per minute" << endl;
+    for(int i = 0; i < workers; ++i){
+        if(results[i].r != nullptr){
+            cout << "mismatch (seed " << seed + i << ", specification " << results[i].specs << "): " << results[i].difference << endl;
+            reportMismatch(results[i].r, results[i].s);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// *** LEXER SERVICE ***
+// A resident lexer, so that a tokenisation does not pay for building the specification and for
+// cold derivatives. The specification is compiled into one derivative automaton, warmed on a
+// sample input when the service starts and shared by a pool of workers. Clients connect to a Unix domain socket and
+// send frames made of a type byte and a 4-byte little-endian length, followed by the payload:
+//   'L' lexes the payload, 'S' asks for statistics and 'Q' stops the service.
+// Every frame is answered, in order, by a frame of a status byte ('K' or 'E') and a length: a lex
+// answer holds a binary token block without lexemes, a statistics answer a line of text. The
+// frames that have arrived on any connection by the time the service looks form one batch,
+// which the workers lex in parallel. Client sockets do not block: answers wait in a buffer of
+// their client until it reads them, so a client that stops reading delays only itself.
+
+// Most bytes a frame may hold; a client sending a longer frame is disconnected.
+const uint32_t SERVICE_MAX_FRAME = 1 << 28;
+
+// Most bytes of answers the service holds for a client before it stops reading its requests.
+const size_t SERVICE_MAX_PENDING = 1 << 24;
+
+// Histogram of latencies in nanoseconds, with eight buckets per power of two, so that
+// percentiles are accurate to within 12.5%.
+class LatencyHistogram {
+    public: vector<unsigned long> buckets;
+            unsigned long count;
+            LatencyHistogram()
+            : buckets(vector<unsigned long>(64 * 8, 0)), count(0){
+
+            }
+
+            void add(uint64_t ns){
+                buckets[bucket(ns)]++;
+                count++;
+            }
+
+            // Returns the smallest latency of the bucket holding the p-th percentile.
+            uint64_t percentile(double p){
+                unsigned long rank = (unsigned long) (p / 100 * count);
+                unsigned long seen = 0;
+                for(size_t i = 0; i < buckets.size(); ++i){
+                    seen += buckets[i];
+                    if(seen > rank){
+                        return lowest(i);
+                    }
+                }
+                return 0;
+            }
+
+    private: static int bucket(uint64_t ns){
+                if(ns < 8){
+                    return ns;
+                }
+                int e = 63 - __builtin_clzll(ns);
+                return (e - 2) * 8 + ((ns >> (e - 3)) & 7);
+            }
+
+            static uint64_t lowest(int i){
+                if(i < 8){
+                    return i;
+                }
+                int e = i / 8 + 2;
+                return ((uint64_t) 1 << e) | ((uint64_t) (i % 8) << (e - 3));
+            }
+};
+
+// A derivative automaton shared by several threads. Cached transitions are followed under a
+// shared lock; a transition that has not been computed yet is added under the exclusive lock.
+class SharedAutomaton {
+    public: DerivativeAutomaton da;
+            std::shared_mutex lock;
+            SharedAutomaton(Rexp* r)
+            : da(r){
+
+            }
+
+            // Lexes the input between begin and end like blexer2_simp and adds the tokens to out.
+            // Returns false if it does not match.
+            bool lex(const char* begin, const char* end, TokenWriter & out){
+                LexBudget budget = LexBudget();
+                LexOutcome outcome = LexOutcome();
+                return lex(begin, end, out, budget, outcome);
+            }
+
+            // Like lex, but within the budget. The nodes of a state stand for the live nodes of a
+            // derivative and the bitcode for the bits; the CPU time is read every 64 steps.
+            bool lex(const char* begin, const char* end, TokenWriter & out, LexBudget & budget, LexOutcome & outcome){
+                long startCpu = threadCpuNanoseconds();
+                outcome = LexOutcome();
+                string s = string(begin, end);
+                vector<int> states = vector<int>{0};
+                std::shared_lock<std::shared_mutex> reader(lock);
+                for(size_t i = 0; i < s.size(); ++i){
+                    outcome.position = i;
+                    outcome.status = (i >= budget.maxSteps) ? LEX_STEPS : ((i & 63) == 0) ? checkLimits(budget, startCpu, outcome) : LEX_OK;
+                    if(outcome.status != LEX_OK){
+                        return false;
+                    }
+                    DerTransition* t = da.transitions[states.back()][(unsigned char) s[i]];
+                    if(t == nullptr){
+                        reader.unlock();
+                        {
+                            std::unique_lock<std::shared_mutex> writer(lock);
+                            t = da.transition(states.back(), s[i]);
+                        }
+                        reader.lock();
+                    }
+                    if(da.dead[t->target]){
+                        outcome.status = LEX_NO_MATCH;
+                        return false;
+                    }
+                    outcome.liveNodes = std::max(outcome.liveNodes, (size_t) da.sizes[t->target]);
+                    if((size_t) da.sizes[t->target] > budget.maxLiveNodes){
+                        outcome.status = LEX_LIVE_NODES;
+                        return false;
+                    }
+                    states.push_back(t->target);
+                }
+                outcome.position = s.size();
+                if(!da.nullable[states.back()]){
+                    outcome.status = LEX_NO_MATCH;
+                    return false;
+                }
+                deque<bool> bs = backwardBits(da, s, states);
+                reader.unlock();
+                outcome.bits = bs.size();
+                outcome.status = (bs.size() > budget.maxBits) ? LEX_BITS : checkLimits(budget, startCpu, outcome);
+                if(outcome.status != LEX_OK){
+                    return false;
+                }
+                vector<Capture> captures = vector<Capture>{};
+                captureBC(da.spec, bs, captures);
+                for(size_t i = 0; i < captures.size(); ++i){
+                    if(captures[i].depth == 0){
+                        out.add(*captures[i].name, captures[i].start, captures[i].end - captures[i].start, begin);
+                    }
+                }
+                return true;
+            }
+};
+
+bool sharedTokens(Rexp* r, const string & s, deque<string> & tokens){
+    SharedAutomaton shared = SharedAutomaton(r);
+    TokenWriter writer = TokenWriter(true);
+    if(!shared.lex(s.data(), s.data() + s.size(), writer)){
+        return false;
+    }
+    tokens = binaryTokens(writer.block());
+    return true;
+}
+
+// A connection to the service: the bytes received that do not form a whole frame yet, and the
+// answers that the client has not read yet, of which the first sent bytes have gone.
+class ServiceClient {
+    public: string input;
+            string output;
+            size_t sent;
+            ServiceClient()
+            : input(""), output(""), sent(0){
+
+            }
+
+            // Sends as much of the output as the socket fd takes without blocking. Returns false
+            // if the connection is gone.
+            bool flush(int fd){
+                while(sent < output.size()){
+                    ssize_t n = send(fd, output.data() + sent, output.size() - sent, MSG_NOSIGNAL);
+                    if(n < 0 && errno == EINTR){
+                        continue;
+                    }
+                    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                        break;
+                    }
+                    if(n <= 0){
+                        return false;
+                    }
+                    sent += n;
+                }
+                if(sent == output.size()){
+                    output.clear();
+                    sent = 0;
+                }
+                return true;
+            }
+
+            size_t pending(){
+                return output.size() - sent;
+            }
+};
+
+// A frame received by the service and the answer to it. client is the index of the connection
+// in the poll set of the service.
+class ServiceRequest {
+    public: size_t client;
+            char type;
+            string payload;
+            high_resolution_clock::time_point arrived;
+            char status;
+            string answer;
+            ServiceRequest(size_t clientIn, char typeIn, string payloadIn)
+            : client(clientIn), type(typeIn), payload(payloadIn), arrived(high_resolution_clock::now()), status('K'), answer(""){
+
+            }
+};
+
+// Writes all of data to fd. Returns false if the connection is gone.
+bool sendAll(int fd, const char* data, size_t size){
+    while(size > 0){
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if(n <= 0){
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Reads exactly size bytes from fd into out. Returns false if the connection is closed first.
+bool receiveAll(int fd, char* out, size_t size){
+    while(size > 0){
+        ssize_t n = recv(fd, out, size, 0);
+        if(n <= 0){
+            return false;
+        }
+        out += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Returns the frame of the given type or status and payload.
+string frameBytes(char type, const string & payload){
+    string frame = string(1, type);
+    uint32_t n = payload.size();
+    for(int i = 0; i < 4; ++i){
+        frame += (char) ((n >> (8 * i)) & 0xff);
+    }
+    frame += payload;
+    return frame;
+}
+
+// Sends a frame of the given type or status and payload to fd.
+bool sendFrame(int fd, char type, const string & payload){
+    string frame = frameBytes(type, payload);
+    return sendAll(fd, frame.data(), frame.size());
+}
+
+class LexerService {
+    public: SharedAutomaton automaton;
+            string path;
+            int listener;
+            LatencyHistogram latencies;
+            unsigned long batches;
+            // The limits of every 'L' request; a request that exceeds them is answered with an
+            // error naming the limit. Unlimited unless set before listen.
+            LexBudget budget;
+            LexerService(Rexp* r, string pathIn, int workersIn)
+            : automaton(r), path(pathIn), listener(-1), batches(0), budget(),
+              workers(workersIn), batch(nullptr), next(0), done(0), generation(0), stopping(false){
+
+            }
+
+            ~LexerService(){
+                {
+                    std::lock_guard<std::mutex> guard(poolLock);
+                    stopping = true;
+                }
+                wake.notify_all();
+                for(size_t i = 0; i < pool.size(); ++i){
+                    pool[i].join();
+                }
+                if(listener != -1){
+                    close(listener);
+                    unlink(path.c_str());
+                }
+            }
+
+            LexerService(const LexerService & other) = delete;
+            LexerService & operator= (const LexerService & other) = delete;
+
+            // Warms the automaton by lexing warmup, starts the workers and starts listening on the
+            // socket, so that clients can connect as soon as it returns. Returns false if there
+            // are no workers or the socket cannot be opened.
+            bool listen(const string & warmup){
+                if(workers < 1){
+                    cout << "the lexer service needs at least one worker" << endl;
+                    return false;
+                }
+                TokenWriter writer = TokenWriter(false);
+                automaton.lex(warmup.data(), warmup.data() + warmup.size(), writer);
+                sockaddr_un address = sockaddr_un();
+                address.sun_family = AF_UNIX;
+                if(path.size() >= sizeof(address.sun_path)){
+                    cout << "socket path too long: " << path << endl;
+                    return false;
+                }
+                strcpy(address.sun_path, path.c_str());
+                unlink(path.c_str());
+                listener = socket(AF_UNIX, SOCK_STREAM, 0);
+                if(listener == -1 || bind(listener, (sockaddr*) &address, sizeof(address)) != 0 || ::listen(listener, 64) != 0){
+                    cout << "could not listen on " << path << endl;
+                    return false;
+                }
+                for(int i = 0; i < workers; ++i){
+                    pool.push_back(std::thread(&LexerService::work, this));
+                }
+                return true;
+            }
+
+            // Serves clients until one sends 'Q'.
+            void run(){
+                vector<pollfd> fds = vector<pollfd>{pollfd{listener, POLLIN, 0}};
+                vector<ServiceClient> clients = vector<ServiceClient>{ServiceClient()};
+                bool quit = false;
+                while(!quit){
+                    if(poll(fds.data(), fds.size(), -1) < 0){
+                        continue;
+                    }
+                    vector<ServiceRequest> requests = vector<ServiceRequest>{};
+                    for(size_t i = 1; i < fds.size(); ++i){
+                        bool gone = (fds[i].revents & (POLLERR | POLLNVAL)) != 0;
+                        if(!gone && (fds[i].revents & POLLOUT)){
+                            gone = !clients[i].flush(fds[i].fd);
+                        }
+                        if(!gone && (fds[i].revents & (POLLIN | POLLHUP))){
+                            gone = !receiveFrames(fds[i].fd, i, clients[i].input, requests);
+                        }
+                        if(gone){
+                            close(fds[i].fd);
+                            fds[i].fd = -1;
+                        }
+                    }
+                    if(fds[0].revents & POLLIN){
+                        int client = accept(listener, nullptr, nullptr);
+                        if(client != -1){
+                            fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+                            fds.push_back(pollfd{client, POLLIN, 0});
+                            clients.push_back(ServiceClient());
+                        }
+                    }
+                    if(requests.size() > 0){
+                        runBatch(requests);
+                        batches++;
+                    }
+                    for(size_t i = 0; i < requests.size(); ++i){
+                        ServiceRequest & request = requests[i];
+                        if(request.type == 'S'){
+                            request.answer = statistics();
+                        }
+                        else if(request.type == 'Q'){
+                            quit = true;
+                        }
+                        else if(request.type != 'L'){
+                            request.status = 'E';
+                            request.answer = "unknown request type";
+                        }
+                        if(fds[request.client].fd != -1){
+                            clients[request.client].output += frameBytes(request.status, request.answer);
+                        }
+                        latencies.add(duration_cast<std::chrono::nanoseconds>(high_resolution_clock::now() - request.arrived).count());
+                    }
+                    // Sends what each client takes now and waits for the rest until it can take
+                    // more; a client holding too many unread answers is not read from meanwhile.
+                    for(size_t i = fds.size() - 1; i >= 1; --i){
+                        if(fds[i].fd != -1 && !clients[i].flush(fds[i].fd)){
+                            close(fds[i].fd);
+                            fds[i].fd = -1;
+                        }
+                        if(fds[i].fd == -1){
+                            fds.erase(fds.begin() + i);
+                            clients.erase(clients.begin() + i);
+                            continue;
+                        }
+                        fds[i].events = (clients[i].pending() < SERVICE_MAX_PENDING) ? POLLIN : 0;
+                        if(clients[i].pending() > 0){
+                            fds[i].events |= POLLOUT;
+                        }
+                    }
+                }
+                for(size_t i = 1; i < fds.size(); ++i){
+                    close(fds[i].fd);
+                }
+            }
+
+            // Returns the request count, the batch count, the latency percentiles and the number
+            // of derivative states.
+            string statistics(){
+                std::shared_lock<std::shared_mutex> reader(automaton.lock);
+                return "requests " + std::to_string(latencies.count) + " batches " + std::to_string(batches)
+                       + " p50 " + std::to_string(latencies.percentile(50) / 1000) + "us p99 " + std::to_string(latencies.percentile(99) / 1000)
+                       + "us states " + std::to_string(automaton.da.keys.size());
+            }
+
+    private: int workers;
+            vector<std::thread> pool;
+            std::mutex poolLock;
+            std::condition_variable wake;
+            std::condition_variable finished;
+            vector<ServiceRequest>* batch;
+            size_t next;
+            size_t done;
+            unsigned long generation;
+            bool stopping;
+
+            // Reads what the client at index client with socket fd has sent into its input and
+            // moves the complete frames in it to requests. Returns false if the client has gone or
+            // sent a frame that is too long.
+            bool receiveFrames(int fd, size_t client, string & input, vector<ServiceRequest> & requests){
+                char buffer[65536];
+                ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+                if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+                    return true;
+                }
+                if(n <= 0){
+                    return false;
+                }
+                input.append(buffer, n);
+                size_t pos = 0;
+                while(input.size() - pos >= 5){
+                    uint32_t length = 0;
+                    for(int i = 0; i < 4; ++i){
+                        length |= (uint32_t) (unsigned char) input[pos + 1 + i] << (8 * i);
+                    }
+                    if(length > SERVICE_MAX_FRAME){
+                        return false;
+                    }
+                    if(input.size() - pos - 5 < length){
+                        break;
+                    }
+                    requests.push_back(ServiceRequest(client, input[pos], input.substr(pos + 5, length)));
+                    pos += 5 + length;
+                }
+                input.erase(0, pos);
+                return true;
+            }
+
+            // Lexes the 'L' requests of the batch on the workers and waits until they are done.
+            void runBatch(vector<ServiceRequest> & requests){
+                std::unique_lock<std::mutex> guard(poolLock);
+                batch = &requests;
+                next = 0;
+                done = 0;
+                generation++;
+                wake.notify_all();
+                finished.wait(guard, [this, &requests](){ return done == requests.size(); });
+                batch = nullptr;
+            }
+
+            void work(){
+                unsigned long seen = 0;
+                std::unique_lock<std::mutex> guard(poolLock);
+                while(true){
+                    wake.wait(guard, [this, seen](){ return stopping || (generation != seen && batch != nullptr && next < batch->size()); });
+                    if(stopping){
+                        return;
+                    }
+                    seen = generation;
+                    while(batch != nullptr && next < batch->size()){
+                        ServiceRequest & request = (*batch)[next++];
+                        guard.unlock();
+                        if(request.type == 'L'){
+                            TokenWriter writer = TokenWriter(false);
+                            LexOutcome outcome = LexOutcome();
+                            if(automaton.lex(request.payload.data(), request.payload.data() + request.payload.size(), writer, budget, outcome)){
+                                request.answer = writer.block();
+                            }
+                            else{
+                                request.status = 'E';
+                                request.answer = lexStatusName(outcome.status);
+                            }
+                        }
+                        guard.lock();
+                        if(++done == batch->size()){
+                            finished.notify_one();
+                        }
+                    }
+                }
+            }
+};
+
+// Connects to the service listening at path. Returns the socket, or -1.
+int connectService(const string & path){
+    sockaddr_un address = sockaddr_un();
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path)){
+        return -1;
+    }
+    strcpy(address.sun_path, path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd == -1 || connect(fd, (sockaddr*) &address, sizeof(address)) != 0){
+        if(fd != -1){
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// Reads the answer to a frame sent to the service on fd. Returns false if the connection failed.
+bool receiveAnswer(int fd, char & status, string & answer){
+    char header[5];
+    if(!receiveAll(fd, header, 5)){
+        return false;
+    }
+    uint32_t length = 0;
+    for(int i = 0; i < 4; ++i){
+        length |= (uint32_t) (unsigned char) header[1 + i] << (8 * i);
+    }
+    status = header[0];
+    answer = string(length, '\0');
+    return receiveAll(fd, &answer[0], length);
+}
+
+// Sends one frame to the service on fd and waits for its answer.
+bool serviceCall(int fd, char type, const string & payload, char & status, string & answer){
+    return sendFrame(fd, type, payload) && receiveAnswer(fd, status, answer);
+}
+
+// Lexes source with the service on fd and appends its tokens to tokens as "name:lexeme"
+// strings, like blexer2_simp. Prints the error and returns false if the service fails.
+bool serviceTokens(int fd, const string & source, deque<string> & tokens){
+    char status;
+    string answer;
+    if(!serviceCall(fd, 'L', source, status, answer)){
+        cout << "lexer service connection failed" << endl;
+        return false;
+    }
+    if(status != 'K'){
+        cout << "lexer service: " << answer << endl;
+        return false;
+    }
+    TokenReader reader = TokenReader(answer.data(), answer.size());
+    BinaryToken t = BinaryToken();
+    while(reader.next(t)){
+        tokens.push_back(binaryTokenKind(t) + ":" + source.substr(t.start, t.length));
+    }
+    return !reader.corrupt;
+}
+
+
+// *** THE FOLLOWING CODE IS FOR TESTING AND EXPERIMENT PURPOSES.***
+
+
+// Performs tests on the simp function to ensure correct output for each if-elseif branch.
+void simpFunctionTest(){
+    bool test1 = (simpBC(new AONE(deque<bool>{}))->equals(new AONE(deque<bool>{})));
+    cout << test1 << endl;
+    bool test2 = (simpBC(new ACHAR(deque<bool>{}, 'z'))->equals(new ACHAR(deque<bool>{}, 'z')));
+    cout << test2 << endl;
+    bool test3 = (simpBC(new ASTAR(deque<bool>{}, new AONE(deque<bool>{false})))->equals(new ASTAR(deque<bool>{}, new AONE(deque<bool>{false}))));
+    cout << test3 << endl;
+    bool test4 = (simpBC(new ANTIMES(deque<bool>{true}, new AONE(deque<bool>{false}), 8))->equals(new ANTIMES(deque<bool>{true}, new AONE(deque<bool>{false}), 8)));
+    cout << test4 << endl;
+    bool test5 = (simpBC(new ASEQ(deque<bool>{true}, new ACHAR(deque<bool>{}, 'b'), new AZERO()))->equals(new AZERO()));
+    cout << test5 << endl;
+    bool test6 = (simpBC(new ASEQ(deque<bool>{true}, new AZERO(), new ACHAR(deque<bool>{}, 'b')))->equals(new AZERO()));
+    cout << test6 << endl;
+    bool test7 = (simpBC(new ASEQ(deque<bool>{true}, new AONE(deque<bool>{false, true}), new ACHAR(deque<bool>{true}, 'b')))->equals(new ACHAR(deque<bool>{true, false, true, true}, 'b')));
+    cout << test7 << endl;
+    bool test8 = (simpBC(new ASEQ(deque<bool>{true}, new AALT(deque<bool>{false}, deque<ARexp*>{new AONE(deque<bool>{}), new ACHAR(deque<bool>{}, 'c')}), new AONE(deque<bool>{false})))->equals(new AALT(deque<bool>{true, false}, deque<ARexp*>{new ASEQ(deque<bool>{}, new AONE(deque<bool>{}), new AONE(deque<bool>{false})), new ASEQ(deque<bool>{}, new ACHAR(deque<bool>{}, 'c'), new AONE(deque<bool>{false}))})));
+    cout << test8 << endl;
+    bool test9 = (simpBC(new AALT(deque<bool>{true}, deque<ARexp*>{}))->equals(new AZERO()));
+    cout << test9 << endl;
+    bool test10 = (simpBC(new AALT(deque<bool>{true}, deque<ARexp*>{new AONE(deque<bool>{false})}))->equals(new AONE(deque<bool>{true, false})));
+    cout << test10 << endl;
+    bool test11 = (simpBC(new AALT(deque<bool>{true}, deque<ARexp*>{new AONE(deque<bool>{false}), new AONE(deque<bool>{true})}))->equals(new AONE(deque<bool>{true, false})));
+    cout << test11 << endl;
+    bool test12 = (simpBC(new AALT(deque<bool>{true}, deque<ARexp*>{new AONE(deque<bool>{false}), new AONE(deque<bool>{true}), new ACHAR(deque<bool>{}, 'a')}))->equals(new AALT(deque<bool>{true}, deque<ARexp*>{new AONE(deque<bool>{false}), new ACHAR(deque<bool>{}, 'a')})));
+    cout << test12 << endl;
+}
+
+// Performs tests on the mkepsBC function to ensure correct output for each if-elseif branch.
+void mkepsFunctionTest(){
+    bool test1 = (mkepsBC(new AONE(deque<bool>{false, true})) == deque<bool>{false, true});
+    cout << test1 << endl;
+    bool test2 = (mkepsBC(new AALT(deque<bool>{false, true}, deque<ARexp*>{new AONE(deque<bool>{true})})) == deque<bool>{false, true, true});
+    cout << test2 << endl;
+    bool test3 = (mkepsBC(new AALT(deque<bool>{false, true}, deque<ARexp*>{new AONE(deque<bool>{true}), new ASTAR(deque<bool>{true}, new ACHAR(deque<bool>{}, 'a'))})) == deque<bool>{false, true, true});
+    cout << test3 << endl;
+    bool test4 = (mkepsBC(new AALT(deque<bool>{false, true}, deque<ARexp*>{new ACHAR(deque<bool>{}, 'a'), new AONE(deque<bool>{false})})) == deque<bool>{false, true, false});
+    cout << test4 << endl;
+    bool test5 = (mkepsBC(new ASEQ(deque<bool>{false, true}, new AONE(deque<bool>{true}), new AONE(deque<bool>{}))) == deque<bool>{false, true, true});
+    cout << test5 << endl;
+    bool test6 = (mkepsBC(new ASTAR(deque<bool>{false}, new ACHAR(deque<bool>{}, 'a'))) == deque<bool>{false, true});
+    cout << test6 << endl;
+    bool test7 = (mkepsBC(new ANTIMES(deque<bool>{false}, new AONE(deque<bool>{false, true}), 0)) == deque<bool>{false});
+    cout << test7 << endl;
+    bool test8 = (mkepsBC(new ANTIMES(deque<bool>{false}, new AONE(deque<bool>{false, true}), 1)) == deque<bool>{false, false, true});
+    cout << test8 << endl;
+    bool test9 = (mkepsBC(new ANTIMES(deque<bool>{false}, new AONE(deque<bool>{false, true}), 5)) == deque<bool>{false, false, true, false, true, false, true, false, true, false, true});
+    cout << test9 << endl;
+}
+
+// Performs tests on the derBC function to ensure correct output for each if-elseif branch.
+void derFunctionTest(){
+    ARexp* AZER = new AZERO();
+    bool test1 = (derBC('a', new AZERO())->equals(AZER));
+    cout << test1 << endl;
+    bool test2 = (derBC('a', new AONE(deque<bool>{}))->equals(AZER));
+    cout << test2 << endl;
+    bool test3 = (derBC('a', new ACHAR(deque<bool>{}, 'a'))->equals(new AONE(deque<bool>{})));
+    cout << test3 << endl;
+    bool test4 = (derBC('a', new ACHAR(deque<bool>{}, 'c'))->equals(AZER));
+    cout << test4 << endl;
+    bool test5 = (derBC('a', new AALT(deque<bool>{false, true}, deque<ARexp*>{AZER, new AONE(deque<bool>{}), new ACHAR(deque<bool>{},'b')}))->equals(new AALT(deque<bool>{false, true}, deque<ARexp*>{AZER, AZER, AZER})));
+    cout << test5 << endl;
+    bool test6 = (derBC('a', new AALT(deque<bool>{false, true}, deque<ARexp*>{AZER, new AONE(deque<bool>{}), new ACHAR(deque<bool>{},'a')}))->equals(new AALT(deque<bool>{false, true}, deque<ARexp*>{AZER, AZER, new AONE(deque<bool>{})})));
+    cout << test6 << endl;
+    bool test7 = (derBC('a', new ASEQ(deque<bool>{}, new ACHAR(deque<bool>{},'a'), new AONE(deque<bool>{})))->equals(new ASEQ(deque<bool>{}, new AONE(deque<bool>{}), new AONE(deque<bool>{}))));
+    cout << test7 << endl;
+    bool test8 = (derBC('a', new ASEQ(deque<bool>{false, true}, new AONE(deque<bool>{false}), new ACHAR(deque<bool>{},'a')))->equals(new AALT(deque<bool>{false, true}, deque<ARexp*>{new ASEQ(deque<bool>{}, AZER, new ACHAR(deque<bool>{}, 'a')), new AONE(deque<bool>{false})})));
+    cout << test8 << endl;
+    bool test9 = (derBC('a', new ANTIMES(deque<bool>{}, new ACHAR(deque<bool>{},'a'), 0))->equals(AZER));
+    cout << test9 << endl;
+    bool test10 = (derBC('a', new ANTIMES(deque<bool>{}, new ACHAR(deque<bool>{},'a'), 1))->equals(new ASEQ(deque<bool>{}, new AONE(deque<bool>{}), new ANTIMES(deque<bool>{}, new ACHAR(deque<bool>{}, 'a'), 0))));
+    cout << test10 << endl;
+    bool test11 = (derBC('a', new ANTIMES(deque<bool>{}, new ACHAR(deque<bool>{},'a'), 2))->equals(new ASEQ(deque<bool>{}, new AONE(deque<bool>{}), new ANTIMES(deque<bool>{}, new ACHAR(deque<bool>{}, 'a'), 1))));
+    cout << test11 << endl;
+    bool test12 = (derBC('a', new ASTAR(deque<bool>{false}, new ACHAR(deque<bool>{}, 'a')))->equals(new ASEQ(deque<bool>{false}, new AONE(deque<bool>{false}), new ASTAR(deque<bool>{}, new ACHAR(deque<bool>{}, 'a')))));
+    cout << test12 << endl;
+}
+
+// Helper function to create a RECD regular expression with a token xIn and 
+// regular expression rIn.
+Rexp* mkRECD(string xIn, Rexp* rIn){
+    return new RECD(xIn, rIn);
+}
+
+// Performs tests on the spec optimiser: the optimised specification must be smaller, must
+// produce the same tokens as the original one and must be made once per specification.
+void optimiseSpecTest(){
+    Rexp* KEYWORD = listToALT(deque<Rexp*>{stringToSEQ("while"), stringToSEQ("write"), stringToSEQ("then"), stringToSEQ("do")});
+    Rexp* ID = new STAR(RANGE("adehilnortw"));
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("k", KEYWORD), mkRECD("i", ID), mkRECD("w", new CHAR(' '))}));
+    string prog = "while do write then whiled wr";
+    bool test1 = (regexSize(optimiseSpec(spec)) < regexSize(spec));
+    cout << test1 << endl;
+    deque<string> expected = sdecode(spec, mkepsBC(simpDersBC(stringToList(prog), internalize(spec))));
+    bool test2 = (blexer2_simp(spec, prog) == expected);
+    cout << test2 << endl;
+    bitset<256> abc;
+    abc.set('a');
+    abc.set('b');
+    abc.set('c');
+    bool test3 = (optimiseSpec(RANGE("abc"))->equals(new CHARSET(abc)));
+    cout << test3 << endl;
+    // "do" must be tried after "doab" but before "doac", which no trie can express.
+    Rexp* ordered = listToALT(deque<Rexp*>{stringToSEQ("doab"), stringToSEQ("do"), stringToSEQ("doac")});
+    bool test4 = (*optimiseSpec(ordered) == *ordered);
+    cout << test4 << endl;
+    Rexp* prefixes = new SEQ(listToALT(deque<Rexp*>{stringToSEQ("do"), stringToSEQ("done")}), new STAR(RANGE("ne")));
+    deque<string> expected5 = sdecode(mkRECD("x", prefixes), mkepsBC(simpDersBC(stringToList("done"), internalize(mkRECD("x", prefixes)))));
+    bool test5 = (blexer2_simp(mkRECD("x", prefixes), "done") == expected5);
+    cout << test5 << endl;
+    bool test6 = (optimiseSpec(spec) == optimiseSpec(spec) && optimiseSpec(ordered) != optimiseSpec(spec));
+    cout << test6 << endl;
+    // Once OPTIMISED_SPECS other specifications have been optimised, spec is optimised again.
+    Rexp* first = optimiseSpec(spec);
+    for(size_t i = 0; i < OPTIMISED_SPECS; ++i){
+        optimiseSpec(new CHAR('a'));
+    }
+    Rexp* again = optimiseSpec(spec);
+    bool test7 = (again != first && again->equals(first));
+    cout << test7 << endl;
+}
+
+// Performs tests on the Glushkov matcher, including a pattern that needs more than one word.
+void glushkovFunctionTest(){
+    Rexp* starStar = new SEQ(new STAR(new STAR(new CHAR('a'))), new CHAR('b'));
+    bool test1 = matches(starStar, "aaab");
+    cout << test1 << endl;
+    bool test2 = !matches(starStar, "aaa");
+    cout << test2 << endl;
+    bool test3 = (longest_match(new STAR(RANGE("ab")), "abbac") == 4);
+    cout << test3 << endl;
+    bool test4 = (longest_match(new CHAR('a'), "ba") == -1);
+    cout << test4 << endl;
+    bool test5 = (longest_match(new STAR(new CHAR('a')), "b") == 0);
+    cout << test5 << endl;
+    Rexp* hundred = new NTIMES(new ALT(new ONE(), new CHAR('a')), 100);
+    bool test6 = matches(hundred, string(100, 'a')) && matches(hundred, string(37, 'a')) && !matches(hundred, string(101, 'a'));
+    cout << test6 << endl;
+    Rexp* keywords = mkRECD("k", listToALT(deque<Rexp*>{stringToSEQ("while"), stringToSEQ("write")}));
+    bool test7 = (longest_match(optimiseSpec(keywords), "writes") == 5);
+    cout << test7 << endl;
+}
+
+// Compares the Glushkov matcher with the derivative matcher on the (a*)*b family.
+void glushkovExperiment(){
+    Rexp* r = new SEQ(new STAR(new STAR(new CHAR('a'))), new CHAR('b'));
+    GlushkovMatcher m = GlushkovMatcher(r);
+    for(int i = 0; i <= 150; i += 10){
+        string s = string(i, 'a');
+        int iterations = 5;
+        unsigned long derTotal = 0;
+        unsigned long glushkovTotal = 0;
+        for(int j = 0; j < iterations; ++j){
+            auto startTime = high_resolution_clock::now();
+            nullableBC(simpDersBC(stringToList(s), internalize(r)));
+            auto midTime = high_resolution_clock::now();
+            m.matches(s);
+            auto endTime = high_resolution_clock::now();
+            derTotal += duration_cast<std::chrono::nanoseconds>(midTime - startTime).count();
+            glushkovTotal += duration_cast<std::chrono::nanoseconds>(endTime - midTime).count();
+        }
+        cout << i << ": derivatives " << derTotal/iterations << " nanoseconds, glushkov " << glushkovTotal/iterations << " nanoseconds" << endl;
+    }
+}
+
+// Returns the path of a new empty file in /tmp whose name ends with suffix, for the tests and
+// experiments that lex a file. The caller removes it.
+string tempFile(const string & suffix){
+    string pattern = "/tmp/bitcode_lexer_XXXXXX" + suffix;
+    vector<char> path = vector<char>(pattern.begin(), pattern.end());
+    path.push_back('\0');
+    int fd = mkstemps(path.data(), suffix.size());
+    if(fd == -1){
+        cout << "could not make a temporary file" << endl;
+        return "";
+    }
+    close(fd);
+    return string(path.data());
+}
+
+// Performs tests on lexing a memory-mapped file: the tokens must agree with blexer2_simp
+// and point into the mapping.
+void mappedFileTest(){
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("k", stringToSEQ("while")), mkRECD("i", new PLUS(RANGE("abcdehilw"))), mkRECD("w", new CHAR(' '))}));
+    string prog = "while abc whilea b";
+    string path = tempFile(".while");
+    std::ofstream out(path);
+    out << prog;
+    out.close();
+    MappedFile file = MappedFile(path);
+    deque<Token> tokens = blexer_mapped(spec, file);
+    deque<string> expected = blexer2_simp(spec, prog);
+    // sdecode starts its token list with the empty accumulator string.
+    expected.pop_front();
+    bool test1 = (tokens.size() == expected.size());
+    for(size_t i = 0; i < tokens.size() && test1; ++i){
+        test1 = (tokenToString(tokens[i]) == expected[i]);
+    }
+    cout << test1 << endl;
+    bool test2 = (tokens.size() > 0 && tokens.front().lexeme == file.data && tokens.back().lexeme + tokens.back().length == file.data + file.size);
+    cout << test2 << endl;
+    std::remove(path.c_str());
+    MappedFile missing = MappedFile("no_such_file.while");
+    bool test3 = (!missing.mapped && blexer_mapped(spec, missing).size() == 0);
+    cout << test3 << endl;
+    Rexp* nested = mkRECD("o", new SEQ(mkRECD("i", stringToSEQ("xy")), new SEQ(mkRECD("j", new CHAR('z')), new CHAR('w'))));
+    string nestedPath = tempFile(".while");
+    out.open(nestedPath);
+    out << "xyzw";
+    out.close();
+    MappedFile nestedFile = MappedFile(nestedPath);
+    deque<Token> spans = blexer_mapped(nested, nestedFile);
+    bool test4 = (spans.size() == 3 && tokenToString(spans[0]) == "o:xyzw" && tokenToString(spans[1]) == "i:xy" && tokenToString(spans[2]) == "j:z");
+    cout << test4 << endl;
+    std::remove(nestedPath.c_str());
+}
+
+// Performs tests on the newline index: it must find the newlines a byte-by-byte scan finds, on
+// either side of a 64-byte block, and give the line and column of every token.
+void positionFunctionTest(){
+    string text = "";
+    for(int i = 0; i < 300; ++i){
+        text += (i % 7 == 0 || i % 64 == 63) ? '\n' : 'x';
+    }
+    NewlineIndex index = NewlineIndex(text.data(), text.size());
+    vector<size_t> expected = vector<size_t>{};
+    for(size_t i = 0; i < text.size(); ++i){
+        if(text[i] == '\n'){
+            expected.push_back(i);
+        }
+    }
+    bool test1 = (index.newlines == expected);
+    cout << test1 << endl;
+    bool test2 = true;
+    size_t line = 1;
+    size_t column = 1;
+    for(size_t i = 0; i < text.size() && test2; ++i){
+        LineColumn lc = index.position(i);
+        test2 = (lc.line == line && lc.column == column);
+        if(text[i] == '\n'){
+            line++;
+            column = 1;
+        }
+        else{
+            column++;
+        }
+    }
+    cout << test2 << endl;
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("k", stringToSEQ("while")), mkRECD("i", new PLUS(RANGE("abcdehilw"))), mkRECD("w", new PLUS(RANGE(" \n")))}));
+    string path = tempFile(".while");
+    std::ofstream out(path);
+    out << "while abc\n  whilea\nb";
+    out.close();
+    MappedFile file = MappedFile(path);
+    deque<Token> tokens = blexer_mapped(spec, file);
+    NewlineIndex fileIndex = NewlineIndex(file.data, file.size);
+    string dump = "";
+    positionedTokens(tokens, fileIndex, dump);
+    bool test3 = (dump == "1:1 k:while\n1:6 w: \n1:7 i:abc\n1:10 w:\n  \n2:3 k:while\n2:8 i:a\n2:9 w:\n\n3:1 i:b\n");
+    cout << test3 << endl;
+    std::remove(path.c_str());
+}
+
+// Lexes copies of a program from a file and compares lexing alone with lexing, indexing the
+// newlines and giving every token its line and column.
+void positionExperiment(Rexp* spec, string prog, int n){
+    string path = tempFile(".while");
+    std::ofstream out(path);
+    for(int i = 0; i < n; ++i){
+        out << prog << "\n";
+    }
+    out.close();
+    MappedFile file = MappedFile(path);
+    auto startTime = high_resolution_clock::now();
+    deque<Token> tokens = blexer_mapped(spec, file);
+    auto lexTime = high_resolution_clock::now();
+    NewlineIndex index = NewlineIndex(file.data, file.size);
+    size_t lines = 0;
+    for(size_t i = 0; i < tokens.size(); ++i){
+        lines += index.position(tokens[i]).line;
+    }
+    auto positionTime = high_resolution_clock::now();
+    long lexing = duration_cast<std::chrono::nanoseconds>(lexTime - startTime).count();
+    long positions = duration_cast<std::chrono::nanoseconds>(positionTime - lexTime).count();
+    cout << file.size << " bytes, " << tokens.size() << " tokens, " << index.newlines.size() << " lines: lexing " << lexing
+         << " nanoseconds, positions " << positions << " nanoseconds (" << 100.0 * positions / lexing << "%)" << endl;
+    std::remove(path.c_str());
+}
+
+// Performs tests on flatten and distinct, including an alternative wide enough to need the
+// hash set to grow.
+void distinctFunctionTest(){
+    deque<ARexp*> rs = deque<ARexp*>{new ACHAR(deque<bool>{}, 'a'), new ACHAR(deque<bool>{true}, 'b'), new ACHAR(deque<bool>{false}, 'a')};
+    deque<ARexp*> unique = distinct(rs);
+    bool test1 = (unique.size() == 2 && unique[0] == rs[0] && unique[1] == rs[1]);
+    cout << test1 << endl;
+    deque<ARexp*> nested = deque<ARexp*>{new AZERO(), new AALT(deque<bool>{true}, deque<ARexp*>{new AONE(deque<bool>{false}), new ACHAR(deque<bool>{}, 'c')}), new AONE(deque<bool>{})};
+    deque<ARexp*> flat = flatten(nested);
+    bool test2 = (flat.size() == 3 && flat[0]->equals(new AONE()) && flat[0]->ann == deque<bool>{true, false} && flat[1]->ann == deque<bool>{true});
+    cout << test2 << endl;
+    deque<ARexp*> wide = deque<ARexp*>{};
+    for(int i = 0; i < 1000; ++i){
+        wide.push_back(new ANTIMES(new ACHAR('a'), i % 300));
+    }
+    bool test3 = (distinct(wide).size() == 300);
+    cout << test3 << endl;
+}
+
+// Times simpBC on alternatives with 10 to 10,000 children containing nested alternatives,
+// ZEROs and duplicates.
+void flattenExperiment(){
+    for(int n = 10; n <= 10000; n *= 10){
+        unsigned long duration_total = 0;
+        int iterations = 5;
+        for(int j = 0; j < iterations; ++j){
+            deque<ARexp*> rs = deque<ARexp*>{};
+            for(int i = 0; i < n; ++i){
+                if(i % 10 == 0){
+                    rs.push_back(new AZERO());
+                }
+                else if(i % 10 == 1){
+                    rs.push_back(new AALT(deque<bool>{true}, deque<ARexp*>{new ACHAR('x'), new ANTIMES(new ACHAR('y'), i)}));
+                }
+                else{
+                    rs.push_back(new ASEQ(new ACHAR((char) (i % 7)), new ANTIMES(new ACHAR('z'), i / 2)));
+                }
+            }
+            ARexp* alt = new AALT(rs);
+            auto startTime = high_resolution_clock::now();
+            simpBC(alt);
+            auto endTime = high_resolution_clock::now();
+            duration_total += duration_cast<std::chrono::nanoseconds>(endTime - startTime).count();
+        }
+        cout << n << " children: " << duration_total/iterations << " nanoseconds" << endl;
+    }
+}
+
+// Performs tests on the derivative automaton: it must produce the same tokens as blexer2_simp,
+// (a+aa)* must have finitely many states, and a bound that is too small must be reported.
+void automatonFunctionTest(){
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("k", listToALT(deque<Rexp*>{stringToSEQ("if"), stringToSEQ("in")})), mkRECD("i", new PLUS(RANGE("fin"))), mkRECD("w", new CHAR(' '))}));
+    DerivativeAutomaton da = DerivativeAutomaton(spec);
+    string prog = "if in fin i if";
+    bool test1 = (blexer_automaton(da, prog) == blexer2_simp(spec, prog) && blexer_automaton(da, prog + " nif") == blexer2_simp(spec, prog + " nif"));
+    cout << test1 << endl;
+    Rexp* aaa = mkRECD("(a+aa)*", new STAR(new ALT(new CHAR('a'), new SEQ(new CHAR('a'), new CHAR('a')))));
+    DerivativeAutomaton daa = DerivativeAutomaton(aaa);
+    bool test2 = (blexer_automaton(daa, string(50, 'a')) == blexer2_simp(aaa, string(50, 'a')) && daa.keys.size() < 10);
+    cout << test2 << endl;
+    bool test3 = checkDerivativeStates(aaa, 10);
+    cout << test3 << endl;
+    bool test4 = !checkDerivativeStates(spec, 1);
+    cout << test4 << endl;
+    bool test5 = (parseCanonicalBC(canonicalBC(internalize(spec)))->equals(internalize(spec)));
+    cout << test5 << endl;
+}
+
+// Performs tests on the minimised transducer: it must tokenise like the automaton it was built
+// from, with fewer states where some are equivalent, and refuse a specification over its bound.
+void minimalFunctionTest(){
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("k", listToALT(deque<Rexp*>{stringToSEQ("if"), stringToSEQ("in")})), mkRECD("i", new PLUS(RANGE("fin"))), mkRECD("w", new CHAR(' '))}));
+    MinimalTransducer m = MinimalTransducer(spec, 1000);
+    DerivativeAutomaton da = DerivativeAutomaton(spec);
+    string prog = "if in fin i if";
+    bool test1 = (m.complete && blexer_minimal(m, prog) == blexer_automaton(da, prog) && blexer_minimal(m, prog + " nif") == blexer2_simp(spec, prog + " nif")
+                  && blexer_minimal(m, "if x").size() == 0);
+    cout << test1 << endl;
+    Rexp* aaa = mkRECD("(a+aa)*", new STAR(new ALT(new CHAR('a'), new SEQ(new CHAR('a'), new CHAR('a')))));
+    MinimalTransducer ma = MinimalTransducer(aaa, 1000);
+    bool test2 = (ma.complete && ma.states < ma.explored && m.states <= m.explored);
+    for(int i = 0; i < 20 && test2; ++i){
+        test2 = (blexer_minimal(ma, string(i, 'a')) == blexer2_simp(aaa, string(i, 'a')));
+    }
+    cout << test2 << endl;
+    bool test3 = !MinimalTransducer(spec, 1).complete;
+    cout << test3 << endl;
+}
+
+// Reports the states and the bytes of the automaton of spec, register programs included, before
+// and after minimisation and compares their throughput on n copies of prog, once every state has been explored.
+void minimalExperiment(Rexp* spec, string prog, int n){
+    MinimalTransducer m = MinimalTransducer(spec, 100000);
+    if(!m.complete){
+        cout << "more than 100000 derivative states" << endl;
+        return;
+    }
+    DerivativeAutomaton da = DerivativeAutomaton(spec);
+    da.explore(100000);
+    cout << "states: " << m.explored << " explored, " << m.states << " after minimisation; table " << automatonBytes(da)
+         << " bytes before, " << m.tableBytes() << " bytes after; " << m.outputStarts.size() - 1 << " distinct outputs, "
+         << m.programStarts.size() - 1 << " distinct programs and " << m.bits.size() << " pooled bits" << endl;
+    string s = "";
+    for(int i = 0; i < n; ++i){
+        s += prog;
+    }
+    auto startTime = high_resolution_clock::now();
+    blexer_automaton(da, s);
+    auto automatonTime = high_resolution_clock::now();
+    blexer_minimal(m, s);
+    auto minimalTime = high_resolution_clock::now();
+    cout << s.size() << " bytes: automaton " << duration_cast<std::chrono::nanoseconds>(automatonTime - startTime).count()
+         << " nanoseconds, minimised " << duration_cast<std::chrono::nanoseconds>(minimalTime - automatonTime).count() << " nanoseconds" << endl;
+}
+
+// Performs tests on searching: matches must be leftmost-longest, ties must go to the first rule,
+// and a rule set that can only start with one byte must use memchr.
+void searchFunctionTest(){
+    Rexp* rules = listToALT(deque<Rexp*>{mkRECD("err", stringToSEQ("error")), mkRECD("num", new PLUS(RANGE("0123456789")))});
+    string text = "an error at 42, errors 7";
+    deque<SearchMatch> found = search(rules, text.data(), text.data() + text.size());
+    bool test1 = (found.size() == 4 && found[0].rule == "err" && found[0].start == 3 && found[0].end == 8 && found[1].rule == "num" && found[1].start == 12 && found[1].end == 14 && found[2].start == 16 && found[3].start == 23 && found[3].end == 24);
+    cout << test1 << endl;
+    Rexp* keywords = new STAR(listToALT(deque<Rexp*>{mkRECD("k", stringToSEQ("if")), mkRECD("i", new PLUS(RANGE("fi")))}));
+    string code = "xiff if";
+    deque<SearchMatch> found2 = search(keywords, code.data(), code.data() + code.size());
+    bool test2 = (found2.size() == 2 && found2[0].rule == "i" && found2[0].start == 1 && found2[0].end == 4 && found2[1].rule == "k" && found2[1].start == 5);
+    cout << test2 << endl;
+    RuleSearcher errors = RuleSearcher(mkRECD("err", stringToSEQ("error")));
+    bool test3 = (errors.onlyByte == 'e' && search(new STAR(new CHAR('a')), code.data(), code.data() + code.size()).size() == 0);
+    cout << test3 << endl;
+    // A match that ends inside a merged thread must not hide a later start.
+    Rexp* overlap = listToALT(deque<Rexp*>{mkRECD("ab", stringToSEQ("ab")), mkRECD("bc", new SEQ(new PLUS(new CHAR('b')), new CHAR('c')))});
+    string bees = "abbbc";
+    deque<SearchMatch> found4 = search(overlap, bees.data(), bees.data() + bees.size());
+    bool test4 = (found4.size() == 2 && found4[0].rule == "ab" && found4[0].end == 2 && found4[1].rule == "bc" && found4[1].start == 2 && found4[1].end == 5);
+    cout << test4 << endl;
+    // A long attempt that fails must be read once, not once from every position.
+    RuleSearcher ab = RuleSearcher(mkRECD("ab", new SEQ(new STAR(new CHAR('a')), new CHAR('b'))));
+    string as = string(100000, 'a');
+    size_t pos = 0;
+    SearchMatch m;
+    bool test5 = !ab.nextMatch(as.data(), as.data() + as.size(), pos, m) && ab.steps <= 2 * as.size();
+    as += "b";
+    pos = 0;
+    test5 = test5 && ab.nextMatch(as.data(), as.data() + as.size(), pos, m) && m.start == 0 && m.end == as.size() && ab.steps <= 4 * as.size();
+    cout << test5 << endl;
+}
+
+// Measures search throughput in GB/s on a synthetic log, to compare with the search experiment
+// in regex.py.
+void searchExperiment(){
+    Rexp* DIGIT = RANGE("0123456789");
+    Rexp* rules = listToALT(deque<Rexp*>{mkRECD("err", stringToSEQ("ERROR")), mkRECD("code", new SEQ(stringToSEQ("E"), new NTIMES(DIGIT, 4)))});
+    string line = "2021-04-09 12:00:01 INFO request served in 12ms from cache node 7\n";
+    string rare = "2021-04-09 12:00:02 ERROR E1234 upstream timed out\n";
+    for(int mb = 1; mb <= 64; mb *= 4){
+        string text = "";
+        for(int lines = 0; text.size() < (size_t) mb * 1000000; ++lines){
+            text += (lines % 100 == 0) ? rare : line;
+        }
+        RuleSearcher searcher = RuleSearcher(rules);
+        unsigned long duration_total = 0;
+        int iterations = 5;
+        size_t count = 0;
+        for(int j = 0; j < iterations; ++j){
+            auto startTime = high_resolution_clock::now();
+            size_t pos = 0;
+            SearchMatch match = SearchMatch();
+            count = 0;
+            while(searcher.nextMatch(text.data(), text.data() + text.size(), pos, match)){
+                count++;
+            }
+            auto endTime = high_resolution_clock::now();
+            duration_total += duration_cast<std::chrono::nanoseconds>(endTime - startTime).count();
+        }
+        double seconds = (duration_total / iterations) / 1e9;
+        cout << mb << "MB: " << count << " matches, " << (text.size() / seconds) / 1e9 << " GB/s" << endl;
+    }
+}
+
+// Performs tests on capture extraction: a string literal token must be split into its quotes
+// and body, and the captures must agree with env.
+void captureFunctionTest(){
+    Rexp* QUOTE = new CHAR('\"');
+    Rexp* STR = new SEQ(mkRECD("q", QUOTE), new SEQ(mkRECD("body", new STAR(RANGE("ab "))), mkRECD("q", QUOTE)));
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("str", STR), mkRECD("w", new CHAR(' '))}));
+    string prog = "\"ab a\" \"\"";
+    vector<Capture> captures = blexer_captures(spec, prog);
+    bool test1 = (captures.size() == 9);
+    cout << test1 << endl;
+    bool test2 = test1 && *captures[0].name == "str" && captures[0].start == 0 && captures[0].end == 6 && captures[0].depth == 0 && *captures[2].name == "body" && captures[2].start == 1 && captures[2].end == 5 && captures[2].depth == 1 && *captures[4].name == "w" && captures[4].start == 6 && captures[7].start == 8 && captures[7].end == 8;
+    cout << test2 << endl;
+    deque<pair<string, string>> expected = env(blexer_simp(spec, stringToList(prog)));
+    bool test3 = (expected.size() == captures.size());
+    for(size_t i = 0; i < captures.size() && test3; ++i){
+        test3 = (expected[i].first == *captures[i].name && expected[i].second == prog.substr(captures[i].start, captures[i].end - captures[i].start));
+    }
+    cout << test3 << endl;
+}
+
+// The specification of hotLexerFunctionTest. The test compiles a driver that includes this file
+// together with the generated lexer and calls it to build the same automaton.
+Rexp* hotTestSpec(){
+    return new STAR(listToALT(deque<Rexp*>{mkRECD("k", stringToSEQ("if")), mkRECD("i", new PLUS(RANGE("fi"))), mkRECD("w", new CHAR(' '))}));
 }
 
-// Returns a value associated with matching the input string s with respect 
-// to the input regular expression r. It needs further processing for tokenisation.
-Val* blexer_simp(Rexp* r, deque<char> s){
-    ARexp* a = simpDersBC(s, internalize(r));
-    //Used to measure the size of the final regular expression.
-    //cout << "Size: " << regexSize(deannotate(a)) << endl;
-    if(nullableBC(a)){
-        return decode(r, mkepsBC(a)).first;
+// Performs tests on profiling and hot-state code generation: every profiled character must be
+// counted, and the generated lexer must compile and tokenise like blexer2_simp, on hot and cold
+// transitions alike. Without a compiler only the states named in the generated file are checked.
+void hotLexerFunctionTest(){
+    Rexp* spec = hotTestSpec();
+    DerivativeAutomaton da = DerivativeAutomaton(spec);
+    string corpus = "if fi iff if if";
+    vector<vector<unsigned long>> counts = profileTransitions(da, corpus);
+    unsigned long total = 0;
+    for(size_t s = 0; s < counts.size(); ++s){
+        for(int c = 0; c < 256; ++c){
+            total += counts[s][c];
+        }
+    }
+    bool test1 = (total == corpus.size());
+    cout << test1 << endl;
+    // Everything the test writes goes into a directory of its own, which is removed at the end.
+    char dir[] = "/tmp/hot_lexer_XXXXXX";
+    if(mkdtemp(dir) == nullptr){
+        cout << "hot lexer: could not make a temporary directory" << endl;
+        cout << 0 << endl;
+        return;
+    }
+    string path = string(dir) + "/hot_lexer_test.cpp";
+    string driverPath = string(dir) + "/hot_lexer_driver.cpp";
+    string binaryPath = string(dir) + "/hot_lexer_driver";
+    bool test2 = emitHotLexer(da, counts, 0.9, path);
+    // The driver is not next to this file, so it includes it by its absolute path.
+    char* source = realpath(__FILE__, nullptr);
+    bool compiler = (system("c++ --version > /dev/null 2>&1") == 0);
+    if(source != nullptr && compiler){
+        std::ofstream driver(driverPath);
+        driver << "#define HOT_LEXER \"" << path << "\"\n";
+        driver << "#define main bitcode_lexer_main\n";
+        driver << "#include \"" << source << "\"\n";
+        driver << "#undef main\n";
+        driver << "int main(int argc, char* argv[]){\n";
+        driver << "    DerivativeAutomaton da = DerivativeAutomaton(hotTestSpec());\n";
+        driver << "    for(int i = 1; i < argc; ++i){\n";
+        driver << "        cout << listToString(blexer_hot(da, argv[i])) << endl;\n";
+        driver << "    }\n";
+        driver << "}\n";
+        driver.close();
+        // "iff fif" also takes transitions that were not profiled as hot.
+        vector<string> inputs = vector<string>{corpus, "iff fif", "i"};
+        string expected = "";
+        string command = "c++ -std=c++17 -pthread -o " + binaryPath + " " + driverPath + " && " + binaryPath;
+        for(size_t i = 0; i < inputs.size(); ++i){
+            expected += listToString(blexer2_simp(spec, inputs[i])) + "\n";
+            command += " '" + inputs[i] + "'";
+        }
+        string output = "";
+        FILE* run = popen((command + " 2>&1").c_str(), "r");
+        char buffer[4096];
+        size_t n;
+        while(run != nullptr && (n = fread(buffer, 1, sizeof(buffer), run)) > 0){
+            output.append(buffer, n);
+        }
+        test2 = test2 && run != nullptr && pclose(run) == 0 && output == expected;
+        std::remove(driverPath.c_str());
+        std::remove(binaryPath.c_str());
     }
     else{
-        cout << "lexing error...\n";
-        return new noMatch();
+        // Without a compiler, or without this file to include, only the generated source is checked.
+        cout << "hot lexer: " << (compiler ? string("cannot read ") + __FILE__ : string("no C++ compiler found")) << ", skipping the compile" << endl;
+        MappedFile generated = MappedFile(path);
+        string code = string(generated.data, generated.size);
+        test2 = test2 && code.find("deque<string> blexer_hot(DerivativeAutomaton & da, string s)") != string::npos;
+        for(size_t s = 0; s < counts.size() && test2; ++s){
+            test2 = (code.find("\"" + da.keys[s] + "\"") != string::npos);
+        }
     }
+    cout << test2 << endl;
+    std::remove(path.c_str());
+    rmdir(dir);
+    free(source);
 }
 
-// Tokenises the input string with respect to the input regular expression
-// using the tail-recursive decode function, sdecode. 
-deque<string> blexer2_simp(Rexp* r, string s){
-    ARexp* a = simpDersBC(stringToList(s), internalize(r));
-    //Used to measure the size of the final regular expression.
-    //cout << "Size: " << regexSize(deannotate(a)) << endl;
-    if(nullableBC(a)){
-        return sdecode(r, mkepsBC(a));
+// Performs tests on binary token streams: tokens appended in two blocks, with and without
+// lexemes, must read back as the tokens of blexer2_simp, and a truncated stream or a lexeme running
+// past its block must be rejected.
+void binaryTokenTest(){
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("k", stringToSEQ("while")), mkRECD("i", new PLUS(RANGE("abcdehilw"))), mkRECD("w", new CHAR(' '))}));
+    string first = "while abc ";
+    string second = "whilea b";
+    string prog = first + second;
+    string path = tempFile(".tok");
+    TokenWriter writer = TokenWriter(true);
+    bool test1 = blexer_binary(spec, prog.data(), prog.data() + first.size(), 0, writer) && writer.appendTo(path);
+    writer.withLexemes = false;
+    test1 = test1 && blexer_binary(spec, prog.data() + first.size(), prog.data() + prog.size(), first.size(), writer) && writer.appendTo(path);
+    cout << test1 << endl;
+    MappedFile file = MappedFile(path);
+    TokenReader reader = TokenReader(file.data, file.size);
+    deque<string> tokens = deque<string>{""};
+    BinaryToken t = BinaryToken();
+    bool test2 = true;
+    while(reader.next(t)){
+        tokens.push_back(binaryTokenKind(t) + ":" + prog.substr(t.start, t.length));
+        if(t.lexeme != nullptr){
+            test2 = test2 && (string(t.lexeme, t.length) == prog.substr(t.start, t.length));
+        }
     }
-    else{
-        cout << "No match found.\n";
-        return deque<string>{};
+    test2 = test2 && !reader.corrupt && (tokens == blexer2_simp(spec, prog));
+    cout << test2 << endl;
+    TokenReader truncated = TokenReader(file.data, file.size - 1);
+    while(truncated.next(t)){
+
+    }
+    bool test3 = truncated.corrupt;
+    // A block of one token whose length of 100 runs past its 2 bytes of lexemes.
+    string tokenBytes = "";
+    writeVarint(tokenBytes, 0);
+    writeVarint(tokenBytes, 0);
+    writeVarint(tokenBytes, 100);
+    string body = "";
+    for(uint64_t n : vector<uint64_t>{0, 1, 1}){
+        writeVarint(body, n);
+    }
+    body += "k";
+    for(uint64_t n : vector<uint64_t>{1, tokenBytes.size(), 2}){
+        writeVarint(body, n);
+    }
+    body += tokenBytes + "ab";
+    string oversized = "BTOK";
+    writeVarint(oversized, body.size());
+    oversized += body;
+    TokenReader overrun = TokenReader(oversized.data(), oversized.size());
+    test3 = test3 && !overrun.next(t) && overrun.corrupt && !overrun.next(t);
+    cout << test3 << endl;
+    std::remove(path.c_str());
+}
+
+// Performs tests on the pipelined lexer: the tokens must agree with blexer2_simp, lexing errors
+// must be reported, and the ring must apply backpressure without losing or reordering records.
+void pipelineFunctionTest(){
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("k", listToALT(deque<Rexp*>{stringToSEQ("if"), stringToSEQ("in")})), mkRECD("i", new PLUS(RANGE("fin"))), mkRECD("w", new CHAR(' '))}));
+    string prog = "if in fin i if iff";
+    bool test1 = (blexer_pipelined(spec, prog) == blexer2_simp(spec, prog));
+    cout << test1 << endl;
+    string longProg = "";
+    for(int i = 0; i < 300; ++i){
+        longProg += "fi if ";
     }
+    PipelineStats stats = PipelineStats();
+    bool test2 = (blexer_pipelined(spec, longProg, stats) == blexer2_simp(spec, longProg) && stats.records > 300);
+    cout << test2 << endl;
+    bool test3 = (blexer_pipelined(spec, "if x") == deque<string>{});
+    cout << test3 << endl;
+    // A ring much smaller than the number of records must still deliver them all in order.
+    RecordRing ring = RecordRing(4);
+    std::thread producer([&ring](){
+        for(int i = 0; i < 1000; ++i){
+            LexRecord record = LexRecord();
+            record.start = i;
+            ring.push(record);
+        }
+        ring.close();
+    });
+    LexRecord record = LexRecord();
+    bool test4 = true;
+    size_t expected = 0;
+    while(ring.pop(record)){
+        test4 = test4 && (record.start == expected++);
+    }
+    producer.join();
+    test4 = test4 && (expected == 1000);
+    cout << test4 << endl;
 }
 
-// Helper function to convert a string into a nested SEQ regular expression
-// representing the ordered concatenation of all the characters in the string.
-Rexp* stringToSEQ(string s){
-    if(s.length() == 1){
-        return new CHAR(s[0]);
+// Compares blexer2_simp with the pipelined lexer on repetitions of a program. Reports the time
+// until the first token is available as well as the total time.
+void pipelineExperiment(Rexp* spec, string prog){
+    for(int i = 1; i <= 31; i += 10){
+        string s = "";
+        for(int j = 0; j < i; ++j){
+            s += prog;
+        }
+        auto startTime = high_resolution_clock::now();
+        blexer2_simp(spec, s);
+        auto endTime = high_resolution_clock::now();
+        unsigned long simpDuration = duration_cast<std::chrono::nanoseconds>(endTime - startTime).count();
+        PipelineStats stats = PipelineStats();
+        blexer_pipelined(spec, s, stats);
+        cout << i << " copies: blexer2_simp " << simpDuration << " nanoseconds, pipelined " << stats.total << " nanoseconds (first token after " << stats.firstToken << " nanoseconds, " << stats.stalls << " stalls)" << endl;
     }
-    else{
-        return new SEQ(new CHAR(s[0]), stringToSEQ(s.substr(1, s.size()-1)));
+}
+
+// Performs tests on the annotation-free fast path: the tokens must agree with blexer2_simp on
+// ambiguous inputs and a failed match must be reported.
+void backwardFunctionTest(){
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("k", listToALT(deque<Rexp*>{stringToSEQ("if"), stringToSEQ("in")})), mkRECD("i", new PLUS(RANGE("fin"))), mkRECD("w", new CHAR(' '))}));
+    DerivativeAutomaton da = DerivativeAutomaton(spec);
+    string prog = "if in fin i if iff";
+    bool test1 = (blexer_backward(da, prog) == blexer2_simp(spec, prog) && blexer_backward(da, "") == blexer2_simp(spec, ""));
+    cout << test1 << endl;
+    Rexp* aaa = mkRECD("(a+aa)*", new STAR(new ALT(new CHAR('a'), new SEQ(new CHAR('a'), new CHAR('a')))));
+    DerivativeAutomaton daa = DerivativeAutomaton(aaa);
+    bool test2 = (blexer_backward(daa, string(40, 'a')) == blexer2_simp(aaa, string(40, 'a')));
+    cout << test2 << endl;
+    bool test3 = (blexer_backward(da, "if x") == deque<string>{});
+    cout << test3 << endl;
+}
+
+// Compares the fully bitcoded lexer with the annotation-free fast path on repetitions of a
+// program. The automaton is warmed by the first run; cold and warm times are both reported.
+void backwardExperiment(Rexp* spec, string prog){
+    for(int i = 1; i <= 21; i += 10){
+        string s = "";
+        for(int j = 0; j < i; ++j){
+            s += prog;
+        }
+        auto startTime = high_resolution_clock::now();
+        blexer2_simp(spec, s);
+        auto simpTime = high_resolution_clock::now();
+        DerivativeAutomaton da = DerivativeAutomaton(spec);
+        blexer_backward(da, s);
+        auto coldTime = high_resolution_clock::now();
+        blexer_backward(da, s);
+        auto warmTime = high_resolution_clock::now();
+        cout << i << " copies: blexer2_simp " << duration_cast<std::chrono::nanoseconds>(simpTime - startTime).count()
+             << " nanoseconds, backward cold " << duration_cast<std::chrono::nanoseconds>(coldTime - simpTime).count()
+             << " nanoseconds, backward warm " << duration_cast<std::chrono::nanoseconds>(warmTime - coldTime).count() << " nanoseconds" << endl;
     }
 }
 
-// Helper function to convert a string into a nested ALT regular expression
-// representing the RANGE regular expression.
-Rexp* RANGE(string s){
-    if(s.length() == 1){
-        return new CHAR(s[0]);
+// Performs tests on the flat derivatives: they must lex like blexer2_simp, also on an
+// ambiguous star, a failed match must give no tokens, and literals that still have to match the
+// same rest must be simplified into one, wherever they started.
+void flatFunctionTest(){
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("k", listToALT(deque<Rexp*>{stringToSEQ("if"), stringToSEQ("in")})), mkRECD("i", new PLUS(RANGE("fin"))), mkRECD("w", new CHAR(' '))}));
+    string prog = "if in fin i if iff";
+    bool test1 = (blexer_flat(spec, prog) == blexer2_simp(spec, prog) && blexer_flat(spec, "") == blexer2_simp(spec, ""));
+    cout << test1 << endl;
+    Rexp* aaa = mkRECD("(a+aa)*", new STAR(new ALT(new CHAR('a'), new SEQ(new CHAR('a'), new CHAR('a')))));
+    bool test2 = (blexer_flat(aaa, string(40, 'a')) == blexer2_simp(aaa, string(40, 'a')));
+    cout << test2 << endl;
+    bool test3 = (blexer_flat(spec, "if x") == deque<string>{});
+    cout << test3 << endl;
+    Rexp* twice = new ALT(new SEQ(new CHAR('x'), stringToSEQ("if")), stringToSEQ("xif"));
+    FlatRexp flat = FlatRexp();
+    uint32_t rest = flat.simp(flat.der('x', flat.internalize(twice)));
+    Rexp* named = mkRECD("t", twice);
+    bool test4 = (flat.kinds[rest] == FLAT_LITERAL && blexer_flat(named, "xif") == blexer2_simp(named, "xif"));
+    cout << test4 << endl;
+}
+
+// Compares the pointer-based lexer with the flat one on repetitions of a program.
+void flatExperiment(Rexp* spec, string prog){
+    for(int i = 1; i <= 21; i += 10){
+        string s = "";
+        for(int j = 0; j < i; ++j){
+            s += prog;
+        }
+        auto startTime = high_resolution_clock::now();
+        blexer2_simp(spec, s);
+        auto simpTime = high_resolution_clock::now();
+        blexer_flat(spec, s);
+        auto flatTime = high_resolution_clock::now();
+        cout << i << " copies: blexer2_simp " << duration_cast<std::chrono::nanoseconds>(simpTime - startTime).count()
+             << " nanoseconds, flat " << duration_cast<std::chrono::nanoseconds>(flatTime - simpTime).count() << " nanoseconds" << endl;
     }
-    else{
-        return new ALT(new CHAR(s[0]), RANGE(s.substr(1, s.size()-1)));
+}
+
+// Performs tests on LITERAL: its derivatives advance the cursor, it decodes to the whole string at
+// once and it lexes like the nested SEQ of its CHARs, with every decoder.
+void literalFunctionTest(){
+    ARexp* word = internalize(stringToSEQ("if"));
+    ARexp* rest = derBC('i', word);
+    // Literals that still have to match the same rest are equal, wherever they started.
+    bool test1 = (rest->name == "ALITERAL" && rest->equals(derBC('x', internalize(stringToSEQ("xf"))))
+                  && derBC('f', rest)->name == "AONE" && derBC('x', word)->name == "AZERO" && !nullableBC(word));
+    cout << test1 << endl;
+    Rexp* keyword = stringToSEQ("while");
+    bool test2 = (flattenVal(decode(keyword, deque<bool>{}).first) == "while" && decode(keyword, deque<bool>{}).first->tag == LIT_VAL);
+    cout << test2 << endl;
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("k", listToALT(deque<Rexp*>{stringToSEQ("if"), stringToSEQ("iff"), stringToSEQ(":=")})), mkRECD("i", new PLUS(RANGE("fi:="))), mkRECD("w", new CHAR(' '))}));
+    Rexp* chains = expandLiterals(spec);
+    string prog = "if iff := ifff :=: i";
+    deque<string> expected = sdecode(chains, mkepsBC(simpDersBC(stringToList(prog), internalize(chains))));
+    bool test3 = (sdecode(spec, mkepsBC(simpDersBC(stringToList(prog), internalize(spec)))) == expected && blexer2_simp(spec, prog) == expected
+                  && blexer_flat(spec, prog) == expected);
+    cout << test3 << endl;
+    DerivativeAutomaton da = DerivativeAutomaton(spec);
+    GlushkovMatcher glushkov = GlushkovMatcher(spec);
+    bool test4 = (blexer_backward(da, prog) == expected && glushkov.matches(prog) && !glushkov.matches("if x"));
+    cout << test4 << endl;
+    ALITERAL* target = new ALITERAL(&static_cast<LITERAL*>(keyword)->s, 0);
+    *target = *static_cast<ARexp*>(rest);
+    bool test5 = (expandLiterals(new LITERAL(""))->name == "ONE" && target->equals(rest));
+    cout << test5 << endl;
+}
+
+// Compares the derivatives of a specification written with LITERALs with those of the same
+// specification with nested SEQs of CHARs, on repetitions of a program. The specification is not
+// optimised, because the optimiser turns the keywords of both into the same tries.
+void literalExperiment(Rexp* spec, string prog){
+    Rexp* chains = expandLiterals(spec);
+    for(int i = 1; i <= 21; i += 10){
+        string s = "";
+        for(int j = 0; j < i; ++j){
+            s += prog;
+        }
+        auto startTime = high_resolution_clock::now();
+        sdecode(chains, mkepsBC(simpDersBC(stringToList(s), internalize(chains))));
+        auto chainTime = high_resolution_clock::now();
+        sdecode(spec, mkepsBC(simpDersBC(stringToList(s), internalize(spec))));
+        auto literalTime = high_resolution_clock::now();
+        cout << i << " copies: SEQ of CHARs " << duration_cast<std::chrono::nanoseconds>(chainTime - startTime).count()
+             << " nanoseconds, LITERAL " << duration_cast<std::chrono::nanoseconds>(literalTime - chainTime).count() << " nanoseconds" << endl;
     }
 }
 
-// Helper function to return the tail elements of a deque.
-deque<Rexp*> listTail(deque<Rexp*> ls){
-    deque<Rexp*> outList = deque<Rexp*>{};
-    for(int i = 1; i < ls.size(); ++i){
-        outList.push_back(ls[i]);
+// Performs tests on PLUS and OPTIONAL: they lex with the bitcode of their expansions with every
+// engine, nesting them keeps the internalized specification linear and they decode to a Stars and
+// to an Empty or the value of their body.
+void plusFunctionTest(){
+    Rexp* nested = new SEQ(new PLUS(new SEQ(new PLUS(new CHAR('a')), new OPTIONAL(new PLUS(new CHAR('a'))))), new CHAR('b'));
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("n", nested), mkRECD("i", new PLUS(RANGE("ab"))), mkRECD("o", new SEQ(new CHAR('c'), new OPTIONAL(new CHAR('c')))),
+                                                 mkRECD("w", new PLUS(new OPTIONAL(new CHAR(' '))))}));
+    Rexp* expanded = expandRepetitions(spec);
+    DerivativeAutomaton da = DerivativeAutomaton(spec);
+    GlushkovMatcher glushkov = GlushkovMatcher(spec);
+    bool test1 = true;
+    for(string prog : vector<string>{"aab", "aaab ccc ab", "ba  c aaaab", "aaaaab cc"}){
+        deque<bool> expected = mkepsBC(simpDersBC(stringToList(prog), internalize(expanded)));
+        deque<string> tokens = sdecode(expanded, expected);
+        test1 = test1 && (mkepsBC(simpDersBC(stringToList(prog), internalize(spec))) == expected && blexer_flat(spec, prog) == tokens
+                          && blexer_backward(da, prog) == tokens && glushkov.matches(prog));
     }
-    return outList;
+    cout << test1 << endl;
+    Rexp* deep = new CHAR('a');
+    Rexp* deepExpanded = new CHAR('a');
+    for(int i = 0; i < 10; ++i){
+        deep = new PLUS(deep);
+        deepExpanded = expandRepetitions(new PLUS(deepExpanded));
+    }
+    bool test2 = (regexSizeBC(internalize(deep)) == 11 && regexSizeBC(internalize(deepExpanded)) > 1000);
+    cout << test2 << endl;
+    Val* plus = decode(new PLUS(new CHAR('a')), deque<bool>{false, false, true}).first;
+    Val* none = decode(new OPTIONAL(new CHAR('a')), deque<bool>{false}).first;
+    Val* some = decode(new OPTIONAL(new CHAR('a')), deque<bool>{true}).first;
+    bool test3 = (plus->tag == STARS_VAL && flattenVal(plus) == "aaa" && none->tag == EMPTY_VAL && some->tag == CHR_VAL);
+    cout << test3 << endl;
+    // Assignment copies the body instead of sharing it, and ignores a node of another kind.
+    PLUS* target = new PLUS(new CHAR('a'));
+    PLUS* source = new PLUS(new CHAR('b'));
+    *target = *static_cast<Rexp*>(source);
+    APLUS* atarget = new APLUS(new ACHAR('a'));
+    APLUS* asource = new APLUS(new ACHAR('b'));
+    *atarget = *static_cast<ARexp*>(new AOPTIONAL(new ACHAR('b')));
+    bool test4 = (target->equals(source) && target->rs != source->rs && target->star->rs == target->rs && atarget->rs->equals(new ACHAR('a')));
+    *atarget = *static_cast<ARexp*>(asource);
+    test4 = test4 && atarget->equals(asource) && atarget->rs != asource->rs;
+    cout << test4 << endl;
 }
 
-// Helper function to convert a deque of regular expressions into a 
-// nested ALT regular expression.
-Rexp* listToALT(deque<Rexp*> ls){
-    if(ls.size() == 1){
-        return ls[0];
+// Compares the derivatives of nested PLUSes, ((a+)+)+ and deeper, with those of their expansions
+// into SEQs and STARs, on strings of a's followed by a b.
+void plusExperiment(int depth, int n){
+    Rexp* nested = new CHAR('a');
+    for(int i = 0; i < depth; ++i){
+        nested = new PLUS(nested);
+    }
+    Rexp* spec = mkRECD("p", new SEQ(nested, new CHAR('b')));
+    Rexp* expanded = expandRepetitions(spec);
+    cout << "internalized size: PLUS " << regexSizeBC(internalize(spec)) << ", expanded " << regexSizeBC(internalize(expanded)) << endl;
+    for(int i = 1; i <= n; i *= 10){
+        string s = string(i, 'a') + "b";
+        auto startTime = high_resolution_clock::now();
+        mkepsBC(simpDersBC(stringToList(s), internalize(expanded)));
+        auto expandedTime = high_resolution_clock::now();
+        mkepsBC(simpDersBC(stringToList(s), internalize(spec)));
+        auto plusTime = high_resolution_clock::now();
+        cout << i << " a's: expanded " << duration_cast<std::chrono::nanoseconds>(expandedTime - startTime).count()
+             << " nanoseconds, PLUS " << duration_cast<std::chrono::nanoseconds>(plusTime - expandedTime).count() << " nanoseconds" << endl;
     }
-    else{
-        return new ALT(ls[0], listToALT(listTail(ls)));
+}
+
+// Performs tests on the spec rewriter: nested STARs collapse, unreachable, empty and repeated
+// alternatives go, and on every string the translated bitcode of the rewritten specification is
+// the one of the specification as it was written.
+void rewriteFunctionTest(){
+    Rexp* a = new CHAR('a');
+    Rexp* b = new CHAR('b');
+    Rexp* starStar = mkRECD("x", new SEQ(new STAR(new STAR(a)), b));
+    bool test1 = (SpecRewriter(starStar).spec->equals(mkRECD("x", new SEQ(new STAR(a), b)))
+                  && SpecRewriter(new STAR(new ALT(new ZERO(), new ALT(new ONE(), new ALT(a, a))))).spec->equals(new STAR(a))
+                  && SpecRewriter(new STAR(new ALT(mkRECD("e", new STAR(new ONE())), new ALT(a, new SEQ(new ONE(), new ONE()))))).spec->equals(new STAR(a)));
+    cout << test1 << endl;
+    deque<Rexp*> specs = deque<Rexp*>{starStar, mkRECD("x", new SEQ(new STAR(new PLUS(a)), b)), new STAR(new STAR(new STAR(new ALT(a, new SEQ(a, b))))),
+                                      new STAR(new OPTIONAL(a)), new STAR(listToALT(deque<Rexp*>{new SEQ(a, b), new SEQ(a, new STAR(b)), new SEQ(b, a), new ONE()})),
+                                      new STAR(new ALT(mkRECD("p", new STAR(new PLUS(new ALT(a, new ONE())))), mkRECD("q", new SEQ(b, new OPTIONAL(a))))),
+                                      new STAR(listToALT(deque<Rexp*>{mkRECD("e", new STAR(new ONE())), a, new SEQ(new ONE(), new OPTIONAL(new ONE())), b}))};
+    bool test2 = true;
+    for(size_t i = 0; i < specs.size(); ++i){
+        SpecRewriter rewriter = SpecRewriter(specs[i]);
+        for(string s : vector<string>{"", "b", "ab", "aab", "abab", "aaaab", "baab", "bbaba"}){
+            ARexp* plain = simpDersBC(stringToList(s), internalize(specs[i]));
+            ARexp* rewritten = simpDersBC(stringToList(s), internalize(rewriter.spec));
+            test2 = test2 && (nullableBC(plain) == nullableBC(rewritten));
+            if(test2 && nullableBC(plain)){
+                deque<bool> bs = mkepsBC(rewritten);
+                test2 = (rewriter.translate(bs) == mkepsBC(plain));
+            }
+        }
     }
+    cout << test2 << endl;
+    bool test3 = (valToString(blexer_simp(starStar, stringToList("aaab"))) == valToString(decode(starStar, mkepsBC(simpDersBC(stringToList("aaab"), internalize(starStar)))).first));
+    cout << test3 << endl;
 }
 
+// Compares blexer2_simp, which rewrites the specification, with derivatives of the specification
+// as it was written, on strings of n a's followed by a b.
+void rewriteExperiment(Rexp* spec, int n){
+    for(int i = 1; i <= n; i *= 10){
+        string s = string(i, 'a') + "b";
+        auto startTime = high_resolution_clock::now();
+        sdecode(spec, mkepsBC(simpDersBC(stringToList(s), internalize(spec))));
+        auto plainTime = high_resolution_clock::now();
+        blexer2_simp(spec, s);
+        auto rewrittenTime = high_resolution_clock::now();
+        cout << i << " a's: as written " << duration_cast<std::chrono::nanoseconds>(plainTime - startTime).count()
+             << " nanoseconds, rewritten " << duration_cast<std::chrono::nanoseconds>(rewrittenTime - plainTime).count() << " nanoseconds" << endl;
+    }
+}
 
-// *** THE FOLLOWING CODE IS FOR TESTING AND EXPERIMENT PURPOSES.***
+// Builds a balanced SEQ of n ONEs, whose program is one long chain of epsilon instructions.
+Rexp* onesSEQ(int n){
+    if(n == 1){
+        return new ONE();
+    }
+    return new SEQ(onesSEQ(n / 2), onesSEQ(n - n / 2));
+}
 
+// Runs vm on "aaab" and "aaaa" on a thread with a 256 KB stack and returns whether only the
+// second matched.
+bool runOnSmallStack(PikeVM & vm){
+    struct Run {
+        PikeVM* vm;
+        bool ok;
+        static void* body(void* p){
+            Run* run = static_cast<Run*>(p);
+            deque<bool> bs = deque<bool>{};
+            run->ok = !run->vm->run("aaab", bs) && run->vm->run("aaaa", bs);
+            return nullptr;
+        }
+    };
+    Run run = Run{&vm, false};
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, 256 * 1024);
+    pthread_t thread;
+    bool started = (pthread_create(&thread, &attributes, &Run::body, &run) == 0);
+    pthread_attr_destroy(&attributes);
+    if(started){
+        pthread_join(thread, nullptr);
+    }
+    return started && run.ok;
+}
 
-// Performs tests on the simp function to ensure correct output for each if-elseif branch.
-void simpFunctionTest(){
-    bool test1 = (simpBC(new AONE(deque<bool>{}))->equals(new AONE(deque<bool>{})));
+// Performs tests on the Pike VM: it must give the tokens of blexer2_simp where that takes the
+// POSIX value, the longest match for "iff" where blexer2_simp does not, the POSIX bitcode of
+// other ambiguous specifications and fail quickly on (a*)*b. A string that does not match and a
+// program that is too large must give their own status. A long chain of epsilon instructions
+// must not need a deep stack, and the log must keep only the entries of live threads.
+void pikeFunctionTest(){
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("k", listToALT(deque<Rexp*>{stringToSEQ("if"), stringToSEQ("in")})), mkRECD("i", new PLUS(RANGE("fin"))), mkRECD("w", new CHAR(' '))}));
+    string prog = "if in fin i if";
+    PikeStatus status;
+    bool test1 = (blexer_pike(spec, prog, status) == blexer2_simp(spec, prog) && status == PIKE_OK && blexer_pike(spec, "", status) == blexer2_simp(spec, "")
+                  && blexer_pike(spec, "iff", status) == deque<string>{"", "i:iff"});
     cout << test1 << endl;
-    bool test2 = (simpBC(new ACHAR(deque<bool>{}, 'z'))->equals(new ACHAR(deque<bool>{}, 'z')));
+    Rexp* optional = new STAR(new SEQ(new SEQ(RANGE("ab"), new ALT(new ONE(), RANGE("abc"))), new OPTIONAL(new CHAR('a'))));
+    Rexp* aaa = mkRECD("(a+aa)*", new STAR(new ALT(new CHAR('a'), new SEQ(new CHAR('a'), new CHAR('a')))));
+    bool test2 = true;
+    for(Rexp* r : vector<Rexp*>{optional, aaa}){
+        for(string s : vector<string>{"ba", "bab", "aaaaa"}){
+            ARexp* posix = internalize(r);
+            for(size_t i = 0; i < s.size(); ++i){
+                posix = simpBC(derBC(s[i], posix), false);
+            }
+            deque<bool> bs = deque<bool>{};
+            test2 = test2 && (pikeBits(r, s, bs) == nullableBC(posix)) && (!nullableBC(posix) || bs == mkepsBC(posix));
+        }
+    }
     cout << test2 << endl;
-    bool test3 = (simpBC(new ASTAR(deque<bool>{}, new AONE(deque<bool>{false})))->equals(new ASTAR(deque<bool>{}, new AONE(deque<bool>{false}))));
+    deque<bool> bs = deque<bool>{};
+    bool test3 = (!pikeBits(new SEQ(new STAR(new STAR(new CHAR('a'))), new CHAR('b')), string(10000, 'a'), bs)
+                  && pikeBits(new SEQ(new NTIMES(new ALT(new ONE(), new CHAR('a')), 100), new NTIMES(new CHAR('a'), 100)), string(150, 'a'), bs));
     cout << test3 << endl;
-    bool test4 = (simpBC(new ANTIMES(deque<bool>{true}, new AONE(deque<bool>{false}), 8))->equals(new ANTIMES(deque<bool>{true}, new AONE(deque<bool>{false}), 8)));
+    // A program over the limit is rejected rather than built; one under it runs on few threads.
+    PikeVM large = PikeVM(new NTIMES(new CHAR('a'), 8000));
+    PikeVM tooLarge = PikeVM(new NTIMES(new CHAR('a'), 100000));
+    bs.clear();
+    bool test4 = (!large.tooLarge && large.run(string(8000, 'a'), bs) && !large.run(string(7999, 'a'), bs)
+                  && tooLarge.tooLarge && tooLarge.prog.size() <= PIKE_MAX_INSTRUCTIONS + 16 && !tooLarge.run("a", bs)
+                  && PikeVM(onesSEQ(20000)).tooLarge);
+    test4 = test4 && blexer_pike(new NTIMES(new CHAR('a'), 100000), "a", status).size() == 0 && status == PIKE_TOO_LARGE
+            && blexer_pike(spec, "if x", status).size() == 0 && status == PIKE_NO_MATCH;
     cout << test4 << endl;
-    bool test5 = (simpBC(new ASEQ(deque<bool>{true}, new ACHAR(deque<bool>{}, 'b'), new AZERO()))->equals(new AZERO()));
+    PikeVM chain = PikeVM(new SEQ(onesSEQ(12000), new STAR(new CHAR('a'))));
+    string longProg = "";
+    for(int i = 0; i < 1000; ++i){
+        longProg += prog + " iff ";
+    }
+    PikeVM vm = PikeVM(spec);
+    bs.clear();
+    bool test5 = (!chain.tooLarge && runOnSmallStack(chain) && vm.run(longProg, bs) && vm.maxLogEntries < 3 * longProg.size());
     cout << test5 << endl;
-    bool test6 = (simpBC(new ASEQ(deque<bool>{true}, new AZERO(), new ACHAR(deque<bool>{}, 'b')))->equals(new AZERO()));
-    cout << test6 << endl;
-    bool test7 = (simpBC(new ASEQ(deque<bool>{true}, new AONE(deque<bool>{false, true}), new ACHAR(deque<bool>{true}, 'b')))->equals(new ACHAR(deque<bool>{true, false, true, true}, 'b')));
-    cout << test7 << endl;
-    bool test8 = (simpBC(new ASEQ(deque<bool>{true}, new AALT(deque<bool>{false}, deque<ARexp*>{new AONE(deque<bool>{}), new ACHAR(deque<bool>{}, 'c')}), new AONE(deque<bool>{false})))->equals(new AALT(deque<bool>{true, false}, deque<ARexp*>{new ASEQ(deque<bool>{}, new AONE(deque<bool>{}), new AONE(deque<bool>{false})), new ASEQ(deque<bool>{}, new ACHAR(deque<bool>{}, 'c'), new AONE(deque<bool>{false}))})));
-    cout << test8 << endl;
-    bool test9 = (simpBC(new AALT(deque<bool>{true}, deque<ARexp*>{}))->equals(new AZERO()));
-    cout << test9 << endl;
-    bool test10 = (simpBC(new AALT(deque<bool>{true}, deque<ARexp*>{new AONE(deque<bool>{false})}))->equals(new AONE(deque<bool>{true, false})));
-    cout << test10 << endl;
-    bool test11 = (simpBC(new AALT(deque<bool>{true}, deque<ARexp*>{new AONE(deque<bool>{false}), new AONE(deque<bool>{true})}))->equals(new AONE(deque<bool>{true, false})));
-    cout << test11 << endl;
-    bool test12 = (simpBC(new AALT(deque<bool>{true}, deque<ARexp*>{new AONE(deque<bool>{false}), new AONE(deque<bool>{true}), new ACHAR(deque<bool>{}, 'a')}))->equals(new AALT(deque<bool>{true}, deque<ARexp*>{new AONE(deque<bool>{false}), new ACHAR(deque<bool>{}, 'a')})));
-    cout << test12 << endl;
 }
 
-// Performs tests on the mkepsBC function to ensure correct output for each if-elseif branch.
-void mkepsFunctionTest(){
-    bool test1 = (mkepsBC(new AONE(deque<bool>{false, true})) == deque<bool>{false, true});
+// Compares blexer2_simp with the Pike VM on 0 to 150 a's, as the loop in main and regex.py do.
+void pikeExperiment(Rexp* spec){
+    for(int i = 0; i <= 150; i += 10){
+        string s = string(i, 'a');
+        unsigned long simpTotal = 0;
+        unsigned long pikeTotal = 0;
+        int iterations = 5;
+        for(int j = 0; j < iterations; ++j){
+            auto startTime = high_resolution_clock::now();
+            blexer2_simp(spec, s);
+            auto simpTime = high_resolution_clock::now();
+            deque<bool> bs = deque<bool>{};
+            pikeBits(spec, s, bs);
+            auto pikeTime = high_resolution_clock::now();
+            simpTotal += duration_cast<std::chrono::nanoseconds>(simpTime - startTime).count();
+            pikeTotal += duration_cast<std::chrono::nanoseconds>(pikeTime - simpTime).count();
+        }
+        cout << i << " a's: blexer2_simp " << simpTotal / iterations << " nanoseconds, pike VM " << pikeTotal / iterations << " nanoseconds" << endl;
+    }
+}
+
+// Performs tests on the adaptive lexer: a small specification must stay on derivatives, and lower
+// limits must move the same call to the automaton and then to budgeted derivatives, with the same
+// tokens. On "iff" the POSIX value is i:iff, but every engine must give k:if i:f like blexer2_simp.
+// On (1+a){n}a{n} the budgeted derivatives must finish within a large budget and stop part of
+// the way with a small one.
+void adaptiveFunctionTest(){
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("k", listToALT(deque<Rexp*>{stringToSEQ("if"), stringToSEQ("in")})), mkRECD("i", new PLUS(RANGE("fin"))), mkRECD("w", new CHAR(' '))}));
+    string prog = "if in fin i if";
+    deque<string> expected = blexer2_simp(spec, prog);
+    AdaptiveEngine engine;
+    AdaptiveLexer lexer = AdaptiveLexer(spec, 4000, 1000, 10000);
+    bool test1 = (lexer.lex(prog, engine) == expected && engine == ADAPTIVE_DERIVATIVES && blexer_adaptive(spec, prog) == expected);
     cout << test1 << endl;
-    bool test2 = (mkepsBC(new AALT(deque<bool>{false, true}, deque<ARexp*>{new AONE(deque<bool>{true})})) == deque<bool>{false, true, true});
+    AdaptiveLexer automaton = AdaptiveLexer(spec, 1, 1000, 10000);
+    AdaptiveLexer budgeted = AdaptiveLexer(spec, 1, 1, 10000);
+    budgeted.budget.maxLiveNodes = 1000;
+    bool test2 = (automaton.lex(prog, engine) == expected && engine == ADAPTIVE_AUTOMATON
+                  && budgeted.lex(prog, engine) == expected && engine == ADAPTIVE_BUDGETED);
     cout << test2 << endl;
-    bool test3 = (mkepsBC(new AALT(deque<bool>{false, true}, deque<ARexp*>{new AONE(deque<bool>{true}), new ASTAR(deque<bool>{true}, new ACHAR(deque<bool>{}, 'a'))})) == deque<bool>{false, true, true});
+    bool test3 = (lexer.stats.served[ADAPTIVE_DERIVATIVES] == 1 && automaton.stats.switches == 1 && budgeted.stats.switches == 2 && budgeted.stats.served[ADAPTIVE_BUDGETED] == 1);
     cout << test3 << endl;
-    bool test4 = (mkepsBC(new AALT(deque<bool>{false, true}, deque<ARexp*>{new ACHAR(deque<bool>{}, 'a'), new AONE(deque<bool>{false})})) == deque<bool>{false, true, false});
+    string ambiguous = "iff";
+    deque<string> simp = blexer2_simp(spec, ambiguous);
+    PikeStatus status;
+    bool test4 = (simp == deque<string>{"", "k:if", "i:f"} && blexer_pike(spec, ambiguous, status) == deque<string>{"", "i:iff"}
+                  && lexer.lex(ambiguous, engine) == simp && engine == ADAPTIVE_DERIVATIVES
+                  && automaton.lex(ambiguous, engine) == simp && engine == ADAPTIVE_AUTOMATON
+                  && budgeted.lex(ambiguous, engine) == simp && engine == ADAPTIVE_BUDGETED);
     cout << test4 << endl;
-    bool test5 = (mkepsBC(new ASEQ(deque<bool>{false, true}, new AONE(deque<bool>{true}), new AONE(deque<bool>{}))) == deque<bool>{false, true, true});
+    Rexp* hostile = mkRECD("x", new SEQ(new NTIMES(new ALT(new ONE(), new CHAR('a')), 200), new NTIMES(new CHAR('a'), 200)));
+    string as = string(200, 'a');
+    AdaptiveLexer large = AdaptiveLexer(hostile, 500, 100, 10000);
+    AdaptiveLexer small = AdaptiveLexer(hostile, 500, 100, 10000);
+    small.budget.maxLiveNodes = 200;
+    deque<string> tokens = deque<string>{};
+    LexOutcome outcome = LexOutcome();
+    deque<string> hostileTokens = blexer2_simp(hostile, as);
+    // The caller's arena must be in use again after every engine, also after a failed call.
+    vector<ARexp*> outer = vector<ARexp*>{};
+    ARexp::arena = &outer;
+    bool test5 = (large.lex(as, engine, tokens, outcome) && tokens == hostileTokens && engine == ADAPTIVE_BUDGETED && ARexp::arena == &outer
+                  && !small.lex(as, engine, tokens, outcome) && engine == ADAPTIVE_BUDGETED && outcome.status == LEX_LIVE_NODES
+                  && outcome.position > 0 && outcome.position < as.size() && ARexp::arena == &outer);
+    ARexp::arena = nullptr;
     cout << test5 << endl;
-    bool test6 = (mkepsBC(new ASTAR(deque<bool>{false}, new ACHAR(deque<bool>{}, 'a'))) == deque<bool>{false, true});
-    cout << test6 << endl;
-    bool test7 = (mkepsBC(new ANTIMES(deque<bool>{false}, new AONE(deque<bool>{false, true}), 0)) == deque<bool>{false});
-    cout << test7 << endl;
-    bool test8 = (mkepsBC(new ANTIMES(deque<bool>{false}, new AONE(deque<bool>{false, true}), 1)) == deque<bool>{false, false, true});
-    cout << test8 << endl;
-    bool test9 = (mkepsBC(new ANTIMES(deque<bool>{false}, new AONE(deque<bool>{false, true}), 5)) == deque<bool>{false, false, true, false, true, false, true, false, true, false, true});
-    cout << test9 << endl;
 }
 
-// Performs tests on the derBC function to ensure correct output for each if-elseif branch.
-void derFunctionTest(){
-    ARexp* AZER = new AZERO();
-    bool test1 = (derBC('a', new AZERO())->equals(AZER));
+// Compares blexer2_simp with the adaptive lexer on n copies of unit and reports the engine that
+// served each call.
+void adaptiveExperiment(Rexp* spec, string unit, int n){
+    AdaptiveLexer lexer = AdaptiveLexer(spec, 4000, 1000, 10000);
+    for(int i = 1; i <= n; i *= 4){
+        string s = "";
+        for(int j = 0; j < i; ++j){
+            s += unit;
+        }
+        auto startTime = high_resolution_clock::now();
+        blexer2_simp(spec, s);
+        auto simpTime = high_resolution_clock::now();
+        AdaptiveEngine engine;
+        lexer.lex(s, engine);
+        auto adaptiveTime = high_resolution_clock::now();
+        cout << i << " copies: blexer2_simp " << duration_cast<std::chrono::nanoseconds>(simpTime - startTime).count()
+             << " nanoseconds, adaptive " << duration_cast<std::chrono::nanoseconds>(adaptiveTime - simpTime).count()
+             << " nanoseconds on " << adaptiveEngineName(engine) << endl;
+    }
+}
+
+// Performs tests on budgeted lexing: an unlimited budget must give the tokens of blexer2_simp,
+// and each limit and the cancellation token must stop the call where it is exceeded.
+void budgetFunctionTest(){
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("k", listToALT(deque<Rexp*>{stringToSEQ("if"), stringToSEQ("in")})), mkRECD("i", new PLUS(RANGE("fin"))), mkRECD("w", new CHAR(' '))}));
+    string prog = "if in fin i if";
+    deque<string> tokens = deque<string>{};
+    LexOutcome outcome = LexOutcome();
+    LexBudget budget = LexBudget();
+    bool test1 = (blexer_budgeted(spec, prog, budget, tokens, outcome) && tokens == blexer2_simp(spec, prog) && outcome.position == prog.size()
+                  && !blexer_budgeted(spec, "if?", budget, tokens, outcome) && outcome.status == LEX_NO_MATCH);
     cout << test1 << endl;
-    bool test2 = (derBC('a', new AONE(deque<bool>{}))->equals(AZER));
+    budget.maxSteps = 3;
+    bool test2 = (!blexer_budgeted(spec, prog, budget, tokens, outcome) && outcome.status == LEX_STEPS && outcome.position == 3);
+    budget = LexBudget();
+    CancelToken cancel = CancelToken();
+    cancel.cancel();
+    budget.cancel = &cancel;
+    test2 = test2 && !blexer_budgeted(spec, prog, budget, tokens, outcome) && outcome.status == LEX_CANCELLED && outcome.position == 0;
     cout << test2 << endl;
-    bool test3 = (derBC('a', new ACHAR(deque<bool>{}, 'a'))->equals(new AONE(deque<bool>{})));
+    Rexp* hostile = new SEQ(new NTIMES(new ALT(new ONE(), new CHAR('a')), 100), new NTIMES(new CHAR('a'), 100));
+    string as = string(100, 'a');
+    budget = LexBudget();
+    budget.maxLiveNodes = 100;
+    bool test3 = (!blexer_budgeted(hostile, as, budget, tokens, outcome) && outcome.status == LEX_LIVE_NODES && outcome.position > 0 && outcome.position < as.size());
+    budget = LexBudget();
+    budget.maxBits = 10;
+    test3 = test3 && !blexer_budgeted(spec, prog, budget, tokens, outcome) && outcome.status == LEX_BITS;
+    budget = LexBudget();
+    budget.maxCpuNanoseconds = 0;
+    test3 = test3 && !blexer_budgeted(hostile, as, budget, tokens, outcome) && outcome.status == LEX_CPU_TIME;
     cout << test3 << endl;
-    bool test4 = (derBC('a', new ACHAR(deque<bool>{}, 'c'))->equals(AZER));
+    // The bitcode of a long input is decoded in chunks, where sdecode would run out of stack.
+    string longProg = "";
+    for(int i = 0; i < 2000; ++i){
+        longProg += "if in fin ";
+    }
+    budget = LexBudget();
+    budget.maxLiveNodes = 10000;
+    bool test4 = (blexer_budgeted(spec, longProg, budget, tokens, outcome) && tokens == blexer_flat(spec, longProg) && outcome.bits > DECODE_CHUNK_BITS);
     cout << test4 << endl;
-    bool test5 = (derBC('a', new AALT(deque<bool>{false, true}, deque<ARexp*>{AZER, new AONE(deque<bool>{}), new ACHAR(deque<bool>{},'b')}))->equals(new AALT(deque<bool>{false, true}, deque<ARexp*>{AZER, AZER, AZER})));
+    // A caller that keeps its own arena gets it back, whether the call matched or not.
+    vector<ARexp*> outer = vector<ARexp*>{};
+    ARexp::arena = &outer;
+    budget = LexBudget();
+    bool test5 = blexer_budgeted(spec, prog, budget, tokens, outcome) && ARexp::arena == &outer;
+    budget.maxSteps = 3;
+    test5 = test5 && !blexer_budgeted(spec, prog, budget, tokens, outcome) && ARexp::arena == &outer;
+    ARexp::arena = nullptr;
     cout << test5 << endl;
-    bool test6 = (derBC('a', new AALT(deque<bool>{false, true}, deque<ARexp*>{AZER, new AONE(deque<bool>{}), new ACHAR(deque<bool>{},'a')}))->equals(new AALT(deque<bool>{false, true}, deque<ARexp*>{AZER, AZER, new AONE(deque<bool>{})})));
+    // The bits held inside the derivative are bounded even when no node limit is set.
+    budget = LexBudget();
+    budget.maxBits = 1000;
+    bool test6 = (!blexer_budgeted(hostile, as, budget, tokens, outcome) && outcome.status == LEX_BITS && outcome.position > 0 && outcome.position < as.size());
     cout << test6 << endl;
-    bool test7 = (derBC('a', new ASEQ(deque<bool>{}, new ACHAR(deque<bool>{},'a'), new AONE(deque<bool>{})))->equals(new ASEQ(deque<bool>{}, new AONE(deque<bool>{}), new AONE(deque<bool>{}))));
-    cout << test7 << endl;
-    bool test8 = (derBC('a', new ASEQ(deque<bool>{false, true}, new AONE(deque<bool>{false}), new ACHAR(deque<bool>{},'a')))->equals(new AALT(deque<bool>{false, true}, deque<ARexp*>{new ASEQ(deque<bool>{}, AZER, new ACHAR(deque<bool>{}, 'a')), new AONE(deque<bool>{false})})));
-    cout << test8 << endl;
-    bool test9 = (derBC('a', new ANTIMES(deque<bool>{}, new ACHAR(deque<bool>{},'a'), 0))->equals(AZER));
-    cout << test9 << endl;
-    bool test10 = (derBC('a', new ANTIMES(deque<bool>{}, new ACHAR(deque<bool>{},'a'), 1))->equals(new ASEQ(deque<bool>{}, new AONE(deque<bool>{}), new ANTIMES(deque<bool>{}, new ACHAR(deque<bool>{}, 'a'), 0))));
-    cout << test10 << endl;
-    bool test11 = (derBC('a', new ANTIMES(deque<bool>{}, new ACHAR(deque<bool>{},'a'), 2))->equals(new ASEQ(deque<bool>{}, new AONE(deque<bool>{}), new ANTIMES(deque<bool>{}, new ACHAR(deque<bool>{}, 'a'), 1))));
-    cout << test11 << endl;
-    bool test12 = (derBC('a', new ASTAR(deque<bool>{false}, new ACHAR(deque<bool>{}, 'a')))->equals(new ASEQ(deque<bool>{false}, new AONE(deque<bool>{false}), new ASTAR(deque<bool>{}, new ACHAR(deque<bool>{}, 'a')))));
-    cout << test12 << endl;
 }
 
-// Represents the PLUS(r) regular expression as its equivalent SEQ(r, STAR(r))
-Rexp* PLUS(Rexp* r){
-    return new SEQ(r, new STAR(r));
+// Lexes i a's against (1+a){i}a{i} under a budget, for i up to n, and reports how each call ended.
+void budgetExperiment(LexBudget & budget, int n){
+    for(int i = 1; i <= n; i *= 2){
+        Rexp* hostile = new SEQ(new NTIMES(new ALT(new ONE(), new CHAR('a')), i), new NTIMES(new CHAR('a'), i));
+        deque<string> tokens = deque<string>{};
+        LexOutcome outcome = LexOutcome();
+        blexer_budgeted(hostile, string(i, 'a'), budget, tokens, outcome);
+        cout << i << " a's: " << lexStatusName(outcome.status) << " after " << outcome.position << " characters, "
+             << outcome.liveNodes << " nodes, " << outcome.bits << " bits, " << outcome.cpuNanoseconds << " nanoseconds" << endl;
+    }
 }
 
-// Helper function to create a RECD regular expression with a token xIn and 
-// regular expression rIn.
-Rexp* mkRECD(string xIn, Rexp* rIn){
-    return new RECD(xIn, rIn);
+// Returns the peak resident set size of the process so far, in kilobytes.
+long peakKilobytes(){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
 }
 
-// Represents the OPTIONAL(r) regular expression as its equivalent ALT(ONE, r)
-Rexp* OPTIONAL(Rexp* rIn){
-    return new ALT(new ONE(), rIn);
+// Returns the bitcode of s with respect to spec, with the derivatives in an arena swept like
+// the one of blexer_budgeted. bs stays empty if s does not match.
+deque<bool> sweptBits(Rexp* spec, const string & s){
+    LexBudget budget = LexBudget();
+    budget.maxLiveNodes = 100000;
+    LexOutcome outcome = LexOutcome();
+    vector<ARexp*> nodes = vector<ARexp*>{};
+    vector<ARexp*>* saved = ARexp::arena;
+    ARexp::arena = &nodes;
+    deque<bool> bs = deque<bool>{};
+    budgetedBits(internalize(spec), s, 0, nodes, budget, threadCpuNanoseconds(), outcome, bs);
+    DerivativeAutomaton::freeArena(nodes);
+    ARexp::arena = saved;
+    return bs;
 }
 
-int main() {
+// Decodes the value of copies of a program adding up to at least 1 MB, builds its environment
+// and reports the peak resident set size after each step. The derivatives of a whole megabyte
+// take hours, so the bitcode is that of one copy repeated: the bitcode of two copies must be
+// the bits of the first copy followed by the bitcode of one copy.
+void valExperiment(Rexp* spec, string prog){
+    deque<bool> one = sweptBits(spec, prog);
+    deque<bool> two = sweptBits(spec, prog + prog);
+    size_t unit = two.size() - one.size();
+    if(one.empty() || two.size() < one.size() || !std::equal(one.begin(), one.end(), two.begin() + unit)){
+        cout << "the copies of the program are not lexed independently" << endl;
+        return;
+    }
+    long before = peakKilobytes();
+    deque<bool> bs = deque<bool>{};
+    size_t size = prog.size();
+    for(; size < 1000000; size += prog.size()){
+        bs.insert(bs.end(), two.begin(), two.begin() + unit);
+    }
+    bs.insert(bs.end(), one.begin(), one.end());
+    long afterBits = peakKilobytes();
+    auto startTime = high_resolution_clock::now();
+    Val* v = decode(spec, bs).first;
+    auto endTime = high_resolution_clock::now();
+    long afterDecode = peakKilobytes();
+    deque<pair<string, string>> tokens = env(v);
+    long afterEnv = peakKilobytes();
+    unsigned long duration = duration_cast<std::chrono::milliseconds>(endTime - startTime).count();
+    cout << size << " bytes, " << bs.size() << " bits, " << tokens.size() << " tokens, decoded in " << duration << " milliseconds" << endl;
+    cout << "peak RSS: " << before << " KB before, " << afterBits << " KB with the bitcode, " << afterDecode << " KB after decode, " << afterEnv << " KB after env" << endl;
+}
+
+// Performs tests on the phase profiler: it must tokenise like blexer2_simp, time every phase and
+// report a counter as null exactly when it could not be opened.
+void perfFunctionTest(){
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("k", listToALT(deque<Rexp*>{stringToSEQ("if"), stringToSEQ("in")})), mkRECD("i", new PLUS(RANGE("fin"))), mkRECD("w", new CHAR(' '))}));
+    string prog = "if in fin i if";
+    PerfCounters counters;
+    PhaseProfile profile = PhaseProfile();
+    bool test1 = (blexer_profiled(spec, prog, counters, profile) == blexer2_simp(spec, prog) && profile.bytes == prog.size());
+    cout << test1 << endl;
+    bool test2 = (profile.nanoseconds[PHASE_DERIVATIVE] > 0 && profile.nanoseconds[PHASE_SIMPLIFY] > 0 && profile.nanoseconds[PHASE_DECODE] > 0);
+    for(int c = 0; c < COUNTER_COUNT; ++c){
+        test2 = test2 && (counters.available[c] || profile.counts[PHASE_DERIVATIVE][c] == 0);
+    }
+    cout << test2 << endl;
+    string json = profileToJson(counters, profile);
+    bool test3 = (json.find("\"decode\": {") != string::npos && (json.find("\"cycles\": null") != string::npos) == !counters.available[0]);
+    cout << test3 << endl;
+}
+
+// Performs tests on the differential fuzzer: a short run must find no mismatch, sdecode must
+// decode NTIMES like the other decoders and every shrinking candidate must be smaller.
+void fuzzFunctionTest(){
+    bool test1 = fuzzEngines(1, 20, 0, 50, true, 1);
+    cout << test1 << endl;
+    Rexp* spec = mkRECD("t", new SEQ(new NTIMES(new CHAR('a'), 2), new STAR(new CHAR('b'))));
+    bool test2 = (blexer2_simp(spec, "aabb") == deque<string>{"", "t:aabb"});
+    cout << test2 << endl;
+    vector<Rexp*> candidates = vector<Rexp*>{};
+    shrinkRexp(spec, candidates);
+    bool test3 = (candidates.size() > 0);
+    for(size_t i = 0; i < candidates.size(); ++i){
+        test3 = test3 && (fuzzSize(candidates[i]) < fuzzSize(spec));
+    }
+    cout << test3 << endl;
+}
+
+// Performs tests on the lexer service: requests sent together on two connections must come back
+// in order with the tokens of blexer2_simp, a failed match must be reported, the statistics
+// must count every request and a client that stops reading must delay only itself.
+void serviceFunctionTest(){
+    Rexp* spec = new STAR(listToALT(deque<Rexp*>{mkRECD("k", listToALT(deque<Rexp*>{stringToSEQ("if"), stringToSEQ("in")})), mkRECD("i", new PLUS(RANGE("fin"))), mkRECD("w", new CHAR(' '))}));
+    string path = "/tmp/bitcode_lexer_test.sock";
+    LexerService service = LexerService(spec, path, 2);
+    bool test1 = service.listen("if in fin");
+    cout << test1 << endl;
+    std::thread server(&LexerService::run, &service);
+    int a = connectService(path);
+    int b = connectService(path);
+    vector<string> progs = vector<string>{"if in fin i if iff", "", "fin fin", "if"};
+    for(size_t i = 0; i < progs.size(); ++i){
+        sendFrame((i % 2 == 0) ? a : b, 'L', progs[i]);
+    }
+    bool test2 = true;
+    for(size_t i = 0; i < progs.size(); ++i){
+        char status;
+        string answer;
+        receiveAnswer((i % 2 == 0) ? a : b, status, answer);
+        deque<string> tokens = deque<string>{""};
+        TokenReader reader = TokenReader(answer.data(), answer.size());
+        BinaryToken t = BinaryToken();
+        while(reader.next(t)){
+            tokens.push_back(binaryTokenKind(t) + ":" + progs[i].substr(t.start, t.length));
+        }
+        test2 = test2 && (status == 'K' && tokens == blexer2_simp(spec, progs[i]));
+    }
+    cout << test2 << endl;
+    deque<string> tokens = deque<string>{};
+    char status;
+    string answer;
+    bool test3 = (!serviceTokens(a, "if x", tokens) && serviceCall(b, 'S', "", status, answer) && answer.find("requests 5 ") == 0);
+    cout << test3 << endl;
+    serviceCall(a, 'Q', "", status, answer);
+    server.join();
+    close(a);
+    close(b);
+    // Requests are lexed within the budget of the service.
+    LexerService limited = LexerService(spec, path, 1);
+    limited.budget.maxSteps = 5;
+    bool test4 = limited.listen("");
+    std::thread limitedServer(&LexerService::run, &limited);
+    int c = connectService(path);
+    tokens = deque<string>{""};
+    test4 = test4 && serviceTokens(c, "if in", tokens) && tokens == blexer2_simp(spec, "if in")
+            && serviceCall(c, 'L', "if in fin", status, answer) && status == 'E' && answer == "step limit"
+            && serviceCall(c, 'L', "if x", status, answer) && status == 'E' && answer == "no match";
+    cout << test4 << endl;
+    serviceCall(c, 'Q', "", status, answer);
+    limitedServer.join();
+    close(c);
+    // A client that does not read its answers must not hold up another one, and a service
+    // without workers must not start.
+    LexerService slow = LexerService(spec, path, 1);
+    bool test5 = slow.listen("") && !LexerService(spec, "/tmp/bitcode_lexer_idle.sock", 0).listen("");
+    std::thread slowServer(&LexerService::run, &slow);
+    int d = connectService(path);
+    int e = connectService(path);
+    string big = "";
+    for(int i = 0; i < 16384; ++i){
+        big += "fin ";
+    }
+    for(int i = 0; i < 32; ++i){
+        sendFrame(d, 'L', big);
+    }
+    tokens = deque<string>{""};
+    test5 = test5 && serviceTokens(e, "if in", tokens) && tokens == blexer2_simp(spec, "if in");
+    for(int i = 0; i < 32; ++i){
+        test5 = test5 && receiveAnswer(d, status, answer) && status == 'K';
+    }
+    cout << test5 << endl;
+    serviceCall(e, 'Q', "", status, answer);
+    slowServer.join();
+    close(d);
+    close(e);
+}
+
+int main(int argc, char* argv[]) {
     //Function calls to test important functions.
     //derFunctionTest();
     //mkepsFunctionTest();
     //simpFunctionTest();
+    //optimiseSpecTest();
+    //glushkovFunctionTest();
+    //mappedFileTest();
+    //positionFunctionTest();
+    //distinctFunctionTest();
+    //automatonFunctionTest();
+    //minimalFunctionTest();
+    //searchFunctionTest();
+    //captureFunctionTest();
+    //hotLexerFunctionTest();
+    //binaryTokenTest();
+    //pipelineFunctionTest();
+    //backwardFunctionTest();
+    //flatFunctionTest();
+    //literalFunctionTest();
+    //plusFunctionTest();
+    //rewriteFunctionTest();
+    //pikeFunctionTest();
+    //adaptiveFunctionTest();
+    //budgetFunctionTest();
+    //perfFunctionTest();
+    //fuzzFunctionTest();
+    //serviceFunctionTest();
     
     // Defining the regular expressions for the WHILE language.
     Rexp* SYM = RANGE("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz_._><;=,:\\");
@@ -2107,11 +10534,125 @@ int main() {
     Rexp* KEYWORD = listToALT(deque<Rexp*>{stringToSEQ("skip"), stringToSEQ("while"), stringToSEQ("do"), stringToSEQ("if"), stringToSEQ("then"), stringToSEQ("else"), stringToSEQ("read"), stringToSEQ("write")});
     Rexp* SEMI = new CHAR(';');
     Rexp* OP = listToALT(deque<Rexp*>{stringToSEQ("+"), stringToSEQ("-"), stringToSEQ("*"), stringToSEQ("/"), stringToSEQ("%"), stringToSEQ(":="), stringToSEQ("!="), stringToSEQ("="), stringToSEQ("<"), stringToSEQ(">")});
-    Rexp* WHITESPACE = PLUS(listToALT(deque<Rexp*>{new CHAR(' '), new CHAR('\n'), new CHAR('\t')}));
+    Rexp* WHITESPACE = new PLUS(listToALT(deque<Rexp*>{new CHAR(' '), new CHAR('\n'), new CHAR('\t')}));
     Rexp* PARANTHESES = RANGE("({)}");
     Rexp* STR = new SEQ(new CHAR('\"'), new SEQ(new ALT(new STAR(SYM), new ALT(WHITESPACE, DIGIT)), new CHAR('\"')));
 
     Rexp* WHILE_REGS = new STAR(listToALT(deque<Rexp*>{mkRECD("k", KEYWORD), mkRECD("i", ID), mkRECD("o", OP), mkRECD("n", NUM), mkRECD("s", SEMI), mkRECD("str", STR), mkRECD("p", PARANTHESES), mkRECD("w", WHITESPACE)}));
+
+    // "--check-states N" fails if the WHILE specification has more than N derivative states.
+    if(argc == 3 && string(argv[1]) == "--check-states"){
+        return checkDerivativeStates(WHILE_REGS, std::stoi(argv[2])) ? 0 : 1;
+    }
+    // "--emit-hot CORPUS OUT" profiles the WHILE specification on CORPUS and writes a lexer
+    // specialised to its hot states to OUT.
+    if(argc == 4 && string(argv[1]) == "--emit-hot"){
+        MappedFile corpus = MappedFile(argv[2]);
+        if(!corpus.mapped){
+            return 1;
+        }
+        DerivativeAutomaton da = DerivativeAutomaton(WHILE_REGS);
+        vector<vector<unsigned long>> counts = profileTransitions(da, string(corpus.data, corpus.size));
+        return emitHotLexer(da, counts, 0.99, argv[3]) ? 0 : 1;
+    }
+#ifdef HOT_LEXER
+    // "--hot FILE" prints the tokens of FILE lexed by the lexer written by --emit-hot, which this
+    // build includes.
+    if(argc == 3 && string(argv[1]) == "--hot"){
+        MappedFile file = MappedFile(argv[2]);
+        if(!file.mapped){
+            return 1;
+        }
+        DerivativeAutomaton da = DerivativeAutomaton(WHILE_REGS);
+        deque<string> tokens = blexer_hot(da, string(file.data, file.size));
+        for(size_t i = 0; i < tokens.size(); ++i){
+            cout << tokens[i] << endl;
+        }
+        return 0;
+    }
+#endif
+    // "--serve SOCKET [WORKERS [WARMUP]]" runs the WHILE lexer as a service on the Unix domain
+    // socket SOCKET until a client stops it, after lexing the file WARMUP to warm its cache.
+    // "--request SOCKET FILE" prints the tokens of FILE lexed by the service and
+    // "--stats SOCKET" prints its statistics.
+    if(argc >= 3 && argc <= 5 && string(argv[1]) == "--serve"){
+        int workers = (argc >= 4) ? std::stoi(argv[3]) : std::max(1, (int) std::thread::hardware_concurrency());
+        string warmup = "";
+        if(argc == 5){
+            MappedFile file = MappedFile(argv[4]);
+            if(!file.mapped){
+                return 1;
+            }
+            warmup = string(file.data, file.size);
+        }
+        LexerService service = LexerService(WHILE_REGS, argv[2], workers);
+        if(!service.listen(warmup)){
+            return 1;
+        }
+        service.run();
+        return 0;
+    }
+    if((argc == 4 && string(argv[1]) == "--request") || (argc == 3 && string(argv[1]) == "--stats")){
+        int fd = connectService(argv[2]);
+        if(fd == -1){
+            cout << "could not connect to " << argv[2] << endl;
+            return 1;
+        }
+        bool ok = false;
+        if(argc == 4){
+            MappedFile file = MappedFile(argv[3]);
+            deque<string> tokens = deque<string>{};
+            ok = file.mapped && serviceTokens(fd, string(file.data, file.size), tokens);
+            for(size_t i = 0; i < tokens.size(); ++i){
+                cout << tokens[i] << endl;
+            }
+        }
+        else{
+            char status;
+            string answer;
+            ok = serviceCall(fd, 'S', "", status, answer);
+            cout << answer << endl;
+        }
+        close(fd);
+        return ok ? 0 : 1;
+    }
+    // "--positions FILE" prints the tokens of FILE, each after its line and column.
+    if(argc == 3 && string(argv[1]) == "--positions"){
+        MappedFile file = MappedFile(argv[2]);
+        if(!file.mapped){
+            return 1;
+        }
+        deque<Token> tokens = blexer_mapped(WHILE_REGS, file);
+        NewlineIndex index = NewlineIndex(file.data, file.size);
+        string dump = "";
+        positionedTokens(tokens, index, dump);
+        cout << dump;
+        return 0;
+    }
+    // "--perf FILE" lexes FILE and prints the time and hardware counters of each phase as JSON.
+    if(argc == 3 && string(argv[1]) == "--perf"){
+        MappedFile file = MappedFile(argv[2]);
+        if(!file.mapped){
+            return 1;
+        }
+        PerfCounters counters;
+        PhaseProfile profile = PhaseProfile();
+        blexer_profiled(WHILE_REGS, string(file.data, file.size), counters, profile);
+        cout << profileToJson(counters, profile) << endl;
+        return 0;
+    }
+    // "--fuzz SPECS [SEED]" compares every engine with blexer2_simp on SPECS random specifications.
+    // "--fuzz-throughput SECONDS [SEED]" leaves out the pipelined engine and runs for SECONDS on
+    // every core. Both report the number of cases per minute and fail on the first mismatch.
+    if((argc == 3 || argc == 4) && string(argv[1]) == "--fuzz"){
+        uint64_t seed = (argc == 4) ? std::stoull(argv[3]) : 1;
+        return fuzzEngines(seed, std::stoul(argv[2]), 0, 100, true, 1) ? 0 : 1;
+    }
+    if((argc == 3 || argc == 4) && string(argv[1]) == "--fuzz-throughput"){
+        uint64_t seed = (argc == 4) ? std::stoull(argv[3]) : 1;
+        int workers = std::max(1, (int) std::thread::hardware_concurrency());
+        return fuzzEngines(seed, 0, std::stod(argv[2]), 1000, false, workers) ? 0 : 1;
+    }
     
     
     // Sample WHILE programs for experiments and testing.
@@ -2167,7 +10708,7 @@ write (result))";
             //listToString(blexer2_simp(WHILE_REGS, prog));
 
             //(((a+)(a+))+)b
-            //listToString(blexer2_simp(mkRECD("triplePlus", new SEQ(PLUS(new SEQ(PLUS(new CHAR('a')), PLUS(new CHAR('a')))), new CHAR('b'))), string(i, 'a')));
+            //listToString(blexer2_simp(mkRECD("triplePlus", new SEQ(new PLUS(new SEQ(new PLUS(new CHAR('a')), new PLUS(new CHAR('a')))), new CHAR('b'))), string(i, 'a')));
 
             auto endTime = high_resolution_clock::now();
             unsigned long duration = duration_cast<std::chrono::nanoseconds>(endTime - startTime).count(); 
@@ -2178,8 +10719,64 @@ write (result))";
         cout << average_duration << " nanoseconds" << endl;
     }
 
+    // Compares the pipelined lexer with blexer2_simp on repetitions of the factorial program.
+    // pipelineExperiment(WHILE_REGS, progFac);
+
+    // Compares the annotation-free fast path with blexer2_simp on the same programs.
+    // backwardExperiment(WHILE_REGS, progFac);
+
+    // Compares the flat derivatives with blexer2_simp on the same programs.
+    // flatExperiment(WHILE_REGS, progFac);
+
+    // Compares keywords and operators as LITERALs with the nested SEQs of their CHARs.
+    // literalExperiment(new STAR(listToALT(deque<Rexp*>{mkRECD("k", KEYWORD), mkRECD("o", OP), mkRECD("w", WHITESPACE)})), "while do if then else skip read write := != ");
+    // plusExperiment(6, 1000);
+
+    // Compares (a*)*b rewritten by blexer2_simp with its derivatives as written.
+    // rewriteExperiment(mkRECD("(a*)*b)", new SEQ(new STAR(new STAR(new CHAR('a'))), new CHAR('b'))), 10000);
+
+    // Compares the Pike VM with blexer2_simp on the same strings as regex.py.
+    // pikeExperiment(mkRECD("(a*)*b)", new SEQ(new STAR(new STAR(new CHAR('a'))), new CHAR('b'))));
+    // pikeExperiment(mkRECD("(1+a){n}(a){n}", new SEQ(new NTIMES(new ALT(new ONE(),(new CHAR('a'))), 150), new NTIMES(new CHAR('a'), 150))));
+    // pikeExperiment(mkRECD("(a+aa)*", new STAR(new ALT(new CHAR('a'), new SEQ(new CHAR('a'), new CHAR('a'))))));
+    // pikeExperiment(mkRECD("triplePlus", new SEQ(new PLUS(new SEQ(new PLUS(new CHAR('a')), new PLUS(new CHAR('a')))), new CHAR('b'))));
+
+    // Compares the adaptive lexer with blexer2_simp on a family whose derivatives grow with the
+    // input and on the factorial program.
+    // adaptiveExperiment(mkRECD("(1+a){n}(a){n}", new SEQ(new NTIMES(new ALT(new ONE(),(new CHAR('a'))), 1000), new NTIMES(new CHAR('a'), 1000))), "a", 1024);
+    // adaptiveExperiment(WHILE_REGS, progFac, 16);
+
+    // Lexes a hostile input under a budget of 100000 live nodes and one second of CPU time.
+    // LexBudget budget = LexBudget();
+    // budget.maxLiveNodes = 100000;
+    // budget.maxCpuNanoseconds = 1000000000L;
+    // budgetExperiment(budget, 1024);
+
     // Tokenizes the factorial program and prints it to the console.
     // cout << listToString(blexer2_simp(WHILE_REGS, progFac)) << endl;
 
+    // Tokenizes the factorial program straight from its file without copying it.
+    // MappedFile facFile = MappedFile("../Flex_Code/factorial.while");
+    // deque<Token> facTokens = blexer_mapped(WHILE_REGS, facFile);
+
+    // Compares lexing 10 copies of the factorial program with lexing them and giving every
+    // token its line and column.
+    // positionExperiment(WHILE_REGS, progFac, 10);
+
+    // Compares the derivative automaton of the WHILE specification with its minimised transducer.
+    // minimalExperiment(WHILE_REGS, progFac, 10);
+
+    // Measures the peak memory of lexing a 1 MB program made of copies of the factorial program.
+    // valExperiment(WHILE_REGS, progFac);
+
+    // Compares the Glushkov matcher with the derivative matcher on the (a*)*b family.
+    // glushkovExperiment();
+
+    // Times simpBC on wide alternatives with nested alternatives, ZEROs and duplicates.
+    // flattenExperiment();
+
+    // Measures search throughput on a synthetic log, to compare with regex.py.
+    // searchExperiment();
+
     return 0;
 }
\ No newline at end of file
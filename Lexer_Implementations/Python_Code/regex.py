@@ -25,4 +25,32 @@ for x in range(0, 150, 10):
 
         time += (stop-start)
 
-    print('Time: ', time/5)  
\ No newline at end of file
+    print('Time: ', time/5)  
+
+# The following code is used to measure search throughput in GB/s, to compare with
+# searchExperiment in bitcode_lexer.cpp. It uses the same synthetic log and rules.
+line = "2021-04-09 12:00:01 INFO request served in 12ms from cache node 7\n"
+rare = "2021-04-09 12:00:02 ERROR E1234 upstream timed out\n"
+rules = re.compile("(?P<err>ERROR)|(?P<code>E[0-9]{4})")
+
+mb = 1
+while mb <= 64:
+    parts = []
+    size = 0
+    lines = 0
+    while size < mb * 1000000:
+        text = rare if lines % 100 == 0 else line
+        parts.append(text)
+        size += len(text)
+        lines += 1
+    log = "".join(parts)
+    time = 0
+    for y in range(5):
+        start = timeit.default_timer()
+        count = sum(1 for match in rules.finditer(log))
+        stop = timeit.default_timer()
+
+        time += (stop-start)
+
+    print(mb, 'MB: ', count, 'matches,', len(log) / (time/5) / 1e9, 'GB/s')
+    mb *= 4